@@ -0,0 +1,303 @@
+/* UCSD CubeSat
+   binlog.h
+
+   Deferred binary logging.  read_reg() and write_reg() used to carry
+   commented out printf()s, since formatting text and writing it to a
+   console on every SPI transaction slowed the radio code down more than
+   the transaction itself.  A log call here formats nothing.  It stores
+   the call site's id, a timestamp and its raw integer arguments in a
+   ring that belongs to the calling thread, which is a few stores and a
+   clock read.  A writer thread started by binlog_open() drains the rings
+   into a binary file every BL_FLUSH_US, and loralog.c turns the file
+   back into text offline.  Register tracing can then stay on in the
+   field, with -R on loraTX and loraRX.
+
+   Usage:
+
+   BLOG_DEBUG("switched to SF%u at %u Hz", sf, bw_hz);
+
+   There is one macro per level, BLOG_TRACE through BLOG_WARN.  Levels
+   below BINLOG_LEVEL, which can be set before including this file, are
+   compiled out: their macros expand to nothing.  The rest cost a single
+   branch until binlog_open() is called.
+
+   Notes on call sites:
+   Every macro use declares a static struct bl_site with the format, file
+   and line.  The first time it runs it is given a small id, and the
+   writer puts the site's description in the file before the first
+   record that uses it, so the file decodes on its own.  Arguments are
+   stored as 64 bit integers, at most BL_MAX_ARGS of them, so formats
+   should only use integer conversions (%d %u %x %c and their length
+   modifiers).  A pointer passed for %s or %p would mean nothing once the
+   program has exited.
+
+   Notes on the rings:
+   Each thread takes one of BL_MAX_THREADS statically allocated rings the
+   first time it logs, so logging never allocates.  A ring is single
+   producer single consumer, the thread and the writer, so it needs no
+   lock.  When it is full the record is dropped and counted rather than
+   making the caller wait, and the count goes in the file.  The writer
+   thread is the only part that needs pthreads, and binlog_open() and
+   binlog_close() are inline so programs that never call them need no
+   -lpthread on C libraries older than glibc 2.34.
+
+   File format, little endian:
+   header  "LBL1", u64 wall clock ns and u64 monotonic ns at binlog_open()
+   'S'     site: u16 id, u8 level, u8 args, u16 line, u16 file length,
+           file, u16 format length, format
+   'E'     event: u16 site id, u8 thread, u64 monotonic ns, then the args
+           as u64 each
+   'D'     drops: u8 thread, u32 records dropped since the last one
+
+   ---------------------------------------------------------------------------------------------*/
+
+#ifndef BINLOG_H
+#define BINLOG_H
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "perfctr.h"
+
+#define BL_TRACE 0
+#define BL_DEBUG 1
+#define BL_INFO  2
+#define BL_WARN  3
+#define BL_OFF   4
+
+#ifndef BINLOG_LEVEL
+#define BINLOG_LEVEL BL_TRACE
+#endif
+
+#define BL_MAX_ARGS     4
+#define BL_MAX_SITES    1024
+#define BL_MAX_THREADS  8
+#define BL_RING_ENTRIES 1024     //per thread, a power of two
+#define BL_FLUSH_US     10000
+#define BL_MAGIC        "LBL1"
+
+struct bl_site{
+  const char *fmt;
+  const char *file;
+  uint16_t line;
+  uint8_t  level;
+  uint8_t  nargs;
+  uint16_t id;             //0 until the first call
+};
+
+struct bl_rec{
+  uint16_t site;
+  uint64_t t_ns;
+  uint64_t a[BL_MAX_ARGS];
+};
+
+struct bl_ring{
+  uint32_t head;           //written by the owning thread
+  uint32_t tail;           //written by the writer
+  uint32_t dropped;        //records the owner couldn't fit
+  uint32_t dropped_out;    //drops the writer has put in the file
+  struct bl_rec rec[BL_RING_ENTRIES];
+};
+
+//on while a log is open, the one branch a disabled call site costs
+static volatile int bl_enabled = 0;
+
+static struct bl_site *bl_sites[BL_MAX_SITES];
+static uint16_t bl_nsites = 0;
+static char bl_lock = 0;
+
+//rings, the last one is shared by any threads beyond BL_MAX_THREADS
+//and only ever counts drops
+static struct bl_ring bl_rings[BL_MAX_THREADS + 1];
+static uint32_t bl_nrings = 0;
+static __thread struct bl_ring *bl_mine = NULL;
+
+//writer side
+static FILE *bl_out = NULL;
+static uint16_t bl_sites_out = 0;
+static pthread_t bl_writer;
+
+//-----------------------------------------logging macros----------------------------------------
+
+//records one call with its arguments, converted to 64 bits each
+#define BL_LOG(level, format, ...) do{                                                  \
+    if(bl_enabled){                                                                      \
+      static struct bl_site bl_site_ = {format, __FILE__, __LINE__, level, 0, 0};        \
+      const uint64_t bl_a_[] = {0, ##__VA_ARGS__};                                       \
+      _Static_assert(sizeof(bl_a_) / sizeof(uint64_t) - 1 <= BL_MAX_ARGS, "too many log arguments"); \
+      bl_site_.nargs = sizeof(bl_a_) / sizeof(uint64_t) - 1;                             \
+      bl_log(&bl_site_, bl_a_ + 1);                                                      \
+    }                                                                                    \
+  }while(0)
+
+#if BINLOG_LEVEL <= BL_TRACE
+#define BLOG_TRACE(format, ...) BL_LOG(BL_TRACE, format, ##__VA_ARGS__)
+#else
+#define BLOG_TRACE(format, ...) do{}while(0)
+#endif
+
+#if BINLOG_LEVEL <= BL_DEBUG
+#define BLOG_DEBUG(format, ...) BL_LOG(BL_DEBUG, format, ##__VA_ARGS__)
+#else
+#define BLOG_DEBUG(format, ...) do{}while(0)
+#endif
+
+#if BINLOG_LEVEL <= BL_INFO
+#define BLOG_INFO(format, ...) BL_LOG(BL_INFO, format, ##__VA_ARGS__)
+#else
+#define BLOG_INFO(format, ...) do{}while(0)
+#endif
+
+#if BINLOG_LEVEL <= BL_WARN
+#define BLOG_WARN(format, ...) BL_LOG(BL_WARN, format, ##__VA_ARGS__)
+#else
+#define BLOG_WARN(format, ...) do{}while(0)
+#endif
+
+//-----------------------------------helper function implementations----------------------------
+
+static uint64_t bl_now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//gives a site its id, once.  returns 0 if the table is full
+static uint16_t bl_register(struct bl_site *s){
+  while(__atomic_test_and_set(&bl_lock, __ATOMIC_ACQUIRE)){}
+  uint16_t id = s->id;
+  if(id == 0 && bl_nsites < BL_MAX_SITES - 1){
+    id = bl_nsites + 1;
+    bl_sites[id] = s;
+    __atomic_store_n(&s->id, id, __ATOMIC_RELEASE);
+    __atomic_store_n(&bl_nsites, id, __ATOMIC_RELEASE);
+  }
+  __atomic_clear(&bl_lock, __ATOMIC_RELEASE);
+  return id;
+}
+
+//the calling thread's ring, taken on its first call
+static struct bl_ring *bl_ring_claim(void){
+  uint32_t i = __atomic_fetch_add(&bl_nrings, 1, __ATOMIC_ACQ_REL);
+  bl_mine = &bl_rings[i < BL_MAX_THREADS ? i : BL_MAX_THREADS];
+  return bl_mine;
+}
+
+//the hot path behind the macros
+static void bl_log(struct bl_site *s, const uint64_t *a){
+  uint16_t id = __atomic_load_n(&s->id, __ATOMIC_ACQUIRE);
+  if(id == 0 && (id = bl_register(s)) == 0) return;
+  PERF_BEGIN(PR_LOG);
+  struct bl_ring *r = bl_mine ? bl_mine : bl_ring_claim();
+  uint32_t head = r->head;
+  if(r == &bl_rings[BL_MAX_THREADS] || head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= BL_RING_ENTRIES){
+    __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+    PERF_END(PR_LOG);
+    return;
+  }
+  struct bl_rec *e = &r->rec[head & (BL_RING_ENTRIES - 1)];
+  e->site = id;
+  e->t_ns = bl_now_ns();
+  for(int i = 0; i < s->nargs; i++) e->a[i] = a[i];
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+  PERF_END(PR_LOG);
+}
+
+//little endian field writer for the file
+static void bl_put(FILE *f, uint64_t v, int bytes){
+  for(int i = 0; i < bytes; i++) fputc((v >> (8 * i)) & 0xFF, f);
+}
+
+//describes every site registered since the last call
+static void bl_write_sites(FILE *f){
+  uint16_t n = __atomic_load_n(&bl_nsites, __ATOMIC_ACQUIRE);
+  for(uint16_t id = bl_sites_out + 1; id <= n; id++){
+    const struct bl_site *s = bl_sites[id];
+    fputc('S', f);
+    bl_put(f, id, 2);
+    bl_put(f, s->level, 1);
+    bl_put(f, s->nargs, 1);
+    bl_put(f, s->line, 2);
+    bl_put(f, strlen(s->file), 2);
+    fputs(s->file, f);
+    bl_put(f, strlen(s->fmt), 2);
+    fputs(s->fmt, f);
+  }
+  bl_sites_out = n;
+}
+
+//moves everything in the rings to the file.  only the writer calls it
+static void binlog_flush(void){
+  if(!bl_out) return;
+  uint32_t nrings = __atomic_load_n(&bl_nrings, __ATOMIC_ACQUIRE);
+  if(nrings > BL_MAX_THREADS + 1) nrings = BL_MAX_THREADS + 1;
+  for(uint32_t i = 0; i < nrings; i++){
+    struct bl_ring *r = &bl_rings[i];
+    //head first: every record below it has a site registered before it
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    bl_write_sites(bl_out);
+    for(uint32_t k = r->tail; k != head; k++){
+      const struct bl_rec *e = &r->rec[k & (BL_RING_ENTRIES - 1)];
+      fputc('E', bl_out);
+      bl_put(bl_out, e->site, 2);
+      bl_put(bl_out, i, 1);
+      bl_put(bl_out, e->t_ns, 8);
+      for(int a = 0; a < bl_sites[e->site]->nargs; a++) bl_put(bl_out, e->a[a], 8);
+    }
+    __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+    uint32_t dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    if(dropped != r->dropped_out){
+      fputc('D', bl_out);
+      bl_put(bl_out, i, 1);
+      bl_put(bl_out, dropped - r->dropped_out, 4);
+      r->dropped_out = dropped;
+    }
+  }
+  fflush(bl_out);
+}
+
+//the writer thread, drains every BL_FLUSH_US until the log is closed
+static void *bl_writer_main(void *arg){
+  struct timespec ts = {0, BL_FLUSH_US * 1000};
+  while(bl_enabled){
+    binlog_flush();
+    nanosleep(&ts, NULL);
+  }
+  binlog_flush();
+  return NULL;
+}
+
+//opens a binary log and starts the writer.  0 on success, -1 if the
+//file can't be opened
+static inline int binlog_open(const char *path){
+  bl_out = fopen(path, "wb");
+  if(!bl_out) return -1;
+  struct timespec wall;
+  clock_gettime(CLOCK_REALTIME, &wall);
+  fputs(BL_MAGIC, bl_out);
+  bl_put(bl_out, (uint64_t)wall.tv_sec * 1000000000 + wall.tv_nsec, 8);
+  bl_put(bl_out, bl_now_ns(), 8);
+  bl_enabled = 1;
+  if(pthread_create(&bl_writer, NULL, bl_writer_main, NULL) != 0){
+    bl_enabled = 0;
+    fclose(bl_out);
+    bl_out = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+//stops logging, writes out what is left and closes the file
+static inline void binlog_close(void){
+  if(!bl_out) return;
+  bl_enabled = 0;
+  pthread_join(bl_writer, NULL);
+  fclose(bl_out);
+  bl_out = NULL;
+}
+
+#endif
@@ -0,0 +1,168 @@
+/* UCSD CubeSat
+   chansel.h
+
+   Interference aware channel selection.  The groundstation (loraRX -C)
+   keeps a running picture of every channel in an allowed list and moves
+   itself and the balloon to the cleanest one.  Two things count against a
+   channel:
+
+   noise      rssi samples taken while listening on it, and during short
+              scans of the other channels between beacons.  the score uses
+              the 90th percentile, so a channel that is quiet on average
+              but regularly blasted by someone scores badly
+   traffic    packets demodulated on it that aren't ours (CRC errors,
+              payloads we don't recognize), per minute of listening.  a
+              LoRa user on the same settings collides with us even below
+              the noise percentiles
+
+   score = p90 dBm + CHAN_TRAFFIC_DB per foreign packet a minute, lower is
+   better, and a move needs the best channel to beat the current one by
+   CHAN_HYSTERESIS_DB on CHAN_CONFIRM evaluations in a row so one noisy
+   scan doesn't bounce the link around.
+
+   Notes on memory:
+   This runs for weeks on the groundstation, so every channel keeps a fixed
+   histogram of raw rssi readings (one bin per dB) and decayed counters,
+   nothing that grows.  Once a channel has CHAN_WINDOW samples all its
+   counts are halved, which keeps the percentiles following the last few
+   thousand samples and the memory constant.  Updates are O(1) and a
+   percentile is one pass over CHAN_RSSI_BINS.
+
+   Nothing in here touches the hardware.
+
+   ---------------------------------------------------------------------------------------------*/
+
+#ifndef CHANSEL_H
+#define CHANSEL_H
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define CHAN_MAX           16     //channels in the allowed list
+#define CHAN_RSSI_BINS     256    //raw RegRssiValue, one per dB
+#define CHAN_WINDOW        4096   //samples before a channel's counts are halved
+#define CHAN_TRAFFIC_DB    3      //score penalty per foreign packet a minute
+#define CHAN_TRAFFIC_MAX   30     //cap on the traffic penalty in dB
+#define CHAN_HYSTERESIS_DB 6      //how much better a channel must be to move
+#define CHAN_CONFIRM       3      //evaluations in a row before moving
+#define CHAN_MIN_SAMPLES   64     //a channel needs this much history to be judged
+
+struct chan_stats{
+  uint32_t freq_hz;
+  uint16_t hist[CHAN_RSSI_BINS];
+  uint32_t samples;       //decayed along with the histogram
+  uint32_t foreign;       //decayed foreign packet count
+  uint64_t listen_us;     //decayed listening time the foreign count is over
+};
+
+struct chan_sel{
+  struct chan_stats ch[CHAN_MAX];
+  int      n;
+  int      current;
+  int      candidate;     //channel that has been best lately
+  int      streak;        //evaluations it has been best in a row
+  int16_t  rssi_offset;
+};
+
+//-----------------------------------helper function implementations----------------------------
+
+//starts with n channels, in Hz, on channel current
+static void chan_init(struct chan_sel *s, const uint32_t *freq_hz, int n, int current, int16_t rssi_offset){
+  if(n > CHAN_MAX) n = CHAN_MAX;
+  for(int i = 0; i < n; i++){
+    struct chan_stats *c = &s->ch[i];
+    c->freq_hz = freq_hz[i];
+    for(int k = 0; k < CHAN_RSSI_BINS; k++) c->hist[k] = 0;
+    c->samples = c->foreign = 0;
+    c->listen_us = 0;
+  }
+  s->n = n;
+  s->current = current;
+  s->candidate = -1;
+  s->streak = 0;
+  s->rssi_offset = rssi_offset;
+}
+
+//halves everything so old history fades out
+static void chan_decay(struct chan_stats *c){
+  c->samples = 0;
+  for(int k = 0; k < CHAN_RSSI_BINS; k++){
+    c->hist[k] /= 2;
+    c->samples += c->hist[k];
+  }
+  c->foreign /= 2;
+  c->listen_us /= 2;
+}
+
+//one raw RegRssiValue reading on channel i
+static void chan_rssi(struct chan_sel *s, int i, uint8_t raw){
+  struct chan_stats *c = &s->ch[i];
+  c->hist[raw]++;
+  if(++c->samples >= CHAN_WINDOW) chan_decay(c);
+}
+
+//time spent listening on channel i, and packets there that weren't ours
+static void chan_listen(struct chan_sel *s, int i, uint64_t us, uint32_t foreign){
+  s->ch[i].listen_us += us;
+  s->ch[i].foreign += foreign;
+}
+
+//rssi in dBm below which frac of the channel's samples fall
+static int16_t chan_percentile(const struct chan_sel *s, int i, double frac){
+  const struct chan_stats *c = &s->ch[i];
+  uint32_t want = (uint32_t)(c->samples * frac);
+  uint32_t seen = 0;
+  int k = 0;
+  while(k < CHAN_RSSI_BINS - 1 && (seen += c->hist[k]) <= want) k++;
+  return k + s->rssi_offset;
+}
+
+//foreign packets per minute of listening
+static double chan_traffic(const struct chan_sel *s, int i){
+  const struct chan_stats *c = &s->ch[i];
+  return c->listen_us ? c->foreign * 60e6 / c->listen_us : 0;
+}
+
+//lower is better
+static int chan_score(const struct chan_sel *s, int i){
+  int penalty = (int)(CHAN_TRAFFIC_DB * chan_traffic(s, i));
+  if(penalty > CHAN_TRAFFIC_MAX) penalty = CHAN_TRAFFIC_MAX;
+  return chan_percentile(s, i, 0.9) + penalty;
+}
+
+//ranks the channels.  returns the channel to move to, or -1 to stay
+static int chan_pick(struct chan_sel *s){
+  int best = -1;
+  for(int i = 0; i < s->n; i++){
+    if(s->ch[i].samples < CHAN_MIN_SAMPLES) continue;
+    if(best < 0 || chan_score(s, i) < chan_score(s, best)) best = i;
+  }
+  if(best < 0 || best == s->current || s->ch[s->current].samples < CHAN_MIN_SAMPLES ||
+     chan_score(s, best) + CHAN_HYSTERESIS_DB > chan_score(s, s->current)){
+    s->candidate = -1;
+    s->streak = 0;
+    return -1;
+  }
+  if(best != s->candidate){
+    s->candidate = best;
+    s->streak = 0;
+  }
+  if(++s->streak < CHAN_CONFIRM) return -1;
+  s->candidate = -1;
+  s->streak = 0;
+  return best;
+}
+
+//prints the ranking inputs for every channel
+static void chan_print(FILE *out, const struct chan_sel *s){
+  fprintf(out, "Channels:\n");
+  for(int i = 0; i < s->n; i++){
+    fprintf(out, "  %c %8.3f MHz  p50 %4d dBm  p90 %4d dBm  %5.2f foreign/min  score %4d  (%u samples)\n",
+            i == s->current ? '*' : ' ', s->ch[i].freq_hz / 1e6, chan_percentile(s, i, 0.5),
+            chan_percentile(s, i, 0.9), chan_traffic(s, i), chan_score(s, i), s->ch[i].samples);
+  }
+}
+
+#endif
@@ -0,0 +1,163 @@
+/* UCSD CubeSat
+   csma.h
+
+   Listen before talk for a shared channel.  The transmitter used to key up
+   blindly every cycle, which is fine with one balloon and one groundstation
+   but collides as soon as several of our nodes, or anyone else on 433 MHz,
+   share the band.  Before each Tx the caller checks the channel (see
+   channel_busy() in sx1278.h, CAD plus an optional rssi threshold) and, if
+   it is busy, backs off for a random number of slots.  The window doubles
+   on every busy check up to 2^max_be slots, and the packet is given up on
+   once the total deferral would exceed the latency budget.
+
+   Usage:
+
+   struct csma_state cs;
+   csma_start(&cs, &cfg);
+   while(channel_busy(rssi)){
+     int64_t d = csma_backoff(&cs, &cfg, &seed);
+     if(d < 0) break;                 //over budget, drop
+     ...wait d us...
+   }
+   csma_record(&stats, &cs, sent);
+
+   Nothing in here touches the hardware, so lorasim.c runs the exact same
+   backoff policy against simulated nodes to measure collision rate, delay
+   distribution and goodput under load.
+
+   Notes on slot length:
+   CAD only reliably detects a preamble.  Once a packet is into its payload
+   a CAD can miss it, so a node that backs off for a fraction of a packet
+   tends to check again in the middle of the same packet.  The default slot
+   is therefore one airtime of our own packet, which is also about how long
+   a busy channel stays busy.
+
+   ---------------------------------------------------------------------------------------------*/
+
+#ifndef CSMA_H
+#define CSMA_H
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdio.h>
+#include <stdint.h>
+#include "timing.h"
+
+#define CSMA_MIN_BE      1        //first backoff is 1-2 slots
+#define CSMA_MAX_BE      5        //window stops growing at 32 slots
+#define CSMA_BUDGET_US   2000000  //default max deferral per packet
+#define CSMA_HIST_BINS   14       //0 ms, then powers of two up to 4 s and over
+#define CAD_SYMBOLS      2        //a CAD takes about two symbols
+
+struct csma_cfg{
+  uint32_t slot_us;    //backoff unit
+  uint8_t  min_be;     //initial backoff exponent
+  uint8_t  max_be;     //largest backoff exponent
+  uint32_t budget_us;  //max total deferral before the packet is dropped
+};
+
+//per packet state
+struct csma_state{
+  uint8_t  be;
+  uint32_t waited_us;
+};
+
+struct csma_stats{
+  uint32_t sent;       //packets that got a clear channel
+  uint32_t busy;       //busy channel checks
+  uint32_t dropped;    //packets given up on at the budget
+  uint64_t delay_total;
+  uint32_t delay_max;
+  uint32_t hist[CSMA_HIST_BINS];
+};
+
+//-----------------------------------helper function implementations----------------------------
+
+//small xorshift generator so every node and every simulation run can
+//have its own reproducible stream
+static uint32_t csma_rand(uint32_t *seed){
+  uint32_t x = *seed ? *seed : 0x9E3779B9;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *seed = x;
+  return x;
+}
+
+//defaults for a node whose own packets take air_us on the air
+static void csma_defaults(struct csma_cfg *c, uint32_t air_us){
+  c->slot_us = air_us;
+  c->min_be = CSMA_MIN_BE;
+  c->max_be = CSMA_MAX_BE;
+  c->budget_us = CSMA_BUDGET_US;
+}
+
+//duration of one channel activity detection
+static uint32_t cad_us(const struct modem_cfg *m){
+  return CAD_SYMBOLS * symbol_us(m);
+}
+
+//resets the per packet state before the first channel check
+static void csma_start(struct csma_state *s, const struct csma_cfg *c){
+  s->be = c->min_be;
+  s->waited_us = 0;
+}
+
+//next backoff in us after a busy channel, 1 to 2^be slots.
+//returns -1 if waiting would go past the latency budget
+static int64_t csma_backoff(struct csma_state *s, const struct csma_cfg *c, uint32_t *seed){
+  uint32_t slots = csma_rand(seed) % (1u << s->be) + 1;
+  uint64_t d = (uint64_t)slots * c->slot_us;
+  if(s->be < c->max_be) s->be++;
+  if(s->waited_us + d > c->budget_us) return -1;
+  s->waited_us += d;
+  return (int64_t)d;
+}
+
+//histogram bin of a deferral, 0 for none, else 1 + log2 of milliseconds
+static int csma_bin(uint32_t delay_us){
+  uint32_t ms = delay_us / 1000;
+  if(delay_us == 0) return 0;
+  int bin = 1;
+  while(ms > 0 && bin < CSMA_HIST_BINS - 1){
+    ms >>= 1;
+    bin++;
+  }
+  return bin;
+}
+
+//records how a packet's channel access went
+static void csma_record(struct csma_stats *st, const struct csma_state *s, int sent){
+  if(!sent){
+    st->dropped++;
+    return;
+  }
+  st->sent++;
+  st->delay_total += s->waited_us;
+  if(s->waited_us > st->delay_max) st->delay_max = s->waited_us;
+  st->hist[csma_bin(s->waited_us)]++;
+}
+
+//prints access counts and the deferral distribution
+static void csma_print(FILE *out, const struct csma_stats *st){
+  fprintf(out, "CSMA: %u sent, %u busy checks, %u dropped over budget, "
+          "deferral mean %.1f ms max %.1f ms\n", st->sent, st->busy, st->dropped,
+          st->sent ? st->delay_total / 1000.0 / st->sent : 0, st->delay_max / 1000.0);
+  uint32_t peak = 1;
+  for(int i = 0; i < CSMA_HIST_BINS; i++){
+    if(st->hist[i] > peak) peak = st->hist[i];
+  }
+  for(int i = 0; i < CSMA_HIST_BINS; i++){
+    if(st->hist[i] == 0) continue;
+    if(i == 0){
+      fprintf(out, "  %8s ", "0 ms");
+    }else{
+      fprintf(out, "  <%5u ms ", 1u << (i - 1));
+    }
+    int bar = (int)(40.0 * st->hist[i] / peak);
+    for(int k = 0; k < bar; k++) fputc('#', out);
+    fprintf(out, " %u\n", st->hist[i]);
+  }
+}
+
+#endif
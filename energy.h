@@ -0,0 +1,323 @@
+/* UCSD CubeSat
+   energy.h
+
+   Energy accounting for the SX1278.  The battery life experiment described
+   in loraTX.c counts beacons in batlife.txt and works out the lifetime after
+   the battery is flat, which takes days per data point.  This module instead
+   timestamps every op mode transition and integrates a current figure for
+   each mode into charge used, so two scheduling or power strategies can be
+   compared in minutes.
+
+   Usage from a program that already includes sx1278.h:
+
+   #include "energy.h"
+   energy_init(path, battery_mah);   //after lora_init()
+   ...
+   energy_packet();                  //closes one packet's worth of charge
+   energy_report(stderr);            //running totals and projected life
+
+   energy_init() installs a register hook (see reg_hook in sx1278.h) so every
+   write to REG_OP_MODE, and every read of it that shows the chip moved on
+   its own, is recorded with a monotonic timestamp.  Tx time is capped at
+   the computed airtime of the packet because the chip drops back to standby
+   by itself after TxDone, usually long before anyone reads the op mode.
+   Programs that notice other autonomous transitions (RxTimeout, CadDone)
+   can report them with energy_mode().
+
+   Notes on current figures:
+   The defaults are the typical values from the datasheet electrical specs
+   for the 433 MHz band.  Tx current depends on the PA pin and output power
+   in REG_PA_CONFIG, so it is looked up on a small curve of (dBm, mA) points
+   and interpolated.  All of it can be overridden with a text file passed to
+   energy_init(), one figure per line:
+
+   # mode     mA
+   sleep      0.0002
+   standby    1.6
+   rx         11.5
+   cad        11.5
+   base       0        (everything else on the board, e.g. the RPI)
+   tx  17     87       (one line per curve point, replaces the default curve)
+   tx  20     120
+
+   Charge is accumulated in mA*us as a double and converted on output.
+
+   ---------------------------------------------------------------------------------------------*/
+
+#ifndef ENERGY_H
+#define ENERGY_H
+
+//------------------------------header files and label definitions------------------------------
+
+#include "sx1278.h"
+#include <string.h>
+
+//accounting buckets, one per radio mode we have a current figure for
+#define E_SLEEP    0
+#define E_STANDBY  1
+#define E_TX       2
+#define E_RX       3
+#define E_CAD      4
+#define E_MODES    5
+
+#define E_TX_POINTS 8  //max points on the tx current curve
+
+static const char *energy_names[E_MODES] = {"sleep", "standby", "tx", "rx", "cad"};
+
+//current figures in mA
+struct energy_model{
+  double mode_ma[E_MODES];          //tx entry unused, see curve
+  double base_ma;                   //constant load outside the radio
+  int    tx_points;
+  double tx_dbm[E_TX_POINTS];       //ascending output power
+  double tx_ma[E_TX_POINTS];
+};
+
+//running totals
+struct energy_acct{
+  struct energy_model model;
+  double   battery_mah;
+  uint8_t  bucket;                  //mode currently being charged
+  double   bucket_ma;               //its current, tx depends on pa level
+  uint64_t since;                   //timestamp of the last transition
+  uint64_t tx_cap;                  //end of computed tx airtime, 0 if none
+  uint64_t start;
+  uint64_t time_us[E_MODES];
+  double   charge[E_MODES];         //mA*us
+  double   packet_charge;           //mA*us since last energy_packet()
+  double   packet_total;
+  uint32_t packets;
+  uint32_t transitions;
+  uint8_t  pa_config;               //shadow of REG_PA_CONFIG
+  uint8_t  payload_len;             //shadow of REG_PAYLOAD_LEN
+  struct modem_cfg modem;           //shadow of the modem registers
+};
+
+static struct energy_acct energy;
+
+//-----------------------------------helper function implementations----------------------------
+
+//typical datasheet figures
+static void energy_defaults(struct energy_model *m){
+  m->mode_ma[E_SLEEP] = 0.0002;
+  m->mode_ma[E_STANDBY] = 1.6;
+  m->mode_ma[E_TX] = 0;
+  m->mode_ma[E_RX] = 11.5;
+  m->mode_ma[E_CAD] = 11.5;
+  m->base_ma = 0;
+  //RFO +7 and +13 dBm, PA_BOOST +17 and +20 dBm
+  double dbm[] = {7, 13, 17, 20};
+  double ma[] = {20, 29, 87, 120};
+  m->tx_points = 4;
+  memcpy(m->tx_dbm, dbm, sizeof(dbm));
+  memcpy(m->tx_ma, ma, sizeof(ma));
+}
+
+//reads an override file in the format described at the top of this file
+//returns 0 on success, -1 if the file can't be opened
+static int energy_load(struct energy_model *m, const char *path){
+  FILE *f = fopen(path, "r");
+  if(!f) return -1;
+  char line[128], key[16];
+  double a, b;
+  int custom_tx = 0;
+  while(fgets(line, sizeof(line), f)){
+    if(line[0] == '#') continue;
+    int n = sscanf(line, "%15s %lf %lf", key, &a, &b);
+    if(n == 3 && strcmp(key, "tx") == 0){
+      if(!custom_tx){
+        m->tx_points = 0;
+        custom_tx = 1;
+      }
+      //keep the curve sorted by output power
+      if(m->tx_points < E_TX_POINTS){
+        int i = m->tx_points++;
+        while(i > 0 && m->tx_dbm[i-1] > a){
+          m->tx_dbm[i] = m->tx_dbm[i-1];
+          m->tx_ma[i] = m->tx_ma[i-1];
+          i--;
+        }
+        m->tx_dbm[i] = a;
+        m->tx_ma[i] = b;
+      }
+    }else if(n == 2){
+      if(strcmp(key, "base") == 0) m->base_ma = a;
+      for(int i = 0; i < E_MODES; i++){
+        if(strcmp(key, energy_names[i]) == 0) m->mode_ma[i] = a;
+      }
+    }
+  }
+  fclose(f);
+  return 0;
+}
+
+//output power in dBm programmed by a REG_PA_CONFIG value
+//PA_BOOST: 17 - (15 - OutputPower), RFO: 10.8 + 0.6*MaxPower - (15 - OutputPower)
+static double pa_dbm(uint8_t pa_config){
+  double out = pa_config & 0x0F;
+  if(pa_config & 0x80) return 2 + out;
+  return 10.8 + 0.6*((pa_config >> 4) & 0x07) - 15 + out;
+}
+
+//tx current at a REG_PA_CONFIG value, linear between curve points and
+//clamped to the end points
+static double tx_current(const struct energy_model *m, uint8_t pa_config){
+  double dbm = pa_dbm(pa_config);
+  if(m->tx_points == 0) return 0;
+  if(dbm <= m->tx_dbm[0]) return m->tx_ma[0];
+  for(int i = 1; i < m->tx_points; i++){
+    if(dbm <= m->tx_dbm[i]){
+      double t = (dbm - m->tx_dbm[i-1]) / (m->tx_dbm[i] - m->tx_dbm[i-1]);
+      return m->tx_ma[i-1] + t*(m->tx_ma[i] - m->tx_ma[i-1]);
+    }
+  }
+  return m->tx_ma[m->tx_points - 1];
+}
+
+//charges the current bucket up to time t
+static void energy_charge(uint64_t t){
+  if(t <= energy.since) return;
+  //past the end of tx airtime the chip is really in standby
+  if(energy.bucket == E_TX && energy.tx_cap && t > energy.tx_cap){
+    energy_charge(energy.tx_cap);
+    energy.bucket = E_STANDBY;
+    energy.bucket_ma = energy.model.mode_ma[E_STANDBY];
+    energy.tx_cap = 0;
+    energy.transitions++;
+  }
+  uint64_t dt = t - energy.since;
+  double q = dt * (energy.bucket_ma + energy.model.base_ma);
+  energy.time_us[energy.bucket] += dt;
+  energy.charge[energy.bucket] += q;
+  energy.packet_charge += q;
+  energy.since = t;
+}
+
+//accounting bucket for an op mode value
+static uint8_t mode_bucket(uint8_t opmode){
+  switch(opmode & 0x07){
+    case 0:  return E_SLEEP;
+    case 3:  return E_TX;
+    case 5:
+    case 6:  return E_RX;
+    case 7:  return E_CAD;
+    default: return E_STANDBY;  //standby and the synthesizer modes
+  }
+}
+
+//records a transition into an op mode, e.g. after the program has seen
+//RxTimeout and knows the chip went back to standby by itself
+static void energy_mode(uint8_t opmode){
+  uint64_t t = now_us();
+  energy_charge(t);
+  uint8_t bucket = mode_bucket(opmode);
+  if(bucket == energy.bucket && bucket != E_TX) return;
+  energy.transitions++;
+  energy.bucket = bucket;
+  energy.tx_cap = 0;
+  if(bucket == E_TX){
+    energy.bucket_ma = tx_current(&energy.model, energy.pa_config);
+    energy.tx_cap = t + airtime_us(&energy.modem, energy.payload_len);
+  }else{
+    energy.bucket_ma = energy.model.mode_ma[bucket];
+  }
+}
+
+//register hook, keeps the shadow registers current and follows op mode
+static void energy_hook(uint8_t addr, uint8_t data){
+  uint8_t reg = addr & 0x7F;
+  if(reg == REG_OP_MODE){
+    //a read only matters if the chip changed mode on its own
+    if((addr & 0x80) || mode_bucket(data) != energy.bucket) energy_mode(data);
+    return;
+  }
+  if(!(addr & 0x80)) return;
+  switch(reg){
+    case REG_PA_CONFIG:        energy.pa_config = data; break;
+    case REG_PAYLOAD_LEN:      energy.payload_len = data; break;
+    case REG_MODEM_CONFIG1:
+      energy.modem.bw_hz = lora_bw_hz[(data >> 4) < 10 ? (data >> 4) : 9];
+      energy.modem.cr = (data >> 1) & 0x07;
+      energy.modem.implicit = data & 0x01;
+      break;
+    case REG_MODEM_CONFIG2:
+      energy.modem.sf = data >> 4;
+      energy.modem.crc = (data >> 2) & 0x01;
+      break;
+    case REG_MODEM_CONFIG3:    energy.modem.ldro = (data >> 3) & 0x01; break;
+    case REG_PREAMBLE_LEN_MSB: energy.modem.preamble = (energy.modem.preamble & 0xFF) | (data << 8); break;
+    case REG_PREAMBLE_LEN_LSB: energy.modem.preamble = (energy.modem.preamble & 0xFF00) | (uint8_t)data; break;
+  }
+}
+
+//starts accounting.  reads the registers the model depends on once and
+//then follows them through the register hook.  path may be NULL for the
+//datasheet defaults.  battery_mah of 0 skips the lifetime projection
+static void energy_init(const char *path, double battery_mah){
+  memset(&energy, 0, sizeof(energy));
+  energy_defaults(&energy.model);
+  if(path && energy_load(&energy.model, path) != 0){
+    fprintf(stderr, "Couldn't open current figures %s, using defaults.\n", path);
+  }
+  energy.battery_mah = battery_mah;
+  reg_hook = NULL;
+  energy.pa_config = read_reg(REG_PA_CONFIG);
+  energy.payload_len = read_reg(REG_PAYLOAD_LEN);
+  read_modem(&energy.modem);
+  energy.bucket = mode_bucket(read_reg(REG_OP_MODE));
+  energy.bucket_ma = energy.model.mode_ma[energy.bucket];
+  energy.start = energy.since = now_us();
+  reg_hook = energy_hook;
+}
+
+//closes the charge of one packet (one beacon cycle, one reception) and
+//returns it in mA*us
+static double energy_packet(void){
+  energy_charge(now_us());
+  double q = energy.packet_charge;
+  energy.packet_total += q;
+  energy.packets++;
+  energy.packet_charge = 0;
+  return q;
+}
+
+//average current in mA since energy_init()
+static double energy_avg_ma(void){
+  energy_charge(now_us());
+  uint64_t total = energy.since - energy.start;
+  if(total == 0) return 0;
+  double q = 0;
+  for(int i = 0; i < E_MODES; i++) q += energy.charge[i];
+  return q / total;
+}
+
+//projected battery life in hours at the average current so far
+static double energy_life_h(void){
+  double avg = energy_avg_ma();
+  if(avg <= 0 || energy.battery_mah <= 0) return 0;
+  return energy.battery_mah / avg;
+}
+
+//prints per mode time and charge, per packet charge and projected life
+static void energy_report(FILE *out){
+  double avg = energy_avg_ma();
+  uint64_t total = energy.since - energy.start;
+  fprintf(out, "Energy: %.1f s, %u transitions, avg %.3f mA", total / 1e6,
+          energy.transitions, avg);
+  if(energy.battery_mah > 0){
+    fprintf(out, ", %.0f mAh battery lasts %.1f h", energy.battery_mah, energy_life_h());
+  }
+  fprintf(out, "\n");
+  for(int i = 0; i < E_MODES; i++){
+    if(energy.time_us[i] == 0) continue;
+    fprintf(out, "  %-8s %10.3f s %6.2f%% %12.6f mAh\n", energy_names[i],
+            energy.time_us[i] / 1e6, total ? 100.0 * energy.time_us[i] / total : 0,
+            energy.charge[i] / 3.6e9);
+  }
+  if(energy.packets){
+    fprintf(out, "  %u packets, %.3f mC per packet\n", energy.packets,
+            energy.packet_total / energy.packets / 1e6);
+  }
+}
+
+#endif
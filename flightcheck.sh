@@ -0,0 +1,202 @@
+#!/bin/sh
+# UCSD CubeSat
+# flightcheck.sh
+#
+# Footprint and worst case report for the flight build, loraflight.c, and
+# the regression check that keeps them from creeping up.  Run it from
+# anywhere, before committing a change to anything loraflight.c includes:
+#
+# $ ./flightcheck.sh              build, report and check against the budget
+# $ sudo ./flightcheck.sh wcet    also run on the radio for the worst case times
+# $ ./flightcheck.sh update       write this build's figures as the new budget
+# $ sudo ./flightcheck.sh update wcet   the same with the worst case times
+#
+# It checks that the flight object calls nothing from stdio, the heap,
+# exit() or the C library's time formatting, and reports:
+#
+# text data bss        size(1) of the flight object, the code and data the
+#                      flight computer has to hold besides the libraries
+# stack <entry point>  worst case stack from the entry point down, from
+#                      the call graph gcc writes with -fcallgraph-info=su:
+#                      each function's frame plus its deepest callee's.
+#                      calls into bcm2835 and the C library are listed and
+#                      not counted, their stack isn't in the graph.  a
+#                      recursive path, an indirect call or a frame gcc
+#                      can't bound makes it unbounded, which fails
+# wcet_us <entry>      (wcet) the longest a call took over CYCLES beacon
+#                      cycles on the radio, waits included
+# spi_bytes <entry>    (wcet) the most SPI bytes a call sent
+#
+# Each figure is checked against flight-<machine>.budget, machine being
+# what $CC -dumpmachine says, since footprint and stack depend on the
+# target and the compiler.  Anything over its budget fails the check,
+# and so does a figure with no budget yet, or a machine with no budget
+# file at all: only update takes new figures.  A change that is meant to
+# cost more runs update and commits the new budget with it, so the
+# growth shows up in review.  update without wcet keeps the wcet figures
+# of the old budget.  The flight target is the Pi, so its budget is the
+# one that counts and is made there with update wcet.
+#
+# Environment:
+# CC      compiler (cc)
+# LIBS    what loraflight links against for wcet (-lbcm2835)
+# CYCLES  beacon cycles for wcet, 5 s each (20)
+#
+# ---------------------------------------------------------------------------------------------
+
+mode=${1:-check}
+run_wcet=0
+case $mode in
+  check) ;;
+  wcet) run_wcet=1 ;;
+  update) [ "$2" = wcet ] && run_wcet=1 ;;
+  *) echo "usage: $0 [check | wcet | update [wcet]]"; exit 2 ;;
+esac
+
+CC=${CC:-cc}
+LIBS=${LIBS:--lbcm2835}
+CYCLES=${CYCLES:-20}
+ENTRIES="flight_init flight_tick flight_beacon flight_listen flight_recover main"
+CFLAGS="-Os"
+
+cd "$(dirname "$0")" || exit 2
+machine=$($CC -dumpmachine) || exit 2
+budget=flight-$machine.budget
+dir=$(mktemp -d) || exit 2
+trap 'rm -rf "$dir"' EXIT
+
+#------------------------------------------build-------------------------------------------------
+
+if ! $CC $CFLAGS -I. -fstack-usage -fcallgraph-info=su -c loraflight.c -o "$dir/loraflight.o" 2> "$dir/cc.log"; then
+  cat "$dir/cc.log"
+  exit 2
+fi
+
+#-----------------------------------------forbidden calls----------------------------------------
+
+#undefined symbols of the flight object itself.  _chk variants are what
+#-D_FORTIFY_SOURCE turns printf() and friends into
+forbidden=$(nm -u "$dir/loraflight.o" | awk '{print $NF}' | sed 's/@.*//' |
+  grep -E '^(_*[a-z]*printf(_chk)?|puts|fputs|putchar|fputc|putc|fwrite|fopen|fdopen|fclose|fflush|perror|setvbuf|malloc|calloc|realloc|free|exit|_exit|abort|atexit|localtime(_r)?|gmtime(_r)?|asctime(_r)?|ctime(_r)?|strftime|mktime|tzset)$')
+status=0
+if [ -n "$forbidden" ]; then
+  echo "loraflight.o calls what the flight build must not:" $forbidden
+  status=1
+fi
+
+#------------------------------------------figures-----------------------------------------------
+
+size "$dir/loraflight.o" | awk 'NR == 2 {print "text", $1; print "data", $2; print "bss", $3}' > "$dir/measured"
+
+#worst case stack per entry point from the vcg call graph.  a node's title
+#is file:function for statics and the plain name for globals, its label
+#ends in "N bytes (static)" or "(dynamic,bounded)", and a function gcc
+#only saw declared (the libraries) is an ellipse with no size
+awk -v entries="$ENTRIES" -v out="$dir/externals" '
+  function field(s, key,   i) {
+    i = index(s, key "\"")
+    if (i == 0) return ""
+    s = substr(s, i + length(key) + 1)
+    return substr(s, 1, index(s, "\"") - 1)
+  }
+  function worst(f,   i, w, m) {
+    if (f in memo) return memo[f]
+    if (f in active) { bad = "recursive"; return 0 }
+    active[f] = 1
+    if (ext[f]) externals[f] = 1
+    if (unbounded[f]) bad = "unbounded"
+    m = 0
+    for (i = 1; i <= ncall[f]; i++) {
+      w = worst(callee[f, i])
+      if (w > m) m = w
+    }
+    delete active[f]
+    memo[f] = size[f] + m
+    return memo[f]
+  }
+  /^node:/ {
+    t = field($0, "title: ")
+    size[t] = 0
+    if (/shape : ellipse/) ext[t] = 1
+    if (match($0, /[0-9]+ bytes \([a-z,]+\)/)) {
+      s = substr($0, RSTART, RLENGTH)
+      size[t] = s + 0
+      if (s ~ /dynamic/ && s !~ /bounded/) unbounded[t] = 1
+    }
+  }
+  /^edge:/ {
+    f = field($0, "sourcename: ")
+    t = field($0, "targetname: ")
+    callee[f, ++ncall[f]] = t
+    if (t ~ /indirect_call/) unbounded[t] = 1
+  }
+  END {
+    n = split(entries, e, " ")
+    for (k = 1; k <= n; k++) {
+      split("", memo)
+      split("", externals)
+      bad = ""
+      w = worst(e[k])
+      list = ""
+      for (x in externals) list = list " " x
+      print e[k] ":" list > out
+      print "stack", e[k], bad == "" ? w : bad
+    }
+  }' "$dir/loraflight.ci" >> "$dir/measured"
+
+if [ $run_wcet -eq 1 ]; then
+  if ! $CC $CFLAGS -I. -DFLIGHT_WCET="$CYCLES" loraflight.c -o "$dir/loraflight" $LIBS 2> "$dir/cc.log"; then
+    cat "$dir/cc.log"
+    exit 2
+  fi
+  echo "Running $CYCLES beacon cycles on the radio."
+  "$dir/loraflight" 2> "$dir/wcet" > /dev/null
+  r=$?
+  if [ $r -ne 0 ]; then
+    echo "loraflight failed with error -$r."
+    exit 1
+  fi
+  awk '$1 == "wcet" {print "wcet_us", $2, $3; print "spi_bytes", $2, $4}' "$dir/wcet" >> "$dir/measured"
+fi
+
+#------------------------------------------report------------------------------------------------
+
+echo "loraflight.o, $($CC --version | head -n 1) $CFLAGS for $machine"
+limits=$budget
+if [ ! -f "$budget" ]; then
+  echo "No $budget yet, everything is new."
+  [ "$mode" = update ] || status=1
+  limits=/dev/null
+fi
+strict=1
+[ "$mode" = update ] && strict=0
+awk -v budget="$limits" -v strict=$strict '
+  function key(   k, i) {
+    k = $1
+    for (i = 2; i < NF; i++) k = k " " $i
+    return k
+  }
+  FILENAME == budget { if ($1 !~ /^#/ && NF > 1) limit[key()] = $NF; next }
+  {
+    k = key()
+    if (!(k in limit)) { s = "new"; if (strict) over = 1 }
+    else if ($NF !~ /^[0-9]+$/ || $NF + 0 > limit[k] + 0) { s = "OVER"; over = 1 }
+    else s = "ok"
+    printf "  %-28s %10s %10s  %s\n", k, $NF, k in limit ? limit[k] : "-", s
+  }
+  END { exit over }' "$limits" "$dir/measured" || status=1
+echo "  library calls, stack not counted:"
+sed 's/^/    /' "$dir/externals"
+
+if [ "$mode" = update ]; then
+  {
+    echo "# flightcheck.sh budget for loraflight.c: $($CC --version | head -n 1) $CFLAGS, $machine"
+    cat "$dir/measured"
+    [ $run_wcet -eq 1 ] || grep -E '^(wcet_us|spi_bytes) ' "$limits"
+  } > "$dir/budget"
+  mv "$dir/budget" "$budget"
+  echo "Wrote $budget."
+  exit 0
+fi
+[ $status -eq 0 ] && echo "Within budget." || echo "Over budget."
+exit $status
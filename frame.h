@@ -0,0 +1,308 @@
+/* UCSD CubeSat
+   frame.h
+
+   Over the air frame formats.  Until now every packet was a plain ASCII
+   timestamp from get_time() in loraTX.c, and the receiver just printed the
+   bytes.  Protocol frames (coordinator beacons and whatever follows) need
+   to be told apart from those, so they start with a type byte below 0x20.
+   No printable text starts with one, which keeps the old ASCII beacons
+   valid as they are.
+
+   Multi-byte fields are little endian.  Every unpack function checks the
+   type and the length before touching a field and returns -1 on anything
+   that doesn't fit, since every byte that comes off the air is untrusted.
+
+   Nothing in here touches the hardware, so lorasim.c and offline tools can
+   use the same formats.
+
+   Frame types:
+   FRAME_TDMA_BEACON   coordinator superframe announcement (tdma.h)
+   FRAME_CHANNEL_CMD   groundstation tells the balloon to change channel (chansel.h)
+   FRAME_PROFILE_CMD   modem profile switch handshake, both directions (profile.h)
+   FRAME_PING          ping-pong benchmark probe and its echo (pingpong.h)
+   FRAME_STREAM        a chunk of a bulk data stream (loraTX -S, loraRX -S)
+
+   Trailers:
+   A latency trailer (latency.h) can be appended to any payload, ASCII or
+   not.  It ends in two bytes that are never printable text, so the
+   receiver finds it by looking at the end of the packet.
+
+   ---------------------------------------------------------------------------------------------*/
+
+#ifndef FRAME_H
+#define FRAME_H
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdint.h>
+#include "profile.h"
+
+#define FRAME_TDMA_BEACON 0x01
+#define FRAME_CHANNEL_CMD 0x02
+#define FRAME_PROFILE_CMD 0x03
+#define FRAME_PING        0x04
+#define FRAME_STREAM      0x05
+
+#define FRAME_IS_PROTOCOL(b) ((b) < 0x20)
+
+//channel change: type, seq, new frequency, switch delay
+#define CHANNEL_CMD_LEN 11
+
+//profile switch: type, seq, phase, sf, bw, cr, sync, flags, preamble, switch delay
+#define PROFILE_CMD_LEN 15
+#define PROFILE_PROPOSE 1   //groundstation: switch to this profile switch_ms after this packet
+#define PROFILE_ACK     2   //balloon: will do
+#define PROFILE_COMMIT  3   //groundstation: heard you on the new profile, stay
+
+//ping: type, seq, step, flags, echo turnaround, then filler to the probe size
+#define PING_HEADER_LEN 9
+#define PING_ECHO       0x01    //flags: this is the echo, not the probe
+
+//stream chunk: type, seq, flags, then up to STREAM_DATA_LEN bytes of data
+#define STREAM_HEADER_LEN 4
+#define STREAM_DATA_LEN   (255 - STREAM_HEADER_LEN)
+#define STREAM_END        0x01  //flags: last chunk, it carries no data
+
+//latency trailer: enqueue time, fifo loaded and tx start offsets, magic
+#define LAT_TRAILER_LEN 18
+#define LAT_MAGIC0      0xA5
+#define LAT_MAGIC1      0x5A
+
+//coordinator beacon: type, seq, slots, superframe, slot, guard, tx time
+#define TDMA_BEACON_LEN 24
+
+struct tdma_beacon{
+  uint16_t seq;            //superframe counter
+  uint8_t  slots;          //data slots in the superframe
+  uint32_t superframe_us;  //beacon start to next beacon start
+  uint32_t slot_us;        //length of each data slot
+  uint32_t guard_us;       //guard at each end of a slot
+  uint64_t tx_us;          //coordinator wall clock at Tx start (timesync.h)
+};
+
+struct channel_cmd{
+  uint16_t seq;            //so a repeated command isn't acted on twice
+  uint32_t freq_hz;        //channel to move to
+  uint32_t switch_ms;      //both ends retune this long after the command's RxDone
+};
+
+struct profile_cmd{
+  uint16_t seq;            //one per proposal, the ack and commits carry it too
+  uint8_t  phase;
+  struct profile p;        //the profile proposed, and acked or committed
+  uint32_t switch_ms;      //both ends switch this long after the proposal's end
+};
+
+struct ping{
+  uint16_t seq;
+  uint8_t  step;           //which step of the benchmark plan
+  uint8_t  flags;
+  uint32_t turn_us;        //in an echo: the echoer's turnaround for the previous probe
+};
+
+struct stream_hdr{
+  uint16_t seq;            //chunk counter, a gap is a lost chunk
+  uint8_t  flags;
+};
+
+//transmit side timestamps, wall clock microseconds
+struct lat_trailer{
+  uint64_t enqueue_us;     //payload handed to the radio code
+  uint32_t loaded_us;      //FIFO load complete, after enqueue
+  uint32_t tx_us;          //Tx start, after enqueue
+};
+
+//-----------------------------------helper function implementations----------------------------
+
+static void put16(uint8_t *p, uint16_t v){
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v){
+  put16(p, v);
+  put16(p + 2, v >> 16);
+}
+
+static void put64(uint8_t *p, uint64_t v){
+  put32(p, v);
+  put32(p + 4, v >> 32);
+}
+
+static uint16_t get16(const uint8_t *p){
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p){
+  return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static uint64_t get64(const uint8_t *p){
+  return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+//packs a coordinator beacon into buf, returns its length
+static uint8_t pack_tdma_beacon(uint8_t *buf, const struct tdma_beacon *b){
+  buf[0] = FRAME_TDMA_BEACON;
+  put16(buf + 1, b->seq);
+  buf[3] = b->slots;
+  put32(buf + 4, b->superframe_us);
+  put32(buf + 8, b->slot_us);
+  put32(buf + 12, b->guard_us);
+  put64(buf + 16, b->tx_us);
+  return TDMA_BEACON_LEN;
+}
+
+//unpacks a coordinator beacon, 0 on success or -1 if it isn't one
+static int unpack_tdma_beacon(const uint8_t *buf, uint8_t len, struct tdma_beacon *b){
+  if(len != TDMA_BEACON_LEN || buf[0] != FRAME_TDMA_BEACON) return -1;
+  b->seq = get16(buf + 1);
+  b->slots = buf[3];
+  b->superframe_us = get32(buf + 4);
+  b->slot_us = get32(buf + 8);
+  b->guard_us = get32(buf + 12);
+  b->tx_us = get64(buf + 16);
+  //a schedule that doesn't fit in its own superframe is corrupt
+  if(b->slots == 0 || b->slot_us == 0 || b->superframe_us < (uint64_t)b->slots * b->slot_us) return -1;
+  return 0;
+}
+
+//packs a channel change command into buf, returns its length
+static uint8_t pack_channel_cmd(uint8_t *buf, const struct channel_cmd *c){
+  buf[0] = FRAME_CHANNEL_CMD;
+  put16(buf + 1, c->seq);
+  put32(buf + 3, c->freq_hz);
+  put32(buf + 7, c->switch_ms);
+  return CHANNEL_CMD_LEN;
+}
+
+//unpacks a channel change command, 0 on success or -1 if it isn't one.
+//the frequency has to be inside the 410-525 MHz the SX1278 covers
+static int unpack_channel_cmd(const uint8_t *buf, uint8_t len, struct channel_cmd *c){
+  if(len != CHANNEL_CMD_LEN || buf[0] != FRAME_CHANNEL_CMD) return -1;
+  c->seq = get16(buf + 1);
+  c->freq_hz = get32(buf + 3);
+  c->switch_ms = get32(buf + 7);
+  if(c->freq_hz < 410000000 || c->freq_hz > 525000000) return -1;
+  return 0;
+}
+
+//packs a profile switch frame into buf, returns its length
+static uint8_t pack_profile_cmd(uint8_t *buf, const struct profile_cmd *c){
+  buf[0] = FRAME_PROFILE_CMD;
+  put16(buf + 1, c->seq);
+  buf[3] = c->phase;
+  buf[4] = c->p.sf;
+  buf[5] = c->p.bw;
+  buf[6] = c->p.cr;
+  buf[7] = c->p.sync;
+  buf[8] = (c->p.implicit & 0x01) | (c->p.crc & 0x01) << 1;
+  put16(buf + 9, c->p.preamble);
+  put32(buf + 11, c->switch_ms);
+  return PROFILE_CMD_LEN;
+}
+
+//unpacks a profile switch frame, 0 on success or -1 if it isn't one or
+//asks for settings the SX1278 doesn't have
+static int unpack_profile_cmd(const uint8_t *buf, uint8_t len, struct profile_cmd *c){
+  if(len != PROFILE_CMD_LEN || buf[0] != FRAME_PROFILE_CMD) return -1;
+  c->seq = get16(buf + 1);
+  c->phase = buf[3];
+  c->p.sf = buf[4];
+  c->p.bw = buf[5];
+  c->p.cr = buf[6];
+  c->p.sync = buf[7];
+  c->p.implicit = buf[8] & 0x01;
+  c->p.crc = (buf[8] >> 1) & 0x01;
+  c->p.preamble = get16(buf + 9);
+  c->switch_ms = get32(buf + 11);
+  if(c->phase < PROFILE_PROPOSE || c->phase > PROFILE_COMMIT) return -1;
+  if(c->p.sf < 6 || c->p.sf > 12 || c->p.bw > 9 || c->p.cr < 1 || c->p.cr > 4 || c->p.preamble < 6) return -1;
+  return 0;
+}
+
+//packs a ping into buf and fills it out to len bytes, at least
+//PING_HEADER_LEN.  returns the length
+static uint8_t pack_ping(uint8_t *buf, const struct ping *p, uint8_t len){
+  if(len < PING_HEADER_LEN) len = PING_HEADER_LEN;
+  buf[0] = FRAME_PING;
+  put16(buf + 1, p->seq);
+  buf[3] = p->step;
+  buf[4] = p->flags;
+  put32(buf + 5, p->turn_us);
+  for(int i = PING_HEADER_LEN; i < len; i++) buf[i] = (uint8_t)(p->seq + i);
+  return len;
+}
+
+//unpacks a ping, 0 on success or -1 if it isn't one or the filler was
+//damaged on the way
+static int unpack_ping(const uint8_t *buf, uint8_t len, struct ping *p){
+  if(len < PING_HEADER_LEN || buf[0] != FRAME_PING) return -1;
+  p->seq = get16(buf + 1);
+  p->step = buf[3];
+  p->flags = buf[4];
+  p->turn_us = get32(buf + 5);
+  for(int i = PING_HEADER_LEN; i < len; i++){
+    if(buf[i] != (uint8_t)(p->seq + i)) return -1;
+  }
+  return 0;
+}
+
+//writes a stream chunk header in front of the data, returns its length
+static uint8_t pack_stream_header(uint8_t *buf, const struct stream_hdr *h){
+  buf[0] = FRAME_STREAM;
+  put16(buf + 1, h->seq);
+  buf[3] = h->flags;
+  return STREAM_HEADER_LEN;
+}
+
+//unpacks a stream chunk header.  returns the length of the data that
+//follows it, or -1 if it isn't one
+static int unpack_stream_header(const uint8_t *buf, uint8_t len, struct stream_hdr *h){
+  if(len < STREAM_HEADER_LEN || buf[0] != FRAME_STREAM) return -1;
+  h->seq = get16(buf + 1);
+  h->flags = buf[3];
+  return len - STREAM_HEADER_LEN;
+}
+
+//writes a latency trailer at p, which is LAT_TRAILER_LEN bytes before the
+//end of the payload
+static void pack_lat_trailer(uint8_t *p, const struct lat_trailer *t){
+  put64(p, t->enqueue_us);
+  put32(p + 8, t->loaded_us);
+  put32(p + 12, t->tx_us);
+  p[16] = LAT_MAGIC0;
+  p[17] = LAT_MAGIC1;
+}
+
+//finds a latency trailer at the end of a packet.  returns the length of
+//the payload in front of it, or -1 if there is none
+static int unpack_lat_trailer(const uint8_t *buf, uint8_t len, struct lat_trailer *t){
+  if(len < LAT_TRAILER_LEN) return -1;
+  const uint8_t *p = buf + len - LAT_TRAILER_LEN;
+  if(p[16] != LAT_MAGIC0 || p[17] != LAT_MAGIC1) return -1;
+  t->enqueue_us = get64(p);
+  t->loaded_us = get32(p + 8);
+  t->tx_us = get32(p + 12);
+  if(t->tx_us < t->loaded_us) return -1;
+  return len - LAT_TRAILER_LEN;
+}
+
+//1 if a packet looks like one of ours: a protocol frame of a known type
+//or printable text, either with an optional latency trailer.  anything
+//else demodulated on our channel is someone else's traffic
+static int frame_recognized(const uint8_t *buf, uint8_t len){
+  //the same test the receiver unpacks the trailer with, so a frame that
+  //merely ends in the magic bytes keeps them
+  struct lat_trailer t;
+  int n = unpack_lat_trailer(buf, len, &t);
+  if(n >= 0) len = n;
+  if(len == 0) return 0;
+  if(FRAME_IS_PROTOCOL(buf[0])) return buf[0] >= FRAME_TDMA_BEACON && buf[0] <= FRAME_STREAM;
+  for(int i = 0; i < len; i++){
+    if((buf[i] < 0x20 || buf[i] > 0x7E) && buf[i] != '\n') return 0;
+  }
+  return 1;
+}
+
+#endif
@@ -0,0 +1,232 @@
+/* UCSD CubeSat
+   hotpath.h
+
+   Keeps the per packet radio path free of allocation and output.  The
+   beacon loop in loraTX and the receive loops in loraRX used to format
+   the payload with localtime() and asctime() and print each packet in
+   the middle of handling it.  localtime() can read the zone file and
+   allocate, and printf() can allocate its buffer and block on a slow
+   stdout, so a packet now and then took far longer than the rest, worse
+   with the memory tight.  Now:
+
+   - the region from loading (or finding) a packet to the radio being
+     ready for the next one is bracketed by hot_enter() and hot_leave()
+   - everything it uses is on the stack or static, set up before the
+     loop.  output about the packet is printed after hot_leave()
+   - hot_asctime() formats times exactly like asctime() with arithmetic
+     only, from a UTC offset read once in hot_init()
+
+   Notes on the check build:
+   Built with -DHOT_CHECK this file defines malloc(), calloc(), realloc(),
+   free() and write() in the program itself, so every call to them goes
+   through a wrapper first.  That catches the C library allocating for
+   us, but not its output: stdio writes with an internal alias of write()
+   that never reaches ours.  So hot_init() also swaps stdout and stderr
+   for unbuffered streams (fopencookie(3)) whose write goes through the
+   check, and printf(), puts(), fputs(), putchar(), perror() and anything
+   else that prints to them is caught inside the call that printed,
+   whatever the C library turns it into.  Streams the program opens
+   itself are not covered; the radio loops only print to those two.
+
+   A call made by the radio thread between hot_enter() and hot_leave()
+   prints which kind it was and aborts, so the core file has the stack
+   that got there.  With -DHOT_CHECK=2 it is only counted, and
+   hot_report() prints the calls per packet, a measurement rather than
+   a tripwire (with the abort they are always 0 in a run still going):
+
+   $ cc -DHOT_CHECK loraTX.c -o loraTX -lbcm2835
+   $ cc -DHOT_CHECK=2 loraTX.c -o loraTX -lbcm2835
+
+   The wrappers forward to glibc's __libc_malloc() and friends and to the
+   write system call.  Only the thread that calls hot_enter() is checked,
+   so the binlog.h writer thread can still allocate its file buffer.
+   fopencookie() needs _GNU_SOURCE before the first #include, which
+   loraTX.c and loraRX.c define in the check build.  Without HOT_CHECK
+   the markers compile to nothing.
+
+   Notes on time zones:
+   hot_asctime() uses the offset in effect at hot_init(), so a change
+   between summer and winter time while the program runs is not picked
+   up.  The payloads are for telling beacons apart and counting them, so
+   the program is restarted long before that matters.
+
+   ---------------------------------------------------------------------------------------------*/
+
+#ifndef HOTPATH_H
+#define HOTPATH_H
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define ASCTIME_LEN 26   //"Sun Sep 16 01:03:52 1973\n" and the terminator
+
+static long hot_utc_offset = 0;
+
+static const char hot_days[7][4] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+static const char hot_months[12][4] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                       "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+#ifdef HOT_CHECK
+
+#ifndef _GNU_SOURCE
+#error "HOT_CHECK needs _GNU_SOURCE defined before the first #include, for fopencookie()"
+#endif
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+extern void *__libc_malloc(size_t n);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t n);
+extern void __libc_free(void *p);
+
+#define HOT_MALLOC  0
+#define HOT_FREE    1
+#define HOT_WRITE   2
+#define HOT_PRINT   3    //stdio output to stdout or stderr
+#define HOT_CALLS   4
+
+//-DHOT_CHECK is 1 and aborts, -DHOT_CHECK=2 only counts
+#define HOT_ABORT (HOT_CHECK != 2)
+
+static const char *hot_call_names[HOT_CALLS] = {"malloc", "free", "write", "stdio"};
+
+static __thread int hot_in = 0;
+static uint32_t hot_passes = 0;
+static uint32_t hot_calls[HOT_CALLS];
+
+//a forbidden call.  reports it without any of the calls being checked
+static void hot_violation(int call){
+  char msg[96];
+  int n = snprintf(msg, sizeof(msg), "Hot path made a %s call in pass %u.\n", hot_call_names[call], hot_passes + 1);
+  syscall(SYS_write, 2, msg, n);
+  abort();
+}
+
+#define HOT_COUNT(call) do{              \
+    if(hot_in){                          \
+      hot_calls[call]++;                 \
+      if(HOT_ABORT) hot_violation(call); \
+    }                                    \
+  }while(0)
+
+void *malloc(size_t n){
+  HOT_COUNT(HOT_MALLOC);
+  return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t size){
+  HOT_COUNT(HOT_MALLOC);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t n){
+  HOT_COUNT(HOT_MALLOC);
+  return __libc_realloc(p, n);
+}
+
+void free(void *p){
+  if(p) HOT_COUNT(HOT_FREE);
+  __libc_free(p);
+}
+
+ssize_t write(int fd, const void *buf, size_t n){
+  HOT_COUNT(HOT_WRITE);
+  return syscall(SYS_write, fd, buf, n);
+}
+
+//write function of the streams that replace stdout and stderr.  the
+//cookie is the file descriptor
+static ssize_t hot_stream_write(void *cookie, const char *buf, size_t n){
+  HOT_COUNT(HOT_PRINT);
+  return syscall(SYS_write, (int)(intptr_t)cookie, buf, n);
+}
+
+//an unbuffered stream on fd, so every call that prints reaches
+//hot_stream_write() before it returns.  old is kept if that fails
+static FILE *hot_stream(FILE *old, int fd){
+  cookie_io_functions_t io = {NULL, hot_stream_write, NULL, NULL};
+  fflush(old);
+  FILE *f = fopencookie((void *)(intptr_t)fd, "w", io);
+  if(f == NULL) return old;
+  setvbuf(f, NULL, _IONBF, 0);
+  return f;
+}
+
+#endif
+
+//-----------------------------------helper function implementations----------------------------
+
+//reads the local time zone's offset while allocating is still fine
+static void hot_init(void){
+  time_t now = time(NULL);
+  struct tm local;
+  localtime_r(&now, &local);
+  hot_utc_offset = local.tm_gmtoff;
+#ifdef HOT_CHECK
+  stdout = hot_stream(stdout, 1);
+  stderr = hot_stream(stderr, 2);
+#endif
+}
+
+//formats t in local time the way asctime(localtime(&t)) does, into a
+//buffer of ASCTIME_LEN bytes.  returns the buffer
+static char *hot_asctime(time_t t, char *buf){
+  int64_t s = (int64_t)t + hot_utc_offset;
+  int64_t days = s / 86400;
+  int64_t sec = s % 86400;
+  if(sec < 0){
+    sec += 86400;
+    days--;
+  }
+  int wday = (int)((days % 7 + 11) % 7);   //1970-01-01 was a Thursday
+  //civil date from days since the epoch, in 400 year eras from March 1st
+  int64_t z = days + 719468;
+  int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+  int64_t doe = z - era * 146097;
+  int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  int64_t mp = (5 * doy + 2) / 153;
+  int mday = (int)(doy - (153 * mp + 2) / 5 + 1);
+  int mon = (int)(mp < 10 ? mp + 2 : mp - 10);
+  int64_t year = yoe + era * 400 + (mon < 2);
+  snprintf(buf, ASCTIME_LEN, "%.3s %.3s%3d %.2d:%.2d:%.2d %d\n", hot_days[wday], hot_months[mon], mday,
+           (int)(sec / 3600), (int)(sec / 60 % 60), (int)(sec % 60), (int)year);
+  return buf;
+}
+
+#ifdef HOT_CHECK
+
+//start and end of one pass through the per packet path
+static inline void hot_enter(void){
+  hot_in = 1;
+}
+
+static inline void hot_leave(void){
+  hot_in = 0;
+  hot_passes++;
+}
+
+//passes so far and the calls they made per packet
+static void hot_report(FILE *out){
+  double p = hot_passes ? hot_passes : 1;
+  fprintf(out, "Hot path: %u passes, %.2f mallocs %.2f frees %.2f writes %.2f stdio writes per packet.\n",
+          hot_passes, hot_calls[HOT_MALLOC] / p, hot_calls[HOT_FREE] / p, hot_calls[HOT_WRITE] / p,
+          hot_calls[HOT_PRINT] / p);
+}
+
+#else
+
+static inline void hot_enter(void){}
+
+static inline void hot_leave(void){}
+
+static inline void hot_report(FILE *out){}
+
+#endif
+
+#endif
@@ -0,0 +1,155 @@
+/* UCSD CubeSat
+   latency.h
+
+   End to end latency telemetry.  We know how long a packet is on the air
+   from timing.h, but not how long data really takes from the moment the
+   transmitter has it to the moment the groundstation hands it on.  With
+   loraTX -t every payload carries a latency trailer (frame.h) with three
+   transmit side timestamps, and the receiver adds three of its own:
+
+   enqueue -> loaded -> tx start -> RxDone -> drained -> delivered
+     |  queue+spi  | tx wait | air   | service  | output  |
+
+   queue+spi   payload built until the FIFO load finished, the SPI cost
+   tx wait     FIFO loaded until the mode write, schedule slack and LBT
+   air         Tx start until RxDone seen, airtime plus how late RxDone is
+               noticed
+   service     RxDone until the packet is out of the FIFO
+   output      drained until written and flushed to stdout
+   total       enqueue until delivered
+
+   Each stage goes into a log2 histogram and latency_print() shows count,
+   mean, max and percentiles per stage, so it is plain where the time goes.
+
+   Notes on clocks:
+   The stamps are wall clock time, so the air and total stages compare two
+   machines' clocks.  Run both ends on NTP, or use the TDMA nodes whose
+   clocks follow the coordinator's (timesync.h), otherwise those two stages
+   carry the clock offset.  The other stages only ever subtract times from
+   the same machine.  The expected airtime is printed alongside to make an
+   offset obvious.
+
+   Nothing in here touches the hardware.
+
+   ---------------------------------------------------------------------------------------------*/
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdio.h>
+#include <stdint.h>
+#include "frame.h"
+
+#define LAT_BINS 24   //powers of two from 1 us up to 8 s and over
+
+//stages
+#define L_QUEUE   0
+#define L_TXWAIT  1
+#define L_AIR     2
+#define L_SERVICE 3
+#define L_OUTPUT  4
+#define L_TOTAL   5
+#define L_STAGES  6
+
+static const char *lat_names[] = {"queue+spi", "tx wait", "air", "service", "output", "total"};
+
+struct lat_stage{
+  uint32_t n;
+  uint64_t sum_us;
+  uint32_t max_us;
+  uint32_t hist[LAT_BINS];
+};
+
+struct lat_stats{
+  struct lat_stage stage[L_STAGES];
+  uint32_t skewed;   //packets whose air stage came out negative
+};
+
+//receive side timestamps, wall clock microseconds
+struct lat_rx{
+  uint64_t rx_done_us;
+  uint64_t drained_us;
+  uint64_t delivered_us;
+};
+
+//-----------------------------------helper function implementations----------------------------
+
+//histogram bin, 1 + log2 of microseconds, 0 for nothing
+static int lat_bin(uint32_t us){
+  int bin = 0;
+  while(us > 0 && bin < LAT_BINS - 1){
+    us >>= 1;
+    bin++;
+  }
+  return bin;
+}
+
+static void lat_add(struct lat_stage *s, int64_t us){
+  if(us < 0) us = 0;
+  if(us > UINT32_MAX) us = UINT32_MAX;
+  s->n++;
+  s->sum_us += us;
+  if(us > s->max_us) s->max_us = us;
+  s->hist[lat_bin(us)]++;
+}
+
+//records one packet's stages from its trailer and the receive side stamps
+static void latency_record(struct lat_stats *st, const struct lat_trailer *t, const struct lat_rx *r){
+  uint64_t tx = t->enqueue_us + t->tx_us;
+  int64_t air = (int64_t)(r->rx_done_us - tx);
+  if(air < 0) st->skewed++;
+  lat_add(&st->stage[L_QUEUE], t->loaded_us);
+  lat_add(&st->stage[L_TXWAIT], t->tx_us - t->loaded_us);
+  lat_add(&st->stage[L_AIR], air);
+  lat_add(&st->stage[L_SERVICE], (int64_t)(r->drained_us - r->rx_done_us));
+  lat_add(&st->stage[L_OUTPUT], (int64_t)(r->delivered_us - r->drained_us));
+  lat_add(&st->stage[L_TOTAL], (int64_t)(r->delivered_us - t->enqueue_us));
+}
+
+//upper edge in us of the bin holding the given fraction of samples,
+//capped at the largest sample
+static uint32_t lat_percentile(const struct lat_stage *s, double frac){
+  uint32_t want = (uint32_t)(s->n * frac + 0.5);
+  uint32_t seen = 0;
+  for(int i = 0; i < LAT_BINS; i++){
+    seen += s->hist[i];
+    if(seen >= want && seen > 0){
+      uint32_t edge = i == 0 ? 0 : (1u << i) - 1;
+      return edge < s->max_us ? edge : s->max_us;
+    }
+  }
+  return s->max_us;
+}
+
+//prints every stage with its distribution.  air_us is the expected
+//airtime of the packets, for comparison with the air stage
+static void latency_print(FILE *out, const struct lat_stats *st, uint32_t air_us){
+  fprintf(out, "Latency: %u packets, expected airtime %.1f ms, %u with air < 0 (clock offset)\n",
+          st->stage[L_TOTAL].n, air_us / 1000.0, st->skewed);
+  fprintf(out, "  %-10s %10s %10s %10s %10s   log2 us histogram\n", "stage", "mean ms", "p50 ms", "p99 ms", "max ms");
+  for(int k = 0; k < L_STAGES; k++){
+    const struct lat_stage *s = &st->stage[k];
+    if(s->n == 0) continue;
+    fprintf(out, "  %-10s %10.3f %10.3f %10.3f %10.3f   ", lat_names[k], s->sum_us / 1000.0 / s->n,
+            lat_percentile(s, 0.5) / 1000.0, lat_percentile(s, 0.99) / 1000.0, s->max_us / 1000.0);
+    //one digit per bin, 0-9 of the stage's peak
+    uint32_t peak = 1;
+    int lo = LAT_BINS, hi = 0;
+    for(int i = 0; i < LAT_BINS; i++){
+      if(s->hist[i] > peak) peak = s->hist[i];
+      if(s->hist[i]){
+        if(i < lo) lo = i;
+        hi = i;
+      }
+    }
+    fprintf(out, "2^%-2d ", lo > 0 ? lo - 1 : 0);
+    for(int i = lo; i <= hi; i++){
+      fputc(s->hist[i] ? '0' + (int)(9.0 * s->hist[i] / peak + 0.5) : '.', out);
+    }
+    fputc('\n', out);
+  }
+}
+
+#endif
@@ -0,0 +1,111 @@
+/* UCSD CubeSat
+   linkbudget.h
+
+   Link budget math: what rssi and snr a packet should arrive with given
+   the transmit power, antennas, distance and modem settings.  lorabudget
+   compares this against what the coverage logs measured.  Nothing in here
+   touches the hardware.
+
+   rssi = Ptx + Gtx + Grx - cable losses - path loss
+
+   Path loss is free space, 20log10(4 pi d f / c), written as its value at
+   one meter plus 10 n log10(d) so the exponent n can be raised from the
+   free space 2 to try log-distance fits for ground level links.  The
+   noise floor is thermal noise in the signal bandwidth plus the receiver
+   noise figure:
+
+   noise = -174 dBm/Hz + 10log10(BW) + NF
+
+   and the snr is the difference.  LoRa demodulates below the noise floor,
+   down to the snr limit for the spreading factor (snr_limit_db() in
+   profile.h).  The margin is how far the predicted snr is above that
+   limit.
+
+   Notes on RegPaConfig:
+   Bit 7 picks the output pin.  With it clear (the reset value 0x4F) power
+   comes out of RFO at Pmax - (15 - OutputPower), Pmax = 10.8 + 0.6 *
+   MaxPower, up to 15 dBm.  With it set it comes out of PA_BOOST at
+   17 - (15 - OutputPower), 2 to 17 dBm.  Our programs never write the
+   register, so they run at the reset value, and a module that only wires
+   up one of the two pins puts out far less than this on the other one.
+   A large constant offset between prediction and measurement is the first
+   thing to check that against.
+
+   ---------------------------------------------------------------------------------------------*/
+
+#ifndef LINKBUDGET_H
+#define LINKBUDGET_H
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdint.h>
+#include <math.h>
+#include "profile.h"
+
+#define EARTH_RADIUS_M   6371000.0
+#define LIGHT_SPEED      299792458.0
+#define THERMAL_DBM_HZ   -174.0
+#define SX1278_NF_DB     6.0      //datasheet noise figure on the low frequency port
+
+struct link{
+  double tx_dbm;        //conducted power out of the chip
+  double tx_gain_dbi;
+  double rx_gain_dbi;
+  double loss_db;       //cables and connectors, both ends
+  double freq_hz;
+  double exponent;      //path loss exponent, 2 is free space
+  double nf_db;
+  uint32_t bw_hz;
+  uint8_t sf;
+};
+
+//a link's prediction at one distance
+struct budget{
+  double path_db;
+  double rssi_dbm;
+  double noise_dbm;
+  double snr_db;
+  double margin_db;     //snr above the demodulation limit
+};
+
+//-----------------------------------helper function implementations----------------------------
+
+//output power in dBm for a RegPaConfig value
+static double pa_power_dbm(uint8_t pa_config){
+  int out = pa_config & 0x0F;
+  if(pa_config & 0x80) return 17 - (15 - out);
+  double pmax = 10.8 + 0.6 * ((pa_config >> 4) & 0x07);
+  return pmax - (15 - out);
+}
+
+//straight line distance in meters between two positions with altitudes,
+//through the earth's curve rather than along it
+static double slant_m(double lat1, double lon1, double alt1, double lat2, double lon2, double alt2){
+  double p1 = lat1 * M_PI / 180, p2 = lat2 * M_PI / 180;
+  double dl = (lon2 - lon1) * M_PI / 180;
+  double r1 = EARTH_RADIUS_M + alt1, r2 = EARTH_RADIUS_M + alt2;
+  //law of cosines on the two radii and the central angle
+  double c = sin(p1) * sin(p2) + cos(p1) * cos(p2) * cos(dl);
+  double d2 = r1 * r1 + r2 * r2 - 2 * r1 * r2 * c;
+  return d2 > 0 ? sqrt(d2) : 0;
+}
+
+//distance to the radio horizon in meters for two antenna heights above
+//the ground, with the usual 4/3 earth for refraction
+static double horizon_m(double h1, double h2){
+  if(h1 < 0) h1 = 0;
+  if(h2 < 0) h2 = 0;
+  return 4120 * (sqrt(h1) + sqrt(h2));
+}
+
+//fills in the prediction for a link d_m meters long
+static void link_budget(const struct link *l, double d_m, struct budget *b){
+  if(d_m < 1) d_m = 1;
+  b->path_db = 20 * log10(4 * M_PI * l->freq_hz / LIGHT_SPEED) + 10 * l->exponent * log10(d_m);
+  b->rssi_dbm = l->tx_dbm + l->tx_gain_dbi + l->rx_gain_dbi - l->loss_db - b->path_db;
+  b->noise_dbm = THERMAL_DBM_HZ + 10 * log10(l->bw_hz) + l->nf_db;
+  b->snr_db = b->rssi_dbm - b->noise_dbm;
+  b->margin_db = b->snr_db - snr_limit_db(l->sf);
+}
+
+#endif
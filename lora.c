@@ -134,6 +134,8 @@
 
 #include <bcm2835.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <sys/file.h>
 
 //SX1278 device modes
 #define FSK_SLEEP      0b00001000  //0x08  must enter before switching to lora
@@ -183,6 +185,7 @@
 
 //helpful values
 #define FIFO_TX_BASE_ADDR 0b10000000  //0x80
+#define RADIO_LOCK_PATH "/tmp/lora.lock"   //same lock as sx1278.h, held by whichever program drives the chip
 
 //-----------------------------------helper function prototypes----------------------------------
 
@@ -196,6 +199,14 @@ void diagnose();
 
 int main(int argc, char **argv){
 
+  //one program at a time, two interleave their register sequences.  the
+  //lock goes with the process, however it ends
+  int lock = open(RADIO_LOCK_PATH, O_RDWR | O_CREAT, 0666);
+  if(lock < 0 || flock(lock, LOCK_EX | LOCK_NB) < 0){
+    printf("The radio is in use by another program (lorad shares it).\n");
+    return 1;
+  }
+
   //test the library initialization functions
   if(!bcm2835_init()){
     printf("bcm2835_init failed.  Must run as root.\n");
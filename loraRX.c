@@ -136,117 +136,417 @@
    data but I believe this is unecessary. Handling FIFO pointers will just be more 
    complicated in Rx mode when data could arrive at any time.    
 
+   Notes on duty cycled reception:
+   Continuous Rx draws roughly 11.5 mA whether or not anything is on the air,
+   which is fine at the groundstation but flattens a battery node in a day or
+   two.  Running with -d <ms> uses the otherwise unused LORA_RX_SINGLE mode
+   instead.  Every <ms> milliseconds the radio wakes from sleep, listens for
+   RegSymbTimeout symbols (-s, default DUTY_RX_WINDOW) and drops back to
+   sleep on RxTimeout or after a packet.  The transmitter must be started
+   with the matching loraTX -w <ms> -s <symbols> so its preamble spans a
+   full wake interval, and RegPreambleLen is set to the same length here,
+   as the datasheet wants it to match.  The price is latency: a packet can
+   sit in its own preamble for up to one wake interval before the payload
+   arrives.  RX-on fraction and an estimated average current are printed
+   to stderr periodically and on exit (ctrl-c).
+
+   Both receive modes keep energy accounts (energy.h).  -e <file> overrides
+   the per mode current figures and -b <mAh> adds a projected battery life;
+   with either given the continuous mode reports too.
+
+   Between wakes the duty cycled mode idles through power_idle_until()
+   (power.h), which decides between sleep and standby from the measured wake
+   latency and brings the chip back to standby just before the next window.
+
+   Notes on TDMA:
+   With -T <slots> this program becomes the coordinator for that many beacon
+   nodes running loraTX -T <slot>.  Every superframe starts with a beacon
+   (frame.h) announcing the slot layout, and the rest of it is spent in
+   continuous Rx collecting the nodes' packets.  Each packet is checked
+   against the slot it landed in and the worst timing error sets the guard
+   announced in the next beacon (tdma.h).  -l <bytes> is the node payload
+   length the slots are sized for and -p <ms> stretches the superframe,
+   5000 by default to keep the old beacon rate.  Slot fill and channel
+   utilization against the slot-filling limit are printed to stderr.
+
+   Notes on time sync:
+   Every beacon is stamped with this machine's wall clock at the instant
+   Tx starts, and the nodes discipline their clocks to it (timesync.h).
+   Give -D <gpio> with the module's DIO0 wired to that RPI gpio and TxDone
+   and RxDone are timestamped on the pin edge instead of by polling over
+   SPI.  The coordinator then also measures how late it really keys up
+   after its deadline and starts that much earlier next time, so the stamp
+   matches when the beacon went out.  The remaining stamp error is
+   reported with the TDMA statistics.
+
+   Notes on latency telemetry:
+   Packets from loraTX -t end in a latency trailer.  The continuous and
+   duty cycled modes strip it before printing, add the time RxDone was
+   noticed, the FIFO drained and the payload flushed to stdout, and print
+   a per stage breakdown (latency.h) to stderr every LATENCY_REPORT_EVERY
+   such packets.  Packets without a trailer print exactly as before.  In
+   continuous mode RxDone is only noticed at the next 2.5 second check, and
+   the breakdown shows that up in the air stage.
+
+   Notes on channel selection:
+   -C <kHz,kHz,...> gives a list of allowed channels, the first one being
+   where the balloon starts, and the groundstation keeps the link on the
+   cleanest of them (chansel.h).  It listens on the current channel in
+   continuous Rx, sampling the rssi while it waits and counting packets
+   that aren't ours.  Right after each of the balloon's beacons it ranks
+   the channels and, if another one is clearly better, sends a channel
+   change command (frame.h) while the balloon, run with loraTX -C, is
+   listening for one.  Both ends retune CHAN_SWITCH_MS later.  Then it
+   takes a quick rssi scan of every other channel before the next beacon
+   is due.  If no beacon shows up for CHAN_LOST_US the groundstation goes
+   back to the channel it came from, then walks the list until it finds
+   the balloon again.
+
+   Notes on coverage mapping:
+   -G <nmea> turns a range test into a coverage map.  Position comes from
+   a GPS on a serial port (-B <baud>, 9600 by default) or a file of
+   recorded NMEA replayed in real time (nmea.h).  Every received beacon is
+   logged with the position, rssi and snr, and every beacon that should
+   have arrived, one -p period after the last, but didn't is logged as a
+   miss at the position it was due.  Corrupt packets are logged with their
+   rssi as their own kind.  The log goes to -M <file>, coverage.log by
+   default, one line per event:
+
+   R <unix time> <lat> <lon> <alt m> <rssi dBm> <snr dB> <bytes>
+   C <unix time> <lat> <lon> <alt m> <rssi dBm> <snr dB> <bytes>
+   M <unix time> <lat> <lon> <alt m>
+
+   Events without a GPS fix are counted but not logged.  loracov turns any
+   number of these logs into tiles and heatmaps.
+
+   Notes on profile upgrades:
+   -U <sf>,<kHz> moves the link to that faster spreading factor and
+   bandwidth while the balloon (loraTX -P) is close enough to afford it,
+   with the handshake described in profile.h.  The groundstation keeps the
+   mean snr of the last PROFILE_SNR_BEACONS beacons and proposes the
+   upgrade when it is PROFILE_UP_DB above the new profile's demodulation
+   limit (profile.h), and the way back when it falls to PROFILE_DOWN_DB
+   above it.  If beacons stop altogether both ends fall back on their own.
+
+   Notes on streaming:
+   -S <file> (- for stdout) receives a loraTX -S stream.  The data of
+   every FRAME_STREAM chunk is written out in the order it arrives, and
+   chunks missing from the sequence are counted as lost, not filled in.
+   Progress goes to stderr, along with the goodput and how much of the
+   time since the first chunk started the stream had on the air.  The
+   sender turns the payload crc on, so damaged chunks are dropped too.
+   Back to back full size packets leave no room in the FIFO: the next
+   chunk's payload starts overwriting this one about twenty symbols after
+   RxDone, so each one is read out the moment it is seen, and the SPI
+   clock (-k) must be fast enough to read 255 bytes in that time.  -D
+   watches RxDone on the pin.
+
    ---------------------------------------------------------------------------------------------*/
 
 //------------------------------header files and label definitions------------------------------
 
-#include <bcm2835.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <time.h>
-
-//SX1278 device modes
-#define FSK_SLEEP      0b00001000  //0x08  must enter before switching to lora
-#define FSK_CAD        0b00001111  //0x0F  seems to be default startup op mode
-#define LORA_SLEEP     0b10001000  //0x88
-#define LORA_STANDBY   0b10001001  //0x89
-#define LORA_TX        0b10001011  //0x8B
-#define LORA_RX_CONT   0b10001101  //0x8D
-#define LORA_RX_SINGLE 0b10001110  //0x8E
-#define LORA_CAD       0b10001111  //0x8F
-
-//register addresses
-#define REG_FIFO                 0b00000000  //0x00
-#define REG_OP_MODE              0b00000001  //0x01
-#define REG_RF_FREQ_MSB_MSB      0b00000110  //0x06
-#define REG_RF_FREQ_MSB          0b00000111  //0x07
-#define REG_RF_FREQ_LSB          0b00001000  //0x08
-#define REG_PA_CONFIG            0b00001001  //0x09
-#define REG_PA_RAMP              0b00001010  //0x0A
-#define REG_OCP                  0b00001011  //0x0B
-#define REG_LNA                  0b00001100  //0x0C
-#define REG_FIFO_ADDR_PTR        0b00001101  //0x0D
-#define REG_FIFO_TX_BASE_ADDR    0b00001110  //0x0E
-#define REG_FIFO_RX_BASE_ADDR    0b00001111  //0x0F
-#define REG_FIFO_RX_CURRENT_ADDR 0b00010000  //0x10
-#define REG_IRQ_FLAGS_MASK       0b00010001  //0x11
-#define REG_IRQ_FLAGS            0b00010010  //0x12
-#define REG_RX_NUM_BYTES         0b00010011  //0x13
-#define REG_RX_PACKET_COUNT_MSB  0b00010110  //0x16
-#define REG_RX_PACKET_COUNT_LSB  0b00010111  //0x17
-#define REG_MODEM_STAT           0b00011000  //0x18
-#define REG_PACKET_SNR           0b00011001  //0x19
-#define REG_PACKET_RSSI          0b00011010  //0x1A
-#define REG_CURRENT_RSSI         0b00011011  //0x1B
-#define REG_HOP_CHANNEL          0b00011100  //0x1C
-#define REG_MODEM_CONFIG1        0b00011101  //0x1D
-#define REG_MODEM_CONFIG2        0b00011110  //0x1E
-#define REG_PREAMBLE_LEN_MSB     0b00100000  //0x20
-#define REG_PREAMBLE_LEN_LSB     0b00100001  //0x21
-#define REG_PAYLOAD_LEN          0b00100010  //0x22  (implicit mode only)
-#define REG_MAX_PAYLOAD_LEN      0b00100011  //0x23
-#define REG_HOP_PERIOD           0b00100100  //0x24
-#define REG_MODEM_CONFIG3        0b00100110  //0x26
-#define REG_DETECT_OPTIMIZE      0b00110001  //0x31
-#define REG_DETECT_THRESH        0b00110111  //0x37
-#define REG_SYNC_WORD            0b00111001  //0x39
-
-//helpful values
-#define CLEAR_FLAGS       0b11111111  //0xFF
-#define FIFO_RX_BASE_ADDR 0b00000000  //0x00
-#define FLAG_TX_DONE      0b00001000  //0x08
-#define FLAG_VALID_HEADER 0b00010000  //0x10
-#define FLAG_RX_DONE      0b01000000  //0x40
-#define FIFO_TX_BASE_ADDR 0b10000000  //0x80
+#ifdef HOT_CHECK
+#define _GNU_SOURCE   //fopencookie, see hotpath.h
+#endif
+#include "sx1278.h"
+#include "energy.h"
+#include "power.h"
+#include "tdma.h"
+#include "latency.h"
+#include "chansel.h"
+#include "nmea.h"
+#include "hotpath.h"
+#include <signal.h>
+#include <unistd.h>
+
+//wakes between duty cycle status reports
+#define DUTY_REPORT_EVERY  100
+
+//packet checks between energy reports in continuous mode
+#define ENERGY_REPORT_EVERY 24
+
+//packets with a latency trailer between latency reports
+#define LATENCY_REPORT_EVERY 24
+
+//channel selection timing
+#define CHAN_SWITCH_MS      1000      //command to retune delay, well inside a beacon period
+#define CHAN_SCAN_US        10000000  //scan the other channels at least this often
+#define CHAN_LOST_US        20000000  //four missed beacons and the balloon is elsewhere
+#define CHAN_SCAN_READS     8         //rssi reads per channel per scan
+#define CHAN_RSSI_EVERY_US  100000    //rssi sample interval on the current channel
+#define CHAN_REPORT_EVERY   12        //beacons between channel reports
+
+//profile upgrades
+#define PROFILE_SNR_BEACONS 4    //beacons the snr is averaged over
+#define PROFILE_UP_DB       10   //margin over the fast profile's limit to go up
+#define PROFILE_DOWN_DB     4    //margin under which to come back down
+
+//coverage mapping
+#define COVERAGE_REPORT_EVERY 60  //expected beacons between coverage reports
+
+//superframes between TDMA reports
+#define TDMA_REPORT_EVERY 12
+
+//time set aside at the end of a superframe to load the next beacon
+#define TDMA_PREP_US 100000
+
+//streaming: RegIrqFlags polls for RxDone without DIO0, chunks between reports
+#define STREAM_POLL_US      100
+#define STREAM_REPORT_EVERY 100
+
+//how long before TxDone is due to start spinning on DIO0, and the pin
+//read interval while listening for slot packets
+#define DIO0_SPIN_US  2000
+#define DIO0_SLEEP_US 100
 
 //-----------------------------------helper function prototypes----------------------------------
 
-void hardware_init(void);
+void deliver_packet(const uint8_t *buf, uint8_t len, uint64_t rx_done);
+
+void channel_select_rx(const uint32_t *freq_hz, int n);
+
+void channel_scan(struct chan_sel *sel);
+
+void profile_switch_rx(const struct profile *fast, uint32_t period_ms);
+
+int send_profile_cmd(struct profile_cmd *c, const struct modem_cfg *m, uint64_t *done);
+
+void coverage_rx(struct gps_src *gps, FILE *log, uint32_t period_ms);
+
+int coverage_log(FILE *log, char kind, const struct gps_fix *fix, int16_t rssi, double snr, uint8_t len);
 
-void lora_init(void);
+void duty_report(uint32_t wakes, uint32_t packets, uint32_t latency_ms);
 
-uint8_t read_reg(uint8_t addr);
+void duty_cycle_rx(uint32_t wake_ms, uint16_t window);
 
-uint8_t write_reg(uint8_t addr, char data); 
+void tdma_coordinator(uint8_t slots, uint8_t data_len, uint32_t superframe_ms, int dio);
 
-void diagnose(void);
+int stream_rx(FILE *out, int dio);
+
+void stream_report(uint32_t chunks, uint32_t lost, uint32_t corrupt, uint64_t bytes, uint64_t air_total,
+                   uint64_t elapsed);
+
+void stop(int sig);
+
+//cleared by the signal handler to leave the receive loops
+volatile sig_atomic_t running = 1;
+
+//latency breakdown of packets that carry a trailer
+struct lat_stats lat;
+
+//modem settings, for the expected airtime of received packets
+struct modem_cfg rx_modem;
 
 //-----------------------------------------function main-----------------------------------------
 
 int main(int argc, char **argv){
 
+  //command line options
+  //-d <ms>       duty cycled Rx single mode waking every <ms> milliseconds
+  //-s <symbols>  symbols to listen for a preamble on each wake
+  //-e <file>     per mode current figures for energy accounting
+  //-b <mAh>      battery capacity for projected lifetime
+  //-T <slots>    TDMA coordinator for this many nodes
+  //-l <bytes>    node payload length the TDMA slots are sized for
+  //-p <ms>       minimum TDMA superframe length
+  //-D <gpio>     timestamp on the DIO0 pin wired to this gpio
+  //-C <kHz,...>  keep the link on the cleanest of these channels
+  //-G <nmea>     coverage mapping with positions from this serial port or file
+  //-B <baud>     GPS serial baud rate
+  //-M <file>     coverage log
+  //-U <sf,kHz>   upgrade to this profile while the link has margin for it
+  //-S <file>     receive a loraTX -S stream into a file, - for stdout
+  //-k <div>      SPI clock divider
+  //-R <file>     binary register trace, decode with loralog
+  uint32_t wake_ms = 0;
+  uint16_t window = DUTY_RX_WINDOW;
+  char *currents = NULL;
+  double battery_mah = 0;
+  uint8_t slots = 0;
+  uint8_t data_len = 24;
+  uint32_t superframe_ms = 5000;
+  int dio = -1;
+  uint32_t chans[CHAN_MAX];
+  int nchans = 0;
+  char *gps_path = NULL;
+  uint32_t gps_baud = 9600;
+  char *cov_path = "coverage.log";
+  int upgrade = 0;
+  uint32_t up_sf = 0, up_bw = 0;
+  char *stream_path = NULL;
+  char *trace_path = NULL;
+  int opt;
+  while((opt = getopt(argc, argv, "d:s:e:b:T:l:p:D:C:G:B:M:U:S:k:R:")) != -1){
+    switch(opt){
+      case 'd':
+        wake_ms = strtoul(optarg, NULL, 10);
+        break;
+      case 's':
+        window = strtoul(optarg, NULL, 10);
+        break;
+      case 'e':
+        currents = optarg;
+        break;
+      case 'b':
+        battery_mah = atof(optarg);
+        break;
+      case 'T':
+        slots = atoi(optarg);
+        break;
+      case 'l':
+        data_len = atoi(optarg);
+        break;
+      case 'p':
+        superframe_ms = strtoul(optarg, NULL, 10);
+        break;
+      case 'D':
+        dio = atoi(optarg);
+        break;
+      case 'C':
+        for(char *p = optarg; *p && nchans < CHAN_MAX; ){
+          chans[nchans++] = strtoul(p, &p, 10) * 1000;
+          if(*p == ',') p++;
+          else break;
+        }
+        break;
+      case 'G':
+        gps_path = optarg;
+        break;
+      case 'B':
+        gps_baud = strtoul(optarg, NULL, 10);
+        break;
+      case 'M':
+        cov_path = optarg;
+        break;
+      case 'U':
+        upgrade = sscanf(optarg, "%u,%u", &up_sf, &up_bw) == 2;
+        if(!upgrade || up_sf < 6 || up_sf > 12 || bw_index(up_bw * 1000) < 0){
+          printf("-U wants a spreading factor and a bandwidth in kHz, like 7,250.\n");
+          return 1;
+        }
+        break;
+      case 'S':
+        stream_path = optarg;
+        break;
+      case 'k':
+        spi_divider = strtoul(optarg, NULL, 10);
+        break;
+      case 'R':
+        trace_path = optarg;
+        break;
+      default:
+        printf("usage: %s [-d wake_interval_ms] [-s window_symbols] [-e currents] [-b mAh]\n"
+               "       [-T slots] [-l bytes] [-p superframe_ms] [-D dio0_gpio] [-C khz,khz,...]\n"
+               "       [-G nmea_source] [-B baud] [-M coverage_log] [-U sf,khz] [-S file|-]\n"
+               "       [-k spi_divider] [-R trace_file]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  //open the GPS and the logs first, no point starting the radio otherwise
+  struct gps_src gps;
+  FILE *cov = NULL;
+  FILE *stream_out = NULL;
+  if(stream_path){
+    stream_out = strcmp(stream_path, "-") == 0 ? stdout : fopen(stream_path, "wb");
+    if(stream_out == NULL){
+      printf("Can't open %s.\n", stream_path);
+      return 1;
+    }
+  }
+  if(gps_path){
+    if(gps_open(&gps, gps_path, gps_baud) < 0 || (cov = fopen(cov_path, "a")) == NULL){
+      printf("Can't open %s or %s.\n", gps_path, cov_path);
+      return 1;
+    }
+  }
+
+  if(trace_path && binlog_open(trace_path) < 0){
+    printf("Can't open %s.\n", trace_path);
+    return 1;
+  }
+
   hardware_init();  //setup spi
   lora_init();      //boot sequence to LoRa standby
   //diagnose();       //read relevant LoRa registers for diagnostics
+  read_modem(&rx_modem);
+  energy_init(currents, battery_mah);
+  power_init(1);
+  hot_init();
+  int report = currents || battery_mah > 0;
+
+  if(wake_ms || slots || nchans || gps_path || upgrade || stream_out){
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    if(stream_out){
+      int r = stream_rx(stream_out, dio);
+      if(stream_out != stdout) fclose(stream_out);
+      write_reg(REG_OP_MODE, LORA_STANDBY);
+      bcm2835_spi_end();
+      binlog_close();
+      bcm2835_close();
+      return r;
+    }else if(slots){
+      tdma_coordinator(slots, data_len, superframe_ms, dio);
+    }else if(nchans){
+      channel_select_rx(chans, nchans);
+    }else if(gps_path){
+      coverage_rx(&gps, cov, superframe_ms);
+      fclose(cov);
+    }else if(upgrade){
+      struct profile fast;
+      profile_of(&rx_modem, read_reg(REG_SYNC_WORD), &fast);
+      fast.sf = up_sf;
+      fast.bw = bw_index(up_bw * 1000);
+      profile_switch_rx(&fast, superframe_ms);
+    }else{
+      duty_cycle_rx(wake_ms, window);
+    }
+    bcm2835_spi_end();
+    binlog_close();
+    bcm2835_close();
+    return 0;
+  }
 
   //Enter continuous receive mode
+  uint8_t packet[255];
   write_reg(REG_FIFO_ADDR_PTR, FIFO_RX_BASE_ADDR);
   read_reg(REG_IRQ_FLAGS);
   write_reg(REG_OP_MODE, LORA_RX_CONT);
   //printf("Entered LORA_RX_CONT.\n");
 
   //two and a half second delay between checking for packets
-  while(1){
+  for(uint32_t checks = 1; ; checks++){
     clock_t timer1 = 0;
     for(clock_t start = clock(); timer1/CLOCKS_PER_SEC <= 2.5; timer1 = clock() - start){}
-    //checks receive flags
+    //checks receive flags.  the packet is printed once the radio is
+    //listening again, nothing before that allocates or prints
+    hot_enter();
+    uint64_t rx_done = wall_us();
+    int len = -1;
     if(read_reg(REG_IRQ_FLAGS)==(FLAG_RX_DONE | FLAG_VALID_HEADER)){
       //printf("Packet received! =)\n");
       write_reg(REG_OP_MODE, LORA_STANDBY);     //switch into standby for data reading
-      write_reg(REG_FIFO_ADDR_PTR, read_reg(REG_FIFO_RX_CURRENT_ADDR));
-      for(uint8_t i = 0; i < read_reg(REG_RX_NUM_BYTES); i++){
-        printf("%c", read_reg(REG_FIFO));
-      }
-      printf("\n");
-      write_reg(REG_IRQ_FLAGS, CLEAR_FLAGS);
+      len = read_fifo_packet(packet);
+      energy_packet();
+      write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
       write_reg(REG_OP_MODE, LORA_RX_CONT);     //switch back to cont. going in and out of 
       //break;                                  //cont may be uneccessary 
+    }
+    hot_leave();
+    if(len >= 0){
+      deliver_packet(packet, len, rx_done);
     }else{
       printf("No reception.\n");
     }
+    if(report && checks % ENERGY_REPORT_EVERY == 0){
+      energy_report(stderr);
+      hot_report(stderr);
+    }
   }
   
   bcm2835_spi_end();
+  binlog_close();
   bcm2835_close();
   return 0;
   
@@ -254,134 +554,604 @@ int main(int argc, char **argv){
 
 //--------------------------------helper function implementations---------------------------------
 
-//wrapper function that reads from a register
-//argument is byte address of register to be read
-//return value is data held in register
-uint8_t read_reg(uint8_t addr){
-  char tbuf[] = {addr, 0x00};
-  char rbuf[] = {0x00, 0x00};
-  bcm2835_spi_transfernb(tbuf, rbuf, sizeof(tbuf));
-  //printf("Read value 0x%02X from register 0x%02X.\n", rbuf[1], addr);
-  return rbuf[1];
+//prints a received packet, stripping and recording a latency trailer
+void deliver_packet(const uint8_t *buf, uint8_t len, uint64_t rx_done){
+  struct lat_trailer t;
+  struct lat_rx r;
+  r.rx_done_us = rx_done;
+  r.drained_us = wall_us();
+  int n = unpack_lat_trailer(buf, len, &t);
+  fwrite(buf, 1, n < 0 ? len : n, stdout);
+  printf("\n");
+  fflush(stdout);
+  if(PROBE_ENABLED(packet_delivered)) PROBE(packet_delivered, len, 0, wall_us() - rx_done);
+  if(n < 0) return;
+  r.delivered_us = wall_us();
+  latency_record(&lat, &t, &r);
+  if(lat.stage[L_TOTAL].n % LATENCY_REPORT_EVERY == 0){
+    latency_print(stderr, &lat, airtime_us(&rx_modem, len));
+  }
 }
 
-//wrapper function that writes to a register
-//arguments are address to be written to and data to write
-//returns last data held in register before the write
-
-//recently updated second arg type from uint8_t to char.
-//this allows direct entry in the form 'h' rather than hex or binary
-//however, entering hex or binary for configuring hardware still works the same
-uint8_t write_reg(uint8_t addr, char data){
-  char tbuf[] = {addr | 0x80, data};   //flag addr MSB high to indicate write op
-  char rbuf[] = {0x00, 0x00};
-  bcm2835_spi_transfernb(tbuf, rbuf, sizeof(tbuf));
-  if(addr == 0x00){
-    //printf("Wrote character %c to FIFO.\n", data);
-  }else{
-    //printf("Wrote value 0x%02X to register 0x%02X.\n", data, addr);
+//prints RX-on fraction and the average supply current from the energy
+//accounts against what continuous Rx would have drawn
+void duty_report(uint32_t wakes, uint32_t packets, uint32_t latency_ms){
+  double avg_ma = energy_avg_ma();
+  uint64_t total_us = energy.since - energy.start;
+  if(total_us == 0 || avg_ma <= 0) return;
+  double rx_ma = energy.model.mode_ma[E_RX] + energy.model.base_ma;
+  fprintf(stderr, "Duty cycle: %u wakes, %u packets, RX on %.2f%%, "
+          "avg %.3f mA vs %.1f mA continuous (%.1fx less), extra latency <= %u ms\n",
+          wakes, packets, 100.0 * energy.time_us[E_RX] / total_us, avg_ma, rx_ma,
+          rx_ma / avg_ma, latency_ms);
+  energy_report(stderr);
+  power_report(stderr);
+}
+
+//low power receive loop.  wakes on an absolute schedule, listens in
+//Rx single mode for window symbols and sleeps again.  the chip returns
+//to standby on its own after RxTimeout or RxDone
+void duty_cycle_rx(uint32_t wake_ms, uint16_t window){
+  struct modem_cfg modem;
+  read_modem(&modem);
+  set_symb_timeout(window);
+  //the receiver's RegPreambleLen has to match the transmitter's, which
+  //loraTX -w stretches to the same wake interval and window
+  set_preamble(wake_preamble(&modem, wake_ms, window));
+  read_modem(&modem);
+
+  //give up on a wake if the flags never show up, e.g. the chip reset.
+  //a packet that started in our window can still have up to a wake
+  //interval of preamble to go, then a full max length payload
+  uint64_t give_up_us = airtime_us(&modem, 255) + 100000;
+  uint32_t poll_us = symbol_us(&modem) / 4;
+  uint32_t latency_ms = wake_ms + window * symbol_us(&modem) / 1000;
+
+  uint32_t wakes = 0, packets = 0;
+  uint64_t deadline = now_us();
+  uint8_t packet[255];
+
+  while(running){
+    //idle until the next window, the chip comes back in standby.
+    //it is scheduled from the start, not from now, so it can't drift
+    power_idle_until(deadline, 0);
+    deadline += (uint64_t)wake_ms * 1000;
+
+    //arm the receiver.  the packet is printed after the chip is done
+    //with it, nothing before that allocates or prints
+    hot_enter();
+    write_reg(REG_FIFO_ADDR_PTR, FIFO_RX_BASE_ADDR);
+    write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+    uint64_t rx_start = now_us();
+    write_reg(REG_OP_MODE, LORA_RX_SINGLE);
+
+    //wait for RxTimeout or RxDone
+    uint8_t flags;
+    uint64_t rx_done = wall_us();
+    while(!((flags = read_reg(REG_IRQ_FLAGS)) & (FLAG_RX_TIMEOUT | FLAG_RX_DONE))){
+      if(now_us() - rx_start > give_up_us) break;
+      sleep_until_us(now_us() + poll_us);
+      rx_done = wall_us();
+    }
+    //the chip went back to standby by itself, unless we gave up on it
+    if(!(flags & (FLAG_RX_TIMEOUT | FLAG_RX_DONE))) write_reg(REG_OP_MODE, LORA_STANDBY);
+    energy_mode(LORA_STANDBY);
+
+    int len = -1;
+    if((flags & FLAG_RX_DONE) && !(flags & FLAG_PAYLOAD_CRC)){
+      len = read_fifo_packet(packet);
+      packets++;
+      energy_packet();
+    }
+    write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+    hot_leave();
+    if(len >= 0) deliver_packet(packet, len, rx_done);
+
+    if(++wakes % DUTY_REPORT_EVERY == 0){
+      duty_report(wakes, packets, latency_ms);
+      hot_report(stderr);
+    }
   }
-  return rbuf[1];
+  write_reg(REG_OP_MODE, LORA_SLEEP);
+  duty_report(wakes, packets, latency_ms);
 }
 
-//diagnostic function that reads every #defined register except FIFO
-//(because that would inadvertently increment the address pointer)
-//prints outputs because it's just calling the read_reg() function
-void diagnose(void){
-  read_reg(REG_OP_MODE);
-  read_reg(REG_RF_FREQ_MSB_MSB);
-  read_reg(REG_RF_FREQ_MSB);
-  read_reg(REG_RF_FREQ_LSB);
-  read_reg(REG_PA_CONFIG);
-  read_reg(REG_PA_RAMP);
-  read_reg(REG_OCP);
-  read_reg(REG_LNA);
-  read_reg(REG_FIFO_ADDR_PTR);
-  read_reg(REG_FIFO_TX_BASE_ADDR);
-  read_reg(REG_FIFO_RX_BASE_ADDR);
-  read_reg(REG_FIFO_RX_CURRENT_ADDR);
-  read_reg(REG_IRQ_FLAGS_MASK);  
-  read_reg(REG_IRQ_FLAGS);
-  read_reg(REG_RX_NUM_BYTES);
-  read_reg(REG_RX_PACKET_COUNT_MSB);
-  read_reg(REG_RX_PACKET_COUNT_LSB);
-  read_reg(REG_MODEM_STAT);
-  read_reg(REG_PACKET_SNR);
-  read_reg(REG_PACKET_RSSI);
-  read_reg(REG_CURRENT_RSSI);
-  read_reg(REG_HOP_CHANNEL);
-  read_reg(REG_MODEM_CONFIG1);
-  read_reg(REG_MODEM_CONFIG2);
-  read_reg(REG_PREAMBLE_LEN_MSB);
-  read_reg(REG_PREAMBLE_LEN_LSB);
-  read_reg(REG_PAYLOAD_LEN);
-  read_reg(REG_MAX_PAYLOAD_LEN);
-  read_reg(REG_HOP_PERIOD);
-  read_reg(REG_MODEM_CONFIG3);
-  read_reg(REG_DETECT_OPTIMIZE);
-  read_reg(REG_DETECT_THRESH);
-  read_reg(REG_SYNC_WORD);
+//TDMA coordinator.  beacons at the start of every superframe, receives
+//the nodes' slot packets for the rest of it and adapts the guard time to
+//the timing errors it sees.  dio is the DIO0 gpio or -1 to poll over SPI
+void tdma_coordinator(uint8_t slots, uint8_t data_len, uint32_t superframe_ms, int dio){
+  struct modem_cfg modem;
+  read_modem(&modem);
+  uint32_t beacon_air = airtime_us(&modem, TDMA_BEACON_LEN);
+  uint32_t data_air = airtime_us(&modem, data_len);
+  uint32_t poll_us = symbol_us(&modem);
+  uint32_t min_superframe = superframe_ms * 1000;
+
+  struct tdma_guard guard = {tdma_initial_guard(min_superframe), 0};
+  struct tdma_plan plan;
+  tdma_plan(&plan, slots, beacon_air, data_air, guard.guard_us, min_superframe);
+
+  struct tdma_beacon b;
+  uint8_t buf[255];
+  uint32_t frames = 0, filled = 0, strays = 0;
+  uint64_t air_ok = 0, limit_air = 0, elapsed = 0;
+  uint64_t start = now_us() + TDMA_PREP_US;
+
+  //learned Tx start latency after the mode write, and how far the real Tx
+  //start was from the stamp since the last report
+  int64_t keyup_us = 0;
+  int64_t stamp_max = 0;
+  int64_t stamp_sum = 0;
+  uint32_t stamps = 0;
+  if(dio >= 0) dio0_init(dio);
+
+  while(running){
+    //beacon at the very start of the superframe
+    b.seq = frames;
+    b.slots = slots;
+    b.superframe_us = plan.superframe_us;
+    b.slot_us = plan.slot_us;
+    b.guard_us = plan.guard_us;
+    b.tx_us = start + (wall_us() - now_us());
+    load_fifo_packet(buf, pack_tdma_beacon(buf, &b));
+    sleep_until_us(start - keyup_us);
+    write_reg(REG_OP_MODE, LORA_TX);
+
+    //Tx really started one airtime before TxDone
+    uint64_t done;
+    sleep_until_us(start + beacon_air - DIO0_SPIN_US);
+    uint8_t flags = wait_event(FLAG_TX_DONE, start + beacon_air + TX_CONFIRM_US, poll_us, 0, &done);
+    write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+    if(dio >= 0 && (flags & FLAG_TX_DONE)){
+      int64_t late = (int64_t)(done - beacon_air - start);
+      keyup_us += late / 4;
+      int64_t mag = late < 0 ? -late : late;
+      if(mag > stamp_max) stamp_max = mag;
+      stamp_sum += mag;
+      stamps++;
+    }
+
+    //listen to the slots until it's time to get the next beacon ready
+    write_reg(REG_FIFO_ADDR_PTR, FIFO_RX_BASE_ADDR);
+    write_reg(REG_OP_MODE, LORA_RX_CONT);
+    uint64_t listen_end = start + plan.superframe_us - TDMA_PREP_US;
+    while(running){
+      uint64_t seen;
+      uint8_t flags = wait_event(FLAG_RX_DONE, listen_end, poll_us, DIO0_SLEEP_US, &seen);
+      if(!(flags & FLAG_RX_DONE)) break;
+      uint8_t len = read_fifo_packet(buf);
+      write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+      if(flags & FLAG_PAYLOAD_CRC) continue;
+
+      //which slot it landed in and how far from where the schedule puts it
+      int64_t rel = (int64_t)(seen - start) - tdma_tx_offset(&plan, 0) - data_air;
+      int64_t k = rel + plan.slot_us/2;
+      int64_t slot = k < 0 ? -1 : k / plan.slot_us;
+      if(slot >= 0 && slot < slots && len == data_len){
+        tdma_observe(&guard, (int32_t)(rel - slot*plan.slot_us));
+        filled++;
+        air_ok += data_air;
+      }else{
+        strays++;
+      }
+      fwrite(buf, 1, len, stdout);
+      printf("\n");
+      fflush(stdout);
+      energy_packet();
+    }
+    write_reg(REG_OP_MODE, LORA_STANDBY);
+
+    frames++;
+    elapsed += plan.superframe_us;
+    limit_air += (uint64_t)slots * data_air;
+    if(frames % TDMA_REPORT_EVERY == 0 || !running){
+      fprintf(stderr, "TDMA: %u superframes of %.1f ms, %u/%u slots filled, %u strays, guard %u us, "
+              "worst error %u us, utilization %.3f of %.3f limit\n",
+              frames, plan.superframe_us / 1000.0, filled, frames * slots, strays,
+              plan.guard_us, guard.max_err_us, (double)air_ok / elapsed, (double)limit_air / elapsed);
+      if(stamps){
+        fprintf(stderr, "Beacon stamps: key up latency %lld us, stamp error mean %lld us max %lld us\n",
+                (long long)keyup_us, (long long)(stamp_sum / stamps), (long long)stamp_max);
+        stamp_max = stamp_sum = stamps = 0;
+      }
+    }
+
+    //the next superframe uses a guard sized from this one's errors
+    start += plan.superframe_us;
+    tdma_plan(&plan, slots, beacon_air, data_air, tdma_next_guard(&guard), min_superframe);
+  }
 }
 
-//establishes spi and configures appropriate bit transfer parameters
-void hardware_init(void){
-  //test the library initialization functions
-  if(!bcm2835_init()){
-    printf("bcm2835_init failed.  Must run as root.\n");
-    exit(EXIT_SUCCESS);
-  }  
-  if(!bcm2835_spi_begin()){
-    printf("bcm2835_spi_begin failed.  Must run as root.\n");
-    exit(EXIT_SUCCESS);
+//groundstation side of channel selection.  listens on the current
+//channel, and after every beacon from the balloon ranks the channels,
+//sends a move if one is clearly better and scans the rest
+void channel_select_rx(const uint32_t *freq_hz, int n){
+  struct chan_sel sel;
+  chan_init(&sel, freq_hz, n, 0, RSSI_OFFSET_LF);
+  uint32_t poll_us = symbol_us(&rx_modem);
+  uint32_t cmd_air = airtime_us(&rx_modem, CHANNEL_CMD_LEN);
+  set_frequency(sel.ch[0].freq_hz);
+
+  uint8_t buf[255];
+  struct channel_cmd cmd = {0};
+  int prev = -1;             //channel to fall back to after a move
+  int next = -1;             //channel we are moving to at switch_at
+  uint64_t switch_at = 0;
+  uint64_t last_ours = now_us();
+  uint64_t next_scan = now_us() + CHAN_SCAN_US;
+  uint32_t beacons = 0;
+
+  while(running){
+    //listen on the current channel until a beacon of ours, a scan or a move is due
+    uint64_t until = next >= 0 && switch_at < next_scan ? switch_at : next_scan;
+    uint64_t listen_start = now_us();
+    uint32_t foreign = 0;
+    int ours = 0;
+    write_reg(REG_FIFO_ADDR_PTR, FIFO_RX_BASE_ADDR);
+    write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+    write_reg(REG_OP_MODE, LORA_RX_CONT);
+    while(running && !ours && now_us() < until){
+      uint64_t seen;
+      uint64_t wait = now_us() + CHAN_RSSI_EVERY_US;
+      uint8_t flags = wait_irq(FLAG_RX_DONE, wait < until ? wait : until, poll_us, &seen);
+      if(!(flags & FLAG_RX_DONE)){
+        chan_rssi(&sel, sel.current, read_reg(REG_CURRENT_RSSI));
+        continue;
+      }
+      uint8_t len = read_fifo_packet(buf);
+      write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+      if((flags & FLAG_PAYLOAD_CRC) || !frame_recognized(buf, len)){
+        foreign++;
+        continue;
+      }
+      deliver_packet(buf, len, wall_us() - (now_us() - seen));
+      energy_packet();
+      ours = 1;
+      last_ours = now_us();
+      prev = -1;  //the link works here, nothing to fall back to
+    }
+    chan_listen(&sel, sel.current, now_us() - listen_start, foreign);
+    write_reg(REG_OP_MODE, LORA_STANDBY);
+
+    if(ours){
+      //the balloon listens for a command right after its beacon
+      int best = next < 0 ? chan_pick(&sel) : -1;
+      if(best >= 0){
+        cmd.seq++;
+        cmd.freq_hz = sel.ch[best].freq_hz;
+        cmd.switch_ms = CHAN_SWITCH_MS;
+        load_fifo_packet(buf, pack_channel_cmd(buf, &cmd));
+        uint64_t tx_start = now_us();
+        write_reg(REG_OP_MODE, LORA_TX);
+        uint64_t done = tx_start + cmd_air;
+        wait_irq(FLAG_TX_DONE, tx_start + cmd_air + TX_CONFIRM_US, poll_us, &done);
+        write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+        next = best;
+        switch_at = done + CHAN_SWITCH_MS * 1000ULL;
+        fprintf(stderr, "Moving to %.3f MHz, score %d against %d here.\n", cmd.freq_hz / 1e6,
+                chan_score(&sel, best), chan_score(&sel, sel.current));
+      }
+      if(++beacons % CHAN_REPORT_EVERY == 0) chan_print(stderr, &sel);
+    }
+
+    //a move is due
+    if(next >= 0 && now_us() >= switch_at){
+      prev = sel.current;
+      sel.current = next;
+      next = -1;
+      set_frequency(sel.ch[sel.current].freq_hz);
+      last_ours = now_us();
+      continue;
+    }
+
+    //scan the other channels between beacons, or when nothing is heard
+    if(ours || now_us() >= next_scan){
+      channel_scan(&sel);
+      next_scan = now_us() + CHAN_SCAN_US;
+    }
+
+    //lost the balloon, go back where we came from, then search the list
+    if(now_us() - last_ours > CHAN_LOST_US){
+      sel.current = prev >= 0 ? prev : (sel.current + 1) % sel.n;
+      prev = -1;
+      next = -1;
+      set_frequency(sel.ch[sel.current].freq_hz);
+      last_ours = now_us();
+      fprintf(stderr, "No beacon for %u s, listening on %.3f MHz.\n", CHAN_LOST_US / 1000000,
+              sel.ch[sel.current].freq_hz / 1e6);
+    }
+  }
+  write_reg(REG_OP_MODE, LORA_STANDBY);
+  chan_print(stderr, &sel);
+}
+
+//takes a few rssi readings on every channel but the current one and
+//comes back to it
+void channel_scan(struct chan_sel *sel){
+  for(int i = 0; i < sel->n; i++){
+    if(i == sel->current) continue;
+    write_reg(REG_OP_MODE, LORA_STANDBY);
+    set_frequency(sel->ch[i].freq_hz);
+    write_reg(REG_OP_MODE, LORA_RX_CONT);
+    bcm2835_delayMicroseconds(200);  //settle, see loraspec.c
+    for(int k = 0; k < CHAN_SCAN_READS; k++){
+      chan_rssi(sel, i, read_reg(REG_CURRENT_RSSI));
+    }
+  }
+  write_reg(REG_OP_MODE, LORA_STANDBY);
+  set_frequency(sel->ch[sel->current].freq_hz);
+}
+
+//groundstation side of the profile switch handshake (profile.h).  listens
+//for the balloon's beacons, proposes the fast profile when their snr
+//leaves plenty of margin and the base profile when it doesn't, commits
+//while on the fast one and falls back when beacons stop
+void profile_switch_rx(const struct profile *fast, uint32_t period_ms){
+  struct reg_image base, shadow, fast_img;
+  struct profile base_p;
+  read_image(&base);
+  shadow = base;
+  profile_of(&rx_modem, base.sync, &base_p);
+  profile_image(fast, (base.block[1] & 0x03) << 8 | base.block[2], &fast_img);
+  struct modem_cfg fast_m;
+  profile_modem(fast, &fast_m);
+  double up = snr_limit_db(fast->sf) + PROFILE_UP_DB;
+  double down = snr_limit_db(fast->sf) + PROFILE_DOWN_DB;
+  double wider_db = 0;
+  for(uint32_t bw = rx_modem.bw_hz; bw < fast_m.bw_hz / 3 * 2; bw *= 2) wider_db += 3;
+
+  uint8_t buf[255];
+  double snr[PROFILE_SNR_BEACONS];
+  uint32_t heard = 0;            //beacons in snr[] on the current profile
+  struct profile_cmd cmd = {0};
+  struct reg_image target;
+  uint64_t switch_at = 0;        //0 if no switch is armed
+  uint64_t lost_us = (uint64_t)PROFILE_LOST_BEACONS * period_ms * 1000;
+  uint64_t last_ours = now_us();
+  uint32_t switches = 0, fallbacks = 0;
+
+  while(running){
+    int on_fast = memcmp(&shadow, &base, sizeof(base)) != 0;
+    uint64_t until = switch_at ? switch_at : last_ours + lost_us;
+    uint32_t poll_us = symbol_us(&rx_modem);
+    int ours = 0;
+    uint64_t seen;
+    write_reg(REG_FIFO_ADDR_PTR, FIFO_RX_BASE_ADDR);
+    write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+    write_reg(REG_OP_MODE, LORA_RX_CONT);
+    while(running && !ours && now_us() < until){
+      uint8_t flags = wait_irq(FLAG_RX_DONE, until, poll_us, &seen);
+      if(!(flags & FLAG_RX_DONE)) break;
+      uint8_t len = read_fifo_packet(buf);
+      write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+      if((flags & FLAG_PAYLOAD_CRC) || !frame_recognized(buf, len) || FRAME_IS_PROTOCOL(buf[0])) continue;
+      snr[heard++ % PROFILE_SNR_BEACONS] = packet_snr();
+      deliver_packet(buf, len, wall_us() - (now_us() - seen));
+      energy_packet();
+      ours = 1;
+      last_ours = now_us();
+    }
+    write_reg(REG_OP_MODE, LORA_STANDBY);
+
+    //a switch both ends agreed on is due
+    if(switch_at && now_us() >= switch_at){
+      apply_image(&target, &shadow);
+      read_modem(&rx_modem);
+      switch_at = 0;
+      heard = 0;
+      last_ours = now_us();
+      switches++;
+      fprintf(stderr, "Switched to SF%u %.1f kHz.\n", rx_modem.sf, rx_modem.bw_hz / 1e3);
+      continue;
+    }
+
+    //no beacons, go back to where the balloon will also end up
+    if(!ours){
+      if(on_fast && now_us() - last_ours >= lost_us){
+        apply_image(&base, &shadow);
+        read_modem(&rx_modem);
+        heard = 0;
+        last_ours = now_us();
+        fallbacks++;
+        fprintf(stderr, "No beacon for %u periods, back on SF%u %.1f kHz.\n", PROFILE_LOST_BEACONS,
+                rx_modem.sf, rx_modem.bw_hz / 1e3);
+      }
+      continue;
+    }
+
+    //right after a beacon the balloon is listening
+    double mean = 0;
+    int full = heard >= PROFILE_SNR_BEACONS;
+    for(int i = 0; full && i < PROFILE_SNR_BEACONS; i++) mean += snr[i] / PROFILE_SNR_BEACONS;
+    //on base, the snr after the switch is this one less 3 dB of extra
+    //noise for every doubling of the bandwidth
+    int propose = switch_at == 0 && full && (on_fast ? mean < down : mean - wider_db > up);
+    if(propose){
+      cmd.seq++;
+      cmd.phase = PROFILE_PROPOSE;
+      cmd.p = on_fast ? base_p : *fast;
+      cmd.switch_ms = PROFILE_SWITCH_MS;
+      uint64_t done;
+      if(send_profile_cmd(&cmd, &rx_modem, &done) == 0){
+        target = on_fast ? base : fast_img;
+        switch_at = done + PROFILE_SWITCH_MS * 1000ULL;
+        fprintf(stderr, "Balloon agreed to %s, mean snr %.1f dB.\n", on_fast ? "fall back" : "upgrade", mean);
+      }
+    }else if(on_fast && switch_at == 0){
+      cmd.phase = PROFILE_COMMIT;
+      cmd.p = *fast;
+      send_profile_cmd(&cmd, &rx_modem, NULL);
+    }
   }
+  write_reg(REG_OP_MODE, LORA_STANDBY);
+  fprintf(stderr, "Profile switches: %u, fallbacks: %u\n", switches, fallbacks);
+}
+
+//sends a profile frame.  a proposal then waits PROFILE_ACK_US for the
+//balloon's ack and returns 0 if it came, -1 if not; done gets the time
+//the proposal finished.  other phases return 0 once sent
+int send_profile_cmd(struct profile_cmd *c, const struct modem_cfg *m, uint64_t *done){
+  uint8_t buf[255];
+  uint32_t poll_us = symbol_us(m);
+  uint32_t air = airtime_us(m, PROFILE_CMD_LEN);
+  load_fifo_packet(buf, pack_profile_cmd(buf, c));
+  uint64_t tx_start = now_us();
+  uint64_t end = tx_start + air;
+  write_reg(REG_OP_MODE, LORA_TX);
+  wait_irq(FLAG_TX_DONE, tx_start + air + TX_CONFIRM_US, poll_us, &end);
+  write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+  if(done) *done = end;
+  if(c->phase != PROFILE_PROPOSE) return 0;
 
-  //The following five functions define the SPI communication operating
-  //parameters.  Some are default values but redundancy never hurt anyone.  
-
-  //Sets bit order. The SX1278 is expecting to receive MSB first and will
-  //also be transmitting back MSB first.  This is a default.  
-  bcm2835_spi_setBitOrder(BCM2835_SPI_BIT_ORDER_MSBFIRST);
-
-  //Sets the clock polarity and phase. The LoRa module asks for CPOL = 0
-  //and CPHA = 0.  This also happens to be the default.  
-  bcm2835_spi_setDataMode(BCM2835_SPI_MODE0);
-
-  //Sets the clock divider and therefore the clock speed.  The default is
-  //65536 which results in a clock speed of 3.8 kHz. I'm using 2048 which
-  //corresponds to 122 kHz.  Troubleshooting SPI connection.  
-  bcm2835_spi_setClockDivider(BCM2835_SPI_CLOCK_DIVIDER_65536);
-
-  //Specifies which chip select pins will be asserted when an SPI transfer
-  //is made.  The RPI2 has two but we'll just be using RPI pin #24 also
-  //known as "SPI_CE0_N". This is a default setting defined below.
-  bcm2835_spi_chipSelect(BCM2835_SPI_CS0);
-
-  //Configured the polarity under which the chip select is considered active.
-  //The SX1278 looks for a chip select active low.  This is a default setting
-  //given below.
-  bcm2835_spi_setChipSelectPolarity(BCM2835_SPI_CS0, LOW);
-
-  //set a GPIO pin high to stabilize reset pin on sx1278
-  //configure RPI pin 16 to gpio output functionality
-  //then set that pin high
-  bcm2835_gpio_fsel(RPI_V2_GPIO_P1_16, BCM2835_GPIO_FSEL_OUTP);
-  bcm2835_gpio_set(RPI_V2_GPIO_P1_16); 
+  struct profile_cmd ack;
+  uint64_t until = now_us() + PROFILE_ACK_US;
+  int ok = -1;
+  write_reg(REG_FIFO_ADDR_PTR, FIFO_RX_BASE_ADDR);
+  write_reg(REG_OP_MODE, LORA_RX_CONT);
+  while(ok < 0 && wait_irq(FLAG_RX_DONE, until, poll_us, NULL) & FLAG_RX_DONE){
+    uint8_t flags = read_reg(REG_IRQ_FLAGS);
+    uint8_t len = read_fifo_packet(buf);
+    write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+    if(!(flags & FLAG_PAYLOAD_CRC) && unpack_profile_cmd(buf, len, &ack) == 0 &&
+       ack.phase == PROFILE_ACK && ack.seq == c->seq) ok = 0;
+  }
+  write_reg(REG_OP_MODE, LORA_STANDBY);
+  return ok;
 }
 
-//checks device boot mode and enters LoRa standby regardless
-//device is now ready to use
-void lora_init(void){ 
-  uint8_t bootmode = read_reg(REG_OP_MODE);
-  if((bootmode & 0x80) == 0X00 ){
-    write_reg(REG_OP_MODE, FSK_SLEEP);
+//field test receiver.  listens continuously, tags every beacon and every
+//missed one with the current GPS position.  the first beacon sets the
+//phase, after that one is expected every period_ms
+void coverage_rx(struct gps_src *gps, FILE *log, uint32_t period_ms){
+  uint32_t poll_us = symbol_us(&rx_modem);
+  uint64_t period = (uint64_t)period_ms * 1000;
+  uint8_t buf[255];
+  uint32_t got = 0, corrupt = 0, missed = 0, untagged = 0;
+  uint64_t expect = 0;  //when the next beacon should be done, 0 until the first
+
+  write_reg(REG_FIFO_ADDR_PTR, FIFO_RX_BASE_ADDR);
+  write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+  write_reg(REG_OP_MODE, LORA_RX_CONT);
+  while(running){
+    //wake often enough to keep up with the GPS
+    gps_poll(gps);
+    uint64_t seen;
+    uint8_t flags = wait_irq(FLAG_RX_DONE, now_us() + 100000, poll_us, &seen);
+
+    if(flags & FLAG_RX_DONE){
+      uint8_t len = read_fifo_packet(buf);
+      int16_t rssi = packet_rssi();
+      double snr = packet_snr();
+      write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+      gps_poll(gps);
+      int bad = (flags & FLAG_PAYLOAD_CRC) || !frame_recognized(buf, len);
+      if(coverage_log(log, bad ? 'C' : 'R', &gps->fix, rssi, snr, len) < 0) untagged++;
+      if(bad){
+        corrupt++;
+        continue;
+      }
+      deliver_packet(buf, len, wall_us() - (now_us() - seen));
+      energy_packet();
+      got++;
+      expect = seen + period;
+    }
+
+    //half a period past due and nothing, that one is lost
+    while(expect && now_us() > expect + period/2){
+      if(coverage_log(log, 'M', &gps->fix, 0, 0, 0) < 0) untagged++;
+      missed++;
+      expect += period;
+    }
+    if(got + missed > 0 && (got + missed) % COVERAGE_REPORT_EVERY == 0 && (flags & FLAG_RX_DONE)){
+      fprintf(stderr, "Coverage: %u received, %u missed (%.1f%%), %u corrupt, %u untagged, "
+              "GPS %s, %u sentences %u bad\n", got, missed, 100.0 * got / (got + missed), corrupt,
+              untagged, gps->fix.valid ? "fix" : "no fix", gps->n.sentences, gps->n.bad);
+    }
   }
-  write_reg(REG_OP_MODE, LORA_SLEEP);
   write_reg(REG_OP_MODE, LORA_STANDBY);
-  
-  if(read_reg(REG_OP_MODE) != LORA_STANDBY){
-    printf("There was a problem entering LORA_STANDBY.\n");
-    exit(EXIT_SUCCESS);
-  }else{
-    //printf("Device has entered LORA_STANDBY.\n");
+  fprintf(stderr, "Coverage: %u received, %u missed, %u corrupt, %u untagged\n", got, missed, corrupt, untagged);
+}
+
+//appends one event to the coverage log.  returns -1 without a fix
+int coverage_log(FILE *log, char kind, const struct gps_fix *fix, int16_t rssi, double snr, uint8_t len){
+  if(!fix->valid) return -1;
+  uint64_t t = wall_us();
+  fprintf(log, "%c %llu.%06llu %.7f %.7f %.1f", kind, (unsigned long long)(t / 1000000),
+          (unsigned long long)(t % 1000000), fix->lat, fix->lon, fix->alt_m);
+  if(kind != 'M') fprintf(log, " %d %.2f %u", rssi, snr, len);
+  fprintf(log, "\n");
+  fflush(log);
+  return 0;
+}
+
+//streaming receiver for loraTX -S.  writes the data of every chunk to
+//out and counts the chunks that never came.  returns 0 once the end
+//chunk arrives, 1 if stopped before it
+int stream_rx(FILE *out, int dio){
+  if(dio >= 0) dio0_init(dio);
+  uint8_t buf[255];
+  struct stream_hdr h;
+  uint16_t next = 0;
+  uint32_t chunks = 0, lost = 0, corrupt = 0;
+  uint32_t bad = 0;        //corrupt since the last good chunk, part of the next gap
+  uint64_t bytes = 0, air_total = 0, first = 0, last = 0;
+  fprintf(stderr, "Waiting for a stream.\n");
+
+  write_reg(REG_FIFO_ADDR_PTR, FIFO_RX_BASE_ADDR);
+  write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+  write_reg(REG_OP_MODE, LORA_RX_CONT);
+  while(running){
+    uint64_t seen;
+    uint8_t flags = wait_event(FLAG_RX_DONE, now_us() + 1000000, STREAM_POLL_US, 0, &seen);
+    if(!(flags & FLAG_RX_DONE)) continue;
+    //out of the FIFO before the next chunk overwrites it
+    uint8_t len = read_fifo_packet(buf);
+    write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+    if(flags & FLAG_PAYLOAD_CRC){
+      corrupt++;
+      bad++;
+      continue;
+    }
+    int n = unpack_stream_header(buf, len, &h);
+    if(n < 0) continue;
+    //chunks missing before this one, all of them before the first.  the
+    //corrupt ones among them did arrive and are counted as corrupt, not
+    //again as lost
+    uint16_t gap = chunks + lost > 0 ? (uint16_t)(h.seq - next) : h.seq;
+    lost += gap > bad ? gap - bad : 0;
+    bad = 0;
+    next = h.seq + 1;
+    if(h.flags & STREAM_END){
+      stream_report(chunks, lost, corrupt, bytes, air_total, last - first);
+      fflush(out);
+      return 0;
+    }
+    //the stream started when the first chunk went on the air
+    uint32_t air = airtime_us(&rx_modem, len);
+    if(chunks == 0) first = seen - air;
+    fwrite(buf + STREAM_HEADER_LEN, 1, n, out);
+    chunks++;
+    bytes += n;
+    air_total += air;
+    last = seen;
+    if(chunks % STREAM_REPORT_EVERY == 0) stream_report(chunks, lost, corrupt, bytes, air_total, last - first);
   }
+  stream_report(chunks, lost, corrupt, bytes, air_total, last - first);
+  fflush(out);
+  return 1;
+}
+
+//prints stream progress: chunks received and lost, goodput and the
+//share of the time the stream was on the air
+void stream_report(uint32_t chunks, uint32_t lost, uint32_t corrupt, uint64_t bytes, uint64_t air_total,
+                   uint64_t elapsed){
+  if(bytes == 0 || elapsed == 0) return;
+  fprintf(stderr, "Stream: %u chunks, %u lost, %u corrupt, %llu bytes in %.1f s, goodput %.0f B/s, "
+          "on the air %.1f%% of the time\n", chunks, lost, corrupt, (unsigned long long)bytes, elapsed / 1e6,
+          bytes * 1e6 / elapsed, 100.0 * air_total / elapsed);
+}
+
+//signal handler that lets the receive loop finish and report
+void stop(int sig){
+  running = 0;
 }
@@ -154,87 +154,287 @@
    and redirecting them to the file batlife.txt in the same directory as this file. 
    This behavior will be scripted to run on boot via the "rc.local" file.     
 
+   Notes on duty cycled receivers:
+   A battery powered receiver running loraRX -d <ms> only listens for a few
+   symbols every <ms> milliseconds and sleeps the rest of the time.  To be
+   sure it wakes up while a packet is still on the air the preamble has to
+   last at least one whole wake interval plus the receiver's listening
+   window.  Run this program with the matching -w <ms>, and -s <symbols>
+   if the receiver's window isn't the default, and it stretches
+   RegPreambleLen accordingly (see wake_preamble() in timing.h).  The cost
+   is transmit airtime, so the confirm delay below grows to match.
+
+   Notes on energy accounting:
+   Counting beacons in batlife.txt still works, but takes days per data
+   point.  Every op mode change is now also charged against per mode current
+   figures (energy.h), and with -b <mAh> the projected battery life is printed
+   to stderr every ENERGY_REPORT_EVERY beacons.  -e <file> overrides the
+   datasheet current figures, e.g. with ones measured on the balloon payload.
+
+   Notes on sleep between beacons:
+   The chip used to idle in LORA_STANDBY for the whole gap between beacons,
+   and the program busy waited on clock() which also kept the RPI's CPU
+   pinned.  The loop now runs on an absolute monotonic schedule and idles
+   with power_idle_until() (power.h), which sleeps the chip and the process
+   and wakes both just in time to load the next payload.  The FIFO is lost
+   in sleep, which doesn't matter here because it is loaded after waking.
+   Note the old loop compared clock()/CLOCKS_PER_SEC, an integer, against
+   0.5 and 4.5, so the real period was closer to 6 seconds (see the
+   timestamps in rangetest1.txt).  It is now the intended BEACON_PERIOD_US.
+   -n keeps the chip in standby instead, for comparing the two.
+
+   Notes on listen before talk:
+   With -c the transmitter runs channel activity detection before every
+   beacon and backs off with a randomized exponential delay while the
+   channel is busy (csma.h).  -r <dBm> adds an rssi check against that
+   threshold, which also catches non-LoRa users of the band.  A beacon that
+   can't get the channel within -L <ms> is dropped rather than sent late.
+   Access statistics are printed with the energy report.  lorasim.c runs
+   the same policy against simulated nodes to show what it buys under load.
+
+   Notes on TDMA:
+   With -T <slot> the beacon stops free running and joins a slot schedule
+   run by loraRX -T (tdma.h).  The node listens for the coordinator's
+   beacon, works out where its slot falls and keys up only inside it, then
+   sleeps until just before the next beacon is due.  The spacing of
+   successive beacons gives the node's clock drift against the
+   coordinator's, which is corrected for when timing the slot.  A node that
+   misses TDMA_MAX_MISSED beacons in a row stops transmitting and searches
+   again rather than risk someone else's slot.
+
+   Notes on time sync:
+   The coordinator stamps every beacon with its wall clock at Tx start.  A
+   TDMA node turns each beacon into a measurement of its clock's offset,
+   filters them (timesync.h) and puts the coordinator's time, not its own
+   drifting system time, in its payload.  -D <gpio> timestamps RxDone on the
+   module's DIO0 pin wired to that gpio, which is what gets the error under
+   a millisecond, and -o <us> sets the receiver's RxDone latency after the
+   last symbol.  The achieved accuracy is printed every ENERGY_REPORT_EVERY
+   superframes.
+
+   Notes on latency telemetry:
+   -t appends a latency trailer (frame.h, latency.h) to every beacon with
+   the wall clock time the payload was built, and how long after that the
+   FIFO load finished and Tx started.  loraRX adds its own stamps and
+   prints where the time goes.  The payload now goes into the FIFO in one
+   burst, and the Tx start stamp is patched into the FIFO right before
+   keying up, predicted from how long the previous patch took.
+
+   Notes on channel changes:
+   With -C the beacon listens in continuous Rx for CHAN_CMD_WINDOW_US after
+   every beacon for a channel change command from loraRX -C (frame.h,
+   chansel.h), and retunes to the new channel the command's delay after
+   receiving it, which is before the next beacon.  The window costs Rx
+   current every cycle, which the energy report shows.
+
+   Notes on profile switches:
+   With -P the same window after every beacon also takes profile switch
+   proposals from loraRX -U (profile.h has the handshake).  The beacon
+   acks a proposal right away and applies the new register image at the
+   agreed time, then recomputes its airtime.  Without a commit from the
+   groundstation for PROFILE_REVERT_BEACONS beacons it goes back to the
+   profile it started with.
+
+   Notes on streaming:
+   -S <file> (- for stdin, which also takes a pipe) stops beaconing and
+   sends the file as fast as the channel allows.  It goes out in full
+   size packets, a FRAME_STREAM header (frame.h) and STREAM_DATA_LEN bytes
+   of data, each loaded with one burst and keyed up the moment the last
+   one's TxDone is seen.  The next chunk is read from the input while the
+   current one is on the air, so the gap between packets is just seeing
+   TxDone and the FIFO load.  A header only chunk flagged STREAM_END
+   closes the stream; only it and the chunk before it can be short.  The
+   payload crc is turned on for the stream.
+   Progress and, at the end, the goodput against the time on air limit
+   (data bytes over the sum of the packets' airtimes, what back to back
+   packets with no gap at all would get) go to stderr.  At the default
+   SPI clock a full packet takes half a second to load, longer than it is
+   on the air at SF7, so raise the clock with -k; -D takes TxDone off the
+   pin instead of polling for it.  loraRX -S writes the stream back out.
+
    ---------------------------------------------------------------------------------------------*/
 
 //------------------------------header files and label definitions------------------------------
 
-#include <bcm2835.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <time.h>
+#ifdef HOT_CHECK
+#define _GNU_SOURCE   //fopencookie, see hotpath.h
+#endif
+#include "sx1278.h"
+#include "energy.h"
+#include "power.h"
+#include "csma.h"
+#include "tdma.h"
+#include "timesync.h"
+#include "latency.h"
+#include "chansel.h"
+#include "hotpath.h"
 #include <string.h>
+#include <unistd.h>
+#include <signal.h>
 
-//SX1278 device modes
-#define FSK_SLEEP      0b00001000  //0x08  must enter before switching to lora
-#define FSK_CAD        0b00001111  //0x0F  seems to be default startup op mode
-#define LORA_SLEEP     0b10001000  //0x88
-#define LORA_STANDBY   0b10001001  //0x89
-#define LORA_TX        0b10001011  //0x8B
-#define LORA_RX_CONT   0b10001101  //0x8D
-#define LORA_RX_SINGLE 0b10001110  //0x8E
-#define LORA_CAD       0b10001111  //0x8F
-
-//register addresses
-#define REG_FIFO                 0b00000000  //0x00
-#define REG_OP_MODE              0b00000001  //0x01
-#define REG_RF_FREQ_MSB_MSB      0b00000110  //0x06
-#define REG_RF_FREQ_MSB          0b00000111  //0x07
-#define REG_RF_FREQ_LSB          0b00001000  //0x08
-#define REG_PA_CONFIG            0b00001001  //0x09
-#define REG_PA_RAMP              0b00001010  //0x0A
-#define REG_OCP                  0b00001011  //0x0B
-#define REG_LNA                  0b00001100  //0x0C
-#define REG_FIFO_ADDR_PTR        0b00001101  //0x0D
-#define REG_FIFO_TX_BASE_ADDR    0b00001110  //0x0E
-#define REG_FIFO_RX_BASE_ADDR    0b00001111  //0x0F
-#define REG_FIFO_RX_CURRENT_ADDR 0b00010000  //0x10
-#define REG_IRQ_FLAGS_MASK       0b00010001  //0x11
-#define REG_IRQ_FLAGS            0b00010010  //0x12
-#define REG_RX_NUM_BYTES         0b00010011  //0x13
-#define REG_RX_PACKET_COUNT_MSB  0b00010110  //0x16
-#define REG_RX_PACKET_COUNT_LSB  0b00010111  //0x17
-#define REG_MODEM_STAT           0b00011000  //0x18
-#define REG_PACKET_SNR           0b00011001  //0x19
-#define REG_PACKET_RSSI          0b00011010  //0x1A
-#define REG_CURRENT_RSSI         0b00011011  //0x1B
-#define REG_HOP_CHANNEL          0b00011100  //0x1C
-#define REG_MODEM_CONFIG1        0b00011101  //0x1D
-#define REG_MODEM_CONFIG2        0b00011110  //0x1E
-#define REG_PREAMBLE_LEN_MSB     0b00100000  //0x20
-#define REG_PREAMBLE_LEN_LSB     0b00100001  //0x21
-#define REG_PAYLOAD_LEN          0b00100010  //0x22  
-#define REG_MAX_PAYLOAD_LEN      0b00100011  //0x23
-#define REG_HOP_PERIOD           0b00100100  //0x24
-#define REG_MODEM_CONFIG3        0b00100110  //0x26
-#define REG_DETECT_OPTIMIZE      0b00110001  //0x31
-#define REG_DETECT_THRESH        0b00110111  //0x37
-#define REG_SYNC_WORD            0b00111001  //0x39
-
-//helpful values
-#define CLEAR_IRQ_FLAGS   0b11111111  //0xFF
-#define FLAG_TX_DONE      0b00001000  //0x08
-#define FIFO_TX_BASE_ADDR 0b10000000  //0x80
-
-//-----------------------------------helper function prototypes----------------------------------
+//beacons between energy reports
+#define ENERGY_REPORT_EVERY 12
 
-void hardware_init(void);
+//time between the start of two beacons
+#define BEACON_PERIOD_US 5000000
 
-void lora_init(void);
+//how long after a beacon to listen for a channel change command.  the
+//groundstation has to poll RxDone, drain the beacon and load the command
+//over the slow SPI bus first
+#define CHAN_CMD_WINDOW_US 500000
 
-uint8_t read_reg(uint8_t addr);
+//how long an unsynchronized TDMA node listens for a coordinator beacon
+#define TDMA_SEARCH_US 10000000
 
-uint8_t write_reg(uint8_t addr, char data); 
+//streaming: RegIrqFlags polls for TxDone without DIO0, chunks between reports
+#define STREAM_POLL_US      100
+#define STREAM_REPORT_EVERY 100
 
-void diagnose(void);
+//-----------------------------------helper function prototypes----------------------------------
 
 char* get_time(void);
 
+char* time_string(time_t rawtime);
+
 void print_array(char *array, int length);
 
+void tdma_node(uint8_t slot, int report, int dio, uint32_t rx_latency);
+
+int stream_tx(FILE *in, int dio);
+
+void stream_report(uint32_t chunks, uint64_t bytes, uint64_t air_total, uint64_t elapsed,
+                   uint64_t gap_total, uint32_t gap_max);
+
+void stop(int sig);
+
+//cleared by the signal handler to end a stream early
+volatile sig_atomic_t running = 1;
+
 //-----------------------------------------function main-----------------------------------------
 
 int main(int argc, char **argv){
 
+  //command line options
+  //-w <ms>    wake interval of a duty cycled receiver, stretches the preamble
+  //-s <symb>  the receiver's listening window, with -w (DUTY_RX_WINDOW)
+  //-e <file>  per mode current figures for energy accounting
+  //-b <mAh>   battery capacity for projected lifetime
+  //-n         never sleep between beacons, idle in standby
+  //-c         listen before talk with CAD
+  //-r <dBm>   also call the channel busy above this rssi, implies -c
+  //-L <ms>    max deferral per beacon before it is dropped
+  //-T <slot>  transmit in this TDMA slot of a loraRX -T coordinator
+  //-D <gpio>  timestamp beacons on the DIO0 pin wired to this gpio
+  //-o <us>    RxDone latency after the end of a packet
+  //-t         append a latency trailer to every beacon
+  //-C         listen for channel change commands after every beacon
+  //-P         take modem profile switches from the groundstation
+  //-S <file>  stream a file, - for stdin, instead of beaconing
+  //-k <div>   SPI clock divider
+  //-R <file>  binary register trace, decode with loralog
+  uint32_t wake_ms = 0;
+  uint16_t window = DUTY_RX_WINDOW;
+  char *currents = NULL;
+  double battery_mah = 0;
+  int sleep_ok = 1;
+  int lbt = 0;
+  int16_t rssi_thresh = RSSI_OFF;
+  uint32_t budget_ms = CSMA_BUDGET_US / 1000;
+  int slot = -1;
+  int dio = -1;
+  uint32_t rx_latency = 0;
+  int trailer = 0;
+  int chan_cmds = 0;
+  int profile_cmds = 0;
+  char *stream_path = NULL;
+  char *trace_path = NULL;
+  int opt;
+  while((opt = getopt(argc, argv, "w:s:e:b:ncr:L:T:D:o:tCPS:k:R:")) != -1){
+    switch(opt){
+      case 'w':
+        wake_ms = strtoul(optarg, NULL, 10);
+        break;
+      case 's':
+        window = strtoul(optarg, NULL, 10);
+        break;
+      case 'e':
+        currents = optarg;
+        break;
+      case 'b':
+        battery_mah = atof(optarg);
+        break;
+      case 'n':
+        sleep_ok = 0;
+        break;
+      case 'c':
+        lbt = 1;
+        break;
+      case 'r':
+        lbt = 1;
+        rssi_thresh = atoi(optarg);
+        break;
+      case 'L':
+        budget_ms = strtoul(optarg, NULL, 10);
+        break;
+      case 'T':{
+        //a slot is a byte on the air, anything else would wrap into
+        //another node's slot
+        char *end;
+        long s = strtol(optarg, &end, 10);
+        if(*optarg == '\0' || *end != '\0' || s < 0 || s > 255){
+          printf("Slot must be 0 to 255.\n");
+          return 1;
+        }
+        slot = s;
+        break;
+      }
+      case 'D':
+        dio = atoi(optarg);
+        break;
+      case 'o':
+        rx_latency = strtoul(optarg, NULL, 10);
+        break;
+      case 't':
+        trailer = 1;
+        break;
+      case 'C':
+        chan_cmds = 1;
+        break;
+      case 'P':
+        profile_cmds = 1;
+        break;
+      case 'S':
+        stream_path = optarg;
+        break;
+      case 'k':
+        spi_divider = strtoul(optarg, NULL, 10);
+        break;
+      case 'R':
+        trace_path = optarg;
+        break;
+      default:
+        printf("usage: %s [-w wake_interval_ms] [-s window_symbols] [-e currents] [-b mAh] [-n] [-c]\n"
+               "       [-r dBm] [-L ms] [-T slot] [-D dio0_gpio] [-o rx_latency_us] [-t] [-C] [-P]\n"
+               "       [-S file|-] [-k spi_divider] [-R trace_file]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  //the input first, no point starting the radio otherwise
+  FILE *stream_in = NULL;
+  if(stream_path){
+    stream_in = strcmp(stream_path, "-") == 0 ? stdin : fopen(stream_path, "rb");
+    if(stream_in == NULL){
+      printf("Can't open %s.\n", stream_path);
+      return 1;
+    }
+  }
+
+  if(trace_path && binlog_open(trace_path) < 0){
+    printf("Can't open %s.\n", trace_path);
+    return 1;
+  }
+
   hardware_init();  //setup spi
   lora_init();      //boot sequence to LoRa standby
   //diagnose();       //read relevant LoRa registers for diagnostics
@@ -242,43 +442,245 @@ int main(int argc, char **argv){
   //allocates space for date/time info
   char payload[25];
 
+  //packet as loaded into the FIFO, the payload plus an optional trailer
+  uint8_t packet[255];
+  uint8_t len = sizeof(payload) - 1 + (trailer ? LAT_TRAILER_LEN : 0);
+  struct lat_trailer lat = {0};
+  uint32_t patch_us = 0;
+
   //set transceiver payload length
-  write_reg(REG_PAYLOAD_LEN, (sizeof(payload) - 1));
+  write_reg(REG_PAYLOAD_LEN, len);
+
+  //lengthen the preamble to span a whole receiver sleep interval.
+  //status goes to stderr since stdout is redirected to batlife.txt
+  struct modem_cfg modem;
+  read_modem(&modem);
+  if(wake_ms){
+    set_preamble(wake_preamble(&modem, wake_ms, window));
+    read_modem(&modem);
+    fprintf(stderr, "Preamble set to %u symbols, %u ms on air per packet.\n",
+            modem.preamble, airtime_us(&modem, len) / 1000);
+  }
+  uint32_t air = airtime_us(&modem, len);
+
+  //charge is counted from here on
+  energy_init(currents, battery_mah);
+  power_init(sleep_ok);
+  hot_init();
+  int report = currents || battery_mah > 0;
+
+  //streaming replaces beaconing altogether
+  if(stream_in){
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    int r = stream_tx(stream_in, dio);
+    if(stream_in != stdin) fclose(stream_in);
+    write_reg(REG_OP_MODE, LORA_STANDBY);
+    bcm2835_spi_end();
+    binlog_close();
+    bcm2835_close();
+    return r;
+  }
+
+  //slotted beaconing replaces the free running schedule below
+  if(slot >= 0){
+    tdma_node(slot, report, dio, rx_latency);
+    bcm2835_spi_end();
+    binlog_close();
+    bcm2835_close();
+    return 0;
+  }
+
+  //channel access, slots are one airtime of our own beacon
+  struct csma_cfg csma;
+  struct csma_state cs;
+  struct csma_stats access = {0};
+  uint32_t seed = (uint32_t)now_us() ^ (uint32_t)getpid();
+  csma_defaults(&csma, air);
+  csma.budget_us = budget_ms * 1000;
+
+  //absolute schedule, and the longest it has taken to build and load a payload
+  uint64_t next = now_us();
+  uint32_t prep_us = 0;
+
+  //channel change the groundstation asked for, applied at switch_at
+  struct channel_cmd cmd;
+  uint16_t cmd_seq = 0;
+  uint32_t switch_hz = 0;
+  uint64_t switch_at = 0;
+
+  //profile switch state.  base is what the chip holds now and what we
+  //fall back to
+  struct reg_image base, shadow, target;
+  struct profile base_p;
+  read_image(&base);
+  shadow = base;
+  profile_of(&modem, base.sync, &base_p);
+  struct profile_cmd pcmd;
+  uint16_t pcmd_seq = 0;
+  uint64_t profile_at = 0;      //when target is applied, 0 if nothing is armed
+  uint32_t uncommitted = 0;     //beacons on a switched profile without a commit
 
   //begin beaconing cycle
-  while(1){
+  for(uint32_t beacons = 1; ; beacons++){
+
+    //a profile switch armed for before then is applied at profile_at,
+    //the instant the groundstation switches, not at the wake for the beacon
+    if(profile_at && profile_at < next - prep_us) power_idle_until(profile_at, 0);
+
+    //apply a profile switch that has come due, or fall back to base
+    if((profile_at && now_us() >= profile_at) || uncommitted >= PROFILE_REVERT_BEACONS){
+      if(uncommitted >= PROFILE_REVERT_BEACONS) target = base;
+      apply_image(&target, &shadow);
+      read_modem(&modem);
+      air = airtime_us(&modem, len);
+      csma.slot_us = air;
+      profile_at = 0;
+      uncommitted = 0;
+      fprintf(stderr, "Profile now SF%u %.1f kHz, %u ms on air per packet.\n", modem.sf,
+              modem.bw_hz / 1e3, air / 1000);
+    }
 
-    //set SPI access to fifo to the Tx base reg
-    write_reg(REG_FIFO_ADDR_PTR, FIFO_TX_BASE_ADDR);
+    //idle until it's time to get the next payload ready
+    power_idle_until(next - prep_us, 0);
+    uint64_t prep_start = now_us();
+
+    //retune before loading if a channel change has come due
+    if(switch_hz && now_us() >= switch_at){
+      set_frequency(switch_hz);
+      fprintf(stderr, "Moved to %.3f MHz.\n", switch_hz / 1e6);
+      switch_hz = 0;
+    }
 
-    //get data and define the payload
-    *strcpy(payload, get_time());
+    //get data and define the payload.  nothing from here until the
+    //radio is done with the beacon allocates or prints
+    hot_enter();
+    memcpy(payload, get_time(), sizeof(payload) - 1);
+    lat.enqueue_us = wall_us();
+    memcpy(packet, payload, sizeof(payload) - 1);
+    if(trailer) pack_lat_trailer(packet + len - LAT_TRAILER_LEN, &lat);
 
     //load payload into FIFO
-    for(int k = 0; k < (sizeof(payload) - 1); k++){
-      write_reg(REG_FIFO, payload[k]);
+    load_fifo_packet(packet, len);
+    lat.loaded_us = wall_us() - lat.enqueue_us;
+
+    //commence Tx on schedule
+    uint32_t took = now_us() - prep_start;
+    if(took > prep_us) prep_us = took;
+    sleep_until_us(next);
+
+    //listen before talk, backing off while someone else has the channel
+    int send = 1;
+    if(lbt){
+      csma_start(&cs, &csma);
+      while(channel_busy(rssi_thresh)){
+        access.busy++;
+        int64_t d = csma_backoff(&cs, &csma, &seed);
+        if(d < 0){
+          send = 0;
+          break;
+        }
+        sleep_until_us(now_us() + d);
+      }
+      csma_record(&access, &cs, send);
     }
 
-    //commence Tx
-    write_reg(REG_OP_MODE, LORA_TX);
-
-    //half second delay before confirm
-    clock_t timer1 = 0;
-    for(clock_t start = clock(); timer1/CLOCKS_PER_SEC <= 0.5; timer1 = clock() - start){}
+    int sent = 0;
+    if(send){
+      //stamp the Tx start into the trailer already in the FIFO
+      if(trailer){
+        uint64_t t = now_us();
+        lat.tx_us = wall_us() + patch_us - lat.enqueue_us;
+        pack_lat_trailer(packet + len - LAT_TRAILER_LEN, &lat);
+        write_reg(REG_FIFO_ADDR_PTR, FIFO_TX_BASE_ADDR + len - LAT_TRAILER_LEN + 8);
+        write_burst(REG_FIFO, packet + len - LAT_TRAILER_LEN + 8, 8);
+        patch_us = now_us() - t;
+      }
+      uint64_t tx_start = now_us();
+      write_reg(REG_OP_MODE, LORA_TX);
+
+      //sleep through the airtime, then wait a little longer for TxDone
+      sleep_until_us(tx_start + air);
+      uint8_t flags;
+      while(!((flags = read_reg(REG_IRQ_FLAGS)) & FLAG_TX_DONE) && now_us() < tx_start + air + TX_CONFIRM_US){
+        sleep_until_us(now_us() + 1000);
+      }
+
+      //confirm Tx
+      if(flags==FLAG_TX_DONE && read_reg(REG_OP_MODE)==LORA_STANDBY){
+        write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+        sent = 1;
+      }
+      if(PROBE_ENABLED(tx_done)) PROBE(tx_done, len, sent, now_us() - tx_start);
+
+      //the groundstation answers right after a beacon if it wants us to move
+      if(chan_cmds || profile_cmds){
+        uint64_t until = now_us() + CHAN_CMD_WINDOW_US;
+        int committed = 0;
+        uint64_t seen;
+        write_reg(REG_FIFO_ADDR_PTR, FIFO_RX_BASE_ADDR);
+        write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+        write_reg(REG_OP_MODE, LORA_RX_CONT);
+        while(wait_irq(FLAG_RX_DONE, until, symbol_us(&modem), &seen) & FLAG_RX_DONE){
+          uint8_t n = read_fifo_packet(packet);
+          uint8_t f = read_reg(REG_IRQ_FLAGS);
+          write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+          if(f & FLAG_PAYLOAD_CRC) continue;
+          if(profile_cmds && unpack_profile_cmd(packet, n, &pcmd) == 0){
+            committed = 1;
+            if(pcmd.phase != PROFILE_PROPOSE) break;
+            //ack first, the groundstation is waiting for it
+            pcmd.phase = PROFILE_ACK;
+            load_fifo_packet(packet, pack_profile_cmd(packet, &pcmd));
+            uint64_t tx_start = now_us();
+            write_reg(REG_OP_MODE, LORA_TX);
+            wait_irq(FLAG_TX_DONE, tx_start + airtime_us(&modem, PROFILE_CMD_LEN) + TX_CONFIRM_US,
+                     symbol_us(&modem), NULL);
+            write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+            write_reg(REG_PAYLOAD_LEN, len);
+            if(pcmd.seq != pcmd_seq){
+              pcmd_seq = pcmd.seq;
+              if(profile_same(&pcmd.p, &base_p)) target = base;
+              else profile_image(&pcmd.p, (base.block[1] & 0x03) << 8 | base.block[2], &target);
+              profile_at = seen + pcmd.switch_ms * 1000ULL;
+            }
+            break;
+          }
+          if(!chan_cmds || unpack_channel_cmd(packet, n, &cmd) < 0) continue;
+          if(cmd.seq != cmd_seq){
+            cmd_seq = cmd.seq;
+            switch_hz = cmd.freq_hz;
+            switch_at = seen + cmd.switch_ms * 1000ULL;
+          }
+          break;
+        }
+        write_reg(REG_OP_MODE, LORA_STANDBY);
+        if(memcmp(&shadow, &base, sizeof(base)) != 0) uncommitted = committed ? 0 : uncommitted + 1;
+      }
+    }
+    hot_leave();
 
-    //confirm Tx
-    if(read_reg(REG_IRQ_FLAGS)==FLAG_TX_DONE && read_reg(REG_OP_MODE)==LORA_STANDBY){
-      write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+    if(!send){
+      fprintf(stderr, "Channel busy for %u ms, beacon dropped.\n", budget_ms);
+    }
+    if(sent){
       printf("Transmitted payload: ");
       print_array(payload, sizeof(payload) - 1);
     }
 
-    //4.5 seconds for a total 5 second transmission delay
-    clock_t timer2 = 0;
-    for(clock_t start = clock(); timer2/CLOCKS_PER_SEC <= 4.5; timer2 = clock() - start){}
+    //one beacon cycle is one packet's worth of charge
+    energy_packet();
+    if(report && beacons % ENERGY_REPORT_EVERY == 0){
+      energy_report(stderr);
+      power_report(stderr);
+      if(lbt) csma_print(stderr, &access);
+      hot_report(stderr);
+    }
+    next += BEACON_PERIOD_US;
   }
   
   bcm2835_spi_end();
+  binlog_close();
   bcm2835_close();
   return 0;
   
@@ -286,158 +688,208 @@ int main(int argc, char **argv){
 
 //--------------------------------helper function implementations---------------------------------
 
-//wrapper function that reads from a register
-//argument is byte address of register to be read
-//return value is data held in register
-uint8_t read_reg(uint8_t addr){
-  char tbuf[] = {addr, 0x00};
-  char rbuf[] = {0x00, 0x00};
-  bcm2835_spi_transfernb(tbuf, rbuf, sizeof(tbuf));
-  //Potential debug message
-  //printf("Read value 0x%02X from register 0x%02X.\n", rbuf[1], addr);
-  return rbuf[1];
+//checks current system time, stores in array and returns
+//its address.  payload is one element longer than number of
+//information bytes to leave room for null terminator.
+char* get_time(void){
+  time_t rawtime;
+  time(&rawtime);
+  return time_string(rawtime);
 }
 
-//wrapper function that writes to a register
-//arguments are address to be written to and data to write
-//returns last data held in register before the write
-
-//recently updated second arg type from uint8_t to char.
-//this allows direct entry in the form 'h' rather than hex or binary
-//however, entering hex or binary for configuring hardware still works the same
-uint8_t write_reg(uint8_t addr, char data){
-  char tbuf[] = {addr | 0x80, data};   //flag addr MSB high to indicate write op
-  char rbuf[] = {0x00, 0x00};
-  bcm2835_spi_transfernb(tbuf, rbuf, sizeof(tbuf));
-  //potential debug message
-  /*
-  if(addr == 0x00){
-    printf("Wrote character %c to FIFO.\n", data);
-  }else{
-    printf("Wrote value 0x%02X to register 0x%02X.\n", data, addr);
-  }
-  */
-  return rbuf[1];
+//formats a given time the same way, e.g. one from the synchronized clock.
+//arithmetic only, localtime() and asctime() can allocate, see hotpath.h
+char* time_string(time_t rawtime){
+  static char payload[ASCTIME_LEN];  //must be static to return local variable addr
+  return hot_asctime(rawtime, payload);
 }
 
-//diagnostic function that reads every #defined register except FIFO
-//(because that would inadvertently increment the address pointer)
-//prints outputs because it's just calling the read_reg() function
-void diagnose(void){
-  read_reg(REG_OP_MODE);
-  read_reg(REG_RF_FREQ_MSB_MSB);
-  read_reg(REG_RF_FREQ_MSB);
-  read_reg(REG_RF_FREQ_LSB);
-  read_reg(REG_PA_CONFIG);
-  read_reg(REG_PA_RAMP);
-  read_reg(REG_OCP);
-  read_reg(REG_LNA);
-  read_reg(REG_FIFO_ADDR_PTR);
-  read_reg(REG_FIFO_TX_BASE_ADDR);
-  read_reg(REG_FIFO_RX_BASE_ADDR);
-  read_reg(REG_FIFO_RX_CURRENT_ADDR);
-  read_reg(REG_IRQ_FLAGS_MASK);  
-  read_reg(REG_IRQ_FLAGS);
-  read_reg(REG_RX_NUM_BYTES);
-  read_reg(REG_RX_PACKET_COUNT_MSB);
-  read_reg(REG_RX_PACKET_COUNT_LSB);
-  read_reg(REG_MODEM_STAT);
-  read_reg(REG_PACKET_SNR);
-  read_reg(REG_PACKET_RSSI);
-  read_reg(REG_CURRENT_RSSI);
-  read_reg(REG_HOP_CHANNEL);
-  read_reg(REG_MODEM_CONFIG1);
-  read_reg(REG_MODEM_CONFIG2);
-  read_reg(REG_PREAMBLE_LEN_MSB);
-  read_reg(REG_PREAMBLE_LEN_LSB);
-  read_reg(REG_PAYLOAD_LEN);
-  read_reg(REG_MAX_PAYLOAD_LEN);
-  read_reg(REG_HOP_PERIOD);
-  read_reg(REG_MODEM_CONFIG3);
-  read_reg(REG_DETECT_OPTIMIZE);
-  read_reg(REG_DETECT_THRESH);
-  read_reg(REG_SYNC_WORD);
-}
+//TDMA node.  follows the coordinator's beacons, disciplines its clock to
+//their timestamps and sends one beacon payload per superframe in its
+//assigned slot.  dio is the DIO0 gpio or -1 to poll over SPI
+void tdma_node(uint8_t slot, int report, int dio, uint32_t rx_latency){
+  struct modem_cfg modem;
+  read_modem(&modem);
+  uint8_t len = 24;
+  uint32_t beacon_air = airtime_us(&modem, TDMA_BEACON_LEN);
+  uint32_t data_air = airtime_us(&modem, len);
+  uint32_t poll_us = symbol_us(&modem);
+
+  struct tdma_sync sync = {0};
+  struct tdma_plan plan = {0};
+  struct tdma_beacon b;
+  uint8_t buf[255];
+  struct timesync ts;
+  timesync_init(&ts);
+  if(dio >= 0) dio0_init(dio);
+
+  for(uint32_t frames = 1; ; frames++){
+
+    //listen from a guard before the beacon is due to a guard after it
+    //should have finished, or for a long search when not synced
+    uint64_t listen_end;
+    uint64_t expect = 0;
+    if(sync.synced){
+      expect = sync.start + tdma_local(&sync, sync.superframe_us);
+      uint32_t guard = plan.guard_us + poll_us;
+      power_idle_until(expect - guard, 0);
+      listen_end = expect + beacon_air + guard;
+    }else{
+      listen_end = now_us() + TDMA_SEARCH_US;
+    }
+    write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+    write_reg(REG_FIFO_ADDR_PTR, FIFO_RX_BASE_ADDR);
+    write_reg(REG_OP_MODE, LORA_RX_CONT);
+
+    int got = 0;
+    while(!got){
+      //spin on the pin when the beacon is due, nap between reads when searching
+      uint64_t seen;
+      uint8_t flags = wait_event(FLAG_RX_DONE, listen_end, poll_us, sync.synced ? 0 : 100, &seen);
+      if(!(flags & FLAG_RX_DONE)) break;
+      uint8_t n = read_fifo_packet(buf);
+      write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+      if(flags & FLAG_PAYLOAD_CRC || unpack_tdma_beacon(buf, n, &b) < 0) continue;
 
-//establishes spi and configures appropriate bit transfer parameters
-void hardware_init(void){
-  //test the library initialization functions
-  if(!bcm2835_init()){
-    printf("bcm2835_init failed.  Must run as root.\n");
-    exit(EXIT_SUCCESS);
-  }  
-  if(!bcm2835_spi_begin()){
-    printf("bcm2835_spi_begin failed.  Must run as root.\n");
-    exit(EXIT_SUCCESS);
-  }
+      //the beacon started one airtime before RxDone
+      tdma_sync_update(&sync, seen - beacon_air, b.seq, b.superframe_us);
+      tdma_plan_from(&plan, &b, beacon_air);
+      timesync_update(&ts, seen, timesync_sample(seen, b.tx_us, beacon_air, rx_latency));
+      got = 1;
+    }
+    write_reg(REG_OP_MODE, LORA_STANDBY);
+
+    if(!got){
+      if(!sync.synced){
+        fprintf(stderr, "No coordinator beacon heard, searching again.\n");
+        continue;
+      }
+      //carry on from where the beacon should have been
+      sync.start = expect;
+      sync.seq++;
+      if(++sync.missed > TDMA_MAX_MISSED){
+        sync.synced = 0;
+        fprintf(stderr, "Lost the coordinator after %u missed beacons.\n", sync.missed);
+        continue;
+      }
+    }
+    if(slot >= plan.slots){
+      fprintf(stderr, "Slot %u not in a %u slot schedule.\n", slot, plan.slots);
+      continue;
+    }
 
-  //The following five functions define the SPI communication operating
-  //parameters.  Some are default values but redundancy never hurt anyone.  
-
-  //Sets bit order. The SX1278 is expecting to receive MSB first and will
-  //also be transmitting back MSB first.  This is a default.  
-  bcm2835_spi_setBitOrder(BCM2835_SPI_BIT_ORDER_MSBFIRST);
-
-  //Sets the clock polarity and phase. The LoRa module asks for CPOL = 0
-  //and CPHA = 0.  This also happens to be the default.  
-  bcm2835_spi_setDataMode(BCM2835_SPI_MODE0);
-
-  //Sets the clock divider and therefore the clock speed.  The default is
-  //65536 which results in a clock speed of 3.8 kHz. I'm using 2048 which
-  //corresponds to 122 kHz.  Troubleshooting SPI connection.  
-  bcm2835_spi_setClockDivider(BCM2835_SPI_CLOCK_DIVIDER_65536);
-
-  //Specifies which chip select pins will be asserted when an SPI transfer
-  //is made.  The RPI2 has two but we'll just be using RPI pin #24 also
-  //known as "SPI_CE0_N". This is a default setting defined below.
-  bcm2835_spi_chipSelect(BCM2835_SPI_CS0);
-
-  //Configured the polarity under which the chip select is considered active.
-  //The SX1278 looks for a chip select active low.  This is a default setting
-  //given below.
-  bcm2835_spi_setChipSelectPolarity(BCM2835_SPI_CS0, LOW);
-
-  //set a GPIO pin high to stabilize reset pin on sx1278
-  //configure RPI pin 16 tp gpio output functionality
-  //then set that pin high
-  bcm2835_gpio_fsel(RPI_V2_GPIO_P1_16, BCM2835_GPIO_FSEL_OUTP);
-  bcm2835_gpio_set(RPI_V2_GPIO_P1_16); 
-}
+    //load the payload, then key up exactly at the start of our slot
+    time_t t = timesync_coord(&ts, now_us()) / 1000000;
+    strcpy((char*)buf, time_string(t));
+    load_fifo_packet(buf, len);
+    uint64_t tx_at = sync.start + tdma_local(&sync, tdma_tx_offset(&plan, slot));
+    if(now_us() > tx_at){
+      fprintf(stderr, "Missed slot %u in superframe %u.\n", slot, sync.seq);
+      continue;
+    }
+    sleep_until_us(tx_at);
+    write_reg(REG_OP_MODE, LORA_TX);
+    uint8_t flags = wait_irq(FLAG_TX_DONE, tx_at + data_air + TX_CONFIRM_US, poll_us, NULL);
+    write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+    if(flags & FLAG_TX_DONE){
+      printf("Transmitted payload: ");
+      print_array((char*)buf, len);
+      fflush(stdout);
+    }
 
-//checks device boot mode and enters LoRa standby regardless
-//device is now ready to use
-//I need to update this function to enable a "retry" functionality
-//if it doesn't work, try again. Don't just cancel
-void lora_init(void){ 
-  uint8_t bootmode = read_reg(REG_OP_MODE);
-  if((bootmode & 0x80) == 0X00 ){
-    write_reg(REG_OP_MODE, FSK_SLEEP);
+    energy_packet();
+    if(frames % ENERGY_REPORT_EVERY == 0){
+      if(report){
+        energy_report(stderr);
+        power_report(stderr);
+      }
+      fprintf(stderr, "TDMA: slot %u, guard %u us, drift %.1f ppm, %u missed\n",
+              slot, plan.guard_us, sync.drift_ppm, sync.missed);
+      timesync_report(stderr, &ts);
+    }
   }
-  write_reg(REG_OP_MODE, LORA_SLEEP);
-  write_reg(REG_OP_MODE, LORA_STANDBY);
-  
-  if(read_reg(REG_OP_MODE) != LORA_STANDBY){
-    printf("There was a problem entering LORA_STANDBY.\n");
-    exit(EXIT_SUCCESS);
-  }else{
-    //potential debug
-    //printf("Device has entered LORA_STANDBY.\n");
+}
+
+//sends everything in from the input as back to back stream chunks.
+//returns 0 once the end chunk is out, 1 if stopped or Tx failed
+int stream_tx(FILE *in, int dio){
+  //payload crc on, so the receiver can drop damaged chunks
+  write_reg(REG_MODEM_CONFIG2, read_reg(REG_MODEM_CONFIG2) | 0x04);
+  struct modem_cfg modem;
+  read_modem(&modem);
+  if(dio >= 0) dio0_init(dio);
+  write_reg(REG_FIFO_TX_BASE_ADDR, FIFO_TX_BASE_ADDR);
+
+  //two chunks, one on the air while the next is read
+  uint8_t pkt[2][255];
+  int cur = 0;
+  struct stream_hdr h = {0, 0};
+  uint32_t chunks = 0, gap_max = 0;
+  uint64_t bytes = 0, air_total = 0, gap_total = 0;
+  uint64_t first = 0, done = 0, last = 0;
+  size_t n = fread(pkt[cur] + STREAM_HEADER_LEN, 1, STREAM_DATA_LEN, in);
+  fprintf(stderr, "Streaming, %u data bytes per packet, %u ms on air each.\n", STREAM_DATA_LEN,
+          airtime_us(&modem, 255) / 1000);
+
+  while(running){
+    h.flags = n == 0 ? STREAM_END : 0;
+    uint8_t len = pack_stream_header(pkt[cur], &h) + n;
+    load_fifo_packet(pkt[cur], len);
+    write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+    uint64_t tx_start = now_us();
+    write_reg(REG_OP_MODE, LORA_TX);
+    if(chunks == 0){
+      first = tx_start;
+    }else if(n > 0){
+      uint32_t gap = tx_start - done;
+      gap_total += gap;
+      if(gap > gap_max) gap_max = gap;
+    }
+
+    //read ahead while this one is on the air, then catch TxDone as
+    //soon as it comes
+    uint32_t air = airtime_us(&modem, len);
+    size_t next = n == 0 ? 0 : fread(pkt[!cur] + STREAM_HEADER_LEN, 1, STREAM_DATA_LEN, in);
+    if(dio < 0) sleep_until_us(tx_start + air);
+    uint8_t flags = wait_event(FLAG_TX_DONE, tx_start + air + TX_CONFIRM_US, STREAM_POLL_US, 0, &done);
+    if(!(flags & FLAG_TX_DONE)){
+      fprintf(stderr, "No TxDone for chunk %u, stopping.\n", h.seq);
+      break;
+    }
+    //the end chunk isn't data, the totals stop before it
+    if(n == 0){
+      stream_report(chunks, bytes, air_total, last - first, gap_total, gap_max);
+      return 0;
+    }
+    chunks++;
+    bytes += n;
+    air_total += air;
+    last = done;
+    if(chunks % STREAM_REPORT_EVERY == 0) stream_report(chunks, bytes, air_total, last - first, gap_total, gap_max);
+    h.seq++;
+    n = next;
+    cur = !cur;
   }
+  stream_report(chunks, bytes, air_total, last - first, gap_total, gap_max);
+  return 1;
 }
 
-//checks current system time, stores in array and returns
-//its address.  payload is one element longer than number of
-//information bytes to leave room for null terminator.
-//sprintf effectively copies a string into array by
-//printing "to string"
-char* get_time(void){
-  time_t rawtime;
-  struct tm * timeinfo;
-  time(&rawtime);
-  timeinfo = localtime(&rawtime);
-  static char payload[25];  //must be static to return local variable addr
-  sprintf(payload, "%s", asctime(timeinfo));  
-  return payload;
+//prints stream progress: goodput against the time on air limit and the
+//gaps between packets
+void stream_report(uint32_t chunks, uint64_t bytes, uint64_t air_total, uint64_t elapsed,
+                   uint64_t gap_total, uint32_t gap_max){
+  if(bytes == 0 || elapsed == 0) return;
+  double goodput = bytes * 1e6 / elapsed;
+  double limit = bytes * 1e6 / air_total;
+  fprintf(stderr, "Stream: %u chunks, %llu bytes in %.1f s, goodput %.0f B/s, time on air limit %.0f B/s "
+          "(%.1f%%), gap mean %.2f ms max %.2f ms\n", chunks, (unsigned long long)bytes, elapsed / 1e6,
+          goodput, limit, 100 * goodput / limit, chunks > 1 ? gap_total / 1e3 / (chunks - 1) : 0,
+          gap_max / 1e3);
+}
+
+//signal handler that lets a stream report before exiting
+void stop(int sig){
+  running = 0;
 }
 
 //prints an array 
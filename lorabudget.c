@@ -0,0 +1,287 @@
+/* UCSD CubeSat
+   lorabudget.c
+
+   Link budget check for range tests.  Given where the groundstation is,
+   the antennas, the transmit power (as the RegPaConfig value) and the
+   modem settings, it predicts the rssi, snr and margin of every packet in
+   the coverage logs loraRX -G writes (linkbudget.h), and lines them up
+   against what was measured.  It needs no hardware:
+
+   $ cc lorabudget.c -o lorabudget -lm
+
+   Output is a summary on stdout:
+
+   - the mean and spread of measured minus predicted rssi and snr.  a
+     steady offset of several dB is power, gain or cable loss that isn't
+     what we think it is: a bad connector, the wrong PA pin, an antenna
+     detuned by its mount
+   - a least squares fit of measured rssi against log distance.  the
+     slope gives the path loss exponent the link actually saw, 2 for a
+     clear line of sight and more with ground clutter, and the intercept
+     at 1 km says how much of the offset is not distance related
+   - a table of distance bins, 10 per decade, with the prediction, the
+     measured mean and the receive ratio counting the missed beacons.  a
+     bin that falls away from the rest is terrain or an obstruction, and
+     misses where the prediction leaves plenty of margin are flagged
+
+   -c writes every packet with its distance and prediction as csv for
+   plotting measured and predicted against each other.
+
+   Notes on the measurement:
+   Below 0 dB snr the packet rssi register reads the noise more than the
+   signal, so following the datasheet the snr is added to it for those
+   packets.  Positions in the log are the balloon or car, altitudes above
+   sea level.  For the radio horizon the remote height above ground is
+   taken as its altitude minus the ground under the groundstation, which
+   is right on flat ground and pessimistic going uphill.
+
+   Notes on speed:
+   Logs are read once, line by line, and nothing per packet is kept except
+   in the csv, so a whole season of logs runs at disk speed.  The fit and
+   the bins are running sums.
+
+   Options:
+   -g <lat,lon,alt>  groundstation position, altitude in m above sea level
+   -H <m>            groundstation antenna height above the ground (10)
+   -P <hex>          RegPaConfig of the transmitter (0x4F, the reset value)
+   -t <dBi>          transmit antenna gain (2.15)
+   -r <dBi>          receive antenna gain (2.15)
+   -L <dB>           cable and connector loss, both ends together (0)
+   -f <kHz>          carrier (434000)
+   -s <sf>           spreading factor (7)
+   -w <kHz>          bandwidth (125)
+   -n <exp>          path loss exponent for the prediction (2)
+   -N <dB>           receiver noise figure (6)
+   -c <file>         per packet csv
+
+   ---------------------------------------------------------------------------------------------*/
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "linkbudget.h"
+
+#define BINS_PER_DECADE 10
+#define BIN_MIN_M       10      //first bin starts here
+#define BINS            60      //up to 10^7 m
+#define MISS_MARGIN_DB  10      //misses with this much predicted margin are suspicious
+
+//running sums for a set of packets
+struct sums{
+  uint32_t n;
+  double resid_rssi, resid_rssi2;
+  double resid_snr, resid_snr2;
+  double rssi, snr;
+};
+
+struct bin{
+  struct sums s;
+  uint32_t missed;
+  uint32_t missed_margin;   //missed with MISS_MARGIN_DB predicted
+};
+
+//the groundstation and everything measured against it
+struct station{
+  double lat, lon, alt;
+  double height;
+  struct link link;
+};
+
+//-----------------------------------helper function prototypes----------------------------------
+
+int parse_event(char *s, char *kind, double *lat, double *lon, double *alt, double *rssi, double *snr);
+
+int distance_bin(double d_m);
+
+void sums_add(struct sums *s, double rssi, double snr, const struct budget *b);
+
+void print_summary(const struct station *st, const struct sums *all, const double *fit,
+                   const struct bin *bins, uint32_t beyond);
+
+//-----------------------------------------function main-----------------------------------------
+
+int main(int argc, char **argv){
+  struct station st = {0, 0, 0, 10, {0, 2.15, 2.15, 0, 434e6, 2, SX1278_NF_DB, 125000, 7}};
+  int have_station = 0;
+  uint8_t pa = 0x4F;
+  char *csv = NULL;
+  int opt;
+  while((opt = getopt(argc, argv, "g:H:P:t:r:L:f:s:w:n:N:c:")) != -1){
+    switch(opt){
+      case 'g': have_station = sscanf(optarg, "%lf,%lf,%lf", &st.lat, &st.lon, &st.alt) == 3; break;
+      case 'H': st.height = atof(optarg); break;
+      case 'P': pa = strtoul(optarg, NULL, 16); break;
+      case 't': st.link.tx_gain_dbi = atof(optarg); break;
+      case 'r': st.link.rx_gain_dbi = atof(optarg); break;
+      case 'L': st.link.loss_db = atof(optarg); break;
+      case 'f': st.link.freq_hz = atof(optarg) * 1000; break;
+      case 's': st.link.sf = atoi(optarg); break;
+      case 'w': st.link.bw_hz = atof(optarg) * 1000; break;
+      case 'n': st.link.exponent = atof(optarg); break;
+      case 'N': st.link.nf_db = atof(optarg); break;
+      case 'c': csv = optarg; break;
+      default:
+        have_station = -1;
+    }
+  }
+  if(have_station != 1 || optind >= argc || st.link.bw_hz == 0 || st.link.sf < 6 || st.link.sf > 12){
+    printf("usage: %s -g lat,lon,alt [-H m] [-P pa_config] [-t dBi] [-r dBi] [-L dB] [-f kHz]\n"
+           "       [-s sf] [-w kHz] [-n exponent] [-N dB] [-c csv] log...\n", argv[0]);
+    return 1;
+  }
+  st.link.tx_dbm = pa_power_dbm(pa);
+
+  FILE *out = NULL;
+  if(csv){
+    if((out = fopen(csv, "w")) == NULL){
+      printf("Can't write %s.\n", csv);
+      return 1;
+    }
+    fprintf(out, "distance_m,kind,rssi_dbm,snr_db,pred_rssi_dbm,pred_snr_db,pred_margin_db\n");
+  }
+
+  static struct bin bins[BINS];
+  struct sums all = {0};
+  double fit[5] = {0};   //n, sum x, sum y, sum xx, sum xy over x = 10log10(km)
+  uint32_t beyond = 0;
+  double ground = st.alt - st.height;
+  char line[256];
+  for(int fi = optind; fi < argc; fi++){
+    FILE *f = fopen(argv[fi], "r");
+    if(f == NULL){
+      printf("Can't open %s.\n", argv[fi]);
+      return 1;
+    }
+    while(fgets(line, sizeof(line), f)){
+      char kind;
+      double lat, lon, alt, rssi = 0, snr = 0;
+      if(parse_event(line, &kind, &lat, &lon, &alt, &rssi, &snr) < 0 || kind == 'C') continue;
+      double d = slant_m(st.lat, st.lon, st.alt, lat, lon, alt);
+      struct budget b;
+      link_budget(&st.link, d, &b);
+      struct bin *bin = &bins[distance_bin(d)];
+      if(d > horizon_m(st.height, alt - ground)) beyond++;
+      if(kind == 'M'){
+        bin->missed++;
+        if(b.margin_db >= MISS_MARGIN_DB) bin->missed_margin++;
+      }else{
+        if(snr < 0) rssi += snr;
+        sums_add(&all, rssi, snr, &b);
+        sums_add(&bin->s, rssi, snr, &b);
+        double x = 10 * log10(d > 1 ? d / 1000 : 0.001);
+        fit[0]++;
+        fit[1] += x;
+        fit[2] += rssi;
+        fit[3] += x * x;
+        fit[4] += x * rssi;
+      }
+      if(out){
+        fprintf(out, "%.1f,%c,", d, kind);
+        if(kind == 'R') fprintf(out, "%.1f,%.2f", rssi, snr);
+        else fprintf(out, ",");
+        fprintf(out, ",%.1f,%.2f,%.2f\n", b.rssi_dbm, b.snr_db, b.margin_db);
+      }
+    }
+    fclose(f);
+  }
+  if(out) fclose(out);
+  print_summary(&st, &all, fit, bins, beyond);
+  return 0;
+}
+
+//--------------------------------helper function implementations---------------------------------
+
+//one coverage log line, 0 on success or -1.  see loraRX's notes on
+//coverage mapping for the format
+int parse_event(char *s, char *kind, double *lat, double *lon, double *alt, double *rssi, double *snr){
+  char *end, *p;
+  *kind = s[0];
+  if((*kind != 'R' && *kind != 'C' && *kind != 'M') || s[1] != ' ') return -1;
+  p = s + 2;
+  strtod(p, &end);          //time
+  if(end == p) return -1;
+  *lat = strtod(p = end, &end);
+  if(end == p) return -1;
+  *lon = strtod(p = end, &end);
+  if(end == p) return -1;
+  *alt = strtod(p = end, &end);
+  if(end == p) return -1;
+  if(*kind == 'M') return 0;
+  *rssi = strtod(p = end, &end);
+  if(end == p) return -1;
+  *snr = strtod(p = end, &end);
+  return end == p ? -1 : 0;
+}
+
+//log spaced distance bin
+int distance_bin(double d_m){
+  if(d_m < BIN_MIN_M) return 0;
+  int i = (int)(BINS_PER_DECADE * log10(d_m / BIN_MIN_M));
+  return i < BINS ? i : BINS - 1;
+}
+
+void sums_add(struct sums *s, double rssi, double snr, const struct budget *b){
+  double dr = rssi - b->rssi_dbm, ds = snr - b->snr_db;
+  s->n++;
+  s->resid_rssi += dr;
+  s->resid_rssi2 += dr * dr;
+  s->resid_snr += ds;
+  s->resid_snr2 += ds * ds;
+  s->rssi += rssi;
+  s->snr += snr;
+}
+
+static double spread(double sum, double sum2, uint32_t n){
+  double v = n > 1 ? (sum2 - sum * sum / n) / (n - 1) : 0;
+  return v > 0 ? sqrt(v) : 0;
+}
+
+void print_summary(const struct station *st, const struct sums *all, const double *fit,
+                   const struct bin *bins, uint32_t beyond){
+  const struct link *l = &st->link;
+  struct budget b;
+  link_budget(l, 1000, &b);
+  printf("Link: %.1f dBm + %.2f dBi + %.2f dBi - %.1f dB, %.3f MHz, SF%u %.1f kHz\n", l->tx_dbm,
+         l->tx_gain_dbi, l->rx_gain_dbi, l->loss_db, l->freq_hz / 1e6, l->sf, l->bw_hz / 1e3);
+  printf("      noise floor %.1f dBm, demodulates to %.1f dB snr, at 1 km %.1f dBm with %.1f dB margin\n",
+         b.noise_dbm, snr_limit_db(l->sf), b.rssi_dbm, b.margin_db);
+  if(all->n == 0){
+    printf("No received packets in the logs.\n");
+    return;
+  }
+  double mr = all->resid_rssi / all->n, ms = all->resid_snr / all->n;
+  printf("%u packets.  measured - predicted: rssi %+.1f dB (sd %.1f), snr %+.1f dB (sd %.1f)\n", all->n,
+         mr, spread(all->resid_rssi, all->resid_rssi2, all->n), ms, spread(all->resid_snr, all->resid_snr2, all->n));
+
+  double den = fit[0] * fit[3] - fit[1] * fit[1];
+  if(fit[0] > 2 && den > 1e-9){
+    double slope = (fit[0] * fit[4] - fit[1] * fit[2]) / den;
+    double at_km = (fit[2] - slope * fit[1]) / fit[0];
+    printf("Fit: rssi = %.1f dBm at 1 km, path loss exponent %.2f (prediction %.1f dBm, exponent %.2f)\n",
+           at_km, -slope, b.rssi_dbm, l->exponent);
+  }else{
+    printf("Fit: not enough spread in distance\n");
+  }
+  if(mr < -6) printf("Warning: packets arrive %.0f dB weaker than predicted.  check power, antennas and cables\n", -mr);
+  if(beyond) printf("Warning: %u events were past the radio horizon\n", beyond);
+
+  printf("%10s %10s %8s %10s %10s %10s %10s %8s\n", "from km", "to km", "packets", "pred dBm", "rssi dBm",
+         "pred snr", "snr dB", "rx %");
+  for(int i = 0; i < BINS; i++){
+    const struct bin *bn = &bins[i];
+    uint32_t due = bn->s.n + bn->missed;
+    if(due == 0) continue;
+    double from = BIN_MIN_M * pow(10, (double)i / BINS_PER_DECADE);
+    double to = BIN_MIN_M * pow(10, (double)(i + 1) / BINS_PER_DECADE);
+    link_budget(l, sqrt(from * to), &b);
+    printf("%10.3f %10.3f %8u %10.1f ", from / 1000, to / 1000, bn->s.n, b.rssi_dbm);
+    if(bn->s.n) printf("%10.1f %10.1f %10.1f", bn->s.rssi / bn->s.n, b.snr_db, bn->s.snr / bn->s.n);
+    else printf("%10s %10.1f %10s", "-", b.snr_db, "-");
+    printf(" %8.1f", 100.0 * bn->s.n / due);
+    if(bn->missed_margin) printf("  %u missed with %d dB margin", bn->missed_margin, MISS_MARGIN_DB);
+    printf("\n");
+  }
+}
@@ -0,0 +1,110 @@
+/* UCSD CubeSat
+   loracat.c
+
+   Command line client of the radio broker, lorad.c.  It talks to the
+   broker's socket only, so it needs neither the bcm2835 library nor
+   root, and any number of them can run next to each other:
+
+   $ cc loracat.c -o loracat
+
+   Modes:
+   (default)  prints every packet the broker hears, one line each: the
+              broker's RxDone time in seconds, rssi, snr and the payload
+              with anything unprintable as a dot
+   -s         sends each line of stdin as a packet, waiting for the
+              broker's LC_TX_DONE before the next, and prints how each
+              went.  lines longer than 255 bytes are cut
+   -i         prints the broker's counters and overhead and exits
+
+   Options:
+   -p <path>  broker socket (LC_SOCKET, /tmp/lorad.sock)
+
+   ---------------------------------------------------------------------------------------------*/
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "loraclient.h"
+
+#define CAT_TX_WAIT_MS 30000   //longest a packet can sit in the broker's queue and on the air
+
+//-----------------------------------helper function prototypes----------------------------------
+
+int listen_rx(int fd);
+
+int send_lines(int fd);
+
+//-----------------------------------------function main-----------------------------------------
+
+int main(int argc, char **argv){
+  const char *path = LC_SOCKET;
+  int sending = 0, info = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "sip:")) != -1){
+    switch(opt){
+      case 's': sending = 1; break;
+      case 'i': info = 1; break;
+      case 'p': path = optarg; break;
+      default:
+        printf("usage: %s [-s | -i] [-p socket]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  int fd = lc_connect(path);
+  if(fd < 0){
+    printf("Can't connect to %s, is lorad running?\n", path);
+    return 1;
+  }
+  if(info){
+    struct lc_msg m;
+    if(lc_stats(fd) < 0 || lc_recv(fd, &m, 1000) != LC_STATS) return 1;
+    printf("%.*s\n", m.len, (char *)m.data);
+    return 0;
+  }
+  int r = sending ? send_lines(fd) : listen_rx(fd);
+  close(fd);
+  return r;
+}
+
+//--------------------------------helper function implementations---------------------------------
+
+//prints received packets until the broker goes away
+int listen_rx(int fd){
+  if(lc_subscribe(fd) < 0) return 1;
+  struct lc_msg m;
+  int type;
+  while((type = lc_recv(fd, &m, -1)) >= 0){
+    if(type != LC_RX) continue;
+    printf("%10.3f %4d dBm %5.1f dB%s ", m.t_us / 1e6, m.rssi, m.snr / 4.0, m.status == LC_ERR_CRC ? " crc" : "");
+    for(int i = 0; i < m.len; i++) putchar(isprint(m.data[i]) ? m.data[i] : '.');
+    putchar('\n');
+    fflush(stdout);
+  }
+  return 0;
+}
+
+//sends stdin a line per packet.  returns 1 if any packet failed
+int send_lines(int fd){
+  char line[512];
+  uint32_t seq = 0;
+  int failed = 0;
+  while(fgets(line, sizeof(line), stdin)){
+    size_t len = strcspn(line, "\n");
+    if(len > 255) len = 255;
+    if(lc_send(fd, (uint8_t *)line, len, ++seq) < 0) return 1;
+    struct lc_msg m;
+    int type;
+    while((type = lc_recv(fd, &m, CAT_TX_WAIT_MS)) > 0 && !(type == LC_TX_DONE && m.seq == seq)){}
+    if(type <= 0){
+      fprintf(stderr, "Packet %u: no answer from the broker.\n", seq);
+      return 1;
+    }
+    if(m.status != LC_OK) failed = 1;
+    fprintf(stderr, "Packet %u, %zu bytes: %s.\n", seq, len, m.status == LC_OK ? "sent" :
+            m.status == LC_ERR_FULL ? "queue full" : m.status == LC_ERR_TIMEOUT ? "no TxDone" : "refused");
+  }
+  return failed;
+}
@@ -0,0 +1,147 @@
+/* UCSD CubeSat
+   loraclient.h
+
+   Client side of the radio broker, lorad.c.  The radio programs each
+   start the SPI bus and take the chip over, so two of them running at
+   once interleave their register writes and both misbehave.  lorad owns
+   the bus and the chip instead, and any number of programs talk to it
+   over a Unix socket with these functions: they submit packets to send
+   and subscribe to the ones received.  Nothing in here touches the
+   hardware, so a client needs no bcm2835 library and no root:
+
+   int fd = lc_connect(LC_SOCKET);
+   lc_subscribe(fd);
+   lc_send(fd, buf, len, seq);
+   struct lc_msg m;
+   while(lc_recv(fd, &m, 1000) > 0){ ... m.type is LC_RX or LC_TX_DONE ... }
+
+   Notes on the protocol:
+   The socket is SOCK_SEQPACKET, so every send() is one message and
+   arrives whole or not at all, and no framing is needed.  A message is a
+   struct lc_msg cut short after len bytes of data.  Both ends are on the
+   same machine, so the struct goes over as it is in memory.
+
+   LC_TX         client to broker, a packet to send.  seq is the client's
+                 own and comes back in the LC_TX_DONE
+   LC_TX_DONE    broker to client, status LC_OK or LC_ERR_*, t_us the
+                 Tx start on the broker's now_us() clock
+   LC_SUBSCRIBE  client to broker, start receiving LC_RX
+   LC_RX         broker to subscribers, one per packet heard.  t_us is
+                 RxDone, rssi and snr the packet's.  a packet that failed
+                 its crc comes with status LC_ERR_CRC
+   LC_STATS      client to broker, answered with the same type and the
+                 broker's counters as text in data
+
+   A subscriber that doesn't read its socket loses LC_RX messages once
+   the socket buffer is full rather than holding the broker up; the drops
+   are counted in LC_STATS.
+
+   ---------------------------------------------------------------------------------------------*/
+
+#ifndef LORACLIENT_H
+#define LORACLIENT_H
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define LC_SOCKET "/tmp/lorad.sock"
+
+//message types
+#define LC_TX        1
+#define LC_TX_DONE   2
+#define LC_SUBSCRIBE 3
+#define LC_RX        4
+#define LC_STATS     5
+
+//status
+#define LC_OK          0
+#define LC_ERR_TIMEOUT 1   //no TxDone
+#define LC_ERR_FULL    2   //the broker's Tx queue is full, try again
+#define LC_ERR_CRC     3
+#define LC_ERR_BAD     4   //a message the broker didn't understand
+
+struct lc_msg{
+  uint8_t  type;
+  uint8_t  status;
+  uint8_t  len;
+  int8_t   snr;           //quarter dB
+  int16_t  rssi;          //dBm
+  uint16_t pad;
+  uint32_t seq;
+  uint64_t t_us;
+  uint8_t  data[255];
+};
+
+#define LC_HEADER_LEN offsetof(struct lc_msg, data)
+
+//-----------------------------------helper function implementations----------------------------
+
+//connects to the broker, returns the socket or -1
+static int lc_connect(const char *path){
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if(fd < 0) return -1;
+  struct sockaddr_un a;
+  memset(&a, 0, sizeof(a));
+  a.sun_family = AF_UNIX;
+  strncpy(a.sun_path, path, sizeof(a.sun_path) - 1);
+  if(connect(fd, (struct sockaddr *)&a, sizeof(a)) < 0){
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+//sends one message, len bytes of its data.  0 on success
+static int lc_put(int fd, struct lc_msg *m){
+  ssize_t n = LC_HEADER_LEN + m->len;
+  return send(fd, m, n, MSG_NOSIGNAL) == n ? 0 : -1;
+}
+
+//asks for every received packet from now on
+static int lc_subscribe(int fd){
+  struct lc_msg m;
+  memset(&m, 0, LC_HEADER_LEN);
+  m.type = LC_SUBSCRIBE;
+  return lc_put(fd, &m);
+}
+
+//queues a packet for sending.  the LC_TX_DONE with the same seq says how
+//it went
+static int lc_send(int fd, const uint8_t *buf, uint8_t len, uint32_t seq){
+  struct lc_msg m;
+  memset(&m, 0, LC_HEADER_LEN);
+  m.type = LC_TX;
+  m.len = len;
+  m.seq = seq;
+  memcpy(m.data, buf, len);
+  return lc_put(fd, &m);
+}
+
+//asks for the broker's counters, which come back as an LC_STATS message
+static int lc_stats(int fd){
+  struct lc_msg m;
+  memset(&m, 0, LC_HEADER_LEN);
+  m.type = LC_STATS;
+  return lc_put(fd, &m);
+}
+
+//waits up to timeout_ms (-1 forever) for a message.  returns its type,
+//0 on timeout and -1 when the broker has gone away
+static int lc_recv(int fd, struct lc_msg *m, int timeout_ms){
+  struct pollfd p = {fd, POLLIN, 0};
+  int r = poll(&p, 1, timeout_ms);
+  if(r == 0) return 0;
+  if(r < 0) return -1;
+  ssize_t n = recv(fd, m, sizeof(*m), 0);
+  if(n < (ssize_t)LC_HEADER_LEN || n != (ssize_t)(LC_HEADER_LEN + m->len)) return -1;
+  return m->type;
+}
+
+#endif
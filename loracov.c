@@ -0,0 +1,474 @@
+/* UCSD CubeSat
+   loracov.c
+
+   Coverage map builder for the logs loraRX -G writes.  It needs no
+   hardware, so it builds anywhere with:
+
+   $ cc loracov.c -o loracov -lpthread -lm
+
+   Every event in the logs falls into a square tile of -z meters (100 by
+   default) and each tile keeps how many beacons were received, missed and
+   corrupt there, plus the rssi and snr of the ones received.  The output
+   is a csv of the tiles and a heatmap of the reception ratio, green where
+   every beacon made it, red where none did, black where we never went.
+
+   Tiles are on an equirectangular grid: rows are tile_m of latitude, and
+   columns are tile_m of longitude at a reference latitude, the first fix
+   ever seen rounded to a degree.  Within a few hundred km of that the
+   tiles stay close enough to square and every tile keeps the same place
+   in the image from one run to the next.
+
+   Notes on speed:
+   A day of driving is a few hundred thousand lines, a season of them a
+   lot more, so the logs are split into byte ranges, one per thread (-j,
+   the number of cpus by default).  A thread starts at the first line
+   after its range begins and finishes the line its range ends in, so
+   every line is parsed exactly once.  Each thread fills its own hash
+   table of tiles and the tables are merged at the end, so there is no
+   locking in the parse.
+
+   Notes on incremental builds:
+   -s <state> keeps the aggregated tiles in a binary file.  If it exists
+   it is loaded first and the new logs are added to it, then it is written
+   back, so each drive only has to be parsed once.  The state records the
+   tile size and reference latitude and a state built with a different -z
+   is refused.  Feeding the same log twice counts it twice.
+
+   Options:
+   -z <m>       tile size in meters (100)
+   -j <n>       threads
+   -s <file>    state to load and update
+   -c <file>    csv of the tiles
+   -o <file>    heatmap, a binary ppm
+   -x <px>      pixels per tile in the heatmap (4)
+
+   ---------------------------------------------------------------------------------------------*/
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "frame.h"
+
+#define COV_MAX_THREADS 64
+#define COV_STATE_HEADER 24   //"LCV1", tile m, reference latitude e7, tiles, pad
+#define COV_TILE_LEN    40
+#define METERS_PER_DEG  111320.0
+
+struct tile{
+  int32_t  row, col;
+  uint32_t received, missed, corrupt;
+  int32_t  rssi_min, rssi_max;
+  int64_t  rssi_sum;        //dBm over received packets
+  int32_t  snr_sum_q;       //quarter dB, like the register
+  uint8_t  used;
+};
+
+//open addressing, linear probing, grows at half full
+struct tile_map{
+  struct tile *t;
+  uint32_t cap;
+  uint32_t n;
+};
+
+struct grid{
+  double tile_m;
+  double lat0;             //reference latitude, NAN until known
+  double dlat, dlon;       //tile size in degrees
+};
+
+//one thread's share of one file
+struct job{
+  const char *path;
+  long from, to;
+  const struct grid *g;
+  struct tile_map map;
+  uint32_t lines, bad;
+};
+
+//-----------------------------------helper function prototypes----------------------------------
+
+void grid_init(struct grid *g, double tile_m, double lat0);
+
+struct tile *tile_get(struct tile_map *m, int32_t row, int32_t col);
+
+void tile_merge(struct tile_map *m, const struct tile *t);
+
+int parse_line(char *s, char *kind, double *lat, double *lon, int *rssi, double *snr);
+
+void *parse_range(void *arg);
+
+double first_lat(char **paths, int n);
+
+int load_state(const char *path, struct grid *g, struct tile_map *m);
+
+int save_state(const char *path, const struct grid *g, const struct tile_map *m);
+
+void write_csv(FILE *f, const struct grid *g, const struct tile_map *m);
+
+int write_heatmap(const char *path, const struct tile_map *m, int px);
+
+//-----------------------------------------function main-----------------------------------------
+
+int main(int argc, char **argv){
+  double tile_m = 100;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  char *state = NULL;
+  char *csv = NULL;
+  char *ppm = NULL;
+  int px = 4;
+  int opt;
+  while((opt = getopt(argc, argv, "z:j:s:c:o:x:")) != -1){
+    switch(opt){
+      case 'z': tile_m = atof(optarg); break;
+      case 'j': threads = atol(optarg); break;
+      case 's': state = optarg; break;
+      case 'c': csv = optarg; break;
+      case 'o': ppm = optarg; break;
+      case 'x': px = atoi(optarg); break;
+      default:
+        printf("usage: %s [-z tile_m] [-j threads] [-s state] [-c csv] [-o heatmap.ppm] [-x px] log...\n", argv[0]);
+        return 1;
+    }
+  }
+  if(tile_m <= 0 || px < 1 || (optind >= argc && state == NULL)){
+    printf("usage: %s [-z tile_m] [-j threads] [-s state] [-c csv] [-o heatmap.ppm] [-x px] log...\n", argv[0]);
+    return 1;
+  }
+  if(threads < 1) threads = 1;
+  if(threads > COV_MAX_THREADS) threads = COV_MAX_THREADS;
+
+  struct grid g;
+  struct tile_map all = {0};
+  grid_init(&g, tile_m, NAN);
+  struct stat st;
+  if(state && stat(state, &st) == 0 && load_state(state, &g, &all) < 0){
+    printf("%s is not a coverage state with %.0f m tiles.\n", state, tile_m);
+    return 1;
+  }
+  if(isnan(g.lat0)) grid_init(&g, tile_m, first_lat(argv + optind, argc - optind));
+
+  //every file in threads byte ranges, run threads at a time
+  uint32_t lines = 0, bad = 0;
+  for(int fi = optind; fi < argc; fi++){
+    if(stat(argv[fi], &st) < 0){
+      printf("Can't open %s.\n", argv[fi]);
+      return 1;
+    }
+    static struct job jobs[COV_MAX_THREADS];
+    pthread_t tid[COV_MAX_THREADS];
+    long chunk = st.st_size / threads + 1;
+    for(long i = 0; i < threads; i++){
+      jobs[i] = (struct job){argv[fi], i * chunk, (i + 1) * chunk, &g, {0}, 0, 0};
+      pthread_create(&tid[i], NULL, parse_range, &jobs[i]);
+    }
+    for(long i = 0; i < threads; i++){
+      pthread_join(tid[i], NULL);
+      for(uint32_t k = 0; k < jobs[i].map.cap; k++){
+        if(jobs[i].map.t[k].used) tile_merge(&all, &jobs[i].map.t[k]);
+      }
+      lines += jobs[i].lines;
+      bad += jobs[i].bad;
+      free(jobs[i].map.t);
+    }
+  }
+  fprintf(stderr, "%u events from %d logs, %u unparsable lines, %u tiles of %.0f m around %.0f deg\n",
+          lines, argc - optind, bad, all.n, tile_m, isnan(g.lat0) ? 0 : g.lat0);
+
+  if(state && save_state(state, &g, &all) < 0){
+    printf("Can't write %s.\n", state);
+    return 1;
+  }
+  if(csv){
+    FILE *f = fopen(csv, "w");
+    if(f == NULL){
+      printf("Can't write %s.\n", csv);
+      return 1;
+    }
+    write_csv(f, &g, &all);
+    fclose(f);
+  }
+  if(ppm && write_heatmap(ppm, &all, px) < 0){
+    printf("Can't write %s.\n", ppm);
+    return 1;
+  }
+  free(all.t);
+  return 0;
+}
+
+//--------------------------------helper function implementations---------------------------------
+
+void grid_init(struct grid *g, double tile_m, double lat0){
+  g->tile_m = tile_m;
+  g->lat0 = lat0;
+  g->dlat = tile_m / METERS_PER_DEG;
+  g->dlon = isnan(lat0) ? g->dlat : tile_m / (METERS_PER_DEG * cos(lat0 * M_PI / 180));
+}
+
+static uint32_t tile_hash(int32_t row, int32_t col){
+  uint64_t k = (uint64_t)(uint32_t)row << 32 | (uint32_t)col;
+  k *= 0x9E3779B97F4A7C15ull;
+  return (uint32_t)(k >> 32);
+}
+
+//finds or adds the tile, NULL only if memory runs out
+struct tile *tile_get(struct tile_map *m, int32_t row, int32_t col){
+  if(2 * (m->n + 1) > m->cap){
+    struct tile_map bigger = {calloc(m->cap ? 2 * m->cap : 1024, sizeof(struct tile)),
+                              m->cap ? 2 * m->cap : 1024, 0};
+    if(bigger.t == NULL) return NULL;
+    for(uint32_t i = 0; i < m->cap; i++){
+      struct tile *o = &m->t[i];
+      if(o->used) *tile_get(&bigger, o->row, o->col) = *o;
+    }
+    free(m->t);
+    *m = bigger;
+  }
+  uint32_t i = tile_hash(row, col) & (m->cap - 1);
+  while(1){
+    struct tile *t = &m->t[i];
+    if(!t->used){
+      t->used = 1;
+      t->row = row;
+      t->col = col;
+      t->rssi_min = INT32_MAX;
+      t->rssi_max = INT32_MIN;
+      m->n++;
+      return t;
+    }
+    if(t->row == row && t->col == col) return t;
+    i = (i + 1) & (m->cap - 1);
+  }
+}
+
+void tile_merge(struct tile_map *m, const struct tile *t){
+  struct tile *d = tile_get(m, t->row, t->col);
+  if(d == NULL) return;
+  d->received += t->received;
+  d->missed += t->missed;
+  d->corrupt += t->corrupt;
+  d->rssi_sum += t->rssi_sum;
+  d->snr_sum_q += t->snr_sum_q;
+  if(t->rssi_min < d->rssi_min) d->rssi_min = t->rssi_min;
+  if(t->rssi_max > d->rssi_max) d->rssi_max = t->rssi_max;
+}
+
+//one log line, 0 on success or -1.  see loraRX's notes on coverage mapping
+int parse_line(char *s, char *kind, double *lat, double *lon, int *rssi, double *snr){
+  char *end;
+  *kind = s[0];
+  if((*kind != 'R' && *kind != 'C' && *kind != 'M') || s[1] != ' ') return -1;
+  strtod(s + 2, &end);        //time
+  *lat = strtod(end, &end);
+  *lon = strtod(end, &end);
+  strtod(end, &end);          //altitude
+  if(*end != ' ' && *end != '\n' && *end != '\0') return -1;
+  if(*lat < -90 || *lat > 90 || *lon < -180 || *lon > 180) return -1;
+  if(*kind == 'M') return 0;
+  char *p = end;
+  *rssi = strtol(p, &end, 10);
+  if(end == p) return -1;
+  p = end;
+  *snr = strtod(p, &end);
+  return end == p ? -1 : 0;
+}
+
+//parses the lines that start in [from, to) into the job's own table
+void *parse_range(void *arg){
+  struct job *j = arg;
+  FILE *f = fopen(j->path, "r");
+  if(f == NULL) return NULL;
+  char line[256];
+  long pos = j->from;
+  fseek(f, pos, SEEK_SET);
+  //a range that starts mid line leaves that line to the previous range
+  if(pos > 0){
+    fseek(f, pos - 1, SEEK_SET);
+    int c;
+    while((c = getc(f)) != EOF && c != '\n') pos++;
+    pos = ftell(f);
+  }
+  while(pos < j->to && fgets(line, sizeof(line), f)){
+    pos = ftell(f);
+    char kind;
+    double lat, lon, snr = 0;
+    int rssi = 0;
+    if(parse_line(line, &kind, &lat, &lon, &rssi, &snr) < 0){
+      j->bad++;
+      continue;
+    }
+    j->lines++;
+    int32_t row = (int32_t)floor(lat / j->g->dlat);
+    int32_t col = (int32_t)floor(lon / j->g->dlon);
+    struct tile *t = tile_get(&j->map, row, col);
+    if(t == NULL) break;
+    if(kind == 'M'){
+      t->missed++;
+    }else if(kind == 'C'){
+      t->corrupt++;
+    }else{
+      t->received++;
+      t->rssi_sum += rssi;
+      t->snr_sum_q += (int32_t)lround(snr * 4);
+      if(rssi < t->rssi_min) t->rssi_min = rssi;
+      if(rssi > t->rssi_max) t->rssi_max = rssi;
+    }
+  }
+  fclose(f);
+  return NULL;
+}
+
+//the reference latitude for a new map, from the first parsable line
+double first_lat(char **paths, int n){
+  char line[256];
+  for(int i = 0; i < n; i++){
+    FILE *f = fopen(paths[i], "r");
+    if(f == NULL) continue;
+    while(fgets(line, sizeof(line), f)){
+      char kind;
+      double lat, lon, snr;
+      int rssi;
+      if(parse_line(line, &kind, &lat, &lon, &rssi, &snr) == 0){
+        fclose(f);
+        return round(lat);
+      }
+    }
+    fclose(f);
+  }
+  return NAN;
+}
+
+//loads a state written with the same tile size, 0 on success or -1
+int load_state(const char *path, struct grid *g, struct tile_map *m){
+  FILE *f = fopen(path, "rb");
+  uint8_t b[COV_STATE_HEADER];
+  if(f == NULL) return -1;
+  if(fread(b, 1, COV_STATE_HEADER, f) != COV_STATE_HEADER || memcmp(b, "LCV1", 4) != 0 ||
+     get32(b + 4) != (uint32_t)lround(g->tile_m)){
+    fclose(f);
+    return -1;
+  }
+  grid_init(g, g->tile_m, (int32_t)get32(b + 8) / 1e7);
+  uint32_t n = get32(b + 12);
+  for(uint32_t i = 0; i < n; i++){
+    uint8_t r[COV_TILE_LEN];
+    if(fread(r, 1, COV_TILE_LEN, f) != COV_TILE_LEN){
+      fclose(f);
+      return -1;
+    }
+    struct tile t = {0};
+    t.row = (int32_t)get32(r);
+    t.col = (int32_t)get32(r + 4);
+    t.received = get32(r + 8);
+    t.missed = get32(r + 12);
+    t.corrupt = get32(r + 16);
+    t.rssi_min = (int32_t)get32(r + 20);
+    t.rssi_max = (int32_t)get32(r + 24);
+    t.rssi_sum = (int64_t)get64(r + 28);
+    t.snr_sum_q = (int32_t)get32(r + 36);
+    tile_merge(m, &t);
+  }
+  fclose(f);
+  return 0;
+}
+
+//writes the state through a temporary file so a crash keeps the old one
+int save_state(const char *path, const struct grid *g, const struct tile_map *m){
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE *f = fopen(tmp, "wb");
+  if(f == NULL) return -1;
+  uint8_t b[COV_STATE_HEADER] = {'L', 'C', 'V', '1'};
+  put32(b + 4, (uint32_t)lround(g->tile_m));
+  put32(b + 8, (uint32_t)(int32_t)lround((isnan(g->lat0) ? 0 : g->lat0) * 1e7));
+  put32(b + 12, m->n);
+  int ok = fwrite(b, 1, COV_STATE_HEADER, f) == COV_STATE_HEADER;
+  for(uint32_t i = 0; i < m->cap && ok; i++){
+    const struct tile *t = &m->t[i];
+    if(!t->used) continue;
+    uint8_t r[COV_TILE_LEN];
+    put32(r, (uint32_t)t->row);
+    put32(r + 4, (uint32_t)t->col);
+    put32(r + 8, t->received);
+    put32(r + 12, t->missed);
+    put32(r + 16, t->corrupt);
+    put32(r + 20, (uint32_t)t->rssi_min);
+    put32(r + 24, (uint32_t)t->rssi_max);
+    put64(r + 28, (uint64_t)t->rssi_sum);
+    put32(r + 36, (uint32_t)t->snr_sum_q);
+    ok = fwrite(r, 1, COV_TILE_LEN, f) == COV_TILE_LEN;
+  }
+  if(fclose(f) != 0 || !ok) return -1;
+  return rename(tmp, path);
+}
+
+//one line per tile with its center, counts and signal
+void write_csv(FILE *f, const struct grid *g, const struct tile_map *m){
+  fprintf(f, "lat,lon,received,missed,corrupt,ratio,rssi_mean,rssi_min,rssi_max,snr_mean\n");
+  for(uint32_t i = 0; i < m->cap; i++){
+    const struct tile *t = &m->t[i];
+    uint32_t due = t->received + t->missed;
+    if(!t->used) continue;
+    fprintf(f, "%.6f,%.6f,%u,%u,%u,", (t->row + 0.5) * g->dlat, (t->col + 0.5) * g->dlon,
+            t->received, t->missed, t->corrupt);
+    if(due) fprintf(f, "%.3f", (double)t->received / due);
+    if(t->received){
+      fprintf(f, ",%.1f,%d,%d,%.2f\n", (double)t->rssi_sum / t->received, t->rssi_min, t->rssi_max,
+              t->snr_sum_q / 4.0 / t->received);
+    }else{
+      fprintf(f, ",,,,\n");
+    }
+  }
+}
+
+//reception ratio from red through yellow to green, north up.  tiles with
+//only corrupt packets are gray, unvisited ones black
+int write_heatmap(const char *path, const struct tile_map *m, int px){
+  if(m->n == 0) return -1;
+  int32_t rmin = INT32_MAX, rmax = INT32_MIN, cmin = INT32_MAX, cmax = INT32_MIN;
+  for(uint32_t i = 0; i < m->cap; i++){
+    const struct tile *t = &m->t[i];
+    if(!t->used) continue;
+    if(t->row < rmin) rmin = t->row;
+    if(t->row > rmax) rmax = t->row;
+    if(t->col < cmin) cmin = t->col;
+    if(t->col > cmax) cmax = t->col;
+  }
+  int64_t w = (int64_t)(cmax - cmin + 1) * px, h = (int64_t)(rmax - rmin + 1) * px;
+  if(w * h > 100000000) return -1;  //a 10k square image is already silly
+  uint8_t *img = calloc(w * h, 3);
+  if(img == NULL) return -1;
+  for(uint32_t i = 0; i < m->cap; i++){
+    const struct tile *t = &m->t[i];
+    uint32_t due = t->received + t->missed;
+    if(!t->used) continue;
+    uint8_t rgb[3] = {96, 96, 96};
+    if(due){
+      double r = (double)t->received / due;
+      rgb[0] = r < 0.5 ? 255 : (uint8_t)(255 * 2 * (1 - r));
+      rgb[1] = r > 0.5 ? 255 : (uint8_t)(255 * 2 * r);
+      rgb[2] = 0;
+    }
+    int64_t y0 = (int64_t)(rmax - t->row) * px, x0 = (int64_t)(t->col - cmin) * px;
+    for(int y = 0; y < px; y++){
+      for(int x = 0; x < px; x++){
+        memcpy(img + 3 * ((y0 + y) * w + x0 + x), rgb, 3);
+      }
+    }
+  }
+  FILE *f = fopen(path, "wb");
+  if(f == NULL){
+    free(img);
+    return -1;
+  }
+  fprintf(f, "P6\n%lld %lld\n255\n", (long long)w, (long long)h);
+  int ok = fwrite(img, 3, w * h, f) == (size_t)(w * h);
+  free(img);
+  return fclose(f) == 0 && ok ? 0 : -1;
+}
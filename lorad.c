@@ -0,0 +1,505 @@
+/* UCSD CubeSat
+   lorad.c
+
+   Radio broker.  Owns the SPI bus and the SX1278 and shares them among
+   any number of client programs over a Unix socket (loraclient.h has the
+   protocol and the client functions):
+
+   $ cc lorad.c -o lorad -lbcm2835
+   $ sudo ./lorad -D 25 &
+   $ ./loracat                    (prints every packet heard)
+   $ echo hello | ./loracat -s    (sends a line per packet)
+
+   The chip sits in continuous Rx.  Every packet heard goes to every
+   subscribed client, and packets submitted by clients are queued and
+   sent in order.  Only lorad touches the chip, so clients can't break
+   each other's register sequences the way two radio programs run at once
+   do; hardware_init() now refuses to start a second one of those.
+
+   Notes on batching:
+   Each pass of the main loop first reads every message waiting on every
+   client socket, then looks at the radio, then sends everything queued
+   as one batch: one move out of Rx, the packets back to back, and one
+   move back into Rx at the end, instead of the round trip per packet.
+   A batch is held back while RegModemStat says a packet is coming in, so
+   a submit can't cut a reception short.  Up to LD_TXQ packets wait; a
+   submit beyond that is answered LC_ERR_FULL straight away.
+
+   Notes on DIO0:
+   With -D the DIO0 line is requested from the gpio character device as
+   a rising edge event and sits in the ppoll() set with the sockets, so
+   RxDone wakes the loop at once instead of at the next LD_POLL_US check.
+   The kernel stamps each edge on CLOCK_MONOTONIC, now_us()'s clock, and
+   that stamp is the LC_RX t_us.  Without -D the loop wakes every
+   LD_POLL_US to read RegIrqFlags and t_us is half a poll before the read
+   that saw RxDone.
+
+   Notes on overhead:
+   What the broker adds to a packet, on top of the SPI traffic and
+   airtime any program driving the chip would have, is reading the
+   request off its socket and sending the LC_TX_DONE for a transmit, and
+   for a reception waking up to the DIO0 edge and sending the LC_RX to
+   every subscriber, timed from the edge less the register and FIFO
+   reads.  Without -D there is no edge and a reception is timed from the
+   check that found it.  Both are timed for every packet and printed
+   every LD_REPORT_EVERY packets, with the number that went over
+   LD_OVERHEAD_US, 50 us.  The time a packet waits in the queue behind
+   the rest of its batch is airtime, not overhead, and isn't counted.
+
+   Notes on status:
+   The op mode, carrier, modem settings, counters, last rssi and snr,
+   clients and queue depth are published in shared memory (status.h) at
+   every change, for lorastat and other monitors to read without asking.
+
+   Notes on tracing:
+   Besides the driver's probes (probes.h) lorad fires packet_queued for
+   every accepted submit, packet_delivered once a reception has gone to
+   every subscriber and tx_done for every transmit.  loratrace.bt turns
+   them into latency histograms.
+
+   Options:
+   -p <path>   socket path (LC_SOCKET, /tmp/lorad.sock)
+   -f <kHz>    carrier (434000)
+   -D <gpio>   wake on DIO0 edges on this gpio instead of polling RegIrqFlags
+   -k <div>    SPI clock divider (65536)
+   -s <path>   status segment for lorastat (STATUS_PATH, /dev/shm/lora-status)
+
+   ---------------------------------------------------------------------------------------------*/
+
+//------------------------------header files and label definitions------------------------------
+
+#define _GNU_SOURCE   //ppoll
+#include "sx1278.h"
+#include "loraclient.h"
+#include <signal.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <linux/gpio.h>
+
+#define LD_MAX_CLIENTS  16
+#define LD_TXQ          32
+#define LD_POLL_US      1000     //radio check interval without DIO0, and while a batch is held back
+#define LD_IDLE_US      100000   //longest wait with DIO0, so a stop signal is never missed for long
+#define LD_GPIOCHIP     "/dev/gpiochip0"   //the SoC's gpios, offsets are the bcm2835 numbers
+#define LD_OVERHEAD_US  50
+#define LD_REPORT_EVERY 100      //packets, sent and received
+
+//RegModemStat signal detected, synchronized and header valid: a packet
+//is on its way in
+#define MODEM_STAT_BUSY 0x0B
+
+struct ld_client{
+  int fd;
+  int sub;
+};
+
+struct ld_tx{
+  int client;             //index into clients, -1 once it has gone
+  uint32_t seq;
+  uint8_t len;
+  uint8_t data[255];
+  uint32_t ovh_us;        //reading it off the socket, the ack is added later
+};
+
+struct ld_stats{
+  uint32_t rx, crc, tx, tx_fail, full, drops;
+  uint32_t batches, batched;
+  uint64_t tx_ovh_sum, rx_ovh_sum;
+  uint32_t tx_ovh_max, rx_ovh_max;
+  uint32_t over;           //packets over LD_OVERHEAD_US
+  int16_t rssi;            //last packet
+  int8_t snr;
+};
+
+//-----------------------------------helper function prototypes----------------------------------
+
+void stop(int sig);
+
+void rx_arm(void);
+
+int client_read(int c, struct ld_tx *q, int *nq);
+
+int dio0_events(int pin);
+
+uint64_t dio0_edge(uint64_t since);
+
+void rx_check(const struct modem_cfg *m);
+
+void tx_batch(struct ld_tx *q, int nq, const struct modem_cfg *m);
+
+void ack(int c, uint32_t seq, uint8_t status, uint64_t t_us);
+
+void record_ovh(uint32_t us, uint64_t *sum, uint32_t *max);
+
+void report(FILE *out);
+
+void publish(int nq);
+
+volatile sig_atomic_t running = 1;
+struct ld_client clients[LD_MAX_CLIENTS];
+int nclients = 0;
+struct ld_stats st;
+int dio0_fd = -1;          //DIO0 rising edge events, -1 without -D
+uint64_t rx_armed_us = 0;  //irq flags last cleared in Rx, an RxDone edge comes after
+
+//-----------------------------------------function main-----------------------------------------
+
+int main(int argc, char **argv){
+  const char *path = LC_SOCKET;
+  uint32_t freq_khz = 434000;
+  int dio = -1;
+  const char *status_path = STATUS_PATH;
+  int opt;
+  while((opt = getopt(argc, argv, "p:f:D:k:s:")) != -1){
+    switch(opt){
+      case 'p':
+        path = optarg;
+        break;
+      case 'f':
+        freq_khz = strtoul(optarg, NULL, 10);
+        break;
+      case 'D':
+        dio = atoi(optarg);
+        break;
+      case 'k':
+        spi_divider = strtoul(optarg, NULL, 10);
+        break;
+      case 's':
+        status_path = optarg;
+        break;
+      default:
+        printf("usage: %s [-p socket] [-f kHz] [-D dio0_gpio] [-k spi_divider] [-s status]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  //the socket first, no point starting the radio otherwise
+  int ls = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  struct sockaddr_un a;
+  memset(&a, 0, sizeof(a));
+  a.sun_family = AF_UNIX;
+  strncpy(a.sun_path, path, sizeof(a.sun_path) - 1);
+  unlink(path);
+  if(ls < 0 || bind(ls, (struct sockaddr *)&a, sizeof(a)) < 0 || listen(ls, LD_MAX_CLIENTS) < 0){
+    printf("Can't listen on %s.\n", path);
+    return 1;
+  }
+  chmod(path, 0666);   //clients don't need root
+
+  hardware_init();
+  if(status_open(status_path) < 0) fprintf(stderr, "Can't publish status in %s.\n", status_path);
+  lora_init();
+  set_frequency(freq_khz * 1000);
+  write_reg(REG_MODEM_CONFIG2, read_reg(REG_MODEM_CONFIG2) | 0x04);   //payload crc on
+  if(dio >= 0){
+    dio0_init(dio);
+    if(dio0_events(dio) < 0){
+      printf("Can't watch gpio %d for edges on %s.\n", dio, LD_GPIOCHIP);
+      close(ls);
+      unlink(path);
+      return 1;
+    }
+  }
+  struct modem_cfg modem;
+  read_modem(&modem);
+  if(status_shm){
+    struct profile prof;
+    profile_of(&modem, read_reg(REG_SYNC_WORD), &prof);
+    status_begin();
+    status_shm->sf = prof.sf;
+    status_shm->bw = prof.bw;
+    status_shm->cr = prof.cr;
+    status_end();
+  }
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+  fprintf(stderr, "Listening on %s, %.3f MHz.\n", path, freq_khz / 1e3);
+
+  static struct ld_tx q[LD_TXQ];
+  int nq = 0;
+  rx_arm();
+  while(running){
+    struct pollfd p[LD_MAX_CLIENTS + 2];
+    p[0].fd = ls;
+    p[0].events = POLLIN;
+    for(int c = 0; c < nclients; c++){
+      p[c + 1].fd = clients[c].fd;
+      p[c + 1].events = POLLIN;
+    }
+    int np = nclients + 1;
+    if(dio0_fd >= 0){
+      p[np].fd = dio0_fd;
+      p[np++].events = POLLIN;
+    }
+    //with DIO0 the edge wakes us, a timed check is only needed to retry
+    //a held back batch
+    long wait_us = dio0_fd >= 0 && !nq ? LD_IDLE_US : LD_POLL_US;
+    struct timespec ts = {0, wait_us * 1000};
+    int r = ppoll(p, np, &ts, NULL);
+    if(r < 0 && errno != EINTR) break;
+
+    //every message waiting on every client, then the radio
+    if(r > 0){
+      for(int c = nclients - 1; c >= 0; c--){
+        if(p[c + 1].revents & (POLLIN | POLLHUP | POLLERR)){
+          while(client_read(c, q, &nq) > 0){}
+        }
+      }
+      if(p[0].revents & POLLIN){
+        int fd = accept(ls, NULL, NULL);
+        if(fd >= 0 && nclients < LD_MAX_CLIENTS){
+          clients[nclients].fd = fd;
+          clients[nclients++].sub = 0;
+        }else if(fd >= 0){
+          close(fd);
+        }
+      }
+    }
+    rx_check(&modem);
+
+    //the queue goes out in one batch unless a packet is coming in
+    if(nq && !(read_reg(REG_MODEM_STAT) & MODEM_STAT_BUSY)){
+      publish(nq);
+      tx_batch(q, nq, &modem);
+      nq = 0;
+      rx_arm();
+    }
+    publish(nq);
+  }
+
+  report(stderr);
+  for(int c = 0; c < nclients; c++) close(clients[c].fd);
+  close(ls);
+  if(dio0_fd >= 0) close(dio0_fd);
+  unlink(path);
+  write_reg(REG_OP_MODE, LORA_STANDBY);
+  bcm2835_spi_end();
+  bcm2835_close();
+  return 0;
+}
+
+//--------------------------------helper function implementations---------------------------------
+
+void stop(int sig){
+  running = 0;
+}
+
+//back to continuous Rx with the flags cleared
+void rx_arm(void){
+  write_reg(REG_FIFO_ADDR_PTR, FIFO_RX_BASE_ADDR);
+  rx_armed_us = now_us();
+  write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+  write_reg(REG_OP_MODE, LORA_RX_CONT);
+}
+
+//reads one message from client c and acts on it.  returns 1 if there
+//was one, 0 if not and -1 if the client went away, in which case it is
+//dropped and its queued packets go out unacknowledged
+int client_read(int c, struct ld_tx *q, int *nq){
+  uint64_t t = now_us();
+  struct lc_msg m;
+  ssize_t n = recv(clients[c].fd, &m, sizeof(m), MSG_DONTWAIT);
+  if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+  if(n <= 0){
+    close(clients[c].fd);
+    clients[c] = clients[--nclients];
+    for(int i = 0; i < *nq; i++){
+      if(q[i].client == c) q[i].client = -1;
+      else if(q[i].client == nclients) q[i].client = c;
+    }
+    return -1;
+  }
+  if(n < (ssize_t)LC_HEADER_LEN || n != (ssize_t)(LC_HEADER_LEN + m.len)){
+    ack(c, 0, LC_ERR_BAD, 0);
+    return 1;
+  }
+  switch(m.type){
+    case LC_TX:
+      if(*nq >= LD_TXQ){
+        st.full++;
+        ack(c, m.seq, LC_ERR_FULL, 0);
+        break;
+      }
+      q[*nq].client = c;
+      q[*nq].seq = m.seq;
+      q[*nq].len = m.len;
+      memcpy(q[*nq].data, m.data, m.len);
+      q[*nq].ovh_us = now_us() - t;
+      (*nq)++;
+      PROBE(packet_queued, c, m.seq, m.len, *nq);
+      break;
+    case LC_SUBSCRIBE:
+      clients[c].sub = 1;
+      break;
+    case LC_STATS:
+      m.status = LC_OK;
+      m.len = snprintf((char *)m.data, sizeof(m.data),
+                       "clients %d rx %u crc %u tx %u fail %u full %u drops %u batches %u/%u "
+                       "ovh tx %.1f/%u rx %.1f/%u us over %u", nclients, st.rx, st.crc, st.tx, st.tx_fail,
+                       st.full, st.drops, st.batches, st.batched,
+                       st.tx ? (double)st.tx_ovh_sum / st.tx : 0, st.tx_ovh_max,
+                       st.rx ? (double)st.rx_ovh_sum / st.rx : 0, st.rx_ovh_max, st.over);
+      if(m.len >= sizeof(m.data)) m.len = sizeof(m.data) - 1;
+      lc_put(clients[c].fd, &m);
+      break;
+    default:
+      ack(c, m.seq, LC_ERR_BAD, 0);
+      break;
+  }
+  return 1;
+}
+
+//requests the gpio as a rising edge event on the gpio character device,
+//leaving dio0_fd non-blocking for ppoll() and dio0_edge().  returns the
+//fd, -1 if the kernel won't give it
+int dio0_events(int pin){
+  int chip = open(LD_GPIOCHIP, O_RDONLY);
+  if(chip < 0) return -1;
+  struct gpioevent_request req;
+  memset(&req, 0, sizeof(req));
+  req.lineoffset = pin;
+  req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+  req.eventflags = GPIOEVENT_REQUEST_RISING_EDGE;
+  strncpy(req.consumer_label, "lorad dio0", sizeof(req.consumer_label) - 1);
+  int r = ioctl(chip, GPIO_GET_LINEEVENT_IOCTL, &req);
+  close(chip);
+  if(r < 0) return -1;
+  fcntl(req.fd, F_SETFL, O_NONBLOCK);
+  dio0_fd = req.fd;
+  return dio0_fd;
+}
+
+//reads every edge waiting and returns the time of the last one at or
+//after since in us on now_us()'s clock, 0 if there was none.  TxDone
+//edges from a batch are read and dropped here too, they are older than
+//the rx_arm() after it
+uint64_t dio0_edge(uint64_t since){
+  struct gpioevent_data ev;
+  uint64_t edge = 0;
+  while(read(dio0_fd, &ev, sizeof(ev)) == sizeof(ev)){
+    if(ev.timestamp / 1000 >= since) edge = ev.timestamp / 1000;
+  }
+  return edge;
+}
+
+//hands a received packet, if there is one, to every subscriber
+void rx_check(const struct modem_cfg *m){
+  uint64_t seen = now_us();
+  uint64_t edge = 0;
+  if(dio0_pin >= 0){
+    //edges first, then the pin: an edge after the pin read stays queued
+    //and wakes the next ppoll().  with the pin high its edge may have
+    //come after the first read, so the queue is read again
+    if(dio0_fd >= 0) edge = dio0_edge(rx_armed_us);
+    if(!bcm2835_gpio_lev(dio0_pin)) return;
+    if(dio0_fd >= 0 && !edge) edge = dio0_edge(rx_armed_us);
+  }
+  uint64_t spi = now_us();
+  uint8_t flags = read_reg(REG_IRQ_FLAGS);
+  if(!(flags & FLAG_RX_DONE)) return;
+
+  struct lc_msg msg;
+  memset(&msg, 0, LC_HEADER_LEN);
+  msg.type = LC_RX;
+  if(edge) msg.t_us = edge;
+  else msg.t_us = dio0_pin >= 0 ? seen : seen - LD_POLL_US / 2;
+  msg.len = read_fifo_packet(msg.data);
+  msg.rssi = st.rssi = packet_rssi();
+  msg.snr = st.snr = (int8_t)read_reg(REG_PACKET_SNR);
+  msg.status = flags & FLAG_PAYLOAD_CRC ? LC_ERR_CRC : LC_OK;
+  rx_armed_us = now_us();
+  write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+  spi = now_us() - spi;
+  if(msg.status == LC_ERR_CRC) st.crc++;
+
+  //a subscriber with a full socket loses the packet, nobody waits for it
+  for(int c = 0; c < nclients; c++){
+    if(!clients[c].sub) continue;
+    if(send(clients[c].fd, &msg, LC_HEADER_LEN + msg.len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) st.drops++;
+  }
+  if(PROBE_ENABLED(packet_delivered)) PROBE(packet_delivered, msg.len, msg.status, now_us() - msg.t_us);
+  st.rx++;
+  //from the edge, or the check without one, less the SPI reads
+  record_ovh(now_us() - (edge ? edge : seen) - spi, &st.rx_ovh_sum, &st.rx_ovh_max);
+  if((st.rx + st.tx) % LD_REPORT_EVERY == 0) report(stderr);
+}
+
+//sends the queued packets back to back, acknowledging each
+void tx_batch(struct ld_tx *q, int nq, const struct modem_cfg *m){
+  write_reg(REG_OP_MODE, LORA_STANDBY);
+  for(int i = 0; i < nq; i++){
+    load_fifo_packet(q[i].data, q[i].len);
+    uint64_t tx_start = now_us();
+    write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+    write_reg(REG_OP_MODE, LORA_TX);
+    uint64_t done;
+    uint8_t flags = wait_event(FLAG_TX_DONE, tx_start + airtime_us(m, q[i].len) + TX_CONFIRM_US, LD_POLL_US, 0, &done);
+    write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+    int ok = (flags & FLAG_TX_DONE) != 0;
+    PROBE(tx_done, q[i].len, ok, ok ? done - tx_start : now_us() - tx_start);
+    if(!ok){
+      st.tx_fail++;
+      write_reg(REG_OP_MODE, LORA_STANDBY);
+    }
+
+    uint64_t t = now_us();
+    if(q[i].client >= 0) ack(q[i].client, q[i].seq, ok ? LC_OK : LC_ERR_TIMEOUT, tx_start);
+    st.tx++;
+    record_ovh(q[i].ovh_us + (now_us() - t), &st.tx_ovh_sum, &st.tx_ovh_max);
+    if((st.rx + st.tx) % LD_REPORT_EVERY == 0) report(stderr);
+  }
+  st.batches++;
+  st.batched += nq;
+}
+
+//answers a client, dropping the answer if its socket is full
+void ack(int c, uint32_t seq, uint8_t status, uint64_t t_us){
+  struct lc_msg m;
+  memset(&m, 0, LC_HEADER_LEN);
+  m.type = LC_TX_DONE;
+  m.status = status;
+  m.seq = seq;
+  m.t_us = t_us;
+  if(send(clients[c].fd, &m, LC_HEADER_LEN, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) st.drops++;
+}
+
+void record_ovh(uint32_t us, uint64_t *sum, uint32_t *max){
+  *sum += us;
+  if(us > *max) *max = us;
+  if(us > LD_OVERHEAD_US) st.over++;
+}
+
+//counters and the per packet overhead so far
+void report(FILE *out){
+  fprintf(out, "Broker: %d clients, %u received (%u crc), %u sent (%u failed) in %u batches, "
+          "%u refused, %u dropped.\n", nclients, st.rx, st.crc, st.tx, st.tx_fail, st.batches, st.full, st.drops);
+  fprintf(out, "Overhead: tx mean %.1f max %u us, rx mean %.1f max %u us, %u packets over %u us.\n",
+          st.tx ? (double)st.tx_ovh_sum / st.tx : 0, st.tx_ovh_max, st.rx ? (double)st.rx_ovh_sum / st.rx : 0,
+          st.rx_ovh_max, st.over, LD_OVERHEAD_US);
+}
+
+//puts the counters in shared memory if anything has changed since the
+//last time
+void publish(int nq){
+  static struct ld_stats last;
+  static int last_nq = -1, last_clients = -1;
+  if(!status_shm || (memcmp(&st, &last, sizeof(st)) == 0 && nq == last_nq && nclients == last_clients)) return;
+  last = st;
+  last_nq = nq;
+  last_clients = nclients;
+  status_begin();
+  status_shm->rssi = st.rssi;
+  status_shm->snr = st.snr;
+  status_shm->clients = nclients;
+  status_shm->rx = st.rx;
+  status_shm->rx_crc = st.crc;
+  status_shm->tx = st.tx;
+  status_shm->tx_failed = st.tx_fail;
+  status_shm->tx_refused = st.full;
+  status_shm->drops = st.drops;
+  status_shm->txq = nq;
+  if(nq > status_shm->txq_max) status_shm->txq_max = nq;
+  status_end();
+}
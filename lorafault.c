@@ -0,0 +1,272 @@
+/* UCSD CubeSat
+   lorafault.c
+
+   Fault injection benchmark.  Sends packets back to back like a beacon
+   node with spifault.h between the driver and the SPI bus, and measures
+   how long the driver's checks take to notice each fault, how long it
+   takes to get the chip back and how many packets the fault cost:
+
+   $ cc lorafault.c -o lorafault -lbcm2835
+   $ sudo ./lorafault -t all -r 2000 -n 200
+
+   Every packet is loaded into the FIFO, sent and waited for, and then
+   checked at the -C level:
+
+   0  TxDone only, like loraTX
+   1  also reads back the op mode, the modem image, the carrier and the
+      FIFO base addresses (default)
+   2  also reads the payload back out of the FIFO before sending it
+
+   A failed check is a detection.  The driver then looks a second time,
+   since the fault may have been in the check's own reads, and if the
+   chip still isn't right it goes back through sleep and reprograms
+   everything until a check passes, which is the recovery.  Higher levels
+   cost SPI time on every packet and buy earlier detection; the table
+   shows what each level misses.
+
+   Notes on lost packets:
+   Whether a packet was lost is decided apart from the checks: right
+   after TxDone (or the timeout) the chip's real state is read with the
+   fault layer suspended, and a packet that didn't finish, or went out
+   with the wrong modem settings, carrier or payload, is lost.  A fault
+   that keeps losing packets for FAULT_GIVE_UP of them with no check
+   failing is counted missed and the chip is reprogrammed.
+
+   Options:
+   -t <type>   flip, drop, zero, ones, delay, stick, reset or all (all)
+   -n <count>  faults to inject (100)
+   -e <count>  inject every this many transactions (0, random)
+   -r <ppm>    random faults per million transactions (5000)
+   -w <count>  transactions one fault lasts, flag reads for stick (1)
+   -d <us>     delay fault length (20000)
+   -C <level>  check level, 0 to 2 (1)
+   -l <bytes>  payload length (16)
+   -s <sf>     spreading factor (7)
+   -f <kHz>    carrier (434000)
+   -c <div>    SPI clock divider (65536)
+   -S <seed>   random seed (1)
+
+   ---------------------------------------------------------------------------------------------*/
+
+//------------------------------header files and label definitions------------------------------
+
+#include "sx1278.h"
+#include "spifault.h"
+#include <signal.h>
+#include <unistd.h>
+
+#define FAULT_GIVE_UP   10     //undetected lost packets before a fault counts as missed
+#define RECOVER_TRIES   20
+
+//what the chip should hold
+struct target{
+  struct reg_image img;
+  uint32_t freq_hz;
+  uint8_t frf[3];
+};
+
+//-----------------------------------helper function prototypes----------------------------------
+
+void stop(int sig);
+
+void setup(const struct target *g);
+
+int check(const struct target *g);
+
+int truth(const struct target *g, const uint8_t *payload, uint8_t len);
+
+int send_packet(const struct target *g, const struct modem_cfg *m, const uint8_t *payload, uint8_t len, int level);
+
+volatile sig_atomic_t running = 1;
+
+//-----------------------------------------function main-----------------------------------------
+
+int main(int argc, char **argv){
+  struct fault_cfg fc = {FAULT_ANY, 0, 5000, 1, 20000, 1};
+  uint32_t faults = 100;
+  uint32_t freq_khz = 434000;
+  int level = 1, len = 16, sf = 7;
+  int opt;
+  while((opt = getopt(argc, argv, "t:n:e:r:w:d:C:l:s:f:c:S:")) != -1){
+    switch(opt){
+      case 't':
+        fc.type = -2;
+        if(strcmp(optarg, "all") == 0) fc.type = FAULT_ANY;
+        for(int t = 0; t < FAULT_TYPES; t++) if(strcmp(optarg, fault_names[t]) == 0) fc.type = t;
+        break;
+      case 'n': faults = strtoul(optarg, NULL, 10); break;
+      case 'e': fc.every = strtoul(optarg, NULL, 10); break;
+      case 'r': fc.ppm = strtoul(optarg, NULL, 10); break;
+      case 'w': fc.span = strtoul(optarg, NULL, 10); break;
+      case 'd': fc.delay_us = strtoul(optarg, NULL, 10); break;
+      case 'C': level = atoi(optarg); break;
+      case 'l': len = atoi(optarg); break;
+      case 's': sf = atoi(optarg); break;
+      case 'f': freq_khz = strtoul(optarg, NULL, 10); break;
+      case 'c': spi_divider = strtoul(optarg, NULL, 10); break;
+      case 'S': fc.seed = strtoul(optarg, NULL, 10); break;
+      default: fc.type = -2;
+    }
+  }
+  if(fc.type < FAULT_ANY || level < 0 || level > 2 || len < 1 || len > 255 || sf < 7 || sf > 12 ||
+     (fc.every == 0 && fc.ppm == 0)){
+    printf("usage: %s [-t flip|drop|zero|ones|delay|stick|reset|all] [-n faults] [-e count | -r ppm]\n"
+           "       [-w span] [-d us] [-C 0|1|2] [-l bytes] [-s sf] [-f kHz] [-c spi_divider] [-S seed]\n",
+           argv[0]);
+    return 1;
+  }
+
+  hardware_init();  //setup spi
+  lora_init();      //boot sequence to LoRa standby
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  //SF -s at 125 kHz with the crc on, the reset settings otherwise
+  struct target g;
+  struct profile p = {sf, 7, 1, 0x12, 0, 1, 8};
+  struct modem_cfg m;
+  profile_image(&p, 0x64, &g.img);
+  profile_modem(&p, &m);
+  g.freq_hz = freq_khz * 1000;
+  uint32_t frf = (uint32_t)(((uint64_t)g.freq_hz << 19) / FXOSC_HZ);
+  g.frf[0] = frf >> 16;
+  g.frf[1] = frf >> 8;
+  g.frf[2] = frf;
+  setup(&g);
+  if(check(&g) < 0){
+    printf("The chip doesn't hold its settings even without faults.\n");
+    exit(EXIT_SUCCESS);
+  }
+
+  fprintf(stderr, "Injecting %u %s faults, check level %d, %d byte packets at SF%d.\n", faults,
+          fc.type == FAULT_ANY ? "random" : fault_names[fc.type], level, len, sf);
+  fault_start(&fc);
+  uint8_t payload[255];
+  uint32_t packets = 0, lost = 0, undetected = 0;
+  uint64_t start = now_us();
+  while(running){
+    uint32_t injected = 0;
+    for(int t = 0; t < FAULT_TYPES; t++) injected += fault_st[t].injected;
+    if(injected >= faults){
+      //no more, but let the last one close
+      if(fault_open < 0) break;
+      fault_c.every = fault_c.ppm = 0;
+    }
+
+    for(int i = 0; i < len; i++) payload[i] = packets + i;
+    int r = send_packet(&g, &m, payload, len, level);
+    packets++;
+    if(r & 2) lost++;
+    undetected = r == 2 ? undetected + 1 : 0;
+    if(undetected >= FAULT_GIVE_UP){
+      fault_missed();
+      setup(&g);
+      undetected = 0;
+    }
+  }
+  double s = (now_us() - start) / 1e6;
+
+  spi_transfer = bcm2835_spi_transfernb;
+  printf("%u packets in %.1f s, %u lost, %.1f transactions per packet\n", packets, s, lost,
+         packets ? (double)fault_n / packets : 0);
+  fault_report(stdout);
+  write_reg(REG_OP_MODE, LORA_STANDBY);
+  bcm2835_spi_end();
+  bcm2835_close();
+  return 0;
+}
+
+//--------------------------------helper function implementations---------------------------------
+
+void stop(int sig){
+  running = 0;
+}
+
+//programs everything from whatever state the chip is in, through sleep
+//since only sleep can switch between FSK and LoRa
+void setup(const struct target *g){
+  write_reg(REG_OP_MODE, FSK_SLEEP);
+  write_reg(REG_OP_MODE, LORA_SLEEP);
+  write_reg(REG_OP_MODE, LORA_STANDBY);
+  //a shadow that differs everywhere, so the whole image goes out
+  struct reg_image shadow = g->img;
+  for(int i = 0; i < IMAGE_BLOCK_LEN; i++) shadow.block[i] = ~shadow.block[i];
+  shadow.config3 = ~shadow.config3;
+  shadow.detect_opt = ~shadow.detect_opt;
+  shadow.detect_thr = ~shadow.detect_thr;
+  shadow.sync = ~shadow.sync;
+  apply_image(&g->img, &shadow);
+  write_burst(REG_RF_FREQ_MSB_MSB, g->frf, 3);
+  write_reg(REG_FIFO_RX_BASE_ADDR, FIFO_RX_BASE_ADDR);
+  write_reg(REG_FIFO_TX_BASE_ADDR, FIFO_TX_BASE_ADDR);
+  write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+}
+
+//0 if the chip is in standby with the target's settings, -1 if not
+int check(const struct target *g){
+  struct reg_image now;
+  uint8_t frf[3];
+  if(read_reg(REG_OP_MODE) != LORA_STANDBY) return -1;
+  read_image(&now);
+  read_burst(REG_RF_FREQ_MSB_MSB, frf, 3);
+  if(memcmp(&now, &g->img, sizeof(now)) != 0 || memcmp(frf, g->frf, 3) != 0) return -1;
+  if(read_reg(REG_FIFO_TX_BASE_ADDR) != FIFO_TX_BASE_ADDR) return -1;
+  if(read_reg(REG_FIFO_RX_BASE_ADDR) != FIFO_RX_BASE_ADDR) return -1;
+  return 0;
+}
+
+//1 if the packet really went out as it should have: TxDone set, and the
+//chip's settings and FIFO what they should be.  reads around the fault
+//layer
+int truth(const struct target *g, const uint8_t *payload, uint8_t len){
+  uint8_t back[255];
+  fault_suspend();
+  int ok = (read_reg(REG_IRQ_FLAGS) & FLAG_TX_DONE) && check(g) == 0 && read_reg(REG_PAYLOAD_LEN) == len;
+  if(ok){
+    write_reg(REG_FIFO_ADDR_PTR, FIFO_TX_BASE_ADDR);
+    read_burst(REG_FIFO, back, len);
+    ok = memcmp(back, payload, len) == 0;
+  }
+  fault_resume();
+  return ok;
+}
+
+//sends one packet and does the checks, the recovery and the accounting.
+//returns bit 0 set if a check failed and bit 1 if the packet was lost
+int send_packet(const struct target *g, const struct modem_cfg *m, const uint8_t *payload, uint8_t len, int level){
+  int detected = 0;
+  load_fifo_packet(payload, len);
+  if(level >= 2){
+    uint8_t back[255];
+    write_reg(REG_FIFO_ADDR_PTR, FIFO_TX_BASE_ADDR);
+    read_burst(REG_FIFO, back, len);
+    detected = memcmp(back, payload, len) != 0;
+  }
+  int ok = 0;
+  if(!detected){
+    uint64_t tx_start = now_us();
+    write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+    write_reg(REG_OP_MODE, LORA_TX);
+    ok = (wait_irq(FLAG_TX_DONE, tx_start + airtime_us(m, len) + TX_CONFIRM_US, 1000, NULL) & FLAG_TX_DONE) != 0;
+    detected = !ok;
+  }
+  uint64_t checked = fault_n;
+  int lost = !truth(g, payload, len);
+  write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+  if(!detected && level >= 1) detected = check(g) < 0;
+  if(lost) fault_lost();
+  if(!detected){
+    if(!lost) fault_clean(checked);
+    return lost << 1;
+  }
+
+  //a second look before reprogramming: the fault may have been in the
+  //check's reads
+  fault_detected();
+  if(!ok) write_reg(REG_OP_MODE, LORA_STANDBY);
+  int tries = 0;
+  while(check(g) < 0 && tries++ < RECOVER_TRIES) setup(g);
+  if(tries > RECOVER_TRIES) fprintf(stderr, "Still not recovered after %d tries.\n", RECOVER_TRIES);
+  else fault_recovered();
+  return 1 | lost << 1;
+}
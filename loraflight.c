@@ -0,0 +1,374 @@
+/* UCSD CubeSat
+   loraflight.c
+
+   The radio task for the flight computer.  The ground programs print as
+   they go, format the time with the C library and exit() on anything they
+   don't like, which is fine on a Pi with someone watching it and not on
+   the spacecraft.  This is loraTX's beacon with the groundstation's
+   channel and profile commands, built from the same headers with the
+   flight build of sx1278.h:
+
+   $ cc -Os loraflight.c -o loraflight -lbcm2835
+   $ ./flightcheck.sh
+
+   - every buffer has a fixed size, static or on the stack, and nothing
+     is allocated
+   - no stdio and no C library time formatting.  the beacon text is built
+     with arithmetic
+   - every entry point returns 0 or a negative FLIGHT_E or LORA_E code
+     (sx1278.h), and main() returns the last one as its exit status if the
+     radio can't be brought back
+
+   Entry points, the functions the flight software calls:
+   flight_init()     brings the radio up on the flight profile and carrier
+   flight_tick()     applies a channel or profile switch that has come due
+   flight_beacon()   sends one packet and waits for TxDone
+   flight_listen()   listens for a groundstation command after a beacon,
+                     and acks a profile proposal
+   flight_recover()  reprograms the chip from sleep after an error
+
+   main() stands in for the flight software: a beacon every
+   BEACON_PERIOD_US with the count and uptime as text, so loraRX on the
+   ground prints it the way it prints loraTX's beacons.
+
+   Notes on the worst case:
+   flightcheck.sh builds this file, checks it calls nothing it shouldn't,
+   reports its footprint and each entry point's worst case stack, and
+   fails if any of them grew past its budget file.  Built with
+   -DFLIGHT_WCET=<cycles> it runs that many beacon cycles and then writes
+   the longest each entry point took, waits included, and the most SPI
+   bytes it sent, to stderr with write(2) since stdio would change what
+   is being measured.  That needs the radio, so it is
+   sudo ./flightcheck.sh wcet on the Pi.
+
+   ---------------------------------------------------------------------------------------------*/
+
+//------------------------------header files and label definitions------------------------------
+
+#ifndef FLIGHT
+#define FLIGHT
+#endif
+
+#include "sx1278.h"
+#include "frame.h"
+#include <string.h>
+#include <unistd.h>
+
+#ifndef FLIGHT_WCET
+#define FLIGHT_WCET 0          //beacon cycles to measure, 0 runs for good
+#endif
+
+#define BEACON_PERIOD_US   5000000
+#define CHAN_CMD_WINDOW_US 500000      //listen after each beacon, as loraTX -C does
+#define FLIGHT_FREQ_HZ     434000000
+#define FLIGHT_SPI_DIVIDER BCM2835_SPI_CLOCK_DIVIDER_256  //about 1 MHz, 8 us a byte
+#define FLIGHT_SYMB_TIMEOUT 0x64       //reset value
+#define FLIGHT_POLL_US     1000
+#define FLIGHT_MAX_FAILS   3           //failed recoveries in a row before main() gives up
+#define BEACON_TEXT_LEN    64
+
+//entry point failures, next to the LORA_E codes
+#define FLIGHT_ETX     -10   //no TxDone by the deadline
+#define FLIGHT_EVERIFY -11   //the chip doesn't hold what was programmed
+
+//SF7 at 125 kHz, 4/5, crc on and an 8 symbol preamble
+static const struct profile flight_profile = {7, 7, 1, SYNC_WORD_LORA, 0, 1, 8};
+
+//everything the radio task keeps between calls
+struct flight{
+  struct reg_image base;      //the flight profile, what a revert goes back to
+  struct reg_image shadow;    //what the chip holds
+  struct reg_image target;    //armed profile switch
+  struct profile cur_p;
+  struct profile target_p;
+  struct modem_cfg modem;     //for cur_p, the timing math
+  uint32_t freq_hz;
+
+  //channel change the groundstation asked for, applied at switch_at
+  uint16_t cmd_seq;
+  uint32_t switch_hz;
+  uint64_t switch_at;
+
+  //profile switch, applied at profile_at, 0 if nothing is armed
+  uint16_t pcmd_seq;
+  uint64_t profile_at;
+  uint32_t uncommitted;       //beacons on a switched profile without a commit
+};
+
+static struct flight fl;
+static uint8_t packet[255];
+
+#if FLIGHT_WCET
+enum{FE_INIT, FE_TICK, FE_BEACON, FE_LISTEN, FE_RECOVER, FE_COUNT};
+static const char *fe_names[FE_COUNT] = {"flight_init", "flight_tick", "flight_beacon", "flight_listen",
+                                         "flight_recover"};
+static uint32_t fe_us[FE_COUNT];
+static uint32_t fe_bytes[FE_COUNT];
+
+//runs an entry point and keeps its longest time and most SPI bytes
+#define FLIGHT_CALL(e, r, call) do{                                         \
+    uint64_t t_ = now_us();                                                 \
+    uint32_t b_ = spi_bytes;                                                \
+    (r) = (call);                                                           \
+    uint32_t us_ = now_us() - t_;                                           \
+    if(us_ > fe_us[e]) fe_us[e] = us_;                                      \
+    if(spi_bytes - b_ > fe_bytes[e]) fe_bytes[e] = spi_bytes - b_;          \
+  }while(0)
+#else
+#define FLIGHT_CALL(e, r, call) ((r) = (call))
+#endif
+
+//-----------------------------------helper function prototypes----------------------------------
+
+int flight_init(uint32_t freq_hz);
+
+int flight_tick(uint64_t now);
+
+int flight_beacon(const uint8_t *payload, uint8_t len);
+
+int flight_listen(uint32_t window_us);
+
+int flight_recover(void);
+
+int flight_program(void);
+
+int put_dec(char *p, uint32_t v);
+
+uint8_t beacon_text(char *p, uint32_t beacons, uint32_t up_s, uint32_t errors);
+
+void wcet_report(void);
+
+//-----------------------------------------function main-----------------------------------------
+
+int main(void){
+  int r;
+  FLIGHT_CALL(FE_INIT, r, flight_init(FLIGHT_FREQ_HZ));
+  if(r < 0) return -r;
+
+  static char text[BEACON_TEXT_LEN];
+  uint64_t start = now_us(), next = start;
+  uint32_t errors = 0;
+  int fails = 0;
+  for(uint32_t beacons = 1; FLIGHT_WCET == 0 || beacons <= FLIGHT_WCET; beacons++){
+    FLIGHT_CALL(FE_TICK, r, flight_tick(now_us()));
+    if(r == LORA_OK){
+      uint8_t len = beacon_text(text, beacons, (now_us() - start) / 1000000, errors);
+      FLIGHT_CALL(FE_BEACON, r, flight_beacon((const uint8_t *)text, len));
+    }
+    if(r == LORA_OK) FLIGHT_CALL(FE_LISTEN, r, flight_listen(CHAN_CMD_WINDOW_US));
+
+    //reprogram after any error, and give up on a radio that won't take it
+    if(r < 0){
+      errors++;
+      FLIGHT_CALL(FE_RECOVER, r, flight_recover());
+      fails = r < 0 ? fails + 1 : 0;
+      if(fails >= FLIGHT_MAX_FAILS){
+        bcm2835_spi_end();
+        bcm2835_close();
+        return -r;
+      }
+    }
+    next += BEACON_PERIOD_US;
+    sleep_until_us(next);
+  }
+
+  wcet_report();
+  write_reg(REG_OP_MODE, LORA_STANDBY);
+  bcm2835_spi_end();
+  bcm2835_close();
+  return 0;
+}
+
+//--------------------------------helper function implementations---------------------------------
+
+//brings the radio up on the flight profile at freq_hz.  returns LORA_OK or
+//the first error
+int flight_init(uint32_t freq_hz){
+  spi_divider = FLIGHT_SPI_DIVIDER;
+  int r = hardware_init();
+  if(r == LORA_OK) r = lora_init();
+  if(r != LORA_OK) return r;
+  fl.freq_hz = freq_hz;
+  return flight_recover();
+}
+
+//applies a channel change or profile switch that has come due, or falls
+//back to the flight profile if a switch was never committed.  must be
+//called in standby, between beacons
+int flight_tick(uint64_t now){
+  if(fl.switch_hz && now >= fl.switch_at){
+    fl.freq_hz = fl.switch_hz;
+    set_frequency(fl.freq_hz);
+    fl.switch_hz = 0;
+  }
+  if((fl.profile_at && now >= fl.profile_at) || fl.uncommitted >= PROFILE_REVERT_BEACONS){
+    if(fl.uncommitted >= PROFILE_REVERT_BEACONS){
+      fl.target = fl.base;
+      fl.target_p = flight_profile;
+    }
+    apply_image(&fl.target, &fl.shadow);
+    fl.cur_p = fl.target_p;
+    profile_modem(&fl.cur_p, &fl.modem);
+    fl.profile_at = 0;
+    fl.uncommitted = 0;
+  }
+  return LORA_OK;
+}
+
+//sends one packet and waits for TxDone, sleeping through the airtime.
+//returns LORA_OK, or FLIGHT_ETX with the chip back in standby
+int flight_beacon(const uint8_t *payload, uint8_t len){
+  load_fifo_packet(payload, len);
+  write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+  uint32_t air = airtime_us(&fl.modem, len);
+  uint64_t tx_start = now_us();
+  write_reg(REG_OP_MODE, LORA_TX);
+  sleep_until_us(tx_start + air);
+  uint8_t flags = wait_irq(FLAG_TX_DONE, tx_start + air + TX_CONFIRM_US, FLIGHT_POLL_US, NULL);
+  write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+  if(PROBE_ENABLED(tx_done)) PROBE(tx_done, len, (flags & FLAG_TX_DONE) != 0, now_us() - tx_start);
+  if(!(flags & FLAG_TX_DONE)){
+    write_reg(REG_OP_MODE, LORA_STANDBY);
+    return FLIGHT_ETX;
+  }
+  return LORA_OK;
+}
+
+//listens window_us for a channel or profile command, the groundstation
+//answers right after a beacon if it wants us to move.  a profile
+//proposal is acked straight away.  returns the frame type acted on, 0 if
+//none came, and leaves the chip in standby
+int flight_listen(uint32_t window_us){
+  uint64_t until = now_us() + window_us;
+  uint64_t seen;
+  int got = 0;
+  struct channel_cmd cmd;
+  struct profile_cmd pcmd;
+  write_reg(REG_FIFO_ADDR_PTR, FIFO_RX_BASE_ADDR);
+  write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+  write_reg(REG_OP_MODE, LORA_RX_CONT);
+  while(wait_irq(FLAG_RX_DONE, until, symbol_us(&fl.modem), &seen) & FLAG_RX_DONE){
+    uint8_t n = read_fifo_packet(packet);
+    uint8_t f = read_reg(REG_IRQ_FLAGS);
+    write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+    if(f & FLAG_PAYLOAD_CRC) continue;
+    if(unpack_profile_cmd(packet, n, &pcmd) == 0){
+      got = FRAME_PROFILE_CMD;
+      if(pcmd.phase != PROFILE_PROPOSE) break;
+      //ack first, the groundstation is waiting for it
+      pcmd.phase = PROFILE_ACK;
+      uint8_t len = pack_profile_cmd(packet, &pcmd);
+      load_fifo_packet(packet, len);
+      uint64_t tx_start = now_us();
+      write_reg(REG_OP_MODE, LORA_TX);
+      wait_irq(FLAG_TX_DONE, tx_start + airtime_us(&fl.modem, len) + TX_CONFIRM_US, symbol_us(&fl.modem), NULL);
+      write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+      if(pcmd.seq != fl.pcmd_seq){
+        fl.pcmd_seq = pcmd.seq;
+        fl.target_p = pcmd.p;
+        profile_image(&pcmd.p, FLIGHT_SYMB_TIMEOUT, &fl.target);
+        fl.profile_at = seen + pcmd.switch_ms * 1000ULL;
+      }
+      break;
+    }
+    if(unpack_channel_cmd(packet, n, &cmd) < 0) continue;
+    got = FRAME_CHANNEL_CMD;
+    if(cmd.seq != fl.cmd_seq){
+      fl.cmd_seq = cmd.seq;
+      fl.switch_hz = cmd.freq_hz;
+      fl.switch_at = seen + cmd.switch_ms * 1000ULL;
+    }
+    break;
+  }
+  write_reg(REG_OP_MODE, LORA_STANDBY);
+  if(memcmp(&fl.shadow, &fl.base, sizeof(fl.base)) != 0){
+    fl.uncommitted = got == FRAME_PROFILE_CMD ? 0 : fl.uncommitted + 1;
+  }
+  return got;
+}
+
+//back to the flight profile on the current carrier, from whatever state
+//the chip is in, and anything armed is dropped.  returns LORA_OK or the
+//reason the chip doesn't hold it
+int flight_recover(void){
+  profile_image(&flight_profile, FLIGHT_SYMB_TIMEOUT, &fl.base);
+  fl.target = fl.base;
+  fl.cur_p = fl.target_p = flight_profile;
+  profile_modem(&fl.cur_p, &fl.modem);
+  fl.switch_hz = 0;
+  fl.profile_at = 0;
+  fl.uncommitted = 0;
+  return flight_program();
+}
+
+//programs the base image, carrier and FIFO layout through sleep, since
+//only sleep can switch between FSK and LoRa, and reads it all back
+int flight_program(void){
+  write_reg(REG_OP_MODE, FSK_SLEEP);
+  write_reg(REG_OP_MODE, LORA_SLEEP);
+  write_reg(REG_OP_MODE, LORA_STANDBY);
+  //a shadow that differs everywhere, so the whole image goes out
+  for(int i = 0; i < IMAGE_BLOCK_LEN; i++) fl.shadow.block[i] = ~fl.base.block[i];
+  fl.shadow.config3 = ~fl.base.config3;
+  fl.shadow.detect_opt = ~fl.base.detect_opt;
+  fl.shadow.detect_thr = ~fl.base.detect_thr;
+  fl.shadow.sync = ~fl.base.sync;
+  apply_image(&fl.base, &fl.shadow);
+  set_frequency(fl.freq_hz);
+  write_reg(REG_FIFO_RX_BASE_ADDR, FIFO_RX_BASE_ADDR);
+  write_reg(REG_FIFO_TX_BASE_ADDR, FIFO_TX_BASE_ADDR);
+  write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+
+  struct reg_image now;
+  if(read_reg(REG_OP_MODE) != LORA_STANDBY) return LORA_ESTANDBY;
+  read_image(&now);
+  if(memcmp(&now, &fl.base, sizeof(now)) != 0) return FLIGHT_EVERIFY;
+  return LORA_OK;
+}
+
+//writes v in decimal at p.  returns the digits written
+int put_dec(char *p, uint32_t v){
+  char d[10];
+  int n = 0;
+  do{
+    d[n++] = '0' + v % 10;
+    v /= 10;
+  }while(v);
+  for(int i = 0; i < n; i++) p[i] = d[n - 1 - i];
+  return n;
+}
+
+//the beacon payload, e.g. "CubeSat beacon 12 up 60 s errors 0\n".  p must
+//hold BEACON_TEXT_LEN bytes.  returns its length
+uint8_t beacon_text(char *p, uint32_t beacons, uint32_t up_s, uint32_t errors){
+  static const char *parts[] = {"CubeSat beacon ", " up ", " s errors "};
+  uint32_t vals[] = {beacons, up_s, errors};
+  int n = 0;
+  for(int i = 0; i < 3; i++){
+    memcpy(p + n, parts[i], strlen(parts[i]));
+    n += strlen(parts[i]);
+    n += put_dec(p + n, vals[i]);
+  }
+  p[n++] = '\n';
+  return n;
+}
+
+//one "wcet <entry point> <us> <spi bytes>" line each for flightcheck.sh
+void wcet_report(void){
+#if FLIGHT_WCET
+  char line[64];
+  for(int e = 0; e < FE_COUNT; e++){
+    int n = 0;
+    memcpy(line, "wcet ", 5);
+    n += 5;
+    memcpy(line + n, fe_names[e], strlen(fe_names[e]));
+    n += strlen(fe_names[e]);
+    line[n++] = ' ';
+    n += put_dec(line + n, fe_us[e]);
+    line[n++] = ' ';
+    n += put_dec(line + n, fe_bytes[e]);
+    line[n++] = '\n';
+    if(write(2, line, n) < 0) return;
+  }
+#endif
+}
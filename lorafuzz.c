@@ -0,0 +1,600 @@
+/* UCSD CubeSat
+   lorafuzz.c
+
+   Fuzzer for the code that parses bytes we don't control.  Every byte
+   that comes off the air is noise or someone else's (rangetest2.txt has
+   plenty of packets that are neither ours nor readable), and the GPS
+   serial line drops and garbles characters, so those parsers get fed
+   mutated inputs here, millions of them, in process and with no
+   hardware.  It builds with just:
+
+   $ cc -O1 -g -fsanitize=address,undefined -fno-sanitize-recover=all \
+        -fsanitize-coverage=trace-pc -DFUZZ_COVERAGE lorafuzz.c -o lorafuzz
+
+   The sanitizers turn an out of bounds read or undefined behaviour into
+   a crash, and with FUZZ_COVERAGE the fuzzer keeps every input that
+   reaches code the corpus hadn't, so it works its way into the parsers
+   instead of only flipping bytes of the seeds.  Without either, plain
+   cc -O2, it runs fastest and only finds what crashes or breaks a check.
+
+   Targets (-T):
+   frame  a received packet, through everything a receiver runs on it:
+          frame_recognized(), unpack_lat_trailer() and the unpack function
+          for its frame type.  anything that unpacks must pack back into
+          the same bytes
+   nmea   a GPS serial stream through nmea_feed().  a fix it accepts
+          must be a position on the earth at a time of day
+
+   Modes:
+   -c <dir> <file>...  write a seed corpus to dir/frame and dir/nmea:
+                       every packet in the given receiver logs
+                       (rangetest1.txt, rangetest2.txt), one frame of
+                       each type with and without a latency trailer, and
+                       a few GPS sentences
+   -r <path>...        run each file (or every file in each directory)
+                       once, for a regression run over a corpus
+   (default) <path>... fuzz, starting from those files
+
+   Options:
+   -T <target>   frame or nmea (frame)
+   -t <s>        seconds to fuzz (60)
+   -S <seed>     random seed (1)
+
+   A crash or a failed check writes the input to crash-<target>-<n> in
+   the current directory, which -r runs again.
+
+   Notes on libFuzzer:
+   The targets are also LLVMFuzzerTestOneInput(), so with clang the same
+   file builds for libFuzzer, one target per binary:
+
+   $ clang -O1 -g -fsanitize=fuzzer,address,undefined -DFUZZ_LIBFUZZER \
+           -DFUZZ_TARGET=FUZZ_NMEA lorafuzz.c -o fuzz-nmea
+   $ ./fuzz-nmea corpus/nmea
+
+   ---------------------------------------------------------------------------------------------*/
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <signal.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "frame.h"
+#include "nmea.h"
+
+#define FUZZ_FRAME 0
+#define FUZZ_NMEA  1
+#define FUZZ_TARGETS 2
+
+#ifndef FUZZ_TARGET
+#define FUZZ_TARGET FUZZ_FRAME
+#endif
+
+#define FUZZ_MAX_LEN     512     //longest input kept, a couple of GPS sentences
+#define FUZZ_MAX_CORPUS  8192
+#define FUZZ_MAP_SIZE    65536   //coverage map, a power of two
+#define FUZZ_REPORT_US   1000000
+
+static const char *target_names[FUZZ_TARGETS] = {"frame", "nmea"};
+
+struct input{
+  uint16_t len;
+  uint8_t  data[FUZZ_MAX_LEN];
+};
+
+//the input running now, for the crash file
+static const uint8_t *cur_data = NULL;
+static size_t cur_len = 0;
+static int cur_target = FUZZ_TARGET;
+static int crashes = 0;
+
+//a check on a parser's output that failed is a crash like any other
+#define FUZZ_CHECK(cond) do{                                                        \
+    if(!(cond)){                                                                     \
+      fprintf(stderr, "check failed at lorafuzz.c:%d: %s\n", __LINE__, #cond);     \
+      save_crash();                                                                  \
+      abort();                                                                       \
+    }                                                                                \
+  }while(0)
+
+//-----------------------------------helper function prototypes----------------------------------
+
+void save_crash(void);
+
+int fuzz_frame(const uint8_t *data, size_t size);
+
+int fuzz_nmea(const uint8_t *data, size_t size);
+
+int run_target(int target, const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+#ifndef FUZZ_LIBFUZZER
+
+uint32_t fuzz_rand(void);
+
+int load_path(const char *path, struct input *corpus, int *n, int max);
+
+int write_seed(const char *dir, int *n, const uint8_t *data, size_t len);
+
+int write_corpus(const char *dir, char **logs, int nlogs);
+
+size_t mutate(uint8_t *d, size_t len, size_t max, const struct input *corpus, int n);
+
+int fuzz(int target, struct input *corpus, int n, uint32_t seconds);
+
+void on_signal(int sig);
+
+static uint32_t seed = 1;
+
+//edge coverage from -fsanitize-coverage=trace-pc, recorded only while a
+//target runs so the mutator's own branches don't count
+static int cov_on = 0;
+
+#ifdef FUZZ_COVERAGE
+static uint8_t cov_map[FUZZ_MAP_SIZE];
+static uintptr_t cov_prev = 0;
+
+__attribute__((no_sanitize_coverage)) void __sanitizer_cov_trace_pc(void){
+  if(!cov_on) return;
+  uintptr_t pc = (uintptr_t)__builtin_return_address(0);
+  cov_map[(pc ^ cov_prev) & (FUZZ_MAP_SIZE - 1)]++;
+  cov_prev = pc >> 1;
+}
+#endif
+
+//the sanitizers call this before they exit on an error
+extern void __sanitizer_set_death_callback(void (*callback)(void)) __attribute__((weak));
+
+//-----------------------------------------function main-----------------------------------------
+
+int main(int argc, char **argv){
+  int target = FUZZ_FRAME;
+  uint32_t seconds = 60;
+  const char *corpus_dir = NULL;
+  int replay = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "T:t:S:c:r")) != -1){
+    switch(opt){
+      case 'T':
+        target = -1;
+        for(int t = 0; t < FUZZ_TARGETS; t++) if(strcmp(optarg, target_names[t]) == 0) target = t;
+        break;
+      case 't': seconds = strtoul(optarg, NULL, 10); break;
+      case 'S': seed = strtoul(optarg, NULL, 10); break;
+      case 'c': corpus_dir = optarg; break;
+      case 'r': replay = 1; break;
+      default: target = -1;
+    }
+  }
+  if(target < 0 || (corpus_dir && optind >= argc)){
+    printf("usage: %s -c corpus_dir receiver_log...\n"
+           "       %s [-T frame|nmea] -r path...\n"
+           "       %s [-T frame|nmea] [-t seconds] [-S seed] [path...]\n", argv[0], argv[0], argv[0]);
+    return 1;
+  }
+  if(corpus_dir) return write_corpus(corpus_dir, argv + optind, argc - optind) < 0;
+
+  cur_target = target;
+  if(__sanitizer_set_death_callback) __sanitizer_set_death_callback(save_crash);
+  signal(SIGSEGV, on_signal);
+  signal(SIGBUS, on_signal);
+  signal(SIGFPE, on_signal);
+
+  static struct input corpus[FUZZ_MAX_CORPUS];
+  int n = 0;
+  for(int i = optind; i < argc; i++){
+    if(load_path(argv[i], corpus, &n, FUZZ_MAX_CORPUS) < 0){
+      printf("Can't read %s.\n", argv[i]);
+      return 1;
+    }
+  }
+  if(replay){
+    for(int i = 0; i < n; i++) run_target(target, corpus[i].data, corpus[i].len);
+    printf("%d inputs ran clean through %s.\n", n, target_names[target]);
+    return 0;
+  }
+  if(n == 0) corpus[n++].len = 0;
+  return fuzz(target, corpus, n, seconds);
+}
+
+#endif
+
+//--------------------------------helper function implementations---------------------------------
+
+//writes the input that is running to crash-<target>-<n>.  only calls
+//that are safe in a signal handler
+void save_crash(void){
+  char name[64];
+  snprintf(name, sizeof(name), "crash-%s-%d", target_names[cur_target], crashes++);
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) return;
+  if(cur_len && write(fd, cur_data, cur_len) < 0){}
+  close(fd);
+  write(2, "input saved to ", 15);
+  write(2, name, strlen(name));
+  write(2, "\n", 1);
+}
+
+//a packet as loraRX sees it.  the buffer is exactly the packet, so a
+//read past the end is caught
+int fuzz_frame(const uint8_t *data, size_t size){
+  if(size > 255) return 0;
+  uint8_t *buf = malloc(size ? size : 1);
+  memcpy(buf, data, size);
+  uint8_t len = size;
+  uint8_t out[255];
+
+  int recognized = frame_recognized(buf, len);
+  struct lat_trailer t;
+  int n = unpack_lat_trailer(buf, len, &t);
+  if(n >= 0){
+    FUZZ_CHECK(n == len - LAT_TRAILER_LEN);
+    pack_lat_trailer(out, &t);
+    FUZZ_CHECK(memcmp(out, buf + n, LAT_TRAILER_LEN) == 0);
+  }else{
+    n = len;
+  }
+
+  int unpacked = -1;
+  if(n > 0){
+    switch(buf[0]){
+      case FRAME_TDMA_BEACON:{
+        struct tdma_beacon b;
+        if((unpacked = unpack_tdma_beacon(buf, n, &b)) == 0){
+          FUZZ_CHECK(pack_tdma_beacon(out, &b) == n && memcmp(out, buf, n) == 0);
+        }
+        break;
+      }
+      case FRAME_CHANNEL_CMD:{
+        struct channel_cmd c;
+        if((unpacked = unpack_channel_cmd(buf, n, &c)) == 0){
+          FUZZ_CHECK(pack_channel_cmd(out, &c) == n && memcmp(out, buf, n) == 0);
+        }
+        break;
+      }
+      case FRAME_PROFILE_CMD:{
+        struct profile_cmd c;
+        if((unpacked = unpack_profile_cmd(buf, n, &c)) == 0){
+          //only the two flag bits of byte 8 mean anything
+          FUZZ_CHECK(pack_profile_cmd(out, &c) == n && memcmp(out, buf, 8) == 0 &&
+                     out[8] == (buf[8] & 0x03) && memcmp(out + 9, buf + 9, n - 9) == 0);
+        }
+        break;
+      }
+      case FRAME_PING:{
+        struct ping p;
+        if((unpacked = unpack_ping(buf, n, &p)) == 0){
+          FUZZ_CHECK(pack_ping(out, &p, n) == n && memcmp(out, buf, n) == 0);
+        }
+        break;
+      }
+      case FRAME_STREAM:{
+        struct stream_hdr h;
+        int data_len = unpack_stream_header(buf, n, &h);
+        if(data_len >= 0){
+          unpacked = 0;
+          FUZZ_CHECK(data_len == n - STREAM_HEADER_LEN);
+          FUZZ_CHECK(pack_stream_header(out, &h) == STREAM_HEADER_LEN && memcmp(out, buf, STREAM_HEADER_LEN) == 0);
+        }
+        break;
+      }
+    }
+  }
+  //a frame that unpacks is one of ours
+  if(unpacked == 0) FUZZ_CHECK(recognized);
+  free(buf);
+  return 0;
+}
+
+//a GPS serial stream, a character at a time
+int fuzz_nmea(const uint8_t *data, size_t size){
+  struct nmea n;
+  nmea_init(&n);
+  for(size_t i = 0; i < size; i++){
+    int r = nmea_feed(&n, data[i]);
+    FUZZ_CHECK(n.len >= 0 && n.len <= NMEA_MAX_LEN);
+    if(r && n.fix.valid){
+      FUZZ_CHECK(fabs(n.fix.lat) <= 90 && fabs(n.fix.lon) <= 180);
+      FUZZ_CHECK(isfinite(n.fix.alt_m) && n.fix.utc_s < 86400 + 1);
+    }
+  }
+  return 0;
+}
+
+int run_target(int target, const uint8_t *data, size_t size){
+  cur_data = data;
+  cur_len = size;
+  return target == FUZZ_NMEA ? fuzz_nmea(data, size) : fuzz_frame(data, size);
+}
+
+//the libFuzzer entry point, the target FUZZ_TARGET picks
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+  return run_target(FUZZ_TARGET, data, size);
+}
+
+#ifndef FUZZ_LIBFUZZER
+
+//xorshift32, as csma.h's
+uint32_t fuzz_rand(void){
+  uint32_t x = seed ? seed : 0x9E3779B9;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  seed = x;
+  return x;
+}
+
+//adds a file, or every file in a directory, to the corpus.  -1 if the
+//path can't be read
+int load_path(const char *path, struct input *corpus, int *n, int max){
+  struct stat sb;
+  if(stat(path, &sb) < 0) return -1;
+  if(S_ISDIR(sb.st_mode)){
+    DIR *d = opendir(path);
+    if(d == NULL) return -1;
+    struct dirent *e;
+    while((e = readdir(d)) != NULL){
+      if(e->d_name[0] == '.') continue;
+      char sub[1024];
+      snprintf(sub, sizeof(sub), "%s/%s", path, e->d_name);
+      load_path(sub, corpus, n, max);
+    }
+    closedir(d);
+    return 0;
+  }
+  if(*n >= max) return 0;
+  FILE *f = fopen(path, "rb");
+  if(f == NULL) return -1;
+  corpus[*n].len = fread(corpus[*n].data, 1, FUZZ_MAX_LEN, f);
+  fclose(f);
+  (*n)++;
+  return 0;
+}
+
+//one seed file, dir/seed-<n>
+int write_seed(const char *dir, int *n, const uint8_t *data, size_t len){
+  char name[1024];
+  snprintf(name, sizeof(name), "%s/seed-%04d", dir, (*n)++);
+  FILE *f = fopen(name, "wb");
+  if(f == NULL) return -1;
+  fwrite(data, 1, len, f);
+  fclose(f);
+  return 0;
+}
+
+//the seed corpus, from receiver logs and a frame of every kind
+int write_corpus(const char *dir, char **logs, int nlogs){
+  char frame_dir[1024], nmea_dir[1024];
+  snprintf(frame_dir, sizeof(frame_dir), "%s/frame", dir);
+  snprintf(nmea_dir, sizeof(nmea_dir), "%s/nmea", dir);
+  mkdir(dir, 0755);
+  mkdir(frame_dir, 0755);
+  mkdir(nmea_dir, 0755);
+
+  //every distinct packet the receivers printed.  comments and the
+  //receiver's own "No reception." lines aren't packets
+  static char seen[4096][256];
+  int nseen = 0, nframe = 0;
+  for(int i = 0; i < nlogs; i++){
+    FILE *f = fopen(logs[i], "rb");
+    if(f == NULL){
+      printf("Can't open %s.\n", logs[i]);
+      return -1;
+    }
+    char line[1024];
+    while(fgets(line, sizeof(line), f)){
+      size_t len = strcspn(line, "\n");
+      if(len > 255) len = 255;
+      line[len] = '\0';
+      if(len == 0 || line[0] == '#' || strcmp(line, "No reception.") == 0) continue;
+      int dup = 0;
+      for(int k = 0; k < nseen && !dup; k++) dup = strcmp(seen[k], line) == 0;
+      if(dup || nseen >= 4096) continue;
+      strcpy(seen[nseen++], line);
+      write_seed(frame_dir, &nframe, (uint8_t *)line, len);
+    }
+    fclose(f);
+  }
+  int logged = nframe;
+
+  //one of each frame type, and each again with a latency trailer
+  uint8_t buf[255];
+  uint8_t lens[6];
+  uint8_t frames[6][255];
+  struct tdma_beacon b = {7, 4, 5000000, 1000000, 20000, 1536000000000000ULL};
+  struct channel_cmd c = {3, 434500000, 2000};
+  struct profile_cmd pc = {9, PROFILE_PROPOSE, {9, 7, 1, 0x12, 0, 1, 8}, 500};
+  struct ping p = {42, 1, PING_ECHO, 1234};
+  struct stream_hdr h = {100, 0};
+  lens[0] = pack_tdma_beacon(frames[0], &b);
+  lens[1] = pack_channel_cmd(frames[1], &c);
+  lens[2] = pack_profile_cmd(frames[2], &pc);
+  lens[3] = pack_ping(frames[3], &p, 32);
+  lens[4] = pack_stream_header(frames[4], &h);
+  memcpy(frames[4] + lens[4], "stream data", 11);
+  lens[4] += 11;
+  //and a plain beacon as loraTX sends it
+  lens[5] = 24;
+  memcpy(frames[5], "Tue Sep  4 05:42:42 2018", lens[5]);
+  struct lat_trailer t = {1536000000000000ULL, 800, 1200};
+  for(int i = 0; i < 6; i++){
+    write_seed(frame_dir, &nframe, frames[i], lens[i]);
+    memcpy(buf, frames[i], lens[i]);
+    pack_lat_trailer(buf + lens[i], &t);
+    write_seed(frame_dir, &nframe, buf, lens[i] + LAT_TRAILER_LEN);
+  }
+
+  //GPS sentences, a fix from each of GGA and RMC and a lost fix
+  static const char *sentences[] = {
+    "GPGGA,123519,3252.6200,N,11714.1400,W,1,08,0.9,120.4,M,-34.0,M,,",
+    "GNRMC,123520,A,3252.6210,N,11714.1390,W,22.4,084.4,040918,,",
+    "GPRMC,123521,V,,,,,,,040918,,",
+    "GPGGA,123522,,,,,0,00,,,M,,M,,"
+  };
+  int nnmea = 0;
+  char all[FUZZ_MAX_LEN] = "";
+  for(size_t i = 0; i < sizeof(sentences) / sizeof(sentences[0]); i++){
+    uint8_t sum = 0;
+    for(const char *s = sentences[i]; *s; s++) sum ^= *s;
+    char line[128];
+    int len = snprintf(line, sizeof(line), "$%s*%02X\r\n", sentences[i], sum);
+    write_seed(nmea_dir, &nnmea, (uint8_t *)line, len);
+    strncat(all, line, sizeof(all) - strlen(all) - 1);
+  }
+  write_seed(nmea_dir, &nnmea, (uint8_t *)all, strlen(all));
+
+  printf("%d frame seeds (%d from the logs) and %d nmea seeds in %s.\n", nframe, logged, nnmea, dir);
+  return 0;
+}
+
+//bytes a mutation likes to write: frame types, the trailer magic and
+//what NMEA is made of
+static const uint8_t interesting[] = {
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x1F, 0x20, 0x7E, 0x7F, 0x80, 0xFF, LAT_MAGIC0, LAT_MAGIC1,
+  '$', '*', ',', '.', '\r', '\n', 'A', 'V', 'N', 'S', 'E', 'W', '0', '9', '-'
+};
+
+//applies one to four random mutations to d in place.  returns the new
+//length, at most max
+size_t mutate(uint8_t *d, size_t len, size_t max, const struct input *corpus, int n){
+  int k = 1 + fuzz_rand() % 4;
+  while(k--){
+    size_t pos = len ? fuzz_rand() % len : 0;
+    switch(fuzz_rand() % 8){
+      case 0:  //flip a bit
+        if(len) d[pos] ^= 1 << (fuzz_rand() % 8);
+        break;
+      case 1:  //random byte
+        if(len) d[pos] = fuzz_rand();
+        break;
+      case 2:  //interesting byte
+        if(len) d[pos] = interesting[fuzz_rand() % sizeof(interesting)];
+        break;
+      case 3:  //insert a byte
+        if(len < max){
+          memmove(d + pos + 1, d + pos, len - pos);
+          d[pos] = fuzz_rand() % 2 ? interesting[fuzz_rand() % sizeof(interesting)] : fuzz_rand();
+          len++;
+        }
+        break;
+      case 4:  //erase a run
+        if(len){
+          size_t run = 1 + fuzz_rand() % (len - pos);
+          memmove(d + pos, d + pos + run, len - pos - run);
+          len -= run;
+        }
+        break;
+      case 5:  //copy a run within the input
+        if(len > 1){
+          size_t from = fuzz_rand() % len;
+          size_t run = 1 + fuzz_rand() % (len - (from > pos ? from : pos));
+          memmove(d + pos, d + from, run);
+        }
+        break;
+      case 6:{ //splice in the tail of another input
+        const struct input *o = &corpus[fuzz_rand() % n];
+        size_t from = o->len ? fuzz_rand() % o->len : 0;
+        size_t run = o->len - from;
+        if(pos + run > max) run = max - pos;
+        memcpy(d + pos, o->data + from, run);
+        len = pos + run;
+        break;
+      }
+      case 7:  //a boundary value in a little endian field
+        if(len >= 4){
+          static const uint32_t edges[] = {0, 1, 0x7FFFFFFF, 0x80000000, 0xFFFFFFFF, 410000000, 525000000};
+          uint32_t v = edges[fuzz_rand() % (sizeof(edges) / sizeof(edges[0]))];
+          pos = fuzz_rand() % (len - 3);
+          put32(d + pos, v);
+        }
+        break;
+    }
+  }
+  return len;
+}
+
+//mutates corpus entries for the given time, keeping the ones that find
+//new coverage.  returns 0, a crash ends the process
+int fuzz(int target, struct input *corpus, int n, uint32_t seconds){
+  size_t max = target == FUZZ_FRAME ? 255 : FUZZ_MAX_LEN;
+  uint64_t execs = 0, last_execs = 0, last_t;
+  uint32_t edges = 0;
+#ifdef FUZZ_COVERAGE
+  static uint8_t virgin[FUZZ_MAP_SIZE];
+#endif
+  uint64_t start = now_us(), end = start + seconds * 1000000ULL;
+  last_t = start;
+  struct input in;
+
+  //the seeds' own coverage first
+  for(int i = 0; i < n; i++){
+    cov_on = 1;
+    run_target(target, corpus[i].data, corpus[i].len);
+    cov_on = 0;
+  }
+#ifdef FUZZ_COVERAGE
+  for(int i = 0; i < FUZZ_MAP_SIZE; i++){
+    if(cov_map[i]) edges++;
+    virgin[i] = cov_map[i] != 0;
+  }
+  memset(cov_map, 0, sizeof(cov_map));
+#endif
+  fprintf(stderr, "Fuzzing %s from %d inputs, %u edges.\n", target_names[target], n, edges);
+
+  while(1){
+    for(int i = 0; i < 1000; i++){
+      const struct input *src = &corpus[fuzz_rand() % n];
+      memcpy(in.data, src->data, src->len);
+      in.len = mutate(in.data, src->len < max ? src->len : max, max, corpus, n);
+#ifdef FUZZ_COVERAGE
+      cov_prev = 0;
+#endif
+      cov_on = 1;
+      run_target(target, in.data, in.len);
+      cov_on = 0;
+      execs++;
+#ifdef FUZZ_COVERAGE
+      //keep it if it reached an edge nothing before it has
+      int fresh = 0;
+      for(int e = 0; e < FUZZ_MAP_SIZE; e += 8){
+        if(*(uint64_t *)(cov_map + e) == 0) continue;
+        for(int b = e; b < e + 8; b++){
+          if(cov_map[b] && !virgin[b]){
+            virgin[b] = 1;
+            edges++;
+            fresh = 1;
+          }
+        }
+      }
+      memset(cov_map, 0, sizeof(cov_map));
+      if(fresh && n < FUZZ_MAX_CORPUS) corpus[n++] = in;
+#endif
+    }
+    uint64_t t = now_us();
+    if(t >= last_t + FUZZ_REPORT_US || t >= end){
+      fprintf(stderr, "%8.1fs %12llu execs %10.0f/s  corpus %d  edges %u\n", (t - start) / 1e6,
+              (unsigned long long)execs, (execs - last_execs) / ((t - last_t) / 1e6), n, edges);
+      last_execs = execs;
+      last_t = t;
+    }
+    if(t >= end) break;
+  }
+  printf("%s: %llu execs in %u s, %.0f/s, corpus %d, %u edges, no crashes\n", target_names[target],
+         (unsigned long long)execs, seconds, execs / ((now_us() - start) / 1e6), n, edges);
+  return 0;
+}
+
+//a crash the sanitizers didn't catch
+void on_signal(int sig){
+  save_crash();
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+#endif
@@ -0,0 +1,281 @@
+/* UCSD CubeSat
+   lorahunt.c
+
+   Hunt mode for a transmitter whose modem settings we don't know, like a
+   satellite that has come up in some fallback configuration.  It cycles
+   through every combination of the spreading factors and bandwidths
+   given, runs channel activity detection at each one, and when CAD sees a
+   preamble it drops into a short Rx window to try to decode the packet.
+   Once one decodes it reports the settings and stops.  Build it like the
+   other radio programs:
+
+   $ cc lorahunt.c -o lorahunt -lbcm2835
+
+   Notes on what is searched:
+   CAD looks for the chirps of a preamble, which depend only on the
+   spreading factor and bandwidth, so those two make up the sweep.  The
+   sync word is only checked after the preamble, and in explicit header
+   mode the coding rate comes in the header, so neither needs a CAD of its
+   own.  Instead every SF/BW combination keeps a cursor into the list of
+   sync words (and coding rates with -I, where there is no header to read
+   it from) and each detection there tries the next candidate.  A packet
+   whose header checks out has the right sync word even if its payload
+   crc fails; that is reported and the same candidate kept.
+
+   Notes on switch time:
+   Every combination is turned into its register image (profile.h) before
+   the hunt starts, and apply_image() only sends what differs from the
+   last one.  The sweep runs bandwidth fastest, so most steps change the
+   one RegModemConfig1 byte, a single 2 byte transaction.  A step is that,
+   clearing the irq flags, the CAD itself (about two symbols) and polling
+   for CadDone.  At start the program prints how long a full pass should
+   take and warns if it is longer than the beacon interval -i, since a
+   transmitter sending one beacon per interval could then slip through
+   every pass.  Slow spreading factors dominate: one CAD at SF12 and
+   62.5 kHz is as long as a hundred at SF7 and 500 kHz.  Run the SPI bus
+   faster with -c to shave the rest.
+
+   Options:
+   -f <kHz>       carrier (434000)
+   -s <sf,...>    spreading factors (7,8,9,10,11,12)
+   -b <kHz,...>   bandwidths (62.5,125,250,500)
+   -y <hex,...>   sync words (12,34)
+   -I <len>       implicit header packets of this length, also hunts coding rates
+   -w <symbols>   Rx window after a detection (16)
+   -i <ms>        beacon interval to cover a pass in (10000)
+   -k             keep hunting after a decode
+   -c <div>       SPI clock divider (65536)
+
+   ---------------------------------------------------------------------------------------------*/
+
+//------------------------------header files and label definitions------------------------------
+
+#include "sx1278.h"
+#include "csma.h"
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+
+#define HUNT_MAX_COMBOS  70     //7 spreading factors by 10 bandwidths
+#define HUNT_MAX_SYNCS   16
+#define HUNT_REPORT_EVERY 20    //passes between reports
+
+//one point of the CAD sweep
+struct combo{
+  struct profile p;
+  struct reg_image cad;          //the image CAD runs with
+  struct modem_cfg m;
+  uint32_t cad_us;
+  uint32_t cursor;               //next sync word and coding rate candidate
+  uint32_t detections;
+};
+
+//-----------------------------------helper function prototypes----------------------------------
+
+int parse_list(const char *s, double *v, int max);
+
+int try_rx(struct combo *c, const uint8_t *syncs, int nsync, int ncr, uint8_t implicit_len,
+           uint16_t window, struct reg_image *shadow);
+
+void stop(int sig);
+
+//cleared by the signal handler to end the hunt
+volatile sig_atomic_t running = 1;
+
+//-----------------------------------------function main-----------------------------------------
+
+int main(int argc, char **argv){
+  uint32_t freq_khz = 434000;
+  double sfs[8], bws[10];
+  int nsf = parse_list("7,8,9,10,11,12", sfs, 8);
+  int nbw = parse_list("62.5,125,250,500", bws, 10);
+  int nsync = 2;
+  uint8_t syncs[HUNT_MAX_SYNCS] = {SYNC_WORD_LORA, 0x34};
+  uint8_t implicit_len = 0;
+  uint16_t window = 16;
+  uint32_t interval_ms = 10000;
+  int keep = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "f:s:b:y:I:w:i:kc:")) != -1){
+    switch(opt){
+      case 'f': freq_khz = strtoul(optarg, NULL, 10); break;
+      case 's': nsf = parse_list(optarg, sfs, 8); break;
+      case 'b': nbw = parse_list(optarg, bws, 10); break;
+      case 'y':
+        //sync words are hex, read them as such
+        nsync = 0;
+        for(char *p = optarg; *p && nsync < HUNT_MAX_SYNCS; ){
+          char *end;
+          syncs[nsync] = strtoul(p, &end, 16);
+          if(end == p) break;
+          nsync++;
+          p = *end == ',' ? end + 1 : end;
+        }
+        break;
+      case 'I': implicit_len = strtoul(optarg, NULL, 10); break;
+      case 'w': window = strtoul(optarg, NULL, 10); break;
+      case 'i': interval_ms = strtoul(optarg, NULL, 10); break;
+      case 'k': keep = 1; break;
+      case 'c': spi_divider = strtoul(optarg, NULL, 10); break;
+      default:
+        nsf = 0;
+    }
+  }
+  if(nsf < 1 || nbw < 1 || nsync < 1 || nsf * nbw > HUNT_MAX_COMBOS){
+    printf("usage: %s [-f kHz] [-s sf,...] [-b kHz,...] [-y hex,...] [-I len] [-w symbols]\n"
+           "       [-i interval_ms] [-k] [-c spi_divider]\n"
+           "at most %d combinations (spreading factors x bandwidths)\n", argv[0], HUNT_MAX_COMBOS);
+    return 1;
+  }
+
+  //every combination and its image, worked out before touching the radio
+  static struct combo combos[HUNT_MAX_COMBOS];
+  int n = 0;
+  for(int i = 0; i < nsf; i++){
+    for(int j = 0; j < nbw; j++){
+      int bw = bw_index((uint32_t)(bws[j] * 1000));
+      if(sfs[i] < 6 || sfs[i] > 12 || bw < 0){
+        printf("SF%g at %g kHz isn't something the SX1278 does.\n", sfs[i], bws[j]);
+        return 1;
+      }
+      struct combo *c = &combos[n++];
+      c->p = (struct profile){(uint8_t)sfs[i], (uint8_t)bw, 1, syncs[0], implicit_len > 0, 0, 8};
+      //SF6 only works in implicit header mode
+      if(c->p.sf == 6) c->p.implicit = 1;
+      profile_image(&c->p, window, &c->cad);
+      profile_modem(&c->p, &c->m);
+      c->cad_us = cad_us(&c->m);
+    }
+  }
+
+  hardware_init();  //setup spi
+  lora_init();      //boot sequence to LoRa standby
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+  set_frequency(freq_khz * 1000);
+  if(implicit_len) write_reg(REG_PAYLOAD_LEN, implicit_len);
+  write_reg(REG_FIFO_RX_BASE_ADDR, FIFO_RX_BASE_ADDR);
+  struct reg_image shadow;
+  read_image(&shadow);
+
+  //what a pass should cost: CAD time plus the bytes each switch sends
+  uint64_t pass_us = 0;
+  for(int i = 0; i < n; i++){
+    //clear flags, CAD and at least one flag read on top of the switch
+    uint32_t bytes = image_bytes(&combos[i].cad, &combos[(i + n - 1) % n].cad) + 2 + 2 + 2;
+    pass_us += combos[i].cad_us + (uint64_t)bytes * 8 * 1000000 / spi_clock_hz();
+  }
+  fprintf(stderr, "Hunting %d SF/BW combinations, %d sync words%s at %u kHz.  a pass should take %.1f ms%s\n",
+          n, nsync, implicit_len ? " and 4 coding rates" : "", freq_khz, pass_us / 1000.0,
+          pass_us > (uint64_t)interval_ms * 1000 ? ", longer than the beacon interval" : "");
+
+  uint64_t switch_us = 0, cad_time = 0, switch_bytes = 0;
+  uint32_t passes = 0, steps = 0;
+  uint64_t began = now_us();
+  int found = 0;
+  while(running && (!found || keep)){
+    for(int i = 0; i < n && running; i++){
+      struct combo *c = &combos[i];
+      uint64_t t0 = now_us();
+      switch_bytes += apply_image(&c->cad, &shadow);
+      write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+      write_reg(REG_OP_MODE, LORA_CAD);
+      uint64_t t1 = now_us();
+      uint8_t flags = wait_irq(FLAG_CAD_DONE, t1 + c->cad_us + CAD_TIMEOUT_US, symbol_us(&c->m) / 2, NULL);
+      uint64_t t2 = now_us();
+      switch_us += t1 - t0;
+      cad_time += t2 - t1;
+      steps++;
+      if(!(flags & FLAG_CAD_DETECTED)) continue;
+
+      c->detections++;
+      int r = try_rx(c, syncs, nsync, implicit_len ? 4 : 1, implicit_len, window, &shadow);
+      if(r > 0){
+        found = 1;
+        if(!keep) break;
+      }
+    }
+    passes++;
+    if(passes % HUNT_REPORT_EVERY == 0 || (found && !keep) || !running){
+      fprintf(stderr, "Hunt: %u passes, %.1f ms a pass, per step switch %.0f us (%.1f bytes), CAD %.0f us\n",
+              passes, (now_us() - began) / 1000.0 / passes, (double)switch_us / steps,
+              (double)switch_bytes / steps, (double)cad_time / steps);
+    }
+  }
+  write_reg(REG_OP_MODE, LORA_STANDBY);
+  for(int i = 0; i < n; i++){
+    char name[48];
+    if(combos[i].detections) fprintf(stderr, "  %s: %u detections\n", profile_name(&combos[i].p, name),
+                                     combos[i].detections);
+  }
+  bcm2835_spi_end();
+  bcm2835_close();
+  return found ? 0 : 1;
+}
+
+//--------------------------------helper function implementations---------------------------------
+
+//comma separated numbers, returns how many
+int parse_list(const char *s, double *v, int max){
+  int n = 0;
+  while(*s && n < max){
+    char *end;
+    v[n] = strtod(s, &end);
+    if(end == s) return -1;
+    n++;
+    s = *end == ',' ? end + 1 : end;
+  }
+  return n;
+}
+
+//after CAD saw a preamble: opens an Rx window with the combination's next
+//sync word and coding rate candidate.  returns 1 when a packet decoded, 0
+//when a header did but the crc failed, -1 when nothing did.  the chip is
+//left in standby
+int try_rx(struct combo *c, const uint8_t *syncs, int nsync, int ncr, uint8_t implicit_len,
+           uint16_t window, struct reg_image *shadow){
+  struct profile p = c->p;
+  uint32_t k = c->cursor % (nsync * ncr);
+  p.sync = syncs[k % nsync];
+  p.cr = ncr > 1 ? 1 + k / nsync : p.cr;
+  struct reg_image img;
+  profile_image(&p, window, &img);
+  apply_image(&img, shadow);
+  write_reg(REG_FIFO_ADDR_PTR, FIFO_RX_BASE_ADDR);
+  write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+  write_reg(REG_OP_MODE, LORA_RX_SINGLE);
+
+  //the window plus the longest packet there could be
+  struct modem_cfg m;
+  profile_modem(&p, &m);
+  uint64_t deadline = now_us() + (uint64_t)window * symbol_us(&m) + airtime_us(&m, 255);
+  uint8_t flags = wait_irq(FLAG_RX_DONE | FLAG_RX_TIMEOUT, deadline, symbol_us(&m), NULL);
+  write_reg(REG_OP_MODE, LORA_STANDBY);
+
+  char name[48];
+  if(!(flags & FLAG_RX_DONE)){
+    c->cursor++;
+    return -1;
+  }
+  uint8_t buf[255];
+  uint8_t len = read_fifo_packet(buf);
+  int16_t rssi = packet_rssi();
+  double snr = packet_snr();
+  if(!implicit_len) p.cr = read_reg(REG_MODEM_STAT) >> 5;
+  write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+  if(flags & FLAG_PAYLOAD_CRC){
+    printf("Header at %s but the payload crc failed, %u bytes, %d dBm, %.2f dB snr\n",
+           profile_name(&p, name), len, rssi, snr);
+    return 0;
+  }
+  printf("Found %s: %u bytes, %d dBm, %.2f dB snr\n", profile_name(&p, name), len, rssi, snr);
+  for(int i = 0; i < len; i++) printf("%c", buf[i] >= 0x20 && buf[i] < 0x7F ? buf[i] : '.');
+  printf("\n");
+  fflush(stdout);
+  return 1;
+}
+
+//signal handler that lets the hunt report
+void stop(int sig){
+  running = 0;
+}
@@ -0,0 +1,239 @@
+/* UCSD CubeSat
+   loralog.c
+
+   Decoder for the binary logs binlog.h writes (loraTX -R, loraRX -R).
+   The programs store each call site's format once and then only raw
+   arguments, so all of the printf() work happens here, after the fact.
+   It needs no hardware, so it builds anywhere with:
+
+   $ cc loralog.c -o loralog
+
+   Modes:
+   (default)  one line per record: seconds since the log was opened, the
+              thread's ring, the level, file:line and the formatted text
+   -c         counts per call site instead, most frequent first, with the
+              mean interval between calls.  a quick way to see which
+              registers a mode keeps hitting
+
+   Options:
+   -l <level> skip records below a level: 0 trace, 1 debug, 2 info, 3 warn
+   -a         print wall clock times instead of seconds since the start
+
+   Dropped records, from a ring that filled up before the writer got to
+   it, are reported in place and in total at the end.
+
+   ---------------------------------------------------------------------------------------------*/
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "binlog.h"
+
+static const char *level_names[] = {"TRACE", "DEBUG", "INFO", "WARN"};
+
+//a call site as the file describes it
+struct site{
+  uint8_t level;
+  uint8_t nargs;
+  uint16_t line;
+  char *file;
+  char *fmt;
+  uint32_t count;
+  uint64_t first_ns, last_ns;
+};
+
+//-----------------------------------helper function prototypes----------------------------------
+
+int get_le(FILE *f, int bytes, uint64_t *v);
+
+char *get_str(FILE *f);
+
+void format_args(FILE *out, const char *fmt, const uint64_t *a, int nargs);
+
+int cmp_count(const void *a, const void *b);
+
+//-----------------------------------------function main-----------------------------------------
+
+int main(int argc, char **argv){
+  int counts = 0;
+  int min_level = BL_TRACE;
+  int wall = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "cl:a")) != -1){
+    switch(opt){
+      case 'c': counts = 1; break;
+      case 'l': min_level = atoi(optarg); break;
+      case 'a': wall = 1; break;
+      default:
+        printf("usage: %s [-c] [-l level] [-a] file\n", argv[0]);
+        return 1;
+    }
+  }
+  if(optind >= argc){
+    printf("usage: %s [-c] [-l level] [-a] file\n", argv[0]);
+    return 1;
+  }
+
+  FILE *f = fopen(argv[optind], "rb");
+  char magic[4];
+  uint64_t wall0, mono0;
+  if(f == NULL || fread(magic, 1, 4, f) != 4 || memcmp(magic, BL_MAGIC, 4) != 0 ||
+     get_le(f, 8, &wall0) < 0 || get_le(f, 8, &mono0) < 0){
+    printf("%s is not a binary log.\n", argv[optind]);
+    return 1;
+  }
+
+  static struct site sites[BL_MAX_SITES];
+  uint64_t dropped = 0, records = 0;
+  int type;
+  while((type = fgetc(f)) != EOF){
+    uint64_t id, v, t, thread;
+    if(type == 'S'){
+      uint64_t level, nargs, line;
+      if(get_le(f, 2, &id) < 0 || get_le(f, 1, &level) < 0 || get_le(f, 1, &nargs) < 0 ||
+         get_le(f, 2, &line) < 0 || id >= BL_MAX_SITES || nargs > BL_MAX_ARGS) break;
+      struct site *s = &sites[id];
+      s->level = level;
+      s->nargs = nargs;
+      s->line = line;
+      if((s->file = get_str(f)) == NULL || (s->fmt = get_str(f)) == NULL) break;
+    }else if(type == 'E'){
+      uint64_t a[BL_MAX_ARGS];
+      if(get_le(f, 2, &id) < 0 || get_le(f, 1, &thread) < 0 || get_le(f, 8, &t) < 0 ||
+         id >= BL_MAX_SITES || sites[id].fmt == NULL) break;
+      struct site *s = &sites[id];
+      int k;
+      for(k = 0; k < s->nargs && get_le(f, 8, &a[k]) == 0; k++){}
+      if(k < s->nargs) break;
+      records++;
+      if(s->count++ == 0) s->first_ns = t;
+      s->last_ns = t;
+      if(counts || s->level < min_level) continue;
+      if(wall){
+        uint64_t ns = wall0 + (t - mono0);
+        time_t sec = ns / 1000000000;
+        char stamp[32];
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", gmtime(&sec));
+        printf("%s.%06u", stamp, (unsigned)(ns % 1000000000 / 1000));
+      }else{
+        printf("%12.6f", (t - mono0) / 1e9);
+      }
+      printf(" %u %-5s %s:%u  ", (unsigned)thread, level_names[s->level < 4 ? s->level : 3], s->file, s->line);
+      format_args(stdout, s->fmt, a, s->nargs);
+      putchar('\n');
+    }else if(type == 'D'){
+      if(get_le(f, 1, &thread) < 0 || get_le(f, 4, &v) < 0) break;
+      dropped += v;
+      if(!counts) printf("%12s %u dropped %u records\n", "", (unsigned)thread, (unsigned)v);
+    }else{
+      break;
+    }
+  }
+  if(!feof(f)) fprintf(stderr, "Stopped at a damaged record, offset %ld.\n", ftell(f));
+  fclose(f);
+
+  if(counts){
+    static struct site *order[BL_MAX_SITES];
+    int n = 0;
+    for(int i = 0; i < BL_MAX_SITES; i++){
+      if(sites[i].count) order[n++] = &sites[i];
+    }
+    qsort(order, n, sizeof(order[0]), cmp_count);
+    printf("%10s %12s %-5s %s\n", "count", "interval us", "level", "site");
+    for(int i = 0; i < n; i++){
+      struct site *s = order[i];
+      double interval = s->count > 1 ? (s->last_ns - s->first_ns) / 1e3 / (s->count - 1) : 0;
+      printf("%10u %12.1f %-5s %s:%u  %s\n", s->count, interval, level_names[s->level < 4 ? s->level : 3],
+             s->file, s->line, s->fmt);
+    }
+  }
+  printf("%llu records, %llu dropped\n", (unsigned long long)records, (unsigned long long)dropped);
+  return 0;
+}
+
+//--------------------------------helper function implementations---------------------------------
+
+//reads a little endian field, -1 at the end of the file
+int get_le(FILE *f, int bytes, uint64_t *v){
+  *v = 0;
+  for(int i = 0; i < bytes; i++){
+    int c = fgetc(f);
+    if(c == EOF) return -1;
+    *v |= (uint64_t)c << (8 * i);
+  }
+  return 0;
+}
+
+//reads a u16 length and that many characters, NULL if the file ends first
+char *get_str(FILE *f){
+  uint64_t len;
+  if(get_le(f, 2, &len) < 0) return NULL;
+  char *s = malloc(len + 1);
+  if(s == NULL || fread(s, 1, len, f) != len){
+    free(s);
+    return NULL;
+  }
+  s[len] = '\0';
+  return s;
+}
+
+//prints a site's format with its stored arguments.  each conversion is
+//handed to printf on its own, widened to the 64 bit value it was stored as
+void format_args(FILE *out, const char *fmt, const uint64_t *a, int nargs){
+  int next = 0;
+  for(const char *p = fmt; *p; p++){
+    if(*p != '%'){
+      fputc(*p, out);
+      continue;
+    }
+    if(p[1] == '%'){
+      fputc('%', out);
+      p++;
+      continue;
+    }
+    //flags, width and precision are kept, the length modifier replaced
+    char spec[32] = "%";
+    int n = 1;
+    p++;
+    while(*p && strchr("-+ #0123456789.", *p) && n < 24) spec[n++] = *p++;
+    while(*p && strchr("hlLqjzt", *p)) p++;
+    if(*p == '\0') break;
+    uint64_t v = next < nargs ? a[next++] : 0;
+    switch(*p){
+      case 'd': case 'i':
+        strcpy(spec + n, "lld");
+        fprintf(out, spec, (long long)v);
+        break;
+      case 'u': case 'x': case 'X': case 'o':
+        spec[n++] = 'l';
+        spec[n++] = 'l';
+        spec[n++] = *p;
+        spec[n] = '\0';
+        fprintf(out, spec, (unsigned long long)v);
+        break;
+      case 'c':
+        strcpy(spec + n, "c");
+        fprintf(out, spec, (int)v);
+        break;
+      case 'e': case 'f': case 'g': case 'E': case 'F': case 'G':
+        //stored as an integer, so the fraction is already gone
+        spec[n++] = *p;
+        spec[n] = '\0';
+        fprintf(out, spec, (double)(long long)v);
+        break;
+      default:
+        //%s and %p stored an address from another process
+        fprintf(out, "<%%%c 0x%llx>", *p, (unsigned long long)v);
+        break;
+    }
+  }
+}
+
+//most frequent site first
+int cmp_count(const void *a, const void *b){
+  const struct site *x = *(struct site *const *)a, *y = *(struct site *const *)b;
+  return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
@@ -0,0 +1,452 @@
+/* UCSD CubeSat
+   loraping.c
+
+   Ping-pong benchmark over real modules (pingpong.h).  Run it with -e on
+   one node to echo and without on the other to ping:
+
+   $ cc loraping.c -o loraping -lbcm2835
+   $ sudo ./loraping -e                     (echoer)
+   $ sudo ./loraping -s 7,9 -b 125,250     (pinger)
+
+   The pinger goes through every spreading factor, bandwidth and probe
+   length given, bandwidth fastest and length fastest of all, sends -n
+   probes at each and prints the table from pp_report(): loss, rtt
+   percentiles, the overhead on top of airtime, the echoer's turnaround
+   and the goodput.  The echoer prints its own turnaround every
+   PING_REPORT_EVERY echoes and when stopped.
+
+   Notes on profiles:
+   Both ends start on whatever the chip holds after lora_init() (the
+   reset settings, SF7 125 kHz) with the payload crc turned on, so a
+   damaged probe can be told from a lost one.  To move to a step's
+   profile the pinger sends the FRAME_PROFILE_CMD proposal loraRX -U
+   uses (profile.h) on the current one, the echoer acks, and both apply
+   the new image PING_SWITCH_MS after the proposal.  There are no
+   commits: the echoer goes back to the base profile on its own once it
+   has heard nothing for PING_IDLE_US, and a pinger that loses the ack
+   falls back and waits that out, so the two always meet again on the
+   base.
+
+   Notes on timestamps:
+   RxDone is seen on DIO0 with -D, which costs no SPI, or by polling
+   RegIrqFlags every PING_POLL_US, which adds half that on average to
+   every rtt.  The echoer's turnaround is its RxDone to the SPI write that
+   puts it in Tx, so it includes reading the probe out of the FIFO,
+   writing the echo back in and the mode changes, all at the SPI clock
+   (-c, very slow by default).
+
+   Notes on the fast path:
+   With -F the echoer uses the fast reply path in sx1278.h.  After every
+   echo it guesses that the next probe will be the same size with the
+   next sequence number and stages that echo in the FIFO while it
+   listens, so the moment a probe of that size passes its crc the echo
+   goes out with no more than five SPI bytes, and the probe is read out
+   while it is on the air.  A wrong guess (the probe after a lost one)
+   sends the staged echo anyway, which the pinger drops as stale, and the
+   right reply follows on the normal path, as it does for the first probe
+   of a step, whose size is new.  Probes over half the FIFO, 128 bytes,
+   always take the normal path.  The echoer prints the turnaround budget
+   at start and the measured fast turnaround next to the normal one.
+
+   Options:
+   -e             echo instead of ping
+   -F             echo on the fast reply path
+   -f <kHz>       carrier (434000)
+   -s <sf,...>    spreading factors (7)
+   -b <kHz,...>   bandwidths (125)
+   -l <len,...>   probe lengths (9,32,64,128,255)
+   -n <count>     probes per step (100)
+   -D <gpio>      watch DIO0 on this gpio instead of polling
+   -c <div>       SPI clock divider (65536)
+   -H             count cycles, instructions, cache misses and context
+                  switches in the FIFO, irq, codec and logging regions
+                  (perfctr.h) and print them per probe at the end
+
+   ---------------------------------------------------------------------------------------------*/
+
+//------------------------------header files and label definitions------------------------------
+
+#include "sx1278.h"
+#include "pingpong.h"
+#include <signal.h>
+#include <unistd.h>
+
+#define PING_SWITCH_MS    500       //proposal to switch, well past the ack
+#define PING_IDLE_US      10000000  //echoer goes back to base after this long without a packet
+#define PING_POLL_US      200       //RegIrqFlags poll interval without DIO0
+#define PING_PIN_SLEEP_US 20        //DIO0 poll interval
+#define PING_REPORT_EVERY 100       //echoes between echoer reports
+#define PING_PROPOSE_TRIES 3
+
+//radio state behind the pp_radio callbacks
+struct hw{
+  struct reg_image base;
+  struct reg_image shadow;
+  struct profile base_p;
+  struct profile cur;
+  struct modem_cfg m;
+  uint16_t cmd_seq;
+  int in_rx;             //Rx continuous entered and not left
+};
+
+//-----------------------------------helper function prototypes----------------------------------
+
+int parse_list(const char *s, double *v, int max);
+
+uint64_t hw_now(void *ctx);
+
+int hw_set_profile(void *ctx, const struct profile *p);
+
+int hw_send(void *ctx, const uint8_t *buf, uint8_t len, uint64_t *tx_start);
+
+int hw_recv(void *ctx, uint8_t *buf, uint64_t deadline, uint64_t *rx_done);
+
+void hw_use(struct hw *h, const struct reg_image *img, const struct profile *p);
+
+void echo_loop(struct hw *h, int fast);
+
+int fast_recv(struct hw *h, uint8_t *buf, uint8_t expect, uint64_t deadline, uint64_t *seen, uint64_t *tx_start);
+
+void stop(int sig);
+
+//cleared by the signal handler to end the run
+volatile sig_atomic_t running = 1;
+volatile int stopping = 0;
+
+//-----------------------------------------function main-----------------------------------------
+
+int main(int argc, char **argv){
+  uint32_t freq_khz = 434000;
+  double sfs[8], bws[10], lens[PP_MAX_STEPS];
+  int nsf = parse_list("7", sfs, 8);
+  int nbw = parse_list("125", bws, 10);
+  int nlen = parse_list("9,32,64,128,255", lens, PP_MAX_STEPS);
+  uint32_t count = 100;
+  int echo = 0, fast = 0, dio = -1, counters = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "eFf:s:b:l:n:D:c:H")) != -1){
+    switch(opt){
+      case 'e': echo = 1; break;
+      case 'F': fast = 1; break;
+      case 'f': freq_khz = strtoul(optarg, NULL, 10); break;
+      case 's': nsf = parse_list(optarg, sfs, 8); break;
+      case 'b': nbw = parse_list(optarg, bws, 10); break;
+      case 'l': nlen = parse_list(optarg, lens, PP_MAX_STEPS); break;
+      case 'n': count = strtoul(optarg, NULL, 10); break;
+      case 'D': dio = atoi(optarg); break;
+      case 'c': spi_divider = strtoul(optarg, NULL, 10); break;
+      case 'H': counters = 1; break;
+      default:
+        nsf = 0;
+    }
+  }
+  if(nsf < 1 || nbw < 1 || nlen < 1 || count < 1 || nsf * nbw * nlen > PP_MAX_STEPS){
+    printf("usage: %s [-e [-F]] [-f kHz] [-s sf,...] [-b kHz,...] [-l len,...] [-n count]\n"
+           "       [-D dio0_gpio] [-c spi_divider] [-H]\n"
+           "at most %d steps (spreading factors x bandwidths x lengths)\n", argv[0], PP_MAX_STEPS);
+    return 1;
+  }
+
+  hardware_init();  //setup spi
+  lora_init();      //boot sequence to LoRa standby
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+  set_frequency(freq_khz * 1000);
+  write_reg(REG_FIFO_RX_BASE_ADDR, FIFO_RX_BASE_ADDR);
+  write_reg(REG_FIFO_TX_BASE_ADDR, FIFO_TX_BASE_ADDR);
+  if(dio >= 0) dio0_init(dio);
+
+  //the base profile is the chip's, with the crc on
+  struct hw h;
+  memset(&h, 0, sizeof(h));
+  read_image(&h.shadow);
+  read_modem(&h.m);
+  h.m.crc = 1;
+  profile_of(&h.m, h.shadow.sync, &h.base_p);
+  profile_image(&h.base_p, (h.shadow.block[1] & 0x03) << 8 | h.shadow.block[2], &h.base);
+  hw_use(&h, &h.base, &h.base_p);
+  if(counters && perf_open() == 0) fprintf(stderr, "No hardware counters on this machine.\n");
+
+  if(echo){
+    echo_loop(&h, fast);
+  }else{
+    static struct pp_step steps[PP_MAX_STEPS];
+    static struct pp_stats stats[PP_MAX_STEPS];
+    int n = 0;
+    for(int i = 0; i < nsf; i++){
+      for(int j = 0; j < nbw; j++){
+        int bw = bw_index((uint32_t)(bws[j] * 1000));
+        if(sfs[i] < 7 || sfs[i] > 12 || bw < 0){
+          printf("SF%g at %g kHz isn't something this benchmark runs.\n", sfs[i], bws[j]);
+          return 1;
+        }
+        for(int k = 0; k < nlen; k++){
+          steps[n].p = h.base_p;
+          steps[n].p.sf = (uint8_t)sfs[i];
+          steps[n].p.bw = (uint8_t)bw;
+          steps[n].len = lens[k] < PING_HEADER_LEN ? PING_HEADER_LEN : lens[k] > 255 ? 255 : (uint8_t)lens[k];
+          n++;
+        }
+      }
+    }
+    struct pp_radio r = {&h, hw_now, hw_set_profile, hw_send, hw_recv};
+    fprintf(stderr, "Pinging: %d steps of %u probes, RxDone on %s.\n", n, count,
+            dio >= 0 ? "DIO0" : "RegIrqFlags polls");
+    pp_run(&r, steps, n, count, stats, &stopping);
+    //leave the echoer where it started
+    hw_set_profile(&h, &h.base_p);
+    pp_report(stdout, steps, n, stats);
+    uint64_t sent = 0;
+    for(int s = 0; s < n; s++) sent += stats[s].sent;
+    perf_report(stdout, sent);
+  }
+  write_reg(REG_OP_MODE, LORA_STANDBY);
+  bcm2835_spi_end();
+  bcm2835_close();
+  return 0;
+}
+
+//--------------------------------helper function implementations---------------------------------
+
+//comma separated numbers, returns how many
+int parse_list(const char *s, double *v, int max){
+  int n = 0;
+  while(*s && n < max){
+    char *end;
+    v[n] = strtod(s, &end);
+    if(end == s) return -1;
+    n++;
+    s = *end == ',' ? end + 1 : end;
+  }
+  return n;
+}
+
+uint64_t hw_now(void *ctx){
+  return now_us();
+}
+
+//programs a profile's image and remembers what it is.  leaves standby
+void hw_use(struct hw *h, const struct reg_image *img, const struct profile *p){
+  write_reg(REG_OP_MODE, LORA_STANDBY);
+  h->in_rx = 0;
+  apply_image(img, &h->shadow);
+  h->cur = *p;
+  profile_modem(p, &h->m);
+}
+
+//moves both ends with a proposal on the current profile.  after
+//PING_PROPOSE_TRIES without an ack it goes back to the base profile and
+//waits until the echoer must have too
+int hw_set_profile(void *ctx, const struct profile *p){
+  struct hw *h = ctx;
+  if(profile_same(p, &h->cur)) return 0;
+  uint8_t buf[255];
+  for(int t = 0; t < PING_PROPOSE_TRIES && running; t++){
+    struct profile_cmd c = {++h->cmd_seq, PROFILE_PROPOSE, *p, PING_SWITCH_MS};
+    uint64_t tx_start;
+    if(hw_send(h, buf, pack_profile_cmd(buf, &c), &tx_start) < 0) continue;
+    uint64_t done = now_us();
+    uint64_t until = done + PROFILE_ACK_US;
+    int n;
+    struct profile_cmd ack;
+    while((n = hw_recv(h, buf, until, NULL)) != -1){
+      if(n < 0 || unpack_profile_cmd(buf, (uint8_t)n, &ack) < 0) continue;
+      if(ack.phase == PROFILE_ACK && ack.seq == c.seq) break;
+    }
+    if(n == -1) continue;
+    write_reg(REG_OP_MODE, LORA_STANDBY);
+    h->in_rx = 0;
+    sleep_until_us(done + PING_SWITCH_MS * 1000ULL);
+    struct reg_image img;
+    profile_image(p, (h->base.block[1] & 0x03) << 8 | h->base.block[2], &img);
+    hw_use(h, &img, p);
+    return 0;
+  }
+  char name[48];
+  fprintf(stderr, "Echoer didn't ack %s, back to base.\n", profile_name(p, name));
+  hw_use(h, &h->base, &h->base_p);
+  sleep_until_us(now_us() + PING_IDLE_US);
+  return -1;
+}
+
+//loads the packet, keys up and waits for TxDone
+int hw_send(void *ctx, const uint8_t *buf, uint8_t len, uint64_t *tx_start){
+  struct hw *h = ctx;
+  write_reg(REG_OP_MODE, LORA_STANDBY);
+  h->in_rx = 0;
+  load_fifo_packet(buf, len);
+  write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+  uint64_t t = now_us();
+  write_reg(REG_OP_MODE, LORA_TX);
+  if(tx_start) *tx_start = t;
+  uint8_t flags = wait_event(FLAG_TX_DONE, t + airtime_us(&h->m, len) + TX_CONFIRM_US, PING_POLL_US,
+                             PING_PIN_SLEEP_US, NULL);
+  write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+  return flags & FLAG_TX_DONE ? 0 : -1;
+}
+
+//listens in Rx continuous, staying there between calls
+int hw_recv(void *ctx, uint8_t *buf, uint64_t deadline, uint64_t *rx_done){
+  struct hw *h = ctx;
+  if(!h->in_rx){
+    write_reg(REG_FIFO_ADDR_PTR, FIFO_RX_BASE_ADDR);
+    write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+    write_reg(REG_OP_MODE, LORA_RX_CONT);
+    h->in_rx = 1;
+  }
+  uint64_t stamp;
+  uint8_t flags = wait_event(FLAG_RX_DONE, deadline, PING_POLL_US, PING_PIN_SLEEP_US, &stamp);
+  if(!(flags & FLAG_RX_DONE)) return -1;
+  if(rx_done) *rx_done = stamp;
+  uint8_t len = read_fifo_packet(buf);
+  write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+  return flags & FLAG_PAYLOAD_CRC ? -2 : len;
+}
+
+//echoes probes and follows profile proposals until stopped.  with fast
+//the echo of the next probe is staged in the FIFO after every echo, see
+//fast_recv()
+void echo_loop(struct hw *h, int fast){
+  uint8_t buf[255], reply[255];
+  struct reg_image target;
+  struct profile target_p;
+  uint64_t switch_at = 0;
+  uint64_t last_heard = now_us();
+  uint32_t echoes = 0, switches = 0, fallbacks = 0;
+  uint32_t last_turn = 0, turn_max = 0;
+  uint64_t turn_total = 0;
+  int last_step = -1;
+  //fast path: the probe the staged echo answers, staged_len 0 if none
+  struct ping staged;
+  uint8_t staged_len = 0;
+  uint32_t hits = 0, misses = 0, fast_max = 0;
+  uint64_t fast_total = 0;
+
+  fprintf(stderr, "Echoing%s.\n", fast ? " on the fast path" : "");
+  if(fast) fast_reply_budget(dio0_pin >= 0 ? PING_PIN_SLEEP_US / 2 : PING_POLL_US / 2, stderr);
+  while(running){
+    int on_base = profile_same(&h->cur, &h->base_p);
+    uint64_t until = switch_at ? switch_at : on_base ? now_us() + 1000000 : last_heard + PING_IDLE_US;
+    uint64_t seen, tx_start = 0;
+    int n;
+    if(staged_len){
+      n = fast_recv(h, buf, staged_len, until, &seen, &tx_start);
+    }else{
+      n = hw_recv(h, buf, until, &seen);
+    }
+
+    if(n == -1){
+      if(switch_at && now_us() >= switch_at){
+        hw_use(h, &target, &target_p);
+        switch_at = 0;
+        last_heard = now_us();
+        switches++;
+      }else if(!on_base && now_us() - last_heard >= PING_IDLE_US){
+        hw_use(h, &h->base, &h->base_p);
+        fallbacks++;
+        fprintf(stderr, "Idle, back on the base profile.\n");
+      }
+      continue;
+    }
+    if(n < 0) continue;
+    last_heard = now_us();
+
+    struct ping p;
+    struct profile_cmd c;
+    PERF_BEGIN(PR_CODEC);
+    int probe = unpack_ping(buf, (uint8_t)n, &p) == 0 && !(p.flags & PING_ECHO);
+    PERF_END(PR_CODEC);
+    if(tx_start && probe && p.seq == staged.seq && p.step == staged.step){
+      //the staged echo was the right one
+      last_turn = (uint32_t)(tx_start - seen);
+      fast_total += last_turn;
+      if(last_turn > fast_max) fast_max = last_turn;
+      hits++;
+    }else{
+      //anything else goes the normal way, even after a wrong staged echo
+      if(tx_start) misses++;
+      if(staged_len) unstage_reply();
+      staged_len = 0;
+      if(probe){
+        //the previous turnaround only means something within a step
+        p.turn_us = p.step == last_step ? last_turn : 0;
+        p.flags |= PING_ECHO;
+        PERF_BEGIN(PR_CODEC);
+        pack_ping(reply, &p, (uint8_t)n);
+        PERF_END(PR_CODEC);
+        if(hw_send(h, reply, (uint8_t)n, &tx_start) < 0) continue;
+        last_turn = (uint32_t)(tx_start - seen);
+        turn_total += last_turn;
+        if(last_turn > turn_max) turn_max = last_turn;
+        echoes++;
+      }else if(unpack_profile_cmd(buf, (uint8_t)n, &c) == 0 && c.phase == PROFILE_PROPOSE){
+        c.phase = PROFILE_ACK;
+        hw_send(h, buf, pack_profile_cmd(buf, &c), NULL);
+        target_p = c.p;
+        profile_image(&c.p, (h->base.block[1] & 0x03) << 8 | h->base.block[2], &target);
+        switch_at = seen + c.switch_ms * 1000ULL;
+      }
+    }
+    if(!probe) continue;
+    last_step = p.step;
+
+    //guess the next probe: the same size, one on
+    if(fast && n <= FIFO_SIZE / 2){
+      staged = (struct ping){p.seq + 1, p.step, PING_ECHO, last_turn};
+      PERF_BEGIN(PR_CODEC);
+      uint8_t staged_bytes = pack_ping(reply, &staged, (uint8_t)n);
+      PERF_END(PR_CODEC);
+      stage_reply(reply, staged_bytes);
+      staged_len = (uint8_t)n;
+    }
+    if((echoes + hits) % PING_REPORT_EVERY == 0){
+      fprintf(stderr, "%u echoes, turnaround mean %.3f ms, max %.3f ms\n", echoes,
+              echoes ? turn_total / 1e3 / echoes : 0, turn_max / 1e3);
+      if(fast){
+        fprintf(stderr, "%u fast echoes, %u wrong guesses, turnaround mean %.3f ms, max %.3f ms\n", hits,
+                misses, hits ? fast_total / 1e3 / hits : 0, fast_max / 1e3);
+      }
+    }
+  }
+  if(staged_len) unstage_reply();
+  fprintf(stderr, "%u echoes, turnaround mean %.3f ms, max %.3f ms, %u profile switches, %u fallbacks\n",
+          echoes, echoes ? turn_total / 1e3 / echoes : 0, turn_max / 1e3, switches, fallbacks);
+  if(fast){
+    fprintf(stderr, "%u fast echoes, %u wrong guesses, turnaround mean %.3f ms, max %.3f ms\n", hits, misses,
+            hits ? fast_total / 1e3 / hits : 0, fast_max / 1e3);
+  }
+  perf_report(stderr, echoes + hits);
+}
+
+//listens with an echo staged and lets fast_reply() send it the moment a
+//probe of the staged length arrives.  returns like hw_recv(), with
+//tx_start nonzero if the staged echo went out, in which case it is also
+//done.  Rx is entered afresh every time so requests never stack up in
+//the FIFO below the staged echo
+int fast_recv(struct hw *h, uint8_t *buf, uint8_t expect, uint64_t deadline, uint64_t *seen, uint64_t *tx_start){
+  if(!h->in_rx){
+    write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+    write_reg(REG_OP_MODE, LORA_RX_CONT);
+    h->in_rx = 1;
+  }
+  uint8_t flags = fast_reply(expect, deadline, PING_POLL_US, PING_PIN_SLEEP_US, seen, tx_start);
+  if(!(flags & FLAG_RX_DONE)) return -1;
+  //the echo is already on the air while the probe is read out
+  write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+  uint8_t len = read_fifo_packet(buf);
+  if(*tx_start){
+    wait_event(FLAG_TX_DONE, *tx_start + airtime_us(&h->m, expect) + TX_CONFIRM_US, PING_POLL_US,
+               PING_PIN_SLEEP_US, NULL);
+    write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+  }else{
+    write_reg(REG_OP_MODE, LORA_STANDBY);
+  }
+  h->in_rx = 0;
+  return flags & FLAG_PAYLOAD_CRC ? -2 : len;
+}
+
+//signal handler that lets the benchmark report
+void stop(int sig){
+  running = 0;
+  stopping = 1;
+}
@@ -0,0 +1,668 @@
+/* UCSD CubeSat
+   lorasim.c
+
+   Multi-node channel simulator.  Once more than a couple of beacon nodes
+   share a channel with the groundstation the interesting questions are
+   about the channel, not about any one radio: how often do packets collide,
+   how long do nodes defer, and how much gets through.  Those are hard to
+   measure with real modules (we'd need a dozen of them and a way to tell a
+   collision from a fade), so this program simulates them.  It needs no
+   hardware and builds with just:
+
+   $ cc lorasim.c -o lorasim
+
+   Each simulated node generates a beacon every period (with jitter, so the
+   nodes drift against each other like our real ones do) and sends it using
+   one of the channel access schemes below.  Airtime comes from timing.h and
+   backoff from csma.h, so the numbers match what loraTX would do with the
+   same settings.
+
+   Access schemes (-m):
+   aloha  key up as soon as the packet is ready, like loraTX always used to
+   csma   CAD before Tx with randomized exponential backoff (loraTX -c)
+   tdma   coordinator beacon and one slot per node (loraRX -T, loraTX -T)
+   both   run aloha then csma on the same traffic and report the gain
+   all    run all three
+   ping   ping-pong benchmark between two simulated radios (pingpong.h)
+
+   A transmission is lost if any other transmission overlaps it in time.
+   There is no capture effect and no fading, so these are the collision
+   numbers, not a link budget.
+
+   Notes on CAD:
+   Channel activity detection reliably sees a preamble, but once a packet is
+   into its payload a CAD catches it only some of the time.  -c sets that
+   probability in percent (default 50).  Set it to 100 for ideal carrier
+   sense, or 0 to see how a preamble only detector does.
+
+   Notes on TDMA:
+   The schedule and the guard and drift logic come straight from tdma.h.
+   Every node's crystal is off by a random amount up to -d ppm, and both
+   the nodes and the coordinator only see RxDone at the next poll, every -J
+   us (one symbol by default), so the guards have real errors to adapt to.
+   With -F every node always has a packet waiting, and the superframe
+   shrinks to just the beacon and the slots unless -P stretches it, so the
+   channel utilization should come out close to the slot-filling limit,
+   slots * airtime / superframe.  -F also saturates aloha and csma, where a
+   node queues its next packet as soon as the last one is done.
+
+   Notes on ping:
+   -m ping runs the same pinger loop as loraping.c against a simulated
+   echoer, 1000 probes at each of the probe lengths 9, 32, 64, 128 and 255
+   (or just -l if given).  Each probe and each echo is lost with -e
+   percent probability.  Both ends see RxDone at a poll, uniformly up to -J
+   us after the packet ends, and every register access costs what it would
+   at the SPI clock divider -D, so the rtt overhead and the echoer's
+   turnaround come out as they would with loraping's register sequence.
+   The default divider is the one the radio programs use, which makes
+   the SPI the largest part of both.  -Q has the echoer stage its next
+   echo and answer on the fast reply path like loraping -e -F.
+
+   Options:
+   -n <nodes>     number of transmitters (8)
+   -p <ms>        beacon period (5000)
+   -j <percent>   period jitter (10)
+   -l <bytes>     payload length (24)
+   -s <sf>        spreading factor (7)
+   -w <hz>        bandwidth in Hz (125000)
+   -t <s>         simulated time (3600)
+   -L <ms>        csma latency budget (2000)
+   -c <percent>   cad payload detection probability (50)
+   -m <mode>      aloha, csma, tdma, both, all or ping (both)
+   -S <seed>      random seed (1)
+   -F             saturated traffic
+   -d <ppm>       tdma crystal drift bound (20)
+   -J <us>        tdma and ping RxDone polling interval (one symbol)
+   -P <ms>        tdma minimum superframe (0, or the beacon period without -F)
+   -e <percent>   ping packet loss (0)
+   -D <div>       ping SPI clock divider (65536)
+   -Q             ping echoer uses the fast reply path (loraping -e -F)
+   -H             ping pinger's codec regions on the hardware counters
+                  (perfctr.h), per probe
+
+   ---------------------------------------------------------------------------------------------*/
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "timing.h"
+#include "csma.h"
+#include "tdma.h"
+#include "pingpong.h"
+
+#define MAX_NODES 1024
+
+//access schemes
+#define MODE_ALOHA 0
+#define MODE_CSMA  1
+#define MODE_TDMA  2
+#define MODE_BOTH  3
+#define MODE_ALL   4
+#define MODE_PING  5
+
+#define SPI_CORE_HZ 250000000   //what sx1278.h divides down for the SPI clock
+#define PING_SIM_QUEUE   2      //a wrong staged echo and the right one
+
+static const char *mode_names[] = {"aloha", "csma", "tdma"};
+
+//node states
+#define NODE_IDLE    0  //waiting for its next packet
+#define NODE_BACKOFF 1  //deferring before another channel check
+#define NODE_CAD     2  //channel activity detection in progress
+#define NODE_TX      3  //on the air
+
+struct node{
+  uint8_t  state;
+  uint64_t t_gen;       //next packet generation
+  uint64_t t_event;     //end of current state
+  uint64_t tx_start;    //current or last transmission
+  uint64_t tx_end;
+  uint8_t  collided;
+  struct csma_state cs;
+};
+
+struct sim_cfg{
+  int      nodes;
+  uint32_t period_us;
+  uint32_t jitter_pct;
+  uint8_t  payload;
+  struct modem_cfg modem;
+  uint64_t duration_us;
+  uint32_t cad_payload_pct;
+  struct csma_cfg csma;
+  uint32_t seed;
+  int      saturated;
+  uint32_t drift_ppm;
+  uint32_t poll_us;
+  uint32_t min_superframe_us;
+  uint32_t loss_pct;
+  uint32_t spi_hz;
+  int      fast;
+  int      counters;
+};
+
+//the two ends of a simulated ping-pong link, seen from the pinger
+struct ping_sim{
+  const struct sim_cfg *c;
+  struct modem_cfg m;
+  uint32_t seed;
+  uint64_t t;             //virtual time
+  uint32_t last_turn;     //echoer's turnaround for its last echo
+  int      last_step;
+  struct ping staged;     //fast path: the echo waiting in the FIFO
+  uint8_t  staged_len;
+  int      pending;       //echoes on their way
+  uint64_t echo_seen[PING_SIM_QUEUE];  //when the pinger's poll will see them
+  uint8_t  echo[PING_SIM_QUEUE][255];
+  uint8_t  echo_len[PING_SIM_QUEUE];
+};
+
+struct sim_result{
+  uint32_t generated;
+  uint32_t overrun;     //packet replaced by the next one before it went out
+  uint32_t sent;
+  uint32_t delivered;
+  uint32_t collided;
+  uint64_t air_ok_us;   //airtime of delivered packets
+  struct csma_stats access;
+  uint32_t superframes;
+  uint64_t limit_air_us; //airtime the tdma slots could have carried
+  uint32_t guard_us;     //last announced guard
+  uint32_t guard_max_us;
+};
+
+//-----------------------------------helper function prototypes----------------------------------
+
+uint64_t jittered(const struct sim_cfg *c, uint32_t *seed);
+
+int sensed_busy(const struct sim_cfg *c, struct node *n, int self, uint64_t t, uint32_t *seed);
+
+void start_tx(struct node *n, int count, int self, uint64_t t, uint32_t air, struct sim_result *r);
+
+void simulate(const struct sim_cfg *c, int mode, struct sim_result *r);
+
+void simulate_tdma(const struct sim_cfg *c, struct sim_result *r);
+
+void print_result(const struct sim_cfg *c, int mode, const struct sim_result *r);
+
+void simulate_ping(const struct sim_cfg *c, const uint8_t *lens, int nlens);
+
+uint64_t spi_us(const struct sim_cfg *c, uint32_t bytes);
+
+uint64_t sim_now(void *ctx);
+
+int sim_set_profile(void *ctx, const struct profile *p);
+
+int sim_send(void *ctx, const uint8_t *buf, uint8_t len, uint64_t *tx_start);
+
+int sim_recv(void *ctx, uint8_t *buf, uint64_t deadline, uint64_t *rx_done);
+
+void sim_echo(struct ping_sim *ps, const struct ping *p, uint8_t len, uint64_t seen);
+
+//-----------------------------------------function main-----------------------------------------
+
+int main(int argc, char **argv){
+
+  struct sim_cfg cfg;
+  cfg.nodes = 8;
+  cfg.period_us = 5000000;
+  cfg.jitter_pct = 10;
+  cfg.payload = 24;
+  cfg.modem.sf = 7;
+  cfg.modem.bw_hz = 125000;
+  cfg.modem.cr = 1;
+  cfg.modem.implicit = 0;
+  cfg.modem.crc = 0;
+  cfg.modem.ldro = 0;
+  cfg.modem.preamble = 8;
+  cfg.duration_us = 3600ULL * 1000000;
+  cfg.cad_payload_pct = 50;
+  cfg.seed = 1;
+  cfg.saturated = 0;
+  cfg.drift_ppm = 20;
+  cfg.poll_us = 0;
+  cfg.loss_pct = 0;
+  uint32_t spi_div = 65536;
+  cfg.fast = 0;
+  cfg.counters = 0;
+  int fixed_len = 0;
+  uint32_t budget_ms = CSMA_BUDGET_US / 1000;
+  int32_t min_superframe_ms = -1;
+  int mode = MODE_BOTH;
+
+  int opt;
+  while((opt = getopt(argc, argv, "n:p:j:l:s:w:t:L:c:m:S:Fd:J:P:e:D:QH")) != -1){
+    switch(opt){
+      case 'n': cfg.nodes = atoi(optarg); break;
+      case 'p': cfg.period_us = strtoul(optarg, NULL, 10) * 1000; break;
+      case 'j': cfg.jitter_pct = strtoul(optarg, NULL, 10); break;
+      case 'l': cfg.payload = atoi(optarg); fixed_len = 1; break;
+      case 's': cfg.modem.sf = atoi(optarg); break;
+      case 'w': cfg.modem.bw_hz = strtoul(optarg, NULL, 10); break;
+      case 't': cfg.duration_us = strtoull(optarg, NULL, 10) * 1000000; break;
+      case 'L': budget_ms = strtoul(optarg, NULL, 10); break;
+      case 'c': cfg.cad_payload_pct = strtoul(optarg, NULL, 10); break;
+      case 'S': cfg.seed = strtoul(optarg, NULL, 10); break;
+      case 'F': cfg.saturated = 1; break;
+      case 'd': cfg.drift_ppm = strtoul(optarg, NULL, 10); break;
+      case 'J': cfg.poll_us = strtoul(optarg, NULL, 10); break;
+      case 'P': min_superframe_ms = atoi(optarg); break;
+      case 'e': cfg.loss_pct = strtoul(optarg, NULL, 10); break;
+      case 'D': spi_div = strtoul(optarg, NULL, 10); break;
+      case 'Q': cfg.fast = 1; break;
+      case 'H': cfg.counters = 1; break;
+      case 'm':
+        if(strcmp(optarg, "aloha") == 0) mode = MODE_ALOHA;
+        else if(strcmp(optarg, "csma") == 0) mode = MODE_CSMA;
+        else if(strcmp(optarg, "tdma") == 0) mode = MODE_TDMA;
+        else if(strcmp(optarg, "all") == 0) mode = MODE_ALL;
+        else if(strcmp(optarg, "ping") == 0) mode = MODE_PING;
+        else mode = MODE_BOTH;
+        break;
+      default:
+        printf("usage: %s [-n nodes] [-p period_ms] [-j jitter%%] [-l bytes] [-s sf] [-w bw_hz]\n"
+               "       [-t seconds] [-L budget_ms] [-c cad%%] [-m aloha|csma|tdma|both|all|ping]\n"
+               "       [-S seed] [-F] [-d ppm] [-J poll_us] [-P superframe_ms] [-e loss%%] [-D spi_divider] [-Q]\n"
+               "       [-H]\n", argv[0]);
+        return 1;
+    }
+  }
+  if(cfg.nodes < 1 || cfg.nodes > MAX_NODES || cfg.modem.sf < 6 || cfg.modem.sf > 12 || cfg.modem.bw_hz == 0){
+    printf("Need 1-%d nodes, sf 6-12 and a nonzero bandwidth.\n", MAX_NODES);
+    return 1;
+  }
+  cfg.modem.ldro = symbol_us(&cfg.modem) > 16000;  //datasheet: mandated above 16 ms symbols
+  uint32_t air = airtime_us(&cfg.modem, cfg.payload);
+  csma_defaults(&cfg.csma, air);
+  cfg.csma.budget_us = budget_ms * 1000;
+  if(cfg.poll_us == 0) cfg.poll_us = symbol_us(&cfg.modem);
+  cfg.spi_hz = SPI_CORE_HZ / (spi_div ? spi_div : 65536);
+  if(min_superframe_ms < 0){
+    cfg.min_superframe_us = cfg.saturated ? 0 : cfg.period_us;
+  }else{
+    cfg.min_superframe_us = min_superframe_ms * 1000;
+  }
+
+  if(mode == MODE_PING){
+    static const uint8_t lens[] = {9, 32, 64, 128, 255};
+    uint8_t len = cfg.payload < PING_HEADER_LEN ? PING_HEADER_LEN : cfg.payload;
+    if(fixed_len){
+      simulate_ping(&cfg, &len, 1);
+    }else{
+      simulate_ping(&cfg, lens, sizeof(lens));
+    }
+    return 0;
+  }
+
+  printf("%d nodes, %u byte payload, SF%u BW%u, %.1f ms on air every %.0f ms, offered load G = %.3f\n",
+         cfg.nodes, cfg.payload, cfg.modem.sf, cfg.modem.bw_hz, air / 1000.0,
+         cfg.period_us / 1000.0, (double)cfg.nodes * air / cfg.period_us);
+
+  struct sim_result res[3];
+  memset(res, 0, sizeof(res));
+  for(int m = MODE_ALOHA; m <= MODE_TDMA; m++){
+    if(mode == MODE_BOTH && m == MODE_TDMA) continue;
+    if(mode < MODE_BOTH && mode != m) continue;
+    if(m == MODE_TDMA){
+      simulate_tdma(&cfg, &res[m]);
+    }else{
+      simulate(&cfg, m, &res[m]);
+    }
+    print_result(&cfg, m, &res[m]);
+  }
+  if(mode >= MODE_BOTH && res[MODE_ALOHA].air_ok_us > 0){
+    printf("goodput gain csma/aloha: %.3fx\n",
+           (double)res[MODE_CSMA].air_ok_us / res[MODE_ALOHA].air_ok_us);
+    if(mode == MODE_ALL){
+      printf("goodput gain tdma/aloha: %.3fx\n",
+             (double)res[MODE_TDMA].air_ok_us / res[MODE_ALOHA].air_ok_us);
+    }
+  }
+  return 0;
+}
+
+//--------------------------------helper function implementations---------------------------------
+
+//one beacon period with uniform jitter
+uint64_t jittered(const struct sim_cfg *c, uint32_t *seed){
+  uint64_t span = (uint64_t)c->period_us * c->jitter_pct / 100;
+  if(span == 0) return c->period_us;
+  return c->period_us - span + csma_rand(seed) % (2*span + 1);
+}
+
+//what a CAD ending at t reports.  any preamble overlapping the CAD window
+//is seen, a payload only with the configured probability
+int sensed_busy(const struct sim_cfg *c, struct node *n, int self, uint64_t t, uint32_t *seed){
+  uint64_t from = t - cad_us(&c->modem);
+  uint64_t preamble = (uint64_t)(4*c->modem.preamble + 17) * symbol_us(&c->modem) / 4;
+  int payload_seen = 0;
+  for(int i = 0; i < c->nodes; i++){
+    if(i == self || n[i].tx_end <= from || n[i].tx_start >= t) continue;
+    if(n[i].tx_start + preamble > from) return 1;
+    payload_seen = 1;
+  }
+  return payload_seen && csma_rand(seed) % 100 < c->cad_payload_pct;
+}
+
+//puts a node on the air and marks any overlap as a collision on both sides
+void start_tx(struct node *n, int count, int self, uint64_t t, uint32_t air, struct sim_result *r){
+  n[self].state = NODE_TX;
+  n[self].tx_start = t;
+  n[self].tx_end = t + air;
+  n[self].t_event = t + air;
+  n[self].collided = 0;
+  for(int i = 0; i < count; i++){
+    if(i != self && n[i].state == NODE_TX && n[i].tx_end > t){
+      n[i].collided = 1;
+      n[self].collided = 1;
+    }
+  }
+  r->sent++;
+}
+
+//runs one access scheme over the whole simulated time
+void simulate(const struct sim_cfg *c, int mode, struct sim_result *r){
+  static struct node n[MAX_NODES];
+  uint32_t seed = c->seed;
+  uint32_t air = airtime_us(&c->modem, c->payload);
+  uint32_t cad = cad_us(&c->modem);
+  memset(n, 0, sizeof(struct node) * c->nodes);
+  for(int i = 0; i < c->nodes; i++){
+    n[i].t_gen = csma_rand(&seed) % (c->saturated ? air : c->period_us);
+    n[i].t_event = UINT64_MAX;
+  }
+
+  while(1){
+    //next event of any node, generation or end of state
+    int who = 0;
+    int gen = 0;
+    uint64_t t = UINT64_MAX;
+    for(int i = 0; i < c->nodes; i++){
+      if(n[i].t_event < t){ t = n[i].t_event; who = i; gen = 0; }
+      if(n[i].t_gen < t){ t = n[i].t_gen; who = i; gen = 1; }
+    }
+    if(t >= c->duration_us) break;
+    struct node *me = &n[who];
+
+    if(gen){
+      r->generated++;
+      //a saturated node queues its next packet once this one is done
+      me->t_gen = c->saturated ? UINT64_MAX : t + jittered(c, &seed);
+      if(me->state != NODE_IDLE){
+        r->overrun++;
+        continue;
+      }
+      if(mode == MODE_ALOHA){
+        start_tx(n, c->nodes, who, t, air, r);
+      }else{
+        csma_start(&me->cs, &c->csma);
+        me->state = NODE_CAD;
+        me->t_event = t + cad;
+      }
+      continue;
+    }
+
+    switch(me->state){
+      case NODE_BACKOFF:
+        me->state = NODE_CAD;
+        me->t_event = t + cad;
+        break;
+      case NODE_CAD:
+        if(sensed_busy(c, n, who, t, &seed)){
+          r->access.busy++;
+          int64_t d = csma_backoff(&me->cs, &c->csma, &seed);
+          if(d < 0){
+            csma_record(&r->access, &me->cs, 0);
+            me->state = NODE_IDLE;
+            me->t_event = UINT64_MAX;
+            if(c->saturated) me->t_gen = t;
+          }else{
+            me->state = NODE_BACKOFF;
+            me->t_event = t + d;
+          }
+        }else{
+          csma_record(&r->access, &me->cs, 1);
+          start_tx(n, c->nodes, who, t, air, r);
+        }
+        break;
+      case NODE_TX:
+        if(me->collided){
+          r->collided++;
+        }else{
+          r->delivered++;
+          r->air_ok_us += air;
+        }
+        me->state = NODE_IDLE;
+        me->t_event = UINT64_MAX;
+        if(c->saturated) me->t_gen = t;
+        break;
+    }
+  }
+}
+
+//runs the tdma schedule superframe by superframe.  the coordinator's clock
+//is the reference, node i's runs fast by drift[i] ppm.  a node's packet is
+//lost if it overlaps a neighbour's or a beacon
+void simulate_tdma(const struct sim_cfg *c, struct sim_result *r){
+  static double drift[MAX_NODES];
+  static struct tdma_sync sync[MAX_NODES];
+  static uint64_t t_gen[MAX_NODES];
+  static uint64_t tx[MAX_NODES];
+  static uint8_t queued[MAX_NODES];
+  uint32_t seed = c->seed;
+  uint32_t air = airtime_us(&c->modem, c->payload);
+  uint32_t beacon_air = airtime_us(&c->modem, TDMA_BEACON_LEN);
+  uint8_t slots = c->nodes > 255 ? 255 : c->nodes;
+
+  for(int i = 0; i < slots; i++){
+    drift[i] = c->drift_ppm ? (double)(csma_rand(&seed) % (2*c->drift_ppm + 1)) - c->drift_ppm : 0;
+    memset(&sync[i], 0, sizeof(sync[i]));
+    t_gen[i] = c->saturated ? 0 : csma_rand(&seed) % c->period_us;
+    queued[i] = 0;
+  }
+
+  struct tdma_plan plan;
+  struct tdma_guard guard;
+  tdma_plan(&plan, slots, beacon_air, air, 0, c->min_superframe_us);
+  guard.guard_us = tdma_initial_guard(plan.superframe_us);
+  guard.max_err_us = 0;
+  tdma_plan(&plan, slots, beacon_air, air, guard.guard_us, c->min_superframe_us);
+
+  for(uint64_t start = 0; start + plan.superframe_us <= c->duration_us; ){
+    r->superframes++;
+
+    //every node hears the beacon and syncs to it on its own clock.
+    //polling sees RxDone up to one poll late, and half a poll is assumed
+    for(int i = 0; i < slots; i++){
+      double k = 1.0 + drift[i] / 1e6;
+      uint64_t seen = (uint64_t)((start + beacon_air) * k) + csma_rand(&seed) % c->poll_us;
+      tdma_sync_update(&sync[i], seen - c->poll_us/2 - beacon_air, r->superframes, plan.superframe_us);
+
+      //traffic that arrived since its last slot
+      if(c->saturated){
+        r->generated++;
+        queued[i] = 1;
+      }
+      while(!c->saturated && t_gen[i] < start + plan.superframe_us){
+        r->generated++;
+        if(queued[i]) r->overrun++;
+        queued[i] = 1;
+        t_gen[i] += jittered(c, &seed);
+      }
+
+      //key up at the slot start, converted back to coordinator time
+      uint64_t local = sync[i].start + tdma_local(&sync[i], tdma_tx_offset(&plan, i));
+      tx[i] = (uint64_t)(local / k);
+    }
+
+    //deliveries, collisions and the coordinator's view of the timing
+    uint64_t next = start + plan.superframe_us;
+    for(int i = 0; i < slots; i++){
+      if(!queued[i]) continue;
+      queued[i] = 0;
+      r->sent++;
+      int lost = tx[i] < start + beacon_air || tx[i] + air > next;
+      if(i > 0 && tx[i] < tx[i-1] + air) lost = 1;
+      if(i < slots - 1 && tx[i+1] < tx[i] + air) lost = 1;
+      if(lost){
+        r->collided++;
+        continue;
+      }
+      r->delivered++;
+      r->air_ok_us += air;
+      uint64_t seen = tx[i] + air + csma_rand(&seed) % c->poll_us;
+      int64_t rel = (int64_t)(seen - c->poll_us/2 - start) - tdma_tx_offset(&plan, 0) - air;
+      tdma_observe(&guard, (int32_t)(rel - (int64_t)i * plan.slot_us));
+    }
+    r->limit_air_us += (uint64_t)slots * air;
+
+    start = next;
+    tdma_plan(&plan, slots, beacon_air, air, tdma_next_guard(&guard), c->min_superframe_us);
+    r->guard_us = plan.guard_us;
+    if(plan.guard_us > r->guard_max_us) r->guard_max_us = plan.guard_us;
+  }
+}
+
+//prints delivery, collisions and goodput, plus the deferral histogram for csma
+void print_result(const struct sim_cfg *c, int mode, const struct sim_result *r){
+  double secs = c->duration_us / 1e6;
+  printf("%s: %u generated, %u sent, %u delivered (%.1f%%), %u collided (%.1f%% of sent), "
+         "%u overrun\n", mode_names[mode], r->generated, r->sent, r->delivered,
+         r->generated ? 100.0 * r->delivered / r->generated : 0, r->collided,
+         r->sent ? 100.0 * r->collided / r->sent : 0, r->overrun);
+  printf("  goodput %.1f bit/s, channel throughput S = %.3f\n",
+         8.0 * c->payload * r->delivered / secs, r->air_ok_us / (double)c->duration_us);
+  if(mode == MODE_CSMA){
+    printf("  ");
+    csma_print(stdout, &r->access);
+  }
+  if(mode == MODE_TDMA){
+    printf("  %u superframes, guard %u us (max %u us), slot-filling limit S = %.3f\n",
+           r->superframes, r->guard_us, r->guard_max_us, r->limit_air_us / (double)c->duration_us);
+  }
+}
+
+//ping-pong benchmark against a simulated echoer, one step per length
+void simulate_ping(const struct sim_cfg *c, const uint8_t *lens, int nlens){
+  static struct pp_step steps[PP_MAX_STEPS];
+  static struct pp_stats stats[PP_MAX_STEPS];
+  struct ping_sim ps;
+  memset(&ps, 0, sizeof(ps));
+  ps.c = c;
+  ps.m = c->modem;
+  ps.seed = c->seed;
+  ps.last_step = -1;
+  for(int i = 0; i < nlens; i++){
+    profile_of(&c->modem, SYNC_WORD_LORA, &steps[i].p);
+    steps[i].len = lens[i];
+  }
+  printf("ping-pong: SF%u BW%u, %u%% loss each way, RxDone polled every %u us, SPI at %u Hz%s\n",
+         c->modem.sf, c->modem.bw_hz, c->loss_pct, c->poll_us, c->spi_hz, c->fast ? ", fast replies" : "");
+  struct pp_radio r = {&ps, sim_now, sim_set_profile, sim_send, sim_recv};
+  if(c->counters && perf_open() == 0) printf("No hardware counters on this machine.\n");
+  pp_run(&r, steps, nlens, PP_MAX_COUNT, stats, NULL);
+  pp_report(stdout, steps, nlens, stats);
+  uint64_t sent = 0;
+  for(int i = 0; i < nlens; i++) sent += stats[i].sent;
+  perf_report(stdout, sent);
+}
+
+//time the bus takes for this many bytes
+uint64_t spi_us(const struct sim_cfg *c, uint32_t bytes){
+  return (uint64_t)bytes * 8 * 1000000 / c->spi_hz;
+}
+
+uint64_t sim_now(void *ctx){
+  return ((struct ping_sim *)ctx)->t;
+}
+
+//both simulated ends always follow
+int sim_set_profile(void *ctx, const struct profile *p){
+  profile_modem(p, &((struct ping_sim *)ctx)->m);
+  return 0;
+}
+
+//sends a probe and plays out the echoer's side of it.  the register
+//traffic is loraping's: standby, FIFO pointer, the burst, RegPayloadLength
+//and clearing the flags before the Tx write, and on the echoer reading
+//RegIrqFlags, RegFifoRxCurrentAddr, the pointer, RegRxNbBytes and the
+//burst, clearing the flags and then the same load as the pinger.  the
+//fast path (-Q) is the flags and length burst and the Tx write when the
+//staged echo's length matches, followed by the normal path if it was
+//the wrong echo
+int sim_send(void *ctx, const uint8_t *buf, uint8_t len, uint64_t *tx_start){
+  struct ping_sim *ps = ctx;
+  const struct sim_cfg *c = ps->c;
+  uint32_t air = airtime_us(&ps->m, len);
+  ps->t += spi_us(c, 2 + 2 + len + 1 + 2 + 2);
+  *tx_start = ps->t;
+  uint64_t arrive = ps->t + spi_us(c, 2) + air;
+  //TxDone at a poll, then clear the flags and go to Rx
+  ps->t = arrive + csma_rand(&ps->seed) % (c->poll_us + 1) + spi_us(c, 2 + 2 + 2 + 2);
+
+  struct ping p;
+  ps->pending = 0;
+  if(csma_rand(&ps->seed) % 100 < c->loss_pct || unpack_ping(buf, len, &p) < 0) return 0;
+  uint64_t seen = arrive + csma_rand(&ps->seed) % (c->poll_us + 1);
+  uint64_t start = seen;
+  if(c->fast && ps->staged_len == len){
+    //the staged echo goes out, right or not
+    uint32_t turn = (uint32_t)spi_us(c, FAST_REPLY_BYTES);
+    int right = ps->staged.seq == p.seq && ps->staged.step == p.step;
+    sim_echo(ps, &ps->staged, len, seen + turn + air + csma_rand(&ps->seed) % (c->poll_us + 1));
+    if(right){
+      ps->last_turn = turn;
+      ps->last_step = p.step;
+      ps->staged.seq++;
+      ps->staged.turn_us = turn;
+      return 0;
+    }
+    //read the probe while it's on the air, TxDone, then the normal path
+    start = seen + turn + air + csma_rand(&ps->seed) % (c->poll_us + 1) + spi_us(c, 2 + 2);
+  }
+  uint32_t turn = (uint32_t)spi_us(c, 2 + 2 + 2 + 2 + len + 1 + 2 + 2 + 2 + len + 1 + 2 + 2);
+  p.turn_us = p.step == ps->last_step ? ps->last_turn : 0;
+  p.flags |= PING_ECHO;
+  ps->last_step = p.step;
+  ps->last_turn = (uint32_t)(start + turn - seen);
+  sim_echo(ps, &p, len, start + turn + spi_us(c, 2) + air + csma_rand(&ps->seed) % (c->poll_us + 1));
+  if(c->fast && len <= 128){
+    ps->staged = (struct ping){p.seq + 1, p.step, PING_ECHO, ps->last_turn};
+    ps->staged_len = len;
+  }
+  return 0;
+}
+
+//puts an echo on its way to the pinger unless it is lost
+void sim_echo(struct ping_sim *ps, const struct ping *p, uint8_t len, uint64_t seen){
+  if(csma_rand(&ps->seed) % 100 < ps->c->loss_pct || ps->pending == PING_SIM_QUEUE) return;
+  ps->echo_len[ps->pending] = pack_ping(ps->echo[ps->pending], p, len);
+  ps->echo_seen[ps->pending] = seen;
+  ps->pending++;
+}
+
+//hands over the next echo if the pinger's poll sees it before the deadline
+int sim_recv(void *ctx, uint8_t *buf, uint64_t deadline, uint64_t *rx_done){
+  struct ping_sim *ps = ctx;
+  if(!ps->pending || ps->echo_seen[0] > deadline){
+    ps->pending = 0;
+    if(deadline > ps->t) ps->t = deadline;
+    return -1;
+  }
+  uint8_t len = ps->echo_len[0];
+  if(ps->echo_seen[0] > ps->t) ps->t = ps->echo_seen[0];
+  if(rx_done) *rx_done = ps->echo_seen[0];
+  memcpy(buf, ps->echo[0], len);
+  ps->pending--;
+  for(int i = 0; i < ps->pending; i++){
+    ps->echo_len[i] = ps->echo_len[i + 1];
+    ps->echo_seen[i] = ps->echo_seen[i + 1];
+    memcpy(ps->echo[i], ps->echo[i + 1], ps->echo_len[i]);
+  }
+  //read it out like read_fifo_packet() and clear the flags
+  ps->t += spi_us(ps->c, 2 + 2 + 2 + len + 1 + 2);
+  return len;
+}
@@ -0,0 +1,199 @@
+/* UCSD CubeSat
+   loraspec.c
+
+   Spectrum sweep and waterfall recorder.  The range tests had dropouts we
+   could never explain because we had no view of the band at all.  This
+   program uses the SX1278 as a crude spectrum analyzer: it steps the
+   carrier across a frequency range, reads RegRssiValue several times at
+   each step and writes one waterfall row per sweep (waterfall.h).  lorawf
+   views and exports the file.  Build it like the other radio programs:
+
+   $ cc loraspec.c -o loraspec -lbcm2835
+
+   Each step is standby, the three RegFrf bytes in one burst, back into
+   continuous Rx (which is what makes the new frequency take effect), a
+   settle delay for the PLL to lock and the rssi to catch up, and then the
+   rssi reads.  Every read is kept as the mean and the max of the step so
+   a short burst from an intermittent emitter still shows up.
+
+   Notes on sweep speed:
+   To catch emitters that key up for a few hundred milliseconds a sweep
+   needs hundreds of steps per second, and at the default SPI divider of
+   65536 (3.8 kHz) every register access alone takes about 4 ms.  -c sets
+   a faster divider; 64 (3.9 MHz) is well within what the SX1278 takes.
+   The program times every phase of a step and reports the achieved rate
+   next to the two hard limits: the bits that have to cross the bus per
+   step at the chosen clock, and the settle time.  Whichever is lower is
+   what the sweep can do.  The datasheet gives about 60 us for the
+   synthesizer to lock, and the rssi is averaged over a few symbols'
+   worth of samples, so settle times much below the default 200 us read
+   stale rssi from the previous step.
+
+   Options:
+   -f <kHz>     start frequency (433050)
+   -F <kHz>     stop frequency (434790)
+   -s <kHz>     step (10)
+   -n <reads>   rssi reads per step (8)
+   -w <us>      settle time after retuning (200)
+   -o <file>    waterfall file (spectrum.lwf)
+   -r <rows>    sweeps to record, 0 runs until ctrl-c (0)
+   -c <div>     SPI clock divider (65536)
+
+   ---------------------------------------------------------------------------------------------*/
+
+//------------------------------header files and label definitions------------------------------
+
+#include "sx1278.h"
+#include "waterfall.h"
+#include <signal.h>
+#include <unistd.h>
+
+//sweeps between rate reports
+#define SPEC_REPORT_EVERY 50
+
+//phases of one step, for the timing report
+#define P_RETUNE 0  //standby and the RegFrf burst
+#define P_RX     1  //back into Rx
+#define P_SETTLE 2
+#define P_READ   3
+#define P_PHASES 4
+
+static const char *phase_names[] = {"retune", "rx", "settle", "rssi reads"};
+
+//-----------------------------------helper function prototypes----------------------------------
+
+void spec_report(const struct wf_header *h, uint32_t rows, uint64_t elapsed, const uint64_t *phase_us);
+
+void stop(int sig);
+
+//cleared by the signal handler to finish the file
+volatile sig_atomic_t running = 1;
+
+//-----------------------------------------function main-----------------------------------------
+
+int main(int argc, char **argv){
+
+  uint32_t start_khz = 433050;
+  uint32_t stop_khz = 434790;
+  uint32_t step_khz = 10;
+  uint32_t reads = 8;
+  uint32_t settle_us = 200;
+  char *path = "spectrum.lwf";
+  uint32_t max_rows = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "f:F:s:n:w:o:r:c:")) != -1){
+    switch(opt){
+      case 'f': start_khz = strtoul(optarg, NULL, 10); break;
+      case 'F': stop_khz = strtoul(optarg, NULL, 10); break;
+      case 's': step_khz = strtoul(optarg, NULL, 10); break;
+      case 'n': reads = strtoul(optarg, NULL, 10); break;
+      case 'w': settle_us = strtoul(optarg, NULL, 10); break;
+      case 'o': path = optarg; break;
+      case 'r': max_rows = strtoul(optarg, NULL, 10); break;
+      case 'c': spi_divider = strtoul(optarg, NULL, 10); break;
+      default:
+        printf("usage: %s [-f start_khz] [-F stop_khz] [-s step_khz] [-n reads] [-w settle_us]\n"
+               "       [-o file] [-r rows] [-c spi_divider]\n", argv[0]);
+        return 1;
+    }
+  }
+  if(step_khz == 0 || stop_khz < start_khz || reads < 1 || reads > 255 ||
+     (stop_khz - start_khz) / step_khz + 1 > WF_MAX_BINS){
+    printf("Need start <= stop, a nonzero step, at most %d steps and 1-255 reads.\n", WF_MAX_BINS);
+    return 1;
+  }
+
+  struct wf_header h;
+  h.start_hz = start_khz * 1000;
+  h.step_hz = step_khz * 1000;
+  h.bins = (stop_khz - start_khz) / step_khz + 1;
+  h.reads = reads;
+  h.settle_us = settle_us;
+  h.rssi_offset = RSSI_OFFSET_LF;
+
+  FILE *f = fopen(path, "wb");
+  if(f == NULL || wf_write_header(f, &h) < 0){
+    printf("Can't write %s.\n", path);
+    return 1;
+  }
+
+  hardware_init();  //setup spi
+  lora_init();      //boot sequence to LoRa standby
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+  fprintf(stderr, "Sweeping %u bins of %u kHz from %u kHz, SPI at %u Hz.\n",
+          h.bins, step_khz, start_khz, spi_clock_hz());
+
+  uint8_t mean[WF_MAX_BINS];
+  uint8_t max[WF_MAX_BINS];
+  uint64_t phase_us[P_PHASES] = {0};
+  uint64_t began = now_us();
+  uint32_t rows = 0;
+
+  while(running && (max_rows == 0 || rows < max_rows)){
+    uint64_t row_t = wall_us();
+    for(int i = 0; i < h.bins && running; i++){
+      uint64_t t0 = now_us();
+      write_reg(REG_OP_MODE, LORA_STANDBY);
+      set_frequency(h.start_hz + i * h.step_hz);
+      uint64_t t1 = now_us();
+      write_reg(REG_OP_MODE, LORA_RX_CONT);
+      uint64_t t2 = now_us();
+      bcm2835_delayMicroseconds(settle_us);
+      uint64_t t3 = now_us();
+
+      uint32_t sum = 0;
+      uint8_t peak = 0;
+      for(uint32_t k = 0; k < reads; k++){
+        uint8_t r = read_reg(REG_CURRENT_RSSI);
+        sum += r;
+        if(r > peak) peak = r;
+      }
+      mean[i] = (sum + reads/2) / reads;
+      max[i] = peak;
+
+      phase_us[P_RETUNE] += t1 - t0;
+      phase_us[P_RX] += t2 - t1;
+      phase_us[P_SETTLE] += t3 - t2;
+      phase_us[P_READ] += now_us() - t3;
+    }
+    if(!running) break;
+    wf_write_row(f, &h, row_t, mean, max);
+    if(++rows % SPEC_REPORT_EVERY == 0){
+      fflush(f);
+      spec_report(&h, rows, now_us() - began, phase_us);
+    }
+  }
+
+  write_reg(REG_OP_MODE, LORA_STANDBY);
+  fclose(f);
+  spec_report(&h, rows, now_us() - began, phase_us);
+  bcm2835_spi_end();
+  bcm2835_close();
+  return 0;
+}
+
+//--------------------------------helper function implementations---------------------------------
+
+//prints the achieved step rate, where the time of a step goes, and what
+//the bus and the settle time would allow on their own
+void spec_report(const struct wf_header *h, uint32_t rows, uint64_t elapsed, const uint64_t *phase_us){
+  uint64_t steps = (uint64_t)rows * h->bins;
+  if(steps == 0 || elapsed == 0) return;
+  //standby 2 bytes, frf burst 4, rx 2, and 2 per rssi read
+  uint32_t bits = 8 * (2 + 4 + 2 + 2 * h->reads);
+  double spi_limit = (double)spi_clock_hz() / bits;
+  double settle_limit = h->settle_us ? 1e6 / h->settle_us : 0;
+  fprintf(stderr, "Sweep: %u rows, %.1f steps/s, %.2f sweeps/s.  per step:", rows,
+          steps * 1e6 / elapsed, rows * 1e6 / elapsed);
+  for(int i = 0; i < P_PHASES; i++){
+    fprintf(stderr, " %s %.0f us%s", phase_names[i], (double)phase_us[i] / steps, i < P_PHASES - 1 ? "," : "\n");
+  }
+  fprintf(stderr, "  limits: SPI %.1f steps/s (%u bits per step at %u Hz), settle %.1f steps/s\n",
+          spi_limit, bits, spi_clock_hz(), settle_limit);
+}
+
+//signal handler that lets the sweep finish its file
+void stop(int sig){
+  running = 0;
+}
@@ -0,0 +1,127 @@
+/* UCSD CubeSat
+   lorastat.c
+
+   Monitor for the radio status a radio program publishes in shared
+   memory (status.h, lorad by default).  It only ever reads the segment,
+   so it needs no hardware, no root and nothing from the radio program,
+   which can't tell it is there:
+
+   $ cc lorastat.c -o lorastat
+
+   By default it prints one line a second: how long ago the status last
+   changed, the op mode, carrier and modem, the last packet's rssi and
+   snr, packets received (crc failures), sent (failed, refused), messages
+   clients lost, clients and the Tx queue now and at its deepest.
+
+   Options:
+   -s <path>  status segment (STATUS_PATH, /dev/shm/lora-status)
+   -i <ms>    interval between lines (1000)
+   -n <count> lines to print, 0 for no end (0)
+   -b <s>     instead of printing, read as fast as possible for this long
+              and print the reads per second and how often a read had to
+              be retried because it raced an update
+
+   ---------------------------------------------------------------------------------------------*/
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include "status.h"
+
+static const char *mode_names[8] = {"sleep", "standby", "fstx", "tx", "fsrx", "rx", "rx single", "cad"};
+
+//kHz per RegModemConfig1 bandwidth index, as in timing.h
+static const double bw_khz[10] = {7.8, 10.4, 15.6, 20.8, 31.25, 41.7, 62.5, 125, 250, 500};
+
+//-----------------------------------helper function prototypes----------------------------------
+
+uint64_t mono_us(void);
+
+void print_status(const struct radio_status *s);
+
+int bench(const struct radio_status *src, uint32_t seconds);
+
+//-----------------------------------------function main-----------------------------------------
+
+int main(int argc, char **argv){
+  const char *path = STATUS_PATH;
+  uint32_t interval_ms = 1000;
+  uint32_t count = 0;
+  uint32_t bench_s = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "s:i:n:b:")) != -1){
+    switch(opt){
+      case 's': path = optarg; break;
+      case 'i': interval_ms = strtoul(optarg, NULL, 10); break;
+      case 'n': count = strtoul(optarg, NULL, 10); break;
+      case 'b': bench_s = strtoul(optarg, NULL, 10); break;
+      default:
+        printf("usage: %s [-s status] [-i ms] [-n count] [-b seconds]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  const struct radio_status *src = status_attach(path);
+  if(src == NULL){
+    printf("No radio status in %s.\n", path);
+    return 1;
+  }
+  if(bench_s) return bench(src, bench_s);
+
+  for(uint32_t i = 0; count == 0 || i < count; i++){
+    struct radio_status s;
+    if(status_read(src, &s) < 0){
+      printf("The writer has been busy for %d tries, it may have died mid update.\n", STATUS_TRIES);
+    }else{
+      print_status(&s);
+    }
+    fflush(stdout);
+    if(count == 0 || i + 1 < count) usleep(interval_ms * 1000);
+  }
+  return 0;
+}
+
+//--------------------------------helper function implementations---------------------------------
+
+//the clock status_end() stamps with
+uint64_t mono_us(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//one line per snapshot
+void print_status(const struct radio_status *s){
+  int alive = kill(s->pid, 0) == 0;
+  double age = (mono_us() - s->updated_us) / 1e6;
+  printf("%8.3fs %s%-9s %9.3f MHz SF%u BW%g CR4/%u  %4d dBm %5.1f dB  rx %u (%u)  tx %u (%u, %u)  "
+         "drops %u  clients %u  txq %u/%u\n", age, alive ? "" : "dead ",
+         (s->op_mode & 0x80) ? mode_names[s->op_mode & 0x07] : "fsk", s->freq_hz / 1e6, s->sf,
+         bw_khz[s->bw < 10 ? s->bw : 9], s->cr + 4, s->rssi, s->snr / 4.0, s->rx, s->rx_crc, s->tx,
+         s->tx_failed, s->tx_refused, s->drops, s->clients, s->txq, s->txq_max);
+}
+
+//reads back to back for a while, returns 0
+int bench(const struct radio_status *src, uint32_t seconds){
+  struct radio_status s;
+  uint64_t reads = 0, copies = 0, failed = 0;
+  uint32_t first = 0, last = 0;
+  uint64_t end = mono_us() + seconds * 1000000ULL;
+  while(mono_us() < end){
+    for(int i = 0; i < 1000; i++){
+      int n = status_read(src, &s);
+      if(n < 0){
+        failed++;
+        continue;
+      }
+      if(reads++ == 0) first = s.changes;
+      last = s.changes;
+      copies += n;
+    }
+  }
+  printf("%.0f reads/s, %.4f%% retried, %llu failed, %u updates seen\n", (double)reads / seconds,
+         reads ? 100.0 * (copies - reads) / reads : 0, (unsigned long long)failed, last - first);
+  return 0;
+}
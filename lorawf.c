@@ -0,0 +1,192 @@
+/* UCSD CubeSat
+   lorawf.c
+
+   Viewer and exporter for the waterfall files loraspec records
+   (waterfall.h).  It needs no hardware, so it builds anywhere with:
+
+   $ cc lorawf.c -o lorawf
+
+   Modes:
+   (default)  text waterfall, one line per sweep, darker is stronger.  wide
+              sweeps are folded into -W columns keeping the strongest bin
+   -c         csv export, one line per bin per sweep: time, frequency, mean
+              and max dBm, for plotting elsewhere
+   -p         peak summary: per bin the median of the means (the noise
+              floor), the highest max and how often the bin was more than
+              -t dB above its floor, strongest first
+
+   Options:
+   -m <dBm>   bottom of the text shading (-130)
+   -M <dBm>   top of the text shading (-60)
+   -x         shade the max instead of the mean
+   -W <cols>  text width (100)
+   -t <dB>    peak summary threshold above the floor (10)
+
+   ---------------------------------------------------------------------------------------------*/
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "waterfall.h"
+
+#define MODE_TEXT 0
+#define MODE_CSV  1
+#define MODE_PEAK 2
+
+//darkest last
+static const char shades[] = " .:-=+*#%@";
+
+//-----------------------------------helper function prototypes----------------------------------
+
+void text_row(const struct wf_header *h, uint64_t t, const uint8_t *v, int cols, int lo, int hi);
+
+void csv_row(const struct wf_header *h, uint64_t t, const uint8_t *mean, const uint8_t *max);
+
+void peak_summary(FILE *f, const struct wf_header *h, int thresh_db);
+
+//-----------------------------------------function main-----------------------------------------
+
+int main(int argc, char **argv){
+  int mode = MODE_TEXT;
+  int lo = -130, hi = -60;
+  int use_max = 0;
+  int cols = 100;
+  int thresh = 10;
+  int opt;
+  while((opt = getopt(argc, argv, "cpm:M:xW:t:")) != -1){
+    switch(opt){
+      case 'c': mode = MODE_CSV; break;
+      case 'p': mode = MODE_PEAK; break;
+      case 'm': lo = atoi(optarg); break;
+      case 'M': hi = atoi(optarg); break;
+      case 'x': use_max = 1; break;
+      case 'W': cols = atoi(optarg); break;
+      case 't': thresh = atoi(optarg); break;
+      default:
+        printf("usage: %s [-c | -p] [-m dBm] [-M dBm] [-x] [-W cols] [-t dB] file.lwf\n", argv[0]);
+        return 1;
+    }
+  }
+  if(optind >= argc || hi <= lo || cols < 1){
+    printf("usage: %s [-c | -p] [-m dBm] [-M dBm] [-x] [-W cols] [-t dB] file.lwf\n", argv[0]);
+    return 1;
+  }
+
+  FILE *f = fopen(argv[optind], "rb");
+  struct wf_header h;
+  if(f == NULL || wf_read_header(f, &h) < 0){
+    printf("%s is not a waterfall file.\n", argv[optind]);
+    return 1;
+  }
+
+  if(mode == MODE_PEAK){
+    peak_summary(f, &h, thresh);
+    fclose(f);
+    return 0;
+  }
+
+  static uint8_t mean[WF_MAX_BINS], max[WF_MAX_BINS];
+  uint64_t t;
+  if(mode == MODE_CSV){
+    printf("time_us,freq_hz,mean_dbm,max_dbm\n");
+  }else{
+    printf("%u bins, %.3f to %.3f MHz, %u reads per step, %d to %d dBm\n", h.bins, h.start_hz / 1e6,
+           (h.start_hz + (h.bins - 1) * (double)h.step_hz) / 1e6, h.reads, lo, hi);
+  }
+  while(wf_read_row(f, &h, &t, mean, max) == 0){
+    if(mode == MODE_CSV){
+      csv_row(&h, t, mean, max);
+    }else{
+      text_row(&h, t, use_max ? max : mean, cols, lo, hi);
+    }
+  }
+  fclose(f);
+  return 0;
+}
+
+//--------------------------------helper function implementations---------------------------------
+
+//one sweep as a line of shades, bins folded into cols keeping the max
+void text_row(const struct wf_header *h, uint64_t t, const uint8_t *v, int cols, int lo, int hi){
+  if(cols > h->bins) cols = h->bins;
+  printf("%6llu.%01llu |", (unsigned long long)(t / 1000000 % 1000000), (unsigned long long)(t / 100000 % 10));
+  for(int c = 0; c < cols; c++){
+    int from = c * h->bins / cols;
+    int to = (c + 1) * h->bins / cols;
+    int best = 0;
+    for(int i = from; i < to; i++){
+      if(v[i] > best) best = v[i];
+    }
+    int dbm = best + h->rssi_offset;
+    int k = (dbm - lo) * (int)(sizeof(shades) - 1) / (hi - lo);
+    if(k < 0) k = 0;
+    if(k > (int)sizeof(shades) - 2) k = sizeof(shades) - 2;
+    putchar(shades[k]);
+  }
+  printf("|\n");
+}
+
+void csv_row(const struct wf_header *h, uint64_t t, const uint8_t *mean, const uint8_t *max){
+  for(int i = 0; i < h->bins; i++){
+    printf("%llu,%u,%d,%d\n", (unsigned long long)t, h->start_hz + i * h->step_hz,
+           mean[i] + h->rssi_offset, max[i] + h->rssi_offset);
+  }
+}
+
+//noise floor, peak and busy fraction per bin.  the floor is the median of
+//the per sweep means, found from a 256 entry histogram per bin so the file
+//is only read once
+void peak_summary(FILE *f, const struct wf_header *h, int thresh_db){
+  static uint32_t hist[WF_MAX_BINS][256];
+  static uint8_t mean[WF_MAX_BINS], max[WF_MAX_BINS], peak[WF_MAX_BINS];
+  static uint32_t busy[WF_MAX_BINS];
+  static int order[WF_MAX_BINS];
+  static uint8_t floor_raw[WF_MAX_BINS];
+  uint32_t rows = 0;
+  uint64_t t;
+  long data = ftell(f);
+  while(wf_read_row(f, h, &t, mean, max) == 0){
+    for(int i = 0; i < h->bins; i++){
+      hist[i][mean[i]]++;
+      if(max[i] > peak[i]) peak[i] = max[i];
+    }
+    rows++;
+  }
+  if(rows == 0){
+    printf("No sweeps in the file.\n");
+    return;
+  }
+  for(int i = 0; i < h->bins; i++){
+    uint32_t seen = 0;
+    int v = 0;
+    while(v < 255 && (seen += hist[i][v]) < (rows + 1) / 2) v++;
+    floor_raw[i] = v;
+  }
+
+  //second pass for how often each bin stood out above its own floor
+  fseek(f, data, SEEK_SET);
+  while(wf_read_row(f, h, &t, mean, max) == 0){
+    for(int i = 0; i < h->bins; i++){
+      if(max[i] >= floor_raw[i] + thresh_db) busy[i]++;
+    }
+  }
+
+  //strongest peaks first, a plain insertion sort is plenty for a few
+  //hundred bins
+  for(int i = 0; i < h->bins; i++){
+    int j = i;
+    while(j > 0 && peak[order[j-1]] - floor_raw[order[j-1]] < peak[i] - floor_raw[i]){
+      order[j] = order[j-1];
+      j--;
+    }
+    order[j] = i;
+  }
+  printf("%u sweeps.  %-12s %10s %10s %10s\n", rows, "freq MHz", "floor dBm", "peak dBm", "busy %");
+  for(int n = 0; n < h->bins; n++){
+    int i = order[n];
+    printf("           %-12.4f %10d %10d %10.2f\n", (h->start_hz + i * (double)h->step_hz) / 1e6,
+           floor_raw[i] + h->rssi_offset, peak[i] + h->rssi_offset, 100.0 * busy[i] / rows);
+  }
+}
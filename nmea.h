@@ -0,0 +1,271 @@
+/* UCSD CubeSat
+   nmea.h
+
+   Minimal NMEA 0183 parser for position tagging.  Any GPS receiver that
+   talks NMEA over a serial port (or a file of recorded sentences) gives us
+   $GPGGA and $GPRMC, which between them have position, altitude, fix
+   quality and UTC time.  Talker IDs other than GP (GN, GL, ...) are taken
+   as well.  Everything else is ignored.
+
+   Usage:
+
+   struct nmea n;
+   nmea_init(&n);
+   while((c = next character) != EOF){
+     if(nmea_feed(&n, c) && n.fix.valid){
+       ...n.fix.lat, n.fix.lon, n.fix.alt_m, n.fix.utc_s
+     }
+   }
+
+   Sentences are checked against their checksum and dropped if it doesn't
+   match or a field doesn't parse, since a serial line on a moving car
+   will produce garbage now and then.  A checksum is one byte, so about
+   one garbled line in 256 passes it anyway; a fix is only taken if it is
+   also a place on the earth at a time of day (lorafuzz.c checks that).
+   Nothing in here touches the radio.
+
+   Notes on sources:
+   gps_open() takes either a serial device, which it sets to raw 8N1 at the
+   given baud rate, or a file of recorded sentences.  A file is replayed
+   in real time: each fix is released when as much time has passed since
+   the first one as the sentence timestamps say, so a recorded drive can be
+   played back against a receiver on the bench.  gps_poll() never blocks.
+
+   ---------------------------------------------------------------------------------------------*/
+
+#ifndef NMEA_H
+#define NMEA_H
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "timing.h"
+
+#define NMEA_MAX_LEN 96   //the standard says 82, leave some slack
+
+struct gps_fix{
+  int      valid;        //a position fix is held
+  double   lat;          //degrees, north positive
+  double   lon;          //degrees, east positive
+  double   alt_m;        //above mean sea level, from GGA
+  uint32_t utc_s;        //seconds since midnight UTC of the last fix
+  uint8_t  sats;
+};
+
+struct nmea{
+  char     line[NMEA_MAX_LEN + 1];
+  int      len;
+  struct gps_fix fix;
+  uint32_t sentences;    //accepted
+  uint32_t bad;          //checksum or parse failures
+};
+
+//where sentences come from
+struct gps_src{
+  int      fd;
+  int      replay;       //a recorded file paced by its own timestamps
+  struct nmea n;         //what has been read
+  struct gps_fix fix;    //what has been released, the current position
+  int      held;         //n.fix is read but not due yet
+  uint64_t t0_local;     //replay: when the first fix was released
+  uint32_t t0_utc;
+};
+
+//-----------------------------------helper function implementations----------------------------
+
+static void nmea_init(struct nmea *n){
+  memset(n, 0, sizeof(*n));
+}
+
+static int nmea_hex(char c){
+  if(c >= '0' && c <= '9') return c - '0';
+  if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+  if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+//splits the sentence in place at commas, returns the number of fields
+static int nmea_fields(char *s, char **f, int max){
+  int n = 0;
+  f[n++] = s;
+  for(; *s && n < max; s++){
+    if(*s == ','){
+      *s = '\0';
+      f[n++] = s + 1;
+    }
+  }
+  return n;
+}
+
+//ddmm.mmmm (dddmm.mmmm for longitude) plus hemisphere to signed degrees.
+//returns -1 if empty or not a place on the earth
+static int nmea_coord(const char *v, const char *hemi, double *out){
+  if(*v == '\0' || hemi[0] == '\0' || hemi[1] != '\0') return -1;
+  int max = *hemi == 'N' || *hemi == 'S' ? 90 : *hemi == 'E' || *hemi == 'W' ? 180 : -1;
+  double raw = atof(v);
+  //also false for a nan, which must not reach the int conversion
+  if(!(raw >= 0 && raw < (max + 1) * 100)) return -1;
+  int deg = (int)(raw / 100);
+  double min = raw - deg * 100;
+  double d = deg + min / 60;
+  if(min >= 60 || d > max) return -1;
+  if(*hemi == 'S' || *hemi == 'W') d = -d;
+  *out = d;
+  return 0;
+}
+
+//hhmmss.ss to seconds since midnight.  returns -1 if it isn't a time of
+//day (a leap second is)
+static int nmea_time(const char *v, uint32_t *out){
+  if(*v < '0' || *v > '9') return -1;
+  long t = strtol(v, NULL, 10);
+  if(t < 0 || t / 10000 > 23 || t / 100 % 100 > 59 || t % 100 > 60) return -1;
+  *out = (t / 10000) * 3600 + (t / 100 % 100) * 60 + t % 100;
+  return 0;
+}
+
+//parses a complete sentence without the leading $ and trailing checksum.
+//returns 1 if it updated the fix
+static int nmea_sentence(struct nmea *n, char *s){
+  char *f[24];
+  int nf = nmea_fields(s, f, 24);
+  if(strlen(f[0]) != 5) return 0;
+  const char *type = f[0] + 2;
+
+  if(strcmp(type, "GGA") == 0 && nf >= 10){
+    //time, lat, N/S, lon, E/W, quality, sats, hdop, altitude
+    if(atoi(f[6]) == 0){
+      n->fix.valid = 0;
+      return 1;
+    }
+    double lat, lon, alt = atof(f[9]);
+    uint32_t utc;
+    if(nmea_coord(f[2], f[3], &lat) < 0 || nmea_coord(f[4], f[5], &lon) < 0) return 0;
+    if(nmea_time(f[1], &utc) < 0 || !isfinite(alt)) return 0;
+    n->fix.lat = lat;
+    n->fix.lon = lon;
+    n->fix.alt_m = alt;
+    n->fix.sats = atoi(f[7]);
+    n->fix.utc_s = utc;
+    n->fix.valid = 1;
+    return 1;
+  }
+  if(strcmp(type, "RMC") == 0 && nf >= 7){
+    //time, status, lat, N/S, lon, E/W
+    if(f[2][0] != 'A'){
+      n->fix.valid = 0;
+      return 1;
+    }
+    double lat, lon;
+    uint32_t utc;
+    if(nmea_coord(f[3], f[4], &lat) < 0 || nmea_coord(f[5], f[6], &lon) < 0) return 0;
+    if(nmea_time(f[1], &utc) < 0) return 0;
+    n->fix.lat = lat;
+    n->fix.lon = lon;
+    n->fix.utc_s = utc;
+    n->fix.valid = 1;
+    return 1;
+  }
+  return 0;
+}
+
+//feeds one character.  returns 1 when a sentence completed and updated
+//the fix (which may have become invalid)
+static int nmea_feed(struct nmea *n, char c){
+  if(c == '$'){
+    n->len = 0;
+    n->line[n->len++] = c;
+    return 0;
+  }
+  if(n->len == 0) return 0;
+  if(c != '\r' && c != '\n'){
+    if(n->len < NMEA_MAX_LEN){
+      n->line[n->len++] = c;
+    }else{
+      n->len = 0;
+      n->bad++;
+    }
+    return 0;
+  }
+
+  //end of line, check *hh against the xor of everything between $ and *
+  n->line[n->len] = '\0';
+  int len = n->len;
+  n->len = 0;
+  if(len < 4 || n->line[len-3] != '*'){
+    n->bad++;
+    return 0;
+  }
+  int hi = nmea_hex(n->line[len-2]), lo = nmea_hex(n->line[len-1]);
+  uint8_t sum = 0;
+  for(int i = 1; i < len - 3; i++) sum ^= n->line[i];
+  if(hi < 0 || lo < 0 || sum != (hi << 4 | lo)){
+    n->bad++;
+    return 0;
+  }
+  n->line[len-3] = '\0';
+  int r = nmea_sentence(n, n->line + 1);
+  if(r) n->sentences++;
+  return r;
+}
+
+//opens a serial device or a replay file, 0 on success or -1
+static int gps_open(struct gps_src *g, const char *path, uint32_t baud){
+  memset(g, 0, sizeof(*g));
+  nmea_init(&g->n);
+  g->fd = open(path, O_RDONLY | O_NONBLOCK | O_NOCTTY);
+  if(g->fd < 0) return -1;
+  struct stat st;
+  fstat(g->fd, &st);
+  g->replay = S_ISREG(st.st_mode);
+  if(isatty(g->fd)){
+    struct termios t;
+    tcgetattr(g->fd, &t);
+    cfmakeraw(&t);
+    speed_t s = baud == 4800 ? B4800 : baud == 19200 ? B19200 : baud == 38400 ? B38400 :
+                baud == 57600 ? B57600 : baud == 115200 ? B115200 : B9600;
+    cfsetispeed(&t, s);
+    cfsetospeed(&t, s);
+    tcsetattr(g->fd, TCSANOW, &t);
+  }
+  return 0;
+}
+
+//reads whatever is available and updates g->fix.  returns 1 if the
+//position changed
+static int gps_poll(struct gps_src *g){
+  int changed = 0;
+  char c;
+  while(1){
+    if(g->held){
+      //replay: release the fix once its time has come
+      uint32_t dt = (g->n.fix.utc_s - g->t0_utc + 86400) % 86400;
+      if(now_us() - g->t0_local < (uint64_t)dt * 1000000) break;
+      g->fix = g->n.fix;
+      g->held = 0;
+      changed = 1;
+    }
+    if(read(g->fd, &c, 1) != 1) break;
+    if(!nmea_feed(&g->n, c)) continue;
+    if(!g->replay){
+      g->fix = g->n.fix;
+      changed = 1;
+      continue;
+    }
+    if(g->t0_local == 0){
+      g->t0_local = now_us();
+      g->t0_utc = g->n.fix.utc_s;
+    }
+    g->held = 1;
+  }
+  return changed;
+}
+
+#endif
@@ -0,0 +1,175 @@
+/* UCSD CubeSat
+   perfctr.h
+
+   Hardware counters around named regions of the radio code.  Wall clock
+   latency says a packet took long, not why: the Pi can be busy computing,
+   stalled on memory, or just waiting for the SPI bus, and only the last
+   one gets better with a faster SPI clock.  perf_open() opens a counter
+   group on the calling thread with perf_event_open(2):
+
+   cycles        PERF_COUNT_HW_CPU_CYCLES
+   instructions  PERF_COUNT_HW_INSTRUCTIONS, over cycles the IPC.  a low
+                 IPC over many cycles is waiting, a high one is work
+   cache misses  PERF_COUNT_HW_CACHE_MISSES
+   ctx switches  PERF_COUNT_SW_CONTEXT_SWITCHES, sleeps and preemptions
+
+   and PERF_BEGIN(region) and PERF_END(region) add what the group counted
+   in between to the region's totals.  perf_report() prints the totals
+   and the averages per packet.  The regions are:
+
+   PR_FIFO_DRAIN  read_fifo_packet()
+   PR_FIFO_LOAD   load_fifo_packet()
+   PR_IRQ         reading RegIrqFlags once an event has been seen, in
+                  wait_irq() and wait_event().  polls that find nothing
+                  never reach PERF_END and aren't counted, they are
+                  waiting, not dispatch
+   PR_CODEC       frame packing and unpacking in the ping benchmark
+   PR_LOG         bl_log() in binlog.h
+
+   loraping -H and lorasim -m ping -H turn it on.  Until perf_open() is
+   called each region boundary costs a single branch on perf_on.
+
+   Notes on accuracy:
+   Each boundary reads the group with one read(2), a microsecond or two
+   on a Pi, so about half a read lands in every region and an enclosing
+   region (PR_FIFO_DRAIN around the PR_LOG of its register reads) also
+   pays for the inner one's reads.  Counters the kernel or the CPU don't
+   offer, in a virtual machine for instance, are left out and printed as
+   -; with /proc/sys/kernel/perf_event_paranoid above 1 only root counts
+   at all, which the radio programs are anyway.
+
+   ---------------------------------------------------------------------------------------------*/
+
+#ifndef PERFCTR_H
+#define PERFCTR_H
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define PERF_CYCLES    0
+#define PERF_INSTR     1
+#define PERF_MISSES    2
+#define PERF_CTX_SW    3
+#define PERF_COUNTERS  4
+
+#define PR_FIFO_DRAIN  0
+#define PR_FIFO_LOAD   1
+#define PR_IRQ         2
+#define PR_CODEC       3
+#define PR_LOG         4
+#define PR_REGIONS     5
+
+struct perf_region{
+  uint64_t start[PERF_COUNTERS];
+  uint64_t total[PERF_COUNTERS];
+  uint64_t calls;
+};
+
+static const char *perf_region_names[PR_REGIONS] = {"fifo drain", "fifo load", "irq dispatch", "codec", "logging"};
+
+//the single branch a disabled region boundary costs
+static int perf_on = 0;
+
+static int perf_fd = -1;
+static int perf_slot[PERF_COUNTERS];   //position in the group read, -1 if not counted
+static int perf_n = 0;
+static struct perf_region perf_regions[PR_REGIONS];
+
+#define PERF_BEGIN(r)  do{ if(perf_on) perf_begin(r); }while(0)
+#define PERF_END(r)    do{ if(perf_on) perf_end(r); }while(0)
+
+//-----------------------------------helper function implementations----------------------------
+
+//opens one counter into the group, -1 if this machine doesn't have it
+static int perf_add(uint32_t type, uint64_t config){
+  struct perf_event_attr a;
+  memset(&a, 0, sizeof(a));
+  a.size = sizeof(a);
+  a.type = type;
+  a.config = config;
+  a.read_format = PERF_FORMAT_GROUP;
+  a.exclude_hv = 1;
+  int fd = syscall(SYS_perf_event_open, &a, 0, -1, perf_fd, 0);
+  if(fd < 0){
+    //not root, count user time only
+    a.exclude_kernel = 1;
+    fd = syscall(SYS_perf_event_open, &a, 0, -1, perf_fd, 0);
+  }
+  if(fd >= 0 && perf_fd < 0) perf_fd = fd;
+  return fd;
+}
+
+//starts counting on the calling thread.  returns the number of counters
+//it got, 0 if none, in which case the regions stay off
+static int perf_open(void){
+  static const uint32_t types[PERF_COUNTERS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+                                                PERF_TYPE_SOFTWARE};
+  static const uint64_t configs[PERF_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                  PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_SW_CONTEXT_SWITCHES};
+  perf_n = 0;
+  for(int i = 0; i < PERF_COUNTERS; i++){
+    perf_slot[i] = perf_add(types[i], configs[i]) >= 0 ? perf_n++ : -1;
+  }
+  memset(perf_regions, 0, sizeof(perf_regions));
+  perf_on = perf_n > 0;
+  return perf_n;
+}
+
+//reads the whole group at once into v, by counter
+static void perf_read(uint64_t *v){
+  uint64_t buf[1 + PERF_COUNTERS];
+  if(read(perf_fd, buf, sizeof(buf)) < (ssize_t)sizeof(uint64_t)) buf[0] = 0;
+  for(int i = 0; i < PERF_COUNTERS; i++){
+    v[i] = perf_slot[i] >= 0 && perf_slot[i] < (int)buf[0] ? buf[1 + perf_slot[i]] : 0;
+  }
+}
+
+static void perf_begin(int r){
+  perf_read(perf_regions[r].start);
+}
+
+static void perf_end(int r){
+  uint64_t v[PERF_COUNTERS];
+  perf_read(v);
+  for(int i = 0; i < PERF_COUNTERS; i++) perf_regions[r].total[i] += v[i] - perf_regions[r].start[i];
+  perf_regions[r].calls++;
+}
+
+//prints one line per region that ran: calls, totals and averages per
+//packet, packets being whatever the caller counts one of
+static void perf_report(FILE *out, uint64_t packets){
+  if(!perf_on) return;
+  if(packets == 0) packets = 1;
+  fprintf(out, "%-13s %8s %12s %12s %6s %10s %8s   per packet: %10s %10s %8s %6s\n", "region", "calls",
+          "cycles", "instr", "ipc", "misses", "ctx sw", "cycles", "instr", "misses", "ctx sw");
+  for(int r = 0; r < PR_REGIONS; r++){
+    const struct perf_region *g = &perf_regions[r];
+    if(g->calls == 0) continue;
+    char col[PERF_COUNTERS][2][24];
+    for(int i = 0; i < PERF_COUNTERS; i++){
+      if(perf_slot[i] < 0){
+        strcpy(col[i][0], "-");
+        strcpy(col[i][1], "-");
+        continue;
+      }
+      snprintf(col[i][0], 24, "%llu", (unsigned long long)g->total[i]);
+      snprintf(col[i][1], 24, "%.1f", (double)g->total[i] / packets);
+    }
+    char ipc[16] = "-";
+    if(perf_slot[PERF_CYCLES] >= 0 && perf_slot[PERF_INSTR] >= 0 && g->total[PERF_CYCLES]){
+      snprintf(ipc, sizeof(ipc), "%.2f", (double)g->total[PERF_INSTR] / g->total[PERF_CYCLES]);
+    }
+    fprintf(out, "%-13s %8llu %12s %12s %6s %10s %8s               %10s %10s %8s %6s\n", perf_region_names[r],
+            (unsigned long long)g->calls, col[PERF_CYCLES][0], col[PERF_INSTR][0], ipc, col[PERF_MISSES][0],
+            col[PERF_CTX_SW][0], col[PERF_CYCLES][1], col[PERF_INSTR][1], col[PERF_MISSES][1],
+            col[PERF_CTX_SW][1]);
+  }
+}
+
+#endif
@@ -0,0 +1,193 @@
+/* UCSD CubeSat
+   pingpong.h
+
+   Ping-pong benchmark.  The Tx and Rx programs only ever send one way, so
+   nothing measured how long a request and its reply take, or how much of
+   that is airtime and how much is our own code.  Here one node (the
+   pinger) sends sequence numbered FRAME_PING probes and the other (the
+   echoer) sends each one straight back with the echo flag set.  The
+   pinger works through a plan of steps, each a modem profile and a probe
+   size, sending a fixed number of probes per step, and reports per step:
+
+   loss      probes without a matching echo before the timeout
+   rtt       probe Tx start to echo RxDone, as percentiles
+   overhead  rtt less the two airtimes, what detection, SPI and mode
+             switches cost on both ends
+   turn      the echoer's own RxDone to Tx start, carried back in the
+             turn_us field of its next echo
+   goodput   probe payload bytes echoed per second of the step, and that
+             as a share of the ping-pong limit len / (2 airtime)
+
+   The pinger loop only talks to a struct pp_radio, so the same loop runs
+   over real modules (loraping.c) and over a simulated radio (lorasim -m
+   ping), and a driver change can be judged on the same numbers either
+   way.  Nothing in here touches the hardware.
+
+   Notes on timeouts:
+   A probe is given up on PP_TIMEOUT_PAD_US plus PP_TIMEOUT_BYTE_US a
+   byte after both airtimes.  The per byte part covers an echoer that
+   moves the probe through the FIFO twice at the radio programs' default
+   3.8 kHz SPI clock, the slowest turnaround there is.  An echo that
+   arrives after that (a late one, or one for the previous step) is
+   counted as stale and dropped, so it can't be taken for the probe after
+   it.
+
+   ---------------------------------------------------------------------------------------------*/
+
+#ifndef PINGPONG_H
+#define PINGPONG_H
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "frame.h"
+#include "perfctr.h"
+
+#define PP_MAX_STEPS      32
+#define PP_MAX_COUNT      1000     //probes per step kept for the percentiles
+#define PP_TIMEOUT_PAD_US 250000   //wait past two airtimes before calling a probe lost
+#define PP_TIMEOUT_BYTE_US 5000    //and this much more per probe byte
+
+//one step of the plan
+struct pp_step{
+  struct profile p;
+  uint8_t len;            //probe size, PING_HEADER_LEN to 255
+};
+
+struct pp_stats{
+  uint8_t  skipped;       //the echoer couldn't be moved to the step's profile
+  uint32_t sent;
+  uint32_t echoed;
+  uint32_t stale;         //echoes for an earlier probe
+  uint32_t corrupt;       //crc failures and damaged filler
+  uint32_t air_us;        //airtime of one probe
+  uint64_t elapsed_us;
+  uint32_t rtt_us[PP_MAX_COUNT];
+  uint32_t turn_us[PP_MAX_COUNT];
+  uint32_t nturn;
+};
+
+//what the benchmark needs from a radio, real or simulated.  times are
+//whatever clock now() runs on
+struct pp_radio{
+  void *ctx;
+  uint64_t (*now)(void *ctx);
+  //moves both ends to a profile, 0 on success or -1 if the peer didn't follow
+  int (*set_profile)(void *ctx, const struct profile *p);
+  //sends a packet and returns once it is on the air and done.  tx_start
+  //gets the time Tx was entered.  0 on success
+  int (*send)(void *ctx, const uint8_t *buf, uint8_t len, uint64_t *tx_start);
+  //receives one packet before the absolute deadline.  rx_done gets the
+  //RxDone time.  returns the length, -1 on timeout and -2 on a crc error
+  int (*recv)(void *ctx, uint8_t *buf, uint64_t deadline, uint64_t *rx_done);
+};
+
+//-----------------------------------helper function implementations----------------------------
+
+static int pp_cmp_u32(const void *a, const void *b){
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+//the q-th percentile of a sorted array, 0 if it is empty
+static uint32_t pp_percentile(const uint32_t *v, uint32_t n, int q){
+  if(n == 0) return 0;
+  uint32_t i = (uint32_t)((uint64_t)(n - 1) * q / 100);
+  return v[i];
+}
+
+//runs the plan, count probes a step, filling in one pp_stats per step.
+//the echoer must already be on steps[0]'s profile or willing to move
+//there.  stop, if not NULL, ends the run early when it goes nonzero
+static void pp_run(const struct pp_radio *r, const struct pp_step *steps, int nsteps, uint32_t count,
+                   struct pp_stats *st, volatile int *stop){
+  uint8_t buf[255];
+  uint16_t seq = 0;
+  if(count > PP_MAX_COUNT) count = PP_MAX_COUNT;
+  for(int s = 0; s < nsteps && !(stop && *stop); s++){
+    memset(&st[s], 0, sizeof(st[s]));
+    if(r->set_profile(r->ctx, &steps[s].p) < 0){
+      st[s].skipped = 1;
+      continue;
+    }
+    struct modem_cfg m;
+    profile_modem(&steps[s].p, &m);
+    st[s].air_us = airtime_us(&m, steps[s].len);
+    uint64_t timeout = 2ULL * st[s].air_us + PP_TIMEOUT_PAD_US + (uint64_t)steps[s].len * PP_TIMEOUT_BYTE_US;
+    uint64_t began = r->now(r->ctx);
+
+    for(uint32_t i = 0; i < count && !(stop && *stop); i++){
+      struct ping probe = {++seq, (uint8_t)s, 0, 0};
+      PERF_BEGIN(PR_CODEC);
+      uint8_t len = pack_ping(buf, &probe, steps[s].len);
+      PERF_END(PR_CODEC);
+      uint64_t tx_start;
+      if(r->send(r->ctx, buf, len, &tx_start) < 0) continue;
+      st[s].sent++;
+
+      //wait for this probe's echo, dropping anything older
+      uint64_t deadline = tx_start + timeout;
+      while(1){
+        uint64_t rx_done;
+        int n = r->recv(r->ctx, buf, deadline, &rx_done);
+        if(n == -1) break;
+        struct ping echo;
+        int bad = n < 0;
+        if(!bad){
+          PERF_BEGIN(PR_CODEC);
+          bad = unpack_ping(buf, (uint8_t)n, &echo) < 0;
+          PERF_END(PR_CODEC);
+        }
+        if(bad){
+          st[s].corrupt++;
+          continue;
+        }
+        if(!(echo.flags & PING_ECHO)) continue;
+        if(echo.seq != probe.seq || echo.step != s){
+          st[s].stale++;
+          continue;
+        }
+        st[s].rtt_us[st[s].echoed++] = (uint32_t)(rx_done - tx_start);
+        if(echo.turn_us && st[s].nturn < PP_MAX_COUNT) st[s].turn_us[st[s].nturn++] = echo.turn_us;
+        break;
+      }
+    }
+    st[s].elapsed_us = r->now(r->ctx) - began;
+  }
+}
+
+//prints one line per step.  sorts the sample arrays
+static void pp_report(FILE *out, const struct pp_step *steps, int nsteps, struct pp_stats *st){
+  fprintf(out, "%-32s %4s %5s %6s %8s %8s %8s %8s %8s %8s %8s %9s %6s\n", "profile", "len", "sent", "loss%",
+          "air ms", "rtt p50", "p90", "p99", "max", "ovh ms", "turn ms", "goodput", "limit");
+  for(int s = 0; s < nsteps; s++){
+    char name[48];
+    profile_name(&steps[s].p, name);
+    if(st[s].skipped){
+      fprintf(out, "%-32s %4u  skipped, the echoer didn't switch\n", name, steps[s].len);
+      continue;
+    }
+    if(st[s].sent == 0) continue;
+    qsort(st[s].rtt_us, st[s].echoed, sizeof(uint32_t), pp_cmp_u32);
+    qsort(st[s].turn_us, st[s].nturn, sizeof(uint32_t), pp_cmp_u32);
+    double ovh = 0;
+    for(uint32_t i = 0; i < st[s].echoed; i++) ovh += (double)st[s].rtt_us[i] - 2.0 * st[s].air_us;
+    if(st[s].echoed) ovh /= st[s].echoed;
+    double goodput = st[s].elapsed_us ? (double)st[s].echoed * steps[s].len * 1e6 / st[s].elapsed_us : 0;
+    double limit = (double)steps[s].len * 1e6 / (2.0 * st[s].air_us);
+    fprintf(out, "%-32s %4u %5u %6.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8.2f %8.3f %7.1f/s %5.1f%%\n",
+            name, steps[s].len, st[s].sent, 100.0 * (st[s].sent - st[s].echoed) / st[s].sent,
+            st[s].air_us / 1e3, pp_percentile(st[s].rtt_us, st[s].echoed, 50) / 1e3,
+            pp_percentile(st[s].rtt_us, st[s].echoed, 90) / 1e3,
+            pp_percentile(st[s].rtt_us, st[s].echoed, 99) / 1e3,
+            pp_percentile(st[s].rtt_us, st[s].echoed, 100) / 1e3, ovh / 1e3,
+            pp_percentile(st[s].turn_us, st[s].nturn, 50) / 1e3, goodput, 100 * goodput / limit);
+    if(st[s].stale || st[s].corrupt){
+      fprintf(out, "%-32s      %u stale echoes, %u corrupt\n", "", st[s].stale, st[s].corrupt);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,139 @@
+/* UCSD CubeSat
+   power.h
+
+   Power state manager for the SX1278.  Between beacons loraTX.c used to sit
+   in LORA_STANDBY for the whole gap, about 1.6 mA, when LORA_SLEEP draws a
+   fraction of a microamp.  power_idle_until() takes the time of the next
+   thing the radio has to do and puts the chip in the lowest mode that still
+   lets it be ready on time, then wakes it back to standby just before the
+   deadline.
+
+   Usage from a program that already includes sx1278.h:
+
+   #include "power.h"
+   power_init(1);                        //after lora_init(), 0 never sleeps
+   ...
+   if(power_idle_until(deadline, 0)){    //returns in standby at deadline
+     //the chip slept, FIFO contents are gone
+   }
+   power_report(stderr);
+
+   Notes on wake latency:
+   Getting out of sleep takes the crystal oscillator startup (TS_OSC, about
+   250 us in the datasheet) plus the register write itself, which at the
+   current SPI clock divider is several milliseconds on its own.  Rather
+   than trust a constant the manager times every wake and keeps a decaying
+   maximum, so it pre-wakes early enough even when the bus is slow.  If a
+   wake does finish after its deadline the lateness is recorded and the
+   estimate grows.
+
+   Notes on the FIFO:
+   The datasheet is explicit that the FIFO is cleared in sleep.  Callers
+   that have already loaded a packet pass reload_us, the time it would take
+   to load it again.  Sleep is only chosen when the gap covers the wake
+   latency plus the reload plus POWER_MIN_SLEEP_US, otherwise the chip
+   stays in standby and keeps its FIFO.  The return value says which
+   happened.
+
+   ---------------------------------------------------------------------------------------------*/
+
+#ifndef POWER_H
+#define POWER_H
+
+//------------------------------header files and label definitions------------------------------
+
+#include "sx1278.h"
+
+#define TS_OSC_US          250   //datasheet oscillator startup from sleep
+#define POWER_MIN_SLEEP_US 2000  //shorter gaps aren't worth the wake up
+#define POWER_WAKE_GUARD   500   //slack added to the wake estimate
+
+struct power_mgr{
+  int      enabled;        //0 keeps the chip in standby, for comparison
+  uint32_t wake_us;        //decaying max of measured wake latency
+  uint64_t start;
+  uint64_t sleep_us;       //time spent asleep
+  uint64_t standby_us;     //time spent idling in standby
+  uint32_t sleeps;         //idles that went to sleep
+  uint32_t stays;          //idles that stayed in standby
+  uint32_t late;           //wakes that finished after their deadline
+  uint32_t late_max_us;
+};
+
+static struct power_mgr power;
+
+//-----------------------------------helper function implementations----------------------------
+
+//starts the manager.  seeds the wake estimate with one timed register
+//access plus the oscillator startup
+static void power_init(int enabled){
+  power.enabled = enabled;
+  uint64_t t = now_us();
+  read_reg(REG_OP_MODE);
+  power.wake_us = (now_us() - t) + TS_OSC_US;
+  power.start = now_us();
+  power.sleep_us = power.standby_us = 0;
+  power.sleeps = power.stays = power.late = power.late_max_us = 0;
+}
+
+//idles the radio until an absolute monotonic deadline and returns with the
+//chip in standby.  reload_us is what losing the FIFO would cost the caller.
+//returns 1 if the chip slept (FIFO lost), 0 if it stayed in standby
+static int power_idle_until(uint64_t deadline, uint32_t reload_us){
+  uint64_t now = now_us();
+  if(deadline <= now){
+    write_reg(REG_OP_MODE, LORA_STANDBY);
+    return 0;
+  }
+  uint64_t gap = deadline - now;
+  uint64_t need = (uint64_t)power.wake_us + POWER_WAKE_GUARD + reload_us + POWER_MIN_SLEEP_US;
+
+  if(!power.enabled || gap < need){
+    write_reg(REG_OP_MODE, LORA_STANDBY);
+    sleep_until_us(deadline);
+    power.standby_us += now_us() - now;
+    power.stays++;
+    return 0;
+  }
+
+  //sleep, then come back just in time
+  write_reg(REG_OP_MODE, LORA_SLEEP);
+  uint64_t wake_at = deadline - power.wake_us - POWER_WAKE_GUARD - reload_us;
+  sleep_until_us(wake_at);
+  uint64_t t = now_us();
+  power.sleep_us += t - now;
+  write_reg(REG_OP_MODE, LORA_STANDBY);
+  bcm2835_delayMicroseconds(TS_OSC_US);
+  uint64_t woke = now_us();
+  power.sleeps++;
+
+  //learn from this wake, decaying slowly so one slow bus access sticks
+  uint32_t took = (uint32_t)(woke - t);
+  power.wake_us -= power.wake_us / 16;
+  if(took > power.wake_us) power.wake_us = took;
+  if(woke > deadline - reload_us){
+    uint32_t over = (uint32_t)(woke - (deadline - reload_us));
+    power.late++;
+    if(over > power.late_max_us) power.late_max_us = over;
+  }
+
+  sleep_until_us(deadline);
+  power.standby_us += now_us() - woke;
+  return 1;
+}
+
+//fraction of wall time since power_init() the chip spent asleep
+static double power_sleep_fraction(void){
+  uint64_t total = now_us() - power.start;
+  return total ? (double)power.sleep_us / total : 0;
+}
+
+//prints achieved sleep fraction and wake timing
+static void power_report(FILE *out){
+  fprintf(out, "Power: asleep %.2f%% of the time, %u sleeps, %u standby idles, "
+          "wake %u us, %u late wakes (max %u us)\n",
+          100*power_sleep_fraction(), power.sleeps, power.stays,
+          power.wake_us, power.late, power.late_max_us);
+}
+
+#endif
@@ -0,0 +1,123 @@
+/* UCSD CubeSat
+   probes.h
+
+   Static tracepoints for tracing a running radio program with bpftrace or
+   perf, without rebuilding it or restarting it.  PROBE(name, args...)
+   puts a nop in the code and records its address, the provider "lora",
+   the name and where to find each argument in an ELF note
+   (.note.stapsdt), the same format systemtap's <sys/sdt.h> writes.  A
+   tracer that attaches replaces the nop with a breakpoint and reads the
+   arguments from there, and until one does the probe is the nop.
+   loratrace.bt has latency histograms built from them:
+
+   $ sudo bpftrace loratrace.bt          (while ./lorad runs)
+
+   Probes and their arguments:
+   reg_write         address, data, previous value
+   mode_change       previous RegOpMode, new RegOpMode
+   fifo_burst        1 for a load and 0 for a drain, length, us it took
+   irq_flags         flags, us from starting to wait to the read that saw
+                     them
+   packet_queued     client, seq, length, queue depth after it
+   packet_delivered  length, status, us from the event to the packet
+                     being handed on
+   tx_done           length, 1 if TxDone came and 0 on a timeout, us from
+                     the Tx mode write
+
+   Notes on the cost:
+   The arguments still have to be in registers or on the stack at the
+   nop, which is a move or two for values the code already has.  A probe
+   with an argument that costs something, a clock read for a latency,
+   sits behind PROBE_ENABLED(name), which reads a counter the tracer bumps
+   while it is attached (a semaphore in <sys/sdt.h> terms).  Every probe
+   has one, so the list above is also the list of PROBE_SEMAPHORE()s
+   below.
+
+   Notes on <sys/sdt.h>:
+   It comes with systemtap, which the Pis don't have, and it is a
+   header's worth of macros for the half page here, so the note is
+   written out directly.  Arguments are all passed as signed longs, so
+   every one reads as a plain integer in a script.  readelf -n on a
+   program lists its probes.
+
+   ---------------------------------------------------------------------------------------------*/
+
+#ifndef PROBES_H
+#define PROBES_H
+
+//------------------------------header files and label definitions------------------------------
+
+#if __SIZEOF_POINTER__ == 8
+#define PROBE_ADDR ".8byte "
+#else
+#define PROBE_ADDR ".4byte "
+#endif
+
+#if __SIZEOF_LONG__ == 8
+#define PROBE_SIZE "-8"
+#else
+#define PROBE_SIZE "-4"
+#endif
+
+//the counter a tracer increments while it is attached to a probe
+#define PROBE_SEMAPHORE(name) \
+  static volatile unsigned short lora_##name##_semaphore __attribute__((used, section(".probes"))) = 0
+
+PROBE_SEMAPHORE(reg_write);
+PROBE_SEMAPHORE(mode_change);
+PROBE_SEMAPHORE(fifo_burst);
+PROBE_SEMAPHORE(irq_flags);
+PROBE_SEMAPHORE(packet_queued);
+PROBE_SEMAPHORE(packet_delivered);
+PROBE_SEMAPHORE(tx_done);
+
+#define PROBE_ENABLED(name) __builtin_expect(lora_##name##_semaphore != 0, 0)
+
+//--------------------------------------probe macros---------------------------------------------
+
+//the nop and its note.  _.stapsdt.base lets a tracer tell how far the
+//program was moved from its link address
+#define PROBE_ASM(name, args)                                              \
+  "990: nop\n"                                                             \
+  ".pushsection .note.stapsdt,\"?\",\"note\"\n"                            \
+  ".balign 4\n"                                                            \
+  ".4byte 992f-991f, 994f-993f, 3\n"                                       \
+  "991: .asciz \"stapsdt\"\n"                                              \
+  "992: .balign 4\n"                                                       \
+  "993: " PROBE_ADDR "990b\n"                                              \
+  PROBE_ADDR "_.stapsdt.base\n"                                            \
+  PROBE_ADDR "lora_" #name "_semaphore\n"                                  \
+  ".asciz \"lora\"\n"                                                      \
+  ".asciz \"" #name "\"\n"                                                 \
+  ".asciz \"" args "\"\n"                                                  \
+  "994: .balign 4\n"                                                       \
+  ".popsection\n"                                                          \
+  ".ifndef _.stapsdt.base\n"                                               \
+  ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"  \
+  ".weak _.stapsdt.base\n"                                                 \
+  ".hidden _.stapsdt.base\n"                                               \
+  "_.stapsdt.base: .space 1\n"                                             \
+  ".size _.stapsdt.base, 1\n"                                              \
+  ".popsection\n"                                                          \
+  ".endif\n"
+
+#define PROBE_ARG(n) PROBE_SIZE "@%[a" #n "]"
+
+#define PROBE1(name, a) \
+  __asm__ __volatile__(PROBE_ASM(name, PROBE_ARG(1)) :: [a1] "nor"((long)(a)))
+#define PROBE2(name, a, b) \
+  __asm__ __volatile__(PROBE_ASM(name, PROBE_ARG(1) " " PROBE_ARG(2)) :: [a1] "nor"((long)(a)), \
+                       [a2] "nor"((long)(b)))
+#define PROBE3(name, a, b, c) \
+  __asm__ __volatile__(PROBE_ASM(name, PROBE_ARG(1) " " PROBE_ARG(2) " " PROBE_ARG(3)) :: \
+                       [a1] "nor"((long)(a)), [a2] "nor"((long)(b)), [a3] "nor"((long)(c)))
+#define PROBE4(name, a, b, c, d) \
+  __asm__ __volatile__(PROBE_ASM(name, PROBE_ARG(1) " " PROBE_ARG(2) " " PROBE_ARG(3) " " PROBE_ARG(4)) :: \
+                       [a1] "nor"((long)(a)), [a2] "nor"((long)(b)), [a3] "nor"((long)(c)), \
+                       [a4] "nor"((long)(d)))
+
+//PROBE(name, args...) picks the macro for its number of arguments, 1 to 4
+#define PROBE_PICK(_1, _2, _3, _4, macro, ...) macro
+#define PROBE(name, ...) PROBE_PICK(__VA_ARGS__, PROBE4, PROBE3, PROBE2, PROBE1, )(name, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,186 @@
+/* UCSD CubeSat
+   profile.h
+
+   Modem profiles and the register images that program them.  A profile
+   is the handful of settings both ends of a link have to agree on:
+   spreading factor, bandwidth, coding rate, sync word, header mode, crc
+   and preamble length.  Switching between profiles has to be quick (the
+   hunt mode in lorahunt.c does it for every combination in a list, within
+   one beacon interval), so each profile is turned once into the exact
+   bytes of the registers it lives in, and sx1278.h's apply_image() only
+   sends the ones that differ from what the chip holds.
+
+   The image covers:
+
+   0x1D-0x21  RegModemConfig1, RegModemConfig2, RegSymbTimeoutLsb and the
+              two preamble length bytes.  contiguous, so whatever changed
+              among them goes in one burst
+   0x26       RegModemConfig3, low data rate optimize and AGC
+   0x31 0x37  RegDetectOptimize and RegDetectionThreshold, which the
+              datasheet wants different for SF6
+   0x39       RegSyncWord
+
+   Low data rate optimize is turned on whenever a symbol lasts more than
+   16 ms, as the datasheet asks, and the AGC is always on.  The registers
+   may only be changed in sleep or standby.  Nothing in here touches the
+   hardware; sx1278.h includes this file.
+
+   Notes on switching profiles mid pass:
+   When the link has margin to spare the groundstation (loraRX -U) moves
+   both ends to a faster profile with a two phase handshake in
+   FRAME_PROFILE_CMD frames (frame.h), sent in the listening window the
+   balloon (loraTX -P) opens after every beacon:
+
+   1. after a beacon the groundstation sends PROPOSE with the profile and
+      a delay, PROFILE_SWITCH_MS
+   2. the balloon answers ACK straight away and arms the switch for the
+      delay after the end of the proposal
+   3. if the ack arrives within PROFILE_ACK_US the groundstation arms the
+      same switch, counted from the end of its own proposal.  both ends
+      apply the new image at the same instant, well before the next
+      beacon, so the first beacon on the new profile is already heard
+   4. after every beacon heard on the new profile the groundstation sends
+      COMMIT
+
+   Either side falls back on its own.  The balloon goes back to the base
+   profile after PROFILE_REVERT_BEACONS beacons without a commit, which
+   also covers a lost ack, where only the balloon switched.  The
+   groundstation goes back after PROFILE_LOST_BEACONS beacon periods
+   without hearing one, which covers a balloon that fell back first and
+   a link that simply dropped.  Both fall back to the same
+   base profile, the one the programs start with, so they always meet
+   again.
+
+   ---------------------------------------------------------------------------------------------*/
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdint.h>
+#include "timing.h"
+#ifndef FLIGHT
+#include <stdio.h>
+#endif
+
+#define IMAGE_BLOCK_LEN   5      //RegModemConfig1 through RegPreambleLsb
+#define LDRO_SYMBOL_US    16000  //symbols longer than this need low data rate optimize
+#define SYNC_WORD_LORA    0x12   //reset value, 0x34 is LoRaWAN's
+
+//profile switch handshake
+#define PROFILE_SWITCH_MS      2000     //proposal to switch, inside a beacon period
+#define PROFILE_ACK_US         1000000  //how long the groundstation waits for the ack
+#define PROFILE_REVERT_BEACONS 3        //balloon beacons without a commit before falling back
+#define PROFILE_LOST_BEACONS   3        //beacon periods the groundstation waits before falling back
+
+struct profile{
+  uint8_t  sf;         //6-12
+  uint8_t  bw;         //RegModemConfig1 bandwidth index, see lora_bw_hz
+  uint8_t  cr;         //1-4 is 4/5-4/8
+  uint8_t  sync;
+  uint8_t  implicit;
+  uint8_t  crc;
+  uint16_t preamble;
+};
+
+//the bytes a profile puts in the chip
+struct reg_image{
+  uint8_t block[IMAGE_BLOCK_LEN];
+  uint8_t config3;
+  uint8_t detect_opt;
+  uint8_t detect_thr;
+  uint8_t sync;
+};
+
+//-----------------------------------helper function implementations----------------------------
+
+//fills in the modem_cfg a profile gives, for the timing math
+static void profile_modem(const struct profile *p, struct modem_cfg *m){
+  m->sf = p->sf;
+  m->bw_hz = lora_bw_hz[p->bw < 10 ? p->bw : 9];
+  m->cr = p->cr;
+  m->implicit = p->implicit;
+  m->crc = p->crc;
+  m->preamble = p->preamble;
+  m->ldro = 0;
+  m->ldro = symbol_us(m) > LDRO_SYMBOL_US;
+}
+
+//the profile a set of modem settings and a sync word make up, the
+//inverse of profile_modem()
+static void profile_of(const struct modem_cfg *m, uint8_t sync, struct profile *p){
+  p->sf = m->sf;
+  p->bw = 9;
+  for(int i = 0; i < 10; i++){
+    if(lora_bw_hz[i] == m->bw_hz) p->bw = i;
+  }
+  p->cr = m->cr;
+  p->sync = sync;
+  p->implicit = m->implicit;
+  p->crc = m->crc;
+  p->preamble = m->preamble;
+}
+
+//1 if two profiles program the same settings
+static int profile_same(const struct profile *a, const struct profile *b){
+  return a->sf == b->sf && a->bw == b->bw && a->cr == b->cr && a->sync == b->sync &&
+         a->implicit == b->implicit && a->crc == b->crc && a->preamble == b->preamble;
+}
+
+//turns a profile into its register image, with the Rx single timeout
+static void profile_image(const struct profile *p, uint16_t symb_timeout, struct reg_image *img){
+  struct modem_cfg m;
+  profile_modem(p, &m);
+  img->block[0] = p->bw << 4 | (p->cr & 0x07) << 1 | (p->implicit & 0x01);
+  img->block[1] = p->sf << 4 | (p->crc & 0x01) << 2 | ((symb_timeout >> 8) & 0x03);
+  img->block[2] = symb_timeout & 0xFF;
+  img->block[3] = p->preamble >> 8;
+  img->block[4] = p->preamble & 0xFF;
+  img->config3 = m.ldro << 3 | 0x04;
+  img->detect_opt = p->sf == 6 ? 0xC5 : 0xC3;
+  img->detect_thr = p->sf == 6 ? 0x0C : 0x0A;
+  img->sync = p->sync;
+}
+
+//lowest snr a spreading factor demodulates at, table 13 of the
+//datasheet: -7.5 dB at SF7 and 2.5 dB lower per step up to -20 dB at SF12
+static double snr_limit_db(uint8_t sf){
+  if(sf < 7) return -5;
+  return -7.5 - 2.5 * (sf - 7);
+}
+
+//bytes apply_image() sends to go from image cur to img: the span of the
+//block that changed in one burst plus a transaction per changed register
+static uint32_t image_bytes(const struct reg_image *img, const struct reg_image *cur){
+  uint32_t bytes = 0;
+  int first = 0, last = IMAGE_BLOCK_LEN - 1;
+  while(first <= last && img->block[first] == cur->block[first]) first++;
+  while(last >= first && img->block[last] == cur->block[last]) last--;
+  if(first <= last) bytes += last - first + 2;
+  bytes += 2 * ((img->config3 != cur->config3) + (img->detect_opt != cur->detect_opt) +
+                (img->detect_thr != cur->detect_thr) + (img->sync != cur->sync));
+  return bytes;
+}
+
+//bandwidth index for a bandwidth in Hz, -1 if it isn't one of the chip's.
+//the nearest within 1%, so 10.4 kHz as profile_name() prints it and
+//10.417 kHz both find 10420.  neighbours are a third apart or more
+static int bw_index(uint32_t hz){
+  for(int i = 0; i < 10; i++){
+    uint32_t d = hz > lora_bw_hz[i] ? hz - lora_bw_hz[i] : lora_bw_hz[i] - hz;
+    if((uint64_t)d * 100 <= lora_bw_hz[i]) return i;
+  }
+  return -1;
+}
+
+#ifndef FLIGHT
+//short human readable form, buf should hold 48 bytes
+static const char *profile_name(const struct profile *p, char *buf){
+  snprintf(buf, 48, "SF%u BW%.1f CR4/%u sync 0x%02X", p->sf, lora_bw_hz[p->bw < 10 ? p->bw : 9] / 1e3,
+           p->cr + 4, p->sync);
+  return buf;
+}
+#endif
+
+#endif
@@ -0,0 +1,310 @@
+/* UCSD CubeSat
+   spifault.h
+
+   Fault injection for the SPI transport.  On a long cable run SPI reads
+   glitch, RegIrqFlags can read back stale, and a brownout resets the chip
+   in the middle of a packet.  fault_start() puts fault_transfer() in
+   sx1278.h's spi_transfer, between every register access and the bus,
+   and it injects one fault at a time, on a schedule (every n
+   transactions) or at random (so many per million transactions):
+
+   flip   one bit of a data byte flipped, on MOSI for a write (the chip
+          stores the wrong value) and on MISO for a read
+   drop   the transaction never reaches the chip, it reads 0x00
+   zero   MISO stuck low, reads 0x00 and writes still land
+   ones   MISO stuck high, reads 0xFF
+   delay  the transaction is held back fault_cfg.delay_us
+   stick  RegIrqFlags reads keep returning what they did before the fault
+   reset  the chip resets: op mode and every register the radio programs
+          set go back to their power on values
+
+   span sets how many transactions one fault lasts, for stick how many
+   flag reads.  A reset is over as soon as it happens.
+
+   Notes on the accounting:
+   The program under test tells the layer what it saw.  fault_detected()
+   when one of its checks fails, fault_recovered() once it has the chip
+   back where it should be, fault_lost() for a packet that didn't go out
+   as it should have, fault_clean() after a packet that went fine (with
+   the transaction count, fault_n, when its real state was read, since a
+   fault after that hasn't had the chance to do harm yet), and
+   fault_missed() when it gives up on a fault it never detected.  Each
+   goes to the open fault, so per fault type the layer keeps the time from
+   injection to detection and from detection to recovery, the packets
+   lost, and the faults that were masked (cleared with nothing detected
+   and nothing lost).  A new fault is only injected once the last one is
+   closed.  A detection with no fault open is a false alarm and counted as
+   such.  lorafault.c is the harness.
+
+   fault_suspend() and fault_resume() take the layer out and put it back,
+   for a harness to read the chip's real state without injecting into or
+   counting its own reads.
+
+   ---------------------------------------------------------------------------------------------*/
+
+#ifndef SPIFAULT_H
+#define SPIFAULT_H
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "sx1278.h"
+
+#define FAULT_FLIP   0
+#define FAULT_DROP   1
+#define FAULT_ZERO   2
+#define FAULT_ONES   3
+#define FAULT_DELAY  4
+#define FAULT_STICK  5
+#define FAULT_RESET  6
+#define FAULT_TYPES  7
+#define FAULT_ANY    -1
+
+static const char *fault_names[FAULT_TYPES] = {"flip", "drop", "zero", "ones", "delay", "stick", "reset"};
+
+//register values after a power on reset, in LoRa mode, for the registers
+//the radio programs write.  RegOpMode goes last, back to FSK standby
+static const uint8_t fault_por[][2] = {
+  {REG_RF_FREQ_MSB_MSB, 0x6C}, {REG_RF_FREQ_MSB, 0x80}, {REG_RF_FREQ_LSB, 0x00},
+  {REG_PA_CONFIG, 0x4F}, {REG_PA_RAMP, 0x09}, {REG_OCP, 0x2B}, {REG_LNA, 0x20},
+  {REG_FIFO_ADDR_PTR, 0x00}, {REG_FIFO_TX_BASE_ADDR, 0x80}, {REG_FIFO_RX_BASE_ADDR, 0x00},
+  {REG_IRQ_FLAGS_MASK, 0x00}, {REG_MODEM_CONFIG1, 0x72}, {REG_MODEM_CONFIG2, 0x70},
+  {REG_SYMB_TIMEOUT_LSB, 0x64}, {REG_PREAMBLE_LEN_MSB, 0x00}, {REG_PREAMBLE_LEN_LSB, 0x08},
+  {REG_PAYLOAD_LEN, 0x01}, {REG_MAX_PAYLOAD_LEN, 0xFF}, {REG_HOP_PERIOD, 0x00},
+  {REG_MODEM_CONFIG3, 0x04}, {REG_DETECT_OPTIMIZE, 0xC3}, {REG_DETECT_THRESH, 0x0A},
+  {REG_SYNC_WORD, 0x12}, {REG_DIO_MAPPING1, 0x00}
+};
+#define FAULT_POR_OP_MODE 0x09   //FSK standby, low frequency port
+
+struct fault_cfg{
+  int      type;          //FAULT_* or FAULT_ANY for a random one each time
+  uint32_t every;         //inject every this many transactions, 0 for random
+  uint32_t ppm;           //with every 0, chance per transaction in millionths
+  uint32_t span;          //transactions one fault lasts, flag reads for stick
+  uint32_t delay_us;      //for delay
+  uint32_t seed;
+};
+
+struct fault_stats{
+  uint32_t injected;
+  uint32_t detected;
+  uint32_t recovered;     //of the detected, the ones recover_us covers
+  uint32_t masked;        //closed with nothing detected and nothing lost
+  uint32_t missed;        //lost packets and was never detected
+  uint32_t lost;          //packets
+  uint64_t detect_us;     //sum, injection to detection
+  uint64_t recover_us;    //sum, detection to recovery
+  uint32_t detect_max_us;
+  uint32_t recover_max_us;
+};
+
+static struct fault_cfg fault_c;
+static struct fault_stats fault_st[FAULT_TYPES];
+static uint32_t fault_false = 0;       //detections with no fault open
+static uint32_t fault_stray_lost = 0;  //packets lost with no fault open
+static uint64_t fault_n = 0;           //transactions seen
+
+//the open fault, -1 if none
+static int fault_open = -1;
+static uint32_t fault_left = 0;        //transactions it still affects
+static uint64_t fault_at = 0;          //injected
+static uint64_t fault_at_n = 0;        //the transaction it was injected on
+static uint64_t fault_seen_at = 0;     //detected, 0 until then
+static int fault_lost_any = 0;
+static uint8_t fault_flags = 0;        //last RegIrqFlags read, what stick repeats
+
+//-----------------------------------helper function implementations----------------------------
+
+//xorshift32, as csma.h's
+static uint32_t fault_rand(void){
+  uint32_t x = fault_c.seed ? fault_c.seed : 0x9E3779B9;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  fault_c.seed = x;
+  return x;
+}
+
+//what a power on reset leaves, written around the fault layer
+static void fault_reset(void){
+  char t[2], r[2];
+  t[0] = REG_OP_MODE | 0x80;
+  t[1] = FSK_SLEEP;
+  bcm2835_spi_transfernb(t, r, 2);
+  t[1] = LORA_SLEEP;
+  bcm2835_spi_transfernb(t, r, 2);
+  for(size_t i = 0; i < sizeof(fault_por) / sizeof(fault_por[0]); i++){
+    t[0] = fault_por[i][0] | 0x80;
+    t[1] = fault_por[i][1];
+    bcm2835_spi_transfernb(t, r, 2);
+  }
+  t[0] = REG_OP_MODE | 0x80;
+  t[1] = FSK_SLEEP;
+  bcm2835_spi_transfernb(t, r, 2);
+  t[1] = FAULT_POR_OP_MODE;
+  bcm2835_spi_transfernb(t, r, 2);
+}
+
+//1 if a new fault is due on this transaction
+static int fault_due(void){
+  if(fault_c.every) return fault_n % fault_c.every == 0;
+  return fault_c.ppm && fault_rand() % 1000000 < fault_c.ppm;
+}
+
+//the spi_transfer sx1278.h calls while the layer is in
+static void fault_transfer(char *tbuf, char *rbuf, uint32_t len){
+  int flags_read = tbuf[0] == REG_IRQ_FLAGS && len > 1;
+  fault_n++;
+  if(fault_open < 0 && fault_due()){
+    fault_open = fault_c.type >= 0 ? fault_c.type : (int)(fault_rand() % FAULT_TYPES);
+    fault_at = now_us();
+    fault_at_n = fault_n;
+    fault_seen_at = 0;
+    fault_lost_any = 0;
+    fault_left = fault_c.span ? fault_c.span : 1;
+    fault_st[fault_open].injected++;
+    if(fault_open == FAULT_RESET){
+      fault_reset();
+      fault_left = 0;
+    }
+  }
+  int type = fault_left ? fault_open : -1;
+  if(type == FAULT_STICK && !flags_read) type = -1;
+  if(type >= 0) fault_left--;
+
+  char flipped[257];
+  switch(type){
+    case FAULT_FLIP:{
+      uint32_t byte = len > 1 ? 1 + fault_rand() % (len - 1) : 0;
+      uint8_t bit = 1 << (fault_rand() % 8);
+      if(tbuf[0] & 0x80){
+        memcpy(flipped, tbuf, len);
+        flipped[byte] ^= bit;
+        bcm2835_spi_transfernb(flipped, rbuf, len);
+      }else{
+        bcm2835_spi_transfernb(tbuf, rbuf, len);
+        rbuf[byte] ^= bit;
+      }
+      break;
+    }
+    case FAULT_DROP:
+      memset(rbuf, 0, len);
+      break;
+    case FAULT_ZERO:
+    case FAULT_ONES:
+      bcm2835_spi_transfernb(tbuf, rbuf, len);
+      memset(rbuf + 1, type == FAULT_ZERO ? 0x00 : 0xFF, len - 1);
+      break;
+    case FAULT_DELAY:
+      sleep_until_us(now_us() + fault_c.delay_us);
+      bcm2835_spi_transfernb(tbuf, rbuf, len);
+      break;
+    case FAULT_STICK:
+      bcm2835_spi_transfernb(tbuf, rbuf, len);
+      rbuf[1] = fault_flags;
+      return;
+    default:
+      bcm2835_spi_transfernb(tbuf, rbuf, len);
+      break;
+  }
+  if(flags_read) fault_flags = rbuf[1];
+}
+
+//puts the layer in with a fresh set of statistics
+static void fault_start(const struct fault_cfg *c){
+  fault_c = *c;
+  memset(fault_st, 0, sizeof(fault_st));
+  fault_false = fault_stray_lost = 0;
+  fault_n = 0;
+  fault_open = -1;
+  fault_left = 0;
+  spi_transfer = fault_transfer;
+}
+
+static void fault_suspend(void){
+  spi_transfer = bcm2835_spi_transfernb;
+}
+
+static void fault_resume(void){
+  spi_transfer = fault_transfer;
+}
+
+//closes the open fault
+static void fault_close(void){
+  fault_open = -1;
+  fault_left = 0;
+}
+
+//a check failed
+static void fault_detected(void){
+  if(fault_open < 0){
+    fault_false++;
+    return;
+  }
+  if(fault_seen_at) return;
+  fault_seen_at = now_us();
+  struct fault_stats *s = &fault_st[fault_open];
+  uint32_t us = fault_seen_at - fault_at;
+  s->detected++;
+  s->detect_us += us;
+  if(us > s->detect_max_us) s->detect_max_us = us;
+}
+
+//the chip is back where it should be, after a detection
+static void fault_recovered(void){
+  if(fault_open < 0 || !fault_seen_at) return;
+  struct fault_stats *s = &fault_st[fault_open];
+  uint32_t us = now_us() - fault_seen_at;
+  s->recovered++;
+  s->recover_us += us;
+  if(us > s->recover_max_us) s->recover_max_us = us;
+  fault_close();
+}
+
+//a packet didn't go out as it should have
+static void fault_lost(void){
+  if(fault_open < 0){
+    fault_stray_lost++;
+    return;
+  }
+  fault_st[fault_open].lost++;
+  fault_lost_any = 1;
+}
+
+//a packet went out fine with nothing detected, as the chip's real state
+//read after transaction checked showed.  a fault injected before that
+//which has run its span did no harm
+static void fault_clean(uint64_t checked){
+  if(fault_open < 0 || fault_left || fault_seen_at || fault_at_n > checked) return;
+  if(!fault_lost_any) fault_st[fault_open].masked++;
+  else fault_st[fault_open].missed++;
+  fault_close();
+}
+
+//gives up on a fault that keeps losing packets without being detected
+static void fault_missed(void){
+  if(fault_open < 0 || fault_seen_at) return;
+  fault_st[fault_open].missed++;
+  fault_close();
+}
+
+//one line per fault type injected
+static void fault_report(FILE *out){
+  fprintf(out, "%-6s %8s %8s %7s %7s  %10s %10s  %10s %10s  %6s %8s\n", "fault", "injected", "detected",
+          "masked", "missed", "detect ms", "max", "recover ms", "max", "lost", "per fault");
+  for(int t = 0; t < FAULT_TYPES; t++){
+    const struct fault_stats *s = &fault_st[t];
+    if(s->injected == 0) continue;
+    fprintf(out, "%-6s %8u %8u %7u %7u  %10.3f %10.3f  %10.3f %10.3f  %6u %8.2f\n", fault_names[t],
+            s->injected, s->detected, s->masked, s->missed,
+            s->detected ? s->detect_us / 1e3 / s->detected : 0, s->detect_max_us / 1e3,
+            s->recovered ? s->recover_us / 1e3 / s->recovered : 0, s->recover_max_us / 1e3,
+            s->lost, (double)s->lost / s->injected);
+  }
+  fprintf(out, "%llu transactions, %u false alarms, %u packets lost with no fault open\n",
+          (unsigned long long)fault_n, fault_false, fault_stray_lost);
+}
+
+#endif
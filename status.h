@@ -0,0 +1,176 @@
+/* UCSD CubeSat
+   status.h
+
+   Radio status in shared memory.  A program that drives the chip (lorad
+   does by default) publishes its state in a small file under /dev/shm:
+   op mode, carrier and modem settings, the last packet's rssi and snr,
+   packet counters and queue depths.  Monitoring tools map the file read
+   only and copy the struct out with status_read(), so they never talk to
+   the radio program, never touch SPI and can sample as often as they
+   like without it noticing.  lorastat.c is such a tool.
+
+   sx1278.h updates the op mode on every RegOpMode write and the carrier
+   on every set_frequency() once status_open() has been called; before
+   that the cost is one branch.  Everything else the program fills in
+   itself between status_begin() and status_end().
+
+   Notes on the seqlock:
+   There is one writer and any number of readers, and the readers can't
+   take a lock the writer would have to wait for.  So the writer makes
+   seq odd before changing anything and even again after, and a reader
+   copies the struct and keeps the copy only if seq was even and the same
+   before and after.  A reader racing an update just copies again; the
+   writer never waits, and never even knows there are readers.
+
+   Notes on versions:
+   The struct starts with a magic number, STATUS_VERSION and its own
+   size.  Fields are only ever added at the end, with the version bumped,
+   so a reader built against an older layout still reads the part it
+   knows, and a newer reader can tell from size which fields an older
+   writer doesn't fill in.  A different magic or a smaller size than the
+   first version's means the file is something else.
+
+   ---------------------------------------------------------------------------------------------*/
+
+#ifndef STATUS_H
+#define STATUS_H
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define STATUS_PATH    "/dev/shm/lora-status"
+#define STATUS_MAGIC   0x5453524C     //"LRST"
+#define STATUS_VERSION 1
+#define STATUS_V1_SIZE 72             //smallest size a valid writer publishes
+#define STATUS_TRIES   1000           //reader copies before giving up on a busy writer
+
+struct radio_status{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size;
+  uint32_t seq;             //odd while the writer is changing things
+  uint32_t pid;             //the writer
+  uint64_t updated_us;      //now_us() of the last change, CLOCK_MONOTONIC
+  uint32_t changes;         //updates since the writer started
+
+  uint8_t  op_mode;         //last RegOpMode written
+  uint8_t  sf;
+  uint8_t  bw;              //RegModemConfig1 bandwidth index
+  uint8_t  cr;
+  uint32_t freq_hz;
+  int16_t  rssi;            //last packet, dBm
+  int8_t   snr;             //last packet, quarter dB
+  uint8_t  clients;
+  uint32_t rx;
+  uint32_t rx_crc;
+  uint32_t tx;
+  uint32_t tx_failed;
+  uint32_t tx_refused;
+  uint32_t drops;           //messages clients didn't take in time
+  uint16_t txq;             //packets waiting to be sent
+  uint16_t txq_max;
+};
+
+//the writer's mapping, NULL until status_open()
+static struct radio_status *status_shm = NULL;
+
+//-----------------------------------helper function implementations----------------------------
+
+//starts a change.  readers retry until the matching status_end()
+static void status_begin(void){
+  __atomic_store_n(&status_shm->seq, status_shm->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+//publishes a change
+static void status_end(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  status_shm->updated_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  status_shm->changes++;
+  __atomic_store_n(&status_shm->seq, status_shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+//creates the segment and publishes an empty status.  0 on success
+static int status_open(const char *path){
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if(fd < 0) return -1;
+  if(ftruncate(fd, sizeof(struct radio_status)) < 0){
+    close(fd);
+    return -1;
+  }
+  void *p = mmap(NULL, sizeof(struct radio_status), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(p == MAP_FAILED) return -1;
+  struct radio_status *s = p;
+  //odd while the header is filled in, in case a reader has it mapped
+  //from a previous run.  seq itself is never cleared, a zero would be
+  //even and pass a half cleared struct off as whole
+  __atomic_store_n(&s->seq, s->seq | 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  size_t after = offsetof(struct radio_status, seq) + sizeof(s->seq);
+  memset((char *)s + after, 0, sizeof(*s) - after);
+  s->magic = STATUS_MAGIC;
+  s->version = STATUS_VERSION;
+  s->size = sizeof(*s);
+  s->pid = getpid();
+  status_shm = s;
+  status_end();
+  return 0;
+}
+
+//the op mode half of a RegOpMode write, called by write_reg()
+static void status_mode(uint8_t mode){
+  status_begin();
+  status_shm->op_mode = mode;
+  status_end();
+}
+
+//maps a published status read only.  returns NULL if there is none or
+//it isn't one
+static const struct radio_status *status_attach(const char *path){
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) return NULL;
+  struct stat sb;
+  if(fstat(fd, &sb) < 0 || sb.st_size < STATUS_V1_SIZE){
+    close(fd);
+    return NULL;
+  }
+  void *p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(p == MAP_FAILED) return NULL;
+  const struct radio_status *s = p;
+  if(s->magic != STATUS_MAGIC || s->size < STATUS_V1_SIZE || s->size > sb.st_size){
+    munmap(p, sb.st_size);
+    return NULL;
+  }
+  return s;
+}
+
+//copies a consistent snapshot of src into dst, as much of it as both
+//layouts have, zeroing the rest.  returns the copies it took, or -1 if
+//the writer was busy for all STATUS_TRIES of them
+static int status_read(const struct radio_status *src, struct radio_status *dst){
+  size_t n = src->size < sizeof(*dst) ? src->size : sizeof(*dst);
+  for(int tries = 1; tries <= STATUS_TRIES; tries++){
+    uint32_t before = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE);
+    if(before & 1) continue;
+    memcpy(dst, (const void *)src, n);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&src->seq, __ATOMIC_RELAXED) == before){
+      memset((uint8_t *)dst + n, 0, sizeof(*dst) - n);
+      return tries;
+    }
+  }
+  return -1;
+}
+
+#endif
@@ -0,0 +1,702 @@
+/* UCSD CubeSat
+   sx1278.h
+
+   Shared SX1278 driver pieces for loraTX.c and loraRX.c.  Both programs
+   started life as copies of lora.c and carried their own register table and
+   read_reg()/write_reg() wrappers.  Now that the transmitter and receiver have
+   to agree on modem timing (preamble length vs. receiver wake interval) the
+   common parts live here so the two sides can't drift apart.
+
+   Everything in this file is static so each program still builds from a
+   single source file, exactly as before:
+
+   $ cc loraTX.c -o loraTX -lbcm2835 -lpthread
+   $ cc loraRX.c -o loraRX -lbcm2835 -lpthread
+
+   (-lpthread only for the -R register trace, see binlog.h, and only on
+   C libraries older than glibc 2.34.)
+
+   See the header of lora.c for the notes on how the bcm2835 library clocks
+   the two-byte register transactions, and timing.h for the time on air math.
+
+   Notes on the fast reply path:
+   A node that answers every packet it hears (an ack, a ping echo) loses
+   link time between RxDone and its reply going out.  The usual sequence,
+   standby, FIFO pointer, the whole reply a byte at a time, payload length
+   and Tx, costs twice the reply length in SPI bytes on top of reading the
+   request.  stage_reply() instead writes the reply into the top of the
+   FIFO before the request arrives, and fast_reply() answers RxDone with
+   one 3 byte burst read of RegIrqFlags and RegRxNbBytes (to check the crc
+   and that the request is the size expected) and one write of RegOpMode
+   straight from Rx to Tx.  The FIFO is accessible in every mode but sleep
+   and the modulator reads from RegFifoTxBaseAddr with its own pointer, so
+   the request can be read out of the bottom of the FIFO while the reply
+   is on the air.  RegMaxPayloadLength is lowered to what is left below
+   the reply so no request can run into it; entering Rx restarts the
+   receive pointer at RegFifoRxBaseAddr, so only one request at a time
+   ever sits below it.  unstage_reply() puts both registers back before
+   the normal load_fifo_packet() path is used again.
+
+   What remains is fast_reply_budget(): seeing the event (a DIO0 pin poll,
+   no SPI, or half a RegIrqFlags poll), the 5 SPI bytes at the bus clock,
+   the synthesizer settling and the PA ramp from RegPaRamp.  At the
+   default SPI divider the bytes alone are 10 ms, at divider 64 they are
+   10 us and the whole turnaround is well under a millisecond.
+
+   Notes on register tracing:
+   read_reg(), write_reg() and the bursts log every transaction at
+   BLOG_TRACE through binlog.h instead of the printf()s they used to have
+   commented out.  Until a program opens a log the cost is one branch per
+   transaction, against the 4 ms the transaction itself takes at the
+   default SPI clock.  Building with -DBINLOG_LEVEL=BL_DEBUG removes them.
+
+   Notes on probes:
+   Register writes, op mode changes, FIFO loads and drains and the irq
+   flags read that ends a wait are also static tracepoints (probes.h),
+   for bpftrace on a program that is already running.
+
+   Notes on the flight build:
+   Built with -DFLIGHT (loraflight.c does) this file leaves out stdio,
+   stdlib and everything that needs them: the register trace, the status
+   segment, the perf counters, the register hook and fast_reply_budget().
+   hardware_init() and lora_init() return one of the LORA_E codes below
+   instead of printing why and exiting, which is all the ground programs
+   ever do with a failure and which a flight computer can't.  The SPI
+   transaction is a direct call that counts the bytes, so the call graph
+   has no function pointers for flightcheck.sh to lose the stack in.
+
+   ---------------------------------------------------------------------------------------------*/
+
+#ifndef SX1278_H
+#define SX1278_H
+
+//------------------------------header files and label definitions------------------------------
+
+#include <bcm2835.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include "timing.h"
+#include "profile.h"
+#include "probes.h"
+#ifndef FLIGHT
+#include <stdio.h>
+#include <stdlib.h>
+#include "binlog.h"
+#include "status.h"
+#include "perfctr.h"
+#endif
+
+//SX1278 device modes
+#define FSK_SLEEP      0b00001000  //0x08  must enter before switching to lora
+#define FSK_CAD        0b00001111  //0x0F  seems to be default startup op mode
+#define LORA_SLEEP     0b10001000  //0x88
+#define LORA_STANDBY   0b10001001  //0x89
+#define LORA_TX        0b10001011  //0x8B
+#define LORA_RX_CONT   0b10001101  //0x8D
+#define LORA_RX_SINGLE 0b10001110  //0x8E
+#define LORA_CAD       0b10001111  //0x8F
+
+//register addresses
+#define REG_FIFO                 0b00000000  //0x00
+#define REG_OP_MODE              0b00000001  //0x01
+#define REG_RF_FREQ_MSB_MSB      0b00000110  //0x06
+#define REG_RF_FREQ_MSB          0b00000111  //0x07
+#define REG_RF_FREQ_LSB          0b00001000  //0x08
+#define REG_PA_CONFIG            0b00001001  //0x09
+#define REG_PA_RAMP              0b00001010  //0x0A
+#define REG_OCP                  0b00001011  //0x0B
+#define REG_LNA                  0b00001100  //0x0C
+#define REG_FIFO_ADDR_PTR        0b00001101  //0x0D
+#define REG_FIFO_TX_BASE_ADDR    0b00001110  //0x0E
+#define REG_FIFO_RX_BASE_ADDR    0b00001111  //0x0F
+#define REG_FIFO_RX_CURRENT_ADDR 0b00010000  //0x10
+#define REG_IRQ_FLAGS_MASK       0b00010001  //0x11
+#define REG_IRQ_FLAGS            0b00010010  //0x12
+#define REG_RX_NUM_BYTES         0b00010011  //0x13
+#define REG_RX_PACKET_COUNT_MSB  0b00010110  //0x16
+#define REG_RX_PACKET_COUNT_LSB  0b00010111  //0x17
+#define REG_MODEM_STAT           0b00011000  //0x18
+#define REG_PACKET_SNR           0b00011001  //0x19
+#define REG_PACKET_RSSI          0b00011010  //0x1A
+#define REG_CURRENT_RSSI         0b00011011  //0x1B
+#define REG_HOP_CHANNEL          0b00011100  //0x1C
+#define REG_MODEM_CONFIG1        0b00011101  //0x1D
+#define REG_MODEM_CONFIG2        0b00011110  //0x1E
+#define REG_SYMB_TIMEOUT_LSB     0b00011111  //0x1F
+#define REG_PREAMBLE_LEN_MSB     0b00100000  //0x20
+#define REG_PREAMBLE_LEN_LSB     0b00100001  //0x21
+#define REG_PAYLOAD_LEN          0b00100010  //0x22  (always on Tx, implicit mode only on Rx)
+#define REG_MAX_PAYLOAD_LEN      0b00100011  //0x23
+#define REG_HOP_PERIOD           0b00100100  //0x24
+#define REG_MODEM_CONFIG3        0b00100110  //0x26
+#define REG_DETECT_OPTIMIZE      0b00110001  //0x31
+#define REG_DETECT_THRESH        0b00110111  //0x37
+#define REG_SYNC_WORD            0b00111001  //0x39
+#define REG_DIO_MAPPING1         0b01000000  //0x40
+
+//irq flags, RegIrqFlags 0x12
+#define FLAG_RX_TIMEOUT     0b10000000  //0x80
+#define FLAG_RX_DONE        0b01000000  //0x40
+#define FLAG_PAYLOAD_CRC    0b00100000  //0x20
+#define FLAG_VALID_HEADER   0b00010000  //0x10
+#define FLAG_TX_DONE        0b00001000  //0x08
+#define FLAG_CAD_DONE       0b00000100  //0x04
+#define FLAG_FHSS_CHANGE    0b00000010  //0x02
+#define FLAG_CAD_DETECTED   0b00000001  //0x01
+
+//helpful values
+#define CLEAR_IRQ_FLAGS   0b11111111  //0xFF
+#define FIFO_RX_BASE_ADDR 0b00000000  //0x00
+#define FIFO_TX_BASE_ADDR 0b10000000  //0x80
+#define SYMB_TIMEOUT_MIN  4           //RegSymbTimeout is 10 bits, datasheet minimum is 4
+#define SYMB_TIMEOUT_MAX  1023
+#define DUTY_RX_WINDOW    8           //default symbols a duty cycled receiver listens per wake
+#define RSSI_OFFSET_LF    -164        //RegRssiValue to dBm on the low frequency port (433 MHz)
+#define RSSI_OFF          -200        //rssi threshold that disables the rssi check
+#define CAD_TIMEOUT_US    100000      //CadDone should take a couple of symbols, not this
+#define RADIO_LOCK_PATH "/tmp/lora.lock"   //held by whichever program drives the chip
+#define TX_CONFIRM_US     500000      //how long past the computed airtime to wait for TxDone
+#define DIO0_PIN          RPI_V2_GPIO_P1_18  //default pin wired to the module's DIO0
+#define DIO0_MAP_MASK     0b11000000  //RegDioMapping1 bits 7-6, 00 is RxDone in Rx and TxDone in Tx
+#define FXOSC_HZ          32000000    //crystal, RF frequency step is FXOSC / 2^19
+#define SPI_CORE_HZ       250000000   //RPI2 core clock the SPI divider divides down
+#define FIFO_SIZE         256
+#define MAX_PAYLOAD_RESET 0xFF        //RegMaxPayloadLength reset value
+#define SYNTH_SETTLE_US   60          //datasheet TS_FS, synthesizer wake up to a locked PLL
+
+//hardware_init() and lora_init() failures
+#define LORA_OK        0
+#define LORA_EBUSY    -1    //another program holds the radio
+#define LORA_EBCM2835 -2    //bcm2835_init failed, not root
+#define LORA_ESPI     -3    //bcm2835_spi_begin failed
+#define LORA_ESTANDBY -4    //the chip didn't enter LoRa standby
+
+//the ground programs print why and exit, as they always have.  the flight
+//build hands the code back
+#ifdef FLIGHT
+#define LORA_FAIL(err, msg) return (err)
+#else
+#define LORA_FAIL(err, msg) do{ printf(msg "\n"); exit(EXIT_SUCCESS); }while(0)
+#endif
+
+//PA ramp time in us indexed by RegPaRamp bits 3-0
+static const uint16_t pa_ramp_us[] = {
+  3400, 2000, 1000, 500, 250, 125, 100, 62, 50, 40, 31, 25, 20, 15, 12, 10
+};
+
+//optional callback run on every register access.  it sees the same
+//address byte that went over the wire, MSB high for a write, so modules
+//like energy.h can follow op mode changes without every caller having
+//to remember to tell them
+#ifdef FLIGHT
+#define reg_hook ((void (*)(uint8_t, uint8_t))NULL)
+#else
+static void (*reg_hook)(uint8_t addr, uint8_t data) = NULL;
+#endif
+
+#ifdef FLIGHT
+//the register trace and the counters compile away
+#define BLOG_TRACE(...) ((void)0)
+#define PERF_BEGIN(r)   ((void)0)
+#define PERF_END(r)     ((void)0)
+
+//bytes over the bus, for loraflight.c's worst case figures
+static uint32_t spi_bytes = 0;
+
+//the SPI transaction every register access goes through
+static void spi_transfer(char *tbuf, char *rbuf, uint32_t len){
+  spi_bytes += len;
+  bcm2835_spi_transfernb(tbuf, rbuf, len);
+}
+#else
+//the SPI transaction every register access goes through.  the bcm2835
+//library's unless a program swaps in a wrapper, like spifault.h's fault
+//injection
+static void (*spi_transfer)(char *tbuf, char *rbuf, uint32_t len) = bcm2835_spi_transfernb;
+#endif
+
+//SPI clock divider hardware_init() programs.  a program may set it first
+//to run the bus faster than the conservative default
+static uint16_t spi_divider = BCM2835_SPI_CLOCK_DIVIDER_65536;
+
+//gpio the module's DIO0 is wired to, -1 until dio0_init()
+static int dio0_pin = -1;
+
+//------------------------------------register access functions----------------------------------
+
+//wrapper function that reads from a register
+//argument is byte address of register to be read
+//return value is data held in register
+static uint8_t read_reg(uint8_t addr){
+  char tbuf[] = {addr, 0x00};
+  char rbuf[] = {0x00, 0x00};
+  spi_transfer(tbuf, rbuf, sizeof(tbuf));
+  BLOG_TRACE("read 0x%02X from register 0x%02X", (uint8_t)rbuf[1], addr);
+  if(reg_hook) reg_hook(addr, rbuf[1]);
+  return rbuf[1];
+}
+
+//wrapper function that writes to a register
+//arguments are address to be written to and data to write
+//returns last data held in register before the write
+
+//second arg type is char rather than uint8_t.
+//this allows direct entry in the form 'h' rather than hex or binary
+//however, entering hex or binary for configuring hardware still works the same
+static uint8_t write_reg(uint8_t addr, char data){
+  char tbuf[] = {addr | 0x80, data};   //flag addr MSB high to indicate write op
+  char rbuf[] = {0x00, 0x00};
+  spi_transfer(tbuf, rbuf, sizeof(tbuf));
+  BLOG_TRACE("wrote 0x%02X to register 0x%02X, was 0x%02X", (uint8_t)data, addr, (uint8_t)rbuf[1]);
+  if(reg_hook) reg_hook(addr | 0x80, data);
+  PROBE(reg_write, addr, (uint8_t)data, (uint8_t)rbuf[1]);
+  if(addr == REG_OP_MODE){
+    PROBE(mode_change, (uint8_t)rbuf[1], (uint8_t)data);
+#ifndef FLIGHT
+    if(status_shm) status_mode(data);
+#endif
+  }
+  return rbuf[1];
+}
+
+//reads len consecutive bytes in one SPI transaction.  the chip auto
+//increments the address, except for REG_FIFO where it advances the FIFO
+//pointer instead, so this is also the fast way to drain a packet
+static void read_burst(uint8_t addr, uint8_t *data, uint8_t len){
+  char tbuf[257] = {0};
+  char rbuf[257];
+  tbuf[0] = addr;
+  spi_transfer(tbuf, rbuf, len + 1);
+  BLOG_TRACE("burst read %u bytes from register 0x%02X, first 0x%02X", len, addr, (uint8_t)rbuf[1]);
+  for(int i = 0; i < len; i++){
+    data[i] = rbuf[i + 1];
+    if(reg_hook) reg_hook(addr ? addr + i : addr, data[i]);
+  }
+}
+
+//writes len consecutive bytes in one SPI transaction, see read_burst()
+static void write_burst(uint8_t addr, const uint8_t *data, uint8_t len){
+  char tbuf[257];
+  char rbuf[257];
+  tbuf[0] = addr | 0x80;
+  for(int i = 0; i < len; i++) tbuf[i + 1] = data[i];
+  spi_transfer(tbuf, rbuf, len + 1);
+  BLOG_TRACE("burst wrote %u bytes to register 0x%02X, first 0x%02X", len, addr, len ? data[0] : 0);
+  if(reg_hook){
+    for(int i = 0; i < len; i++) reg_hook((addr ? addr + i : addr) | 0x80, data[i]);
+  }
+}
+
+//diagnostic function that reads every #defined register except FIFO
+//(because that would inadvertently increment the address pointer)
+//prints outputs because it's just calling the read_reg() function
+static void diagnose(void){
+  read_reg(REG_OP_MODE);
+  read_reg(REG_RF_FREQ_MSB_MSB);
+  read_reg(REG_RF_FREQ_MSB);
+  read_reg(REG_RF_FREQ_LSB);
+  read_reg(REG_PA_CONFIG);
+  read_reg(REG_PA_RAMP);
+  read_reg(REG_OCP);
+  read_reg(REG_LNA);
+  read_reg(REG_FIFO_ADDR_PTR);
+  read_reg(REG_FIFO_TX_BASE_ADDR);
+  read_reg(REG_FIFO_RX_BASE_ADDR);
+  read_reg(REG_FIFO_RX_CURRENT_ADDR);
+  read_reg(REG_IRQ_FLAGS_MASK);
+  read_reg(REG_IRQ_FLAGS);
+  read_reg(REG_RX_NUM_BYTES);
+  read_reg(REG_RX_PACKET_COUNT_MSB);
+  read_reg(REG_RX_PACKET_COUNT_LSB);
+  read_reg(REG_MODEM_STAT);
+  read_reg(REG_PACKET_SNR);
+  read_reg(REG_PACKET_RSSI);
+  read_reg(REG_CURRENT_RSSI);
+  read_reg(REG_HOP_CHANNEL);
+  read_reg(REG_MODEM_CONFIG1);
+  read_reg(REG_MODEM_CONFIG2);
+  read_reg(REG_SYMB_TIMEOUT_LSB);
+  read_reg(REG_PREAMBLE_LEN_MSB);
+  read_reg(REG_PREAMBLE_LEN_LSB);
+  read_reg(REG_PAYLOAD_LEN);
+  read_reg(REG_MAX_PAYLOAD_LEN);
+  read_reg(REG_HOP_PERIOD);
+  read_reg(REG_MODEM_CONFIG3);
+  read_reg(REG_DETECT_OPTIMIZE);
+  read_reg(REG_DETECT_THRESH);
+  read_reg(REG_SYNC_WORD);
+}
+
+//------------------------------------device setup functions-------------------------------------
+
+//establishes spi and configures appropriate bit transfer parameters.
+//returns LORA_OK or a LORA_E code (flight build only, see LORA_FAIL)
+static int hardware_init(void){
+  //one program at a time, two interleave their register sequences.  the
+  //lock goes with the process, however it ends
+  int lock = open(RADIO_LOCK_PATH, O_RDWR | O_CREAT, 0666);
+  if(lock < 0 || flock(lock, LOCK_EX | LOCK_NB) < 0){
+    LORA_FAIL(LORA_EBUSY, "The radio is in use by another program (lorad shares it).");
+  }
+
+  //test the library initialization functions
+  if(!bcm2835_init()){
+    LORA_FAIL(LORA_EBCM2835, "bcm2835_init failed.  Must run as root.");
+  }
+  if(!bcm2835_spi_begin()){
+    LORA_FAIL(LORA_ESPI, "bcm2835_spi_begin failed.  Must run as root.");
+  }
+
+  //The following five functions define the SPI communication operating
+  //parameters.  Some are default values but redundancy never hurt anyone.
+
+  //Sets bit order. The SX1278 is expecting to receive MSB first and will
+  //also be transmitting back MSB first.  This is a default.
+  bcm2835_spi_setBitOrder(BCM2835_SPI_BIT_ORDER_MSBFIRST);
+
+  //Sets the clock polarity and phase. The LoRa module asks for CPOL = 0
+  //and CPHA = 0.  This also happens to be the default.
+  bcm2835_spi_setDataMode(BCM2835_SPI_MODE0);
+
+  //Sets the clock divider and therefore the clock speed.  The default is
+  //65536 which results in a clock speed of 3.8 kHz. I'm using 2048 which
+  //corresponds to 122 kHz.  Troubleshooting SPI connection.
+  //spi_divider is still 65536 unless the program changed it
+  bcm2835_spi_setClockDivider(spi_divider);
+
+  //Specifies which chip select pins will be asserted when an SPI transfer
+  //is made.  The RPI2 has two but we'll just be using RPI pin #24 also
+  //known as "SPI_CE0_N". This is a default setting defined below.
+  bcm2835_spi_chipSelect(BCM2835_SPI_CS0);
+
+  //Configured the polarity under which the chip select is considered active.
+  //The SX1278 looks for a chip select active low.  This is a default setting
+  //given below.
+  bcm2835_spi_setChipSelectPolarity(BCM2835_SPI_CS0, LOW);
+
+  //set a GPIO pin high to stabilize reset pin on sx1278
+  //configure RPI pin 16 to gpio output functionality
+  //then set that pin high
+  bcm2835_gpio_fsel(RPI_V2_GPIO_P1_16, BCM2835_GPIO_FSEL_OUTP);
+  bcm2835_gpio_set(RPI_V2_GPIO_P1_16);
+  return LORA_OK;
+}
+
+//checks device boot mode and enters LoRa standby regardless
+//device is now ready to use
+//I need to update this function to enable a "retry" functionality
+//if it doesn't work, try again. Don't just cancel
+static int lora_init(void){
+  uint8_t bootmode = read_reg(REG_OP_MODE);
+  if((bootmode & 0x80) == 0X00 ){
+    write_reg(REG_OP_MODE, FSK_SLEEP);
+  }
+  write_reg(REG_OP_MODE, LORA_SLEEP);
+  write_reg(REG_OP_MODE, LORA_STANDBY);
+
+  if(read_reg(REG_OP_MODE) != LORA_STANDBY){
+    LORA_FAIL(LORA_ESTANDBY, "There was a problem entering LORA_STANDBY.");
+  }else{
+    //potential debug
+    //printf("Device has entered LORA_STANDBY.\n");
+  }
+  return LORA_OK;
+}
+
+//------------------------------------modem register functions-----------------------------------
+
+//reads the modem configuration registers into a modem_cfg
+static void read_modem(struct modem_cfg *m){
+  uint8_t cfg1 = read_reg(REG_MODEM_CONFIG1);
+  uint8_t cfg2 = read_reg(REG_MODEM_CONFIG2);
+  uint8_t cfg3 = read_reg(REG_MODEM_CONFIG3);
+  uint8_t bw = cfg1 >> 4;
+  m->bw_hz = lora_bw_hz[bw < 10 ? bw : 9];
+  m->cr = (cfg1 >> 1) & 0x07;
+  m->implicit = cfg1 & 0x01;
+  m->sf = cfg2 >> 4;
+  m->crc = (cfg2 >> 2) & 0x01;
+  m->ldro = (cfg3 >> 3) & 0x01;
+  m->preamble = (read_reg(REG_PREAMBLE_LEN_MSB) << 8) | read_reg(REG_PREAMBLE_LEN_LSB);
+}
+
+//programs the preamble length in symbols
+static void set_preamble(uint16_t symbols){
+  write_reg(REG_PREAMBLE_LEN_MSB, symbols >> 8);
+  write_reg(REG_PREAMBLE_LEN_LSB, symbols & 0xFF);
+}
+
+//programs the Rx single timeout in symbols.  the upper two bits share
+//RegModemConfig2 with the spreading factor so they are merged in
+static void set_symb_timeout(uint16_t symbols){
+  if(symbols < SYMB_TIMEOUT_MIN) symbols = SYMB_TIMEOUT_MIN;
+  if(symbols > SYMB_TIMEOUT_MAX) symbols = SYMB_TIMEOUT_MAX;
+  uint8_t cfg2 = read_reg(REG_MODEM_CONFIG2);
+  write_reg(REG_MODEM_CONFIG2, (cfg2 & 0xFC) | (symbols >> 8));
+  write_reg(REG_SYMB_TIMEOUT_LSB, symbols & 0xFF);
+}
+
+//reads what the chip holds into an image, so apply_image() knows what
+//it can skip
+static void read_image(struct reg_image *img){
+  read_burst(REG_MODEM_CONFIG1, img->block, IMAGE_BLOCK_LEN);
+  img->config3 = read_reg(REG_MODEM_CONFIG3);
+  img->detect_opt = read_reg(REG_DETECT_OPTIMIZE);
+  img->detect_thr = read_reg(REG_DETECT_THRESH);
+  img->sync = read_reg(REG_SYNC_WORD);
+}
+
+//programs a profile's image (profile.h).  shadow is what the chip holds
+//and is updated.  of the contiguous block only the span from the first
+//to the last changed byte is sent, in one burst, and the single
+//registers only if they changed.  must be called in sleep or standby.
+//returns the bytes that went over the bus
+static uint32_t apply_image(const struct reg_image *img, struct reg_image *shadow){
+  uint32_t bytes = image_bytes(img, shadow);
+  int first = 0, last = IMAGE_BLOCK_LEN - 1;
+  while(first <= last && img->block[first] == shadow->block[first]) first++;
+  while(last >= first && img->block[last] == shadow->block[last]) last--;
+  if(first <= last) write_burst(REG_MODEM_CONFIG1 + first, img->block + first, last - first + 1);
+  if(img->config3 != shadow->config3) write_reg(REG_MODEM_CONFIG3, img->config3);
+  if(img->detect_opt != shadow->detect_opt) write_reg(REG_DETECT_OPTIMIZE, img->detect_opt);
+  if(img->detect_thr != shadow->detect_thr) write_reg(REG_DETECT_THRESH, img->detect_thr);
+  if(img->sync != shadow->sync) write_reg(REG_SYNC_WORD, img->sync);
+  *shadow = *img;
+  return bytes;
+}
+
+//SPI clock in Hz at the programmed divider
+static uint32_t spi_clock_hz(void){
+  return SPI_CORE_HZ / (spi_divider ? spi_divider : 65536);
+}
+
+//tunes the carrier.  all three RegFrf bytes go in one burst, the chip
+//auto increments from 0x06, and the new frequency takes effect on the next
+//change into an Rx or Tx mode
+static void set_frequency(uint32_t hz){
+  uint32_t frf = (uint32_t)(((uint64_t)hz << 19) / FXOSC_HZ);
+  uint8_t b[3] = {frf >> 16, frf >> 8, frf};
+  write_burst(REG_RF_FREQ_MSB_MSB, b, 3);
+#ifndef FLIGHT
+  if(status_shm){
+    status_begin();
+    status_shm->freq_hz = hz;
+    status_end();
+  }
+#endif
+}
+
+//--------------------------------------packet functions-----------------------------------------
+
+//polls RegIrqFlags until a flag in mask is set or the absolute deadline
+//passes, sleeping poll_us between reads.  returns the flags last read.
+//seen, if not NULL, gets the time the successful read started, which is
+//the best timestamp of the event polling can give
+static uint8_t wait_irq(uint8_t mask, uint64_t deadline, uint32_t poll_us, uint64_t *seen){
+  uint8_t flags;
+  //only stamped for a tracer, one attaching mid wait skips this event
+  uint64_t start = PROBE_ENABLED(irq_flags) ? now_us() : 0;
+  while(1){
+    uint64_t t = now_us();
+    PERF_BEGIN(PR_IRQ);
+    flags = read_reg(REG_IRQ_FLAGS);
+    if(flags & mask){
+      PERF_END(PR_IRQ);
+      if(PROBE_ENABLED(irq_flags) && start) PROBE(irq_flags, flags, t - start);
+      if(seen) *seen = t;
+      return flags;
+    }
+    if(t >= deadline) return flags;
+    sleep_until_us(t + poll_us);
+  }
+}
+
+//copies the last received packet out of the FIFO into buf, which must
+//hold 255 bytes.  returns its length
+static uint8_t read_fifo_packet(uint8_t *buf){
+  PERF_BEGIN(PR_FIFO_DRAIN);
+  uint64_t t = PROBE_ENABLED(fifo_burst) ? now_us() : 0;
+  write_reg(REG_FIFO_ADDR_PTR, read_reg(REG_FIFO_RX_CURRENT_ADDR));
+  uint8_t len = read_reg(REG_RX_NUM_BYTES);
+  read_burst(REG_FIFO, buf, len);
+  if(PROBE_ENABLED(fifo_burst) && t) PROBE(fifo_burst, 0, len, now_us() - t);
+  PERF_END(PR_FIFO_DRAIN);
+  return len;
+}
+
+//loads a packet into the Tx half of the FIFO and sets its length
+static void load_fifo_packet(const uint8_t *buf, uint8_t len){
+  PERF_BEGIN(PR_FIFO_LOAD);
+  uint64_t t = PROBE_ENABLED(fifo_burst) ? now_us() : 0;
+  write_reg(REG_FIFO_ADDR_PTR, FIFO_TX_BASE_ADDR);
+  write_burst(REG_FIFO, buf, len);
+  write_reg(REG_PAYLOAD_LEN, len);
+  if(PROBE_ENABLED(fifo_burst) && t) PROBE(fifo_burst, 1, len, now_us() - t);
+  PERF_END(PR_FIFO_LOAD);
+}
+
+//routes RxDone/TxDone to DIO0 and watches it on the given gpio.  the pin
+//is read through the gpio registers, no SPI involved
+static void dio0_init(int pin){
+  dio0_pin = pin;
+  bcm2835_gpio_fsel(pin, BCM2835_GPIO_FSEL_INPT);
+  bcm2835_gpio_set_pud(pin, BCM2835_GPIO_PUD_DOWN);
+  write_reg(REG_DIO_MAPPING1, read_reg(REG_DIO_MAPPING1) & ~DIO0_MAP_MASK);
+}
+
+//waits for DIO0 to go high or the absolute deadline to pass, sleeping
+//sleep_us between pin reads, or spinning if it's 0.  returns 1 with the
+//time the pin was first seen high in edge, 0 on timeout.  DIO0 stays
+//high until the irq flags are cleared, so clear them before waiting
+static int wait_dio0(uint64_t deadline, uint32_t sleep_us, uint64_t *edge){
+  while(1){
+    uint64_t t = now_us();
+    if(bcm2835_gpio_lev(dio0_pin)){
+      *edge = t;
+      return 1;
+    }
+    if(t >= deadline) return 0;
+    if(sleep_us) sleep_until_us(t + sleep_us);
+  }
+}
+
+//waits for an irq like wait_irq(), but on the DIO0 pin when dio0_init()
+//has been called.  stamp gets the best estimate of when the event
+//happened: the pin edge, or half a poll before the SPI read that saw the
+//flag, and is left alone if it never happened.  pin_sleep_us is passed
+//to wait_dio0().  returns the irq flags, 0 on a DIO0 timeout
+static uint8_t wait_event(uint8_t mask, uint64_t deadline, uint32_t poll_us, uint32_t pin_sleep_us, uint64_t *stamp){
+  uint64_t t = 0;
+  if(dio0_pin < 0){
+    uint8_t flags = wait_irq(mask, deadline, poll_us, &t);
+    if(stamp && (flags & mask)) *stamp = t - poll_us/2;
+    return flags;
+  }
+  uint64_t start = PROBE_ENABLED(irq_flags) ? now_us() : 0;
+  if(!wait_dio0(deadline, pin_sleep_us, &t)) return 0;
+  if(stamp) *stamp = t;
+  PERF_BEGIN(PR_IRQ);
+  uint8_t flags = read_reg(REG_IRQ_FLAGS);
+  PERF_END(PR_IRQ);
+  if(PROBE_ENABLED(irq_flags) && start) PROBE(irq_flags, flags, t - start);
+  return flags;
+}
+
+//--------------------------------------channel functions----------------------------------------
+
+//current rssi in dBm.  only meaningful in an Rx mode
+static int16_t current_rssi(void){
+  return RSSI_OFFSET_LF + read_reg(REG_CURRENT_RSSI);
+}
+
+//rssi in dBm of the last received packet
+static int16_t packet_rssi(void){
+  return RSSI_OFFSET_LF + read_reg(REG_PACKET_RSSI);
+}
+
+//snr in dB of the last received packet, the register holds quarter dB
+static double packet_snr(void){
+  return (int8_t)read_reg(REG_PACKET_SNR) / 4.0;
+}
+
+//listens before talking.  runs channel activity detection from standby
+//and returns 1 if a LoRa preamble was seen.  with rssi_thresh above
+//RSSI_OFF it also briefly enters Rx and calls the channel busy if the
+//carrier is louder than rssi_thresh dBm, which catches other modulations
+//and the payload part of LoRa packets that CAD can miss.  leaves the chip
+//in standby with the FIFO untouched above FIFO_TX_BASE_ADDR
+static int channel_busy(int16_t rssi_thresh){
+  write_reg(REG_OP_MODE, LORA_STANDBY);
+  write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+  write_reg(REG_OP_MODE, LORA_CAD);
+  uint8_t flags;
+  uint64_t start = now_us();
+  while(!((flags = read_reg(REG_IRQ_FLAGS)) & FLAG_CAD_DONE)){
+    if(now_us() - start > CAD_TIMEOUT_US) break;
+  }
+  write_reg(REG_IRQ_FLAGS, CLEAR_IRQ_FLAGS);
+  read_reg(REG_OP_MODE);  //chip is back in standby on its own, lets hooks see it
+  if(flags & FLAG_CAD_DETECTED) return 1;
+
+  if(rssi_thresh > RSSI_OFF){
+    write_reg(REG_OP_MODE, LORA_RX_CONT);
+    bcm2835_delayMicroseconds(1000);  //rssi settles within a symbol or so
+    int16_t rssi = current_rssi();
+    write_reg(REG_OP_MODE, LORA_STANDBY);
+    if(rssi > rssi_thresh) return 1;
+  }
+  return 0;
+}
+
+//-----------------------------------fast reply functions----------------------------------------
+
+//writes a reply into the top of the FIFO and points the modulator at it,
+//then caps incoming packets at the space left below it.  may be called in
+//standby or Rx.  len must be at least 1
+static void stage_reply(const uint8_t *buf, uint8_t len){
+  uint8_t base = (uint8_t)(FIFO_SIZE - len);
+  write_reg(REG_FIFO_TX_BASE_ADDR, base);
+  write_reg(REG_FIFO_ADDR_PTR, base);
+  write_burst(REG_FIFO, buf, len);
+  write_reg(REG_PAYLOAD_LEN, len);
+  write_reg(REG_MAX_PAYLOAD_LEN, base);
+}
+
+//undoes stage_reply() so load_fifo_packet() works again
+static void unstage_reply(void){
+  write_reg(REG_FIFO_TX_BASE_ADDR, FIFO_TX_BASE_ADDR);
+  write_reg(REG_MAX_PAYLOAD_LEN, MAX_PAYLOAD_RESET);
+}
+
+//waits in Rx for a packet and, if its crc is good and it is expect_len
+//bytes long, sends the staged reply at once.  RxDone is watched on DIO0
+//after dio0_init(), otherwise by polling every poll_us.  rx_done gets
+//when the packet was seen, like wait_event(), and tx_start the time the
+//Tx write finished, or 0 if the reply wasn't sent.  returns the irq
+//flags, 0 on a DIO0 timeout.  the request is still in the FIFO to read
+//and the flags still need clearing
+static uint8_t fast_reply(uint8_t expect_len, uint64_t deadline, uint32_t poll_us, uint32_t pin_sleep_us,
+                          uint64_t *rx_done, uint64_t *tx_start){
+  uint8_t r[2] = {0, 0};  //RegIrqFlags, RegRxNbBytes
+  uint64_t t;
+  *tx_start = 0;
+  if(dio0_pin >= 0){
+    if(!wait_dio0(deadline, pin_sleep_us, &t)) return 0;
+    read_burst(REG_IRQ_FLAGS, r, 2);
+  }else{
+    while(1){
+      t = now_us();
+      read_burst(REG_IRQ_FLAGS, r, 2);
+      if(r[0] & FLAG_RX_DONE) break;
+      if(t >= deadline) return r[0];
+      sleep_until_us(t + poll_us);
+    }
+    t -= poll_us/2;
+  }
+  if(rx_done) *rx_done = t;
+  if((r[0] & (FLAG_RX_DONE | FLAG_PAYLOAD_CRC)) == FLAG_RX_DONE && r[1] == expect_len){
+    write_reg(REG_OP_MODE, LORA_TX);
+    *tx_start = now_us();
+  }
+  return r[0];
+}
+
+#ifndef FLIGHT
+//expected RxDone to PA at power of fast_reply() in us, given how late
+//the event is seen on average.  prints the parts to out if not NULL
+static uint32_t fast_reply_budget(uint32_t detect_us, FILE *out){
+  uint32_t spi = (uint32_t)((uint64_t)FAST_REPLY_BYTES * 8 * 1000000 / spi_clock_hz());
+  uint32_t ramp = pa_ramp_us[read_reg(REG_PA_RAMP) & 0x0F];
+  uint32_t total = detect_us + spi + SYNTH_SETTLE_US + ramp;
+  if(out){
+    fprintf(out, "Turnaround budget: detect %u us + SPI %u bytes %u us + synthesizer %u us + "
+            "PA ramp %u us = %u us\n", detect_us, FAST_REPLY_BYTES, spi, SYNTH_SETTLE_US, ramp, total);
+  }
+  return total;
+}
+#endif
+
+#endif
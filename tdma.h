@@ -0,0 +1,151 @@
+/* UCSD CubeSat
+   tdma.h
+
+   Slot schedule for several beacon nodes sharing one groundstation.  Random
+   access, even with listen before talk, wastes more and more of the channel
+   as nodes are added.  With TDMA a coordinator (loraRX -T) starts every
+   superframe with a beacon (frame.h) and each node (loraTX -T) transmits
+   only in the slot it has been assigned:
+
+   |beacon+guard|guard  slot 0  guard|guard  slot 1  guard| ... |(idle)|
+   ^ superframe start                                              ^ next beacon
+
+   Each data slot is one packet airtime plus a guard on either side.  The
+   guard has to absorb everything that makes a node's idea of the slot
+   differ from the coordinator's: crystal drift since the last beacon, the
+   latency of seeing RxDone by polling, and scheduling jitter.
+
+   Notes on guard times:
+   Rather than guess, both ends measure.  The coordinator timestamps every
+   slot packet it receives and compares it with when the schedule says it
+   should have arrived.  The guard announced in the next beacon is twice
+   the worst error seen, grows immediately and shrinks by at most an eighth
+   per superframe.  Nodes measure their own drift against the coordinator
+   from the spacing of successive beacons and scale their local slot offsets
+   by it, so what's left for the guard is the residual.
+
+   All timing is driven by absolute monotonic deadlines (sleep_until_us in
+   timing.h) so errors don't accumulate from one superframe to the next.
+
+   Nothing in here touches the hardware, so lorasim.c runs the same schedule
+   and guard logic.
+
+   ---------------------------------------------------------------------------------------------*/
+
+#ifndef TDMA_H
+#define TDMA_H
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdint.h>
+#include "frame.h"
+
+#define TDMA_GUARD_MIN_US  2000   //floor covering polling and scheduling jitter
+#define TDMA_DRIFT_PPM     50     //assumed crystal drift before anything is measured
+#define TDMA_MAX_MISSED    3      //beacons a node may miss before it stops transmitting
+
+struct tdma_plan{
+  uint8_t  slots;
+  uint32_t beacon_slot_us;   //beacon airtime plus one guard
+  uint32_t slot_us;          //data airtime plus two guards
+  uint32_t guard_us;
+  uint32_t superframe_us;
+};
+
+//coordinator side guard tracking
+struct tdma_guard{
+  uint32_t guard_us;         //currently announced
+  uint32_t max_err_us;       //worst slot timing error this superframe
+};
+
+//node side sync state
+struct tdma_sync{
+  int      synced;
+  uint64_t start;            //local time of the last superframe start
+  uint16_t seq;
+  uint32_t superframe_us;    //as announced in the last beacon
+  double   drift_ppm;        //our clock against the coordinator's
+  uint32_t missed;
+};
+
+//-----------------------------------helper function implementations----------------------------
+
+//lays out a superframe.  min_superframe_us stretches it with idle time at
+//the end, e.g. to keep the old 5 second beacon rate
+static void tdma_plan(struct tdma_plan *p, uint8_t slots, uint32_t beacon_air, uint32_t data_air,
+                      uint32_t guard_us, uint32_t min_superframe_us){
+  p->slots = slots;
+  p->guard_us = guard_us;
+  p->beacon_slot_us = beacon_air + guard_us;
+  p->slot_us = data_air + 2*guard_us;
+  p->superframe_us = p->beacon_slot_us + slots * p->slot_us;
+  if(p->superframe_us < min_superframe_us) p->superframe_us = min_superframe_us;
+}
+
+//plan as announced in a received beacon
+static void tdma_plan_from(struct tdma_plan *p, const struct tdma_beacon *b, uint32_t beacon_air){
+  p->slots = b->slots;
+  p->guard_us = b->guard_us;
+  p->beacon_slot_us = beacon_air + b->guard_us;
+  p->slot_us = b->slot_us;
+  p->superframe_us = b->superframe_us;
+}
+
+//offset from superframe start at which slot i's node keys up
+static uint32_t tdma_tx_offset(const struct tdma_plan *p, uint8_t slot){
+  return p->beacon_slot_us + slot * p->slot_us + p->guard_us;
+}
+
+//guard needed before anything has been measured
+static uint32_t tdma_initial_guard(uint32_t superframe_us){
+  uint32_t g = (uint32_t)((uint64_t)superframe_us * TDMA_DRIFT_PPM / 1000000);
+  return g + TDMA_GUARD_MIN_US;
+}
+
+//coordinator: records the timing error of one received slot packet
+static void tdma_observe(struct tdma_guard *g, int32_t err_us){
+  uint32_t e = err_us < 0 ? -err_us : err_us;
+  if(e > g->max_err_us) g->max_err_us = e;
+}
+
+//coordinator: guard for the next superframe from this one's errors
+static uint32_t tdma_next_guard(struct tdma_guard *g){
+  uint32_t want = 2 * g->max_err_us;
+  if(want < TDMA_GUARD_MIN_US) want = TDMA_GUARD_MIN_US;
+  if(want > g->guard_us){
+    g->guard_us = want;
+  }else{
+    uint32_t floor = g->guard_us - g->guard_us / 8;
+    g->guard_us = want > floor ? want : floor;
+  }
+  g->max_err_us = 0;
+  return g->guard_us;
+}
+
+//node: local duration of a coordinator interval, corrected for drift
+static uint64_t tdma_local(const struct tdma_sync *s, uint64_t coord_us){
+  return (uint64_t)(coord_us * (1.0 + s->drift_ppm / 1e6));
+}
+
+//node: takes a received beacon whose superframe started at local time start
+static void tdma_sync_update(struct tdma_sync *s, uint64_t start, uint16_t seq, uint32_t superframe_us){
+  //only comparable if the superframe length didn't change in between
+  if(s->synced && s->superframe_us == superframe_us){
+    uint16_t frames = seq - s->seq;
+    if(frames > 0 && frames < 64){
+      double expect = (double)frames * superframe_us;
+      double ppm = ((double)(start - s->start) - expect) / expect * 1e6;
+      //clamp what one noisy timestamp can do, then smooth
+      if(ppm > 1000) ppm = 1000;
+      if(ppm < -1000) ppm = -1000;
+      s->drift_ppm += (ppm - s->drift_ppm) / 4;
+    }
+  }
+  s->synced = 1;
+  s->start = start;
+  s->seq = seq;
+  s->superframe_us = superframe_us;
+  s->missed = 0;
+}
+
+#endif
@@ -0,0 +1,159 @@
+/* UCSD CubeSat
+   timesync.h
+
+   Over the air time synchronization.  None of our nodes has GPS and their
+   system clocks wander apart by seconds a day, which the raw asctime()
+   beacons in the range test logs make plain.  The TDMA coordinator
+   (loraRX -T) already sends a beacon at a precisely scheduled instant every
+   superframe, so it stamps each one with its wall clock time at Tx start.
+   A node that receives it knows that instant happened one time on air plus
+   the receiver's RxDone latency before RxDone fired, and every beacon gives
+   it one measurement of its clock's offset from the coordinator's.
+
+   Usage:
+
+   struct timesync ts;
+   timesync_init(&ts);
+   ...on every beacon, with edge the local monotonic time of RxDone
+   timesync_update(&ts, edge, timesync_sample(edge, b.tx_us, air, rx_latency));
+   ...
+   uint64_t t = timesync_coord(&ts, now_us());   //coordinator wall clock
+   timesync_report(stderr, &ts);
+
+   Notes on timestamps:
+   Everything hinges on when RxDone is seen.  Reading RegIrqFlags over SPI
+   at the current clock divider takes milliseconds, so the packet functions
+   in sx1278.h only know an event to within a poll.  DIO0 signals RxDone (and
+   TxDone) on a pin, and wait_dio0() watches that pin through the GPIO
+   registers, which costs no SPI traffic and resolves the edge to a few
+   microseconds when spinning.  The coordinator does the same with TxDone
+   to find out when its beacon really went out, and learns how late it
+   keys up so the stamp it puts in the next beacon is the truth.
+
+   Notes on the estimator:
+   Each sample is the coordinator's clock minus ours.  The estimator tracks
+   offset and rate (an alpha-beta filter, the same shape as a software PLL)
+   and predicts the offset at the time of the next sample.  The prediction
+   error of each accepted sample is the honest measure of sync accuracy,
+   since it is what the clock was off by just before being corrected, and
+   is what timesync_report() prints against the 1 ms target.  Samples that
+   miss the prediction by far more than the recent errors (a late poll, a
+   beacon from a restarted coordinator) are rejected, and a run of
+   rejections steps the clock to the new offset.
+
+   Nothing in here touches the hardware.
+
+   ---------------------------------------------------------------------------------------------*/
+
+#ifndef TIMESYNC_H
+#define TIMESYNC_H
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define TSYNC_TARGET_US   1000   //accuracy the report is judged against
+#define TSYNC_WARMUP      4      //samples before the gate and the stats kick in
+#define TSYNC_GATE_MIN_US 2000   //never reject a sample closer than this
+#define TSYNC_GATE_SIGMA  4      //reject beyond this many rms errors
+#define TSYNC_MAX_REJECT  3      //consecutive rejects that force a step
+#define TSYNC_MAX_PPM     500    //rate estimates are clamped to this
+
+struct timesync{
+  uint32_t samples;      //accepted samples
+  uint64_t last_local;   //local time of the last accepted sample
+  double   offset_us;    //coordinator minus local clock at last_local
+  double   rate_ppm;     //how fast the coordinator's clock runs against ours
+  double   err_sq_us2;   //running mean square prediction error in us^2, for the gate
+  double   err_sum;      //absolute errors since the last report
+  double   err_max;
+  uint32_t err_n;
+  uint32_t rejected;
+  uint32_t run;          //consecutive rejects
+  uint32_t steps;
+};
+
+//-----------------------------------helper function implementations----------------------------
+
+static void timesync_init(struct timesync *ts){
+  ts->samples = 0;
+  ts->last_local = 0;
+  ts->offset_us = ts->rate_ppm = ts->err_sq_us2 = 0;
+  ts->err_sum = ts->err_max = 0;
+  ts->err_n = ts->rejected = ts->run = ts->steps = 0;
+}
+
+//one offset measurement from a beacon stamped coord_tx_us at Tx start
+//whose RxDone was seen at local time rx_local
+static double timesync_sample(uint64_t rx_local, uint64_t coord_tx_us, uint32_t air_us, uint32_t rx_latency_us){
+  return (double)coord_tx_us - ((double)rx_local - air_us - rx_latency_us);
+}
+
+//offset predicted at local time t
+static double timesync_predict(const struct timesync *ts, uint64_t t){
+  return ts->offset_us + ts->rate_ppm * 1e-6 * ((double)t - ts->last_local);
+}
+
+//feeds one sample taken at local time t.  returns 1 if it was accepted
+static int timesync_update(struct timesync *ts, uint64_t t, double sample){
+  if(ts->samples == 0 || t <= ts->last_local){
+    ts->offset_us = sample;
+    ts->last_local = t;
+    ts->samples = 1;
+    return 1;
+  }
+  double dt = (double)(t - ts->last_local);
+  double err = sample - timesync_predict(ts, t);
+  double mag = err < 0 ? -err : err;
+  double gate_sq = TSYNC_GATE_SIGMA * TSYNC_GATE_SIGMA * ts->err_sq_us2;
+  if(gate_sq < (double)TSYNC_GATE_MIN_US * TSYNC_GATE_MIN_US) gate_sq = (double)TSYNC_GATE_MIN_US * TSYNC_GATE_MIN_US;
+
+  if(ts->samples >= TSYNC_WARMUP && err*err > gate_sq){
+    ts->rejected++;
+    if(++ts->run < TSYNC_MAX_REJECT) return 0;
+    //the offset really moved, step to it and learn the rate again
+    ts->steps++;
+    ts->offset_us = sample;
+    ts->last_local = t;
+    ts->rate_ppm = 0;
+    ts->samples = 1;
+    ts->run = 0;
+    return 1;
+  }
+  ts->run = 0;
+
+  //alpha-beta correction of offset and rate
+  ts->offset_us = timesync_predict(ts, t) + err / 2;
+  ts->rate_ppm += err / dt * 1e6 / 8;
+  if(ts->rate_ppm > TSYNC_MAX_PPM) ts->rate_ppm = TSYNC_MAX_PPM;
+  if(ts->rate_ppm < -TSYNC_MAX_PPM) ts->rate_ppm = -TSYNC_MAX_PPM;
+  ts->last_local = t;
+  ts->samples++;
+
+  if(ts->samples > TSYNC_WARMUP){
+    ts->err_sq_us2 += (err*err - ts->err_sq_us2) / 16;
+    ts->err_sum += mag;
+    if(mag > ts->err_max) ts->err_max = mag;
+    ts->err_n++;
+  }
+  return 1;
+}
+
+//coordinator clock at local time t
+static uint64_t timesync_coord(const struct timesync *ts, uint64_t t){
+  return (uint64_t)((double)t + timesync_predict(ts, t));
+}
+
+//prints the sync error since the last report and resets it
+static void timesync_report(FILE *out, struct timesync *ts){
+  double mean = ts->err_n ? ts->err_sum / ts->err_n : 0;
+  fprintf(out, "Sync: %u samples, error mean %.0f us max %.0f us (%s %u us target), rate %.2f ppm, "
+          "%u rejected, %u steps\n", ts->samples, mean, ts->err_max,
+          ts->err_n && ts->err_max <= TSYNC_TARGET_US ? "within" : "outside", TSYNC_TARGET_US,
+          ts->rate_ppm, ts->rejected, ts->steps);
+  ts->err_sum = ts->err_max = 0;
+  ts->err_n = 0;
+}
+
+#endif
@@ -0,0 +1,110 @@
+/* UCSD CubeSat
+   timing.h
+
+   Clock and time on air helpers.  These used to sit in sx1278.h but nothing
+   here touches the hardware, and the multi-node simulator (lorasim.c) needs
+   the exact same numbers as the radio programs without linking bcm2835, so
+   they live on their own.  sx1278.h includes this file.
+
+   Notes on modem timing:
+   All time-on-air numbers come from section 4.1.1.7 of the SX1276/77/78/79
+   datasheet (sx1276_77_78_79.pdf in this directory).  A LoRa symbol lasts
+   Ts = 2^SF / BW seconds.  With the reset values of RegModemConfig1/2
+   (BW 125 kHz, SF7, CR 4/5, explicit header, no CRC) that is 1.024 ms.  The
+   preamble lasts (n_preamble + 4.25) * Ts and the payload takes
+
+   8 + max(ceil((8PL - 4SF + 28 + 16CRC - 20IH) / (4(SF - 2DE))) * (CR + 4), 0)
+
+   symbols.  The helpers below do this math in integer microseconds so no
+   floating point library is needed.  read_modem() in sx1278.h fills in the
+   settings from the registers.
+
+   ---------------------------------------------------------------------------------------------*/
+
+#ifndef TIMING_H
+#define TIMING_H
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdint.h>
+#include <time.h>
+
+//SPI bytes sx1278.h fast_reply() sends between RxDone and Tx: the flags
+//and length burst read plus the RegOpMode write.  kept here with the
+//rest of the timing math so lorasim.c times the same path
+#define FAST_REPLY_BYTES 5
+
+//signal bandwidth in Hz indexed by RegModemConfig1 bits 7-4
+static const uint32_t lora_bw_hz[] = {
+  7810, 10420, 15630, 20830, 31250, 41670, 62500, 125000, 250000, 500000
+};
+
+//modem settings needed for timing math, filled in by read_modem()
+struct modem_cfg{
+  uint8_t  sf;        //spreading factor 6-12
+  uint32_t bw_hz;     //signal bandwidth
+  uint8_t  cr;        //coding rate denominator minus 4, 1-4 is 4/5-4/8
+  uint8_t  implicit;  //implicit header mode on
+  uint8_t  crc;       //payload crc on
+  uint8_t  ldro;      //low data rate optimize on
+  uint16_t preamble;  //programmed preamble length in symbols
+};
+
+//-------------------------------------modem timing functions------------------------------------
+
+//duration of one LoRa symbol in microseconds
+static uint32_t symbol_us(const struct modem_cfg *m){
+  return (uint32_t)(((uint64_t)1 << m->sf) * 1000000 / m->bw_hz);
+}
+
+//time on air in microseconds of a packet carrying payload_len bytes
+//using the programmed preamble length
+static uint32_t airtime_us(const struct modem_cfg *m, uint8_t payload_len){
+  int32_t num = 8*payload_len - 4*m->sf + 28 + 16*m->crc - 20*m->implicit;
+  int32_t den = 4*(m->sf - 2*m->ldro);
+  if(den < 4) den = 4;  //garbage register reads, don't divide by zero
+  int32_t payload_symb = 8;
+  if(num > 0){
+    payload_symb += ((num + den - 1) / den) * (m->cr + 4);
+  }
+  //preamble is n + 4.25 symbols, keep it in quarter symbols until the end
+  uint64_t quarters = 4*(uint64_t)m->preamble + 17 + 4*(uint64_t)payload_symb;
+  return (uint32_t)(quarters * symbol_us(m) / 4);
+}
+
+//preamble length a transmitter needs so that a receiver waking every
+//wake_ms and listening for window symbols is guaranteed to land inside it
+static uint16_t wake_preamble(const struct modem_cfg *m, uint32_t wake_ms, uint16_t window){
+  uint64_t symbols = ((uint64_t)wake_ms*1000 + symbol_us(m) - 1) / symbol_us(m) + window;
+  return symbols > 0xFFFF ? 0xFFFF : (uint16_t)symbols;
+}
+
+//---------------------------------------clock functions-----------------------------------------
+
+//monotonic time in microseconds.  unlike clock() this keeps counting while
+//the process sleeps, which is the whole point of the low power modes
+static uint64_t now_us(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+//wall clock time in microseconds since the epoch, for timestamps that
+//have to mean something on another machine
+static uint64_t wall_us(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+//sleeps until an absolute monotonic deadline so scheduling error
+//doesn't accumulate from one cycle to the next.  returns early if a
+//signal arrives so callers can notice a stop request
+static void sleep_until_us(uint64_t deadline){
+  struct timespec ts;
+  ts.tv_sec = deadline / 1000000;
+  ts.tv_nsec = (deadline % 1000000) * 1000;
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+#endif
@@ -0,0 +1,103 @@
+/* UCSD CubeSat
+   waterfall.h
+
+   File format for spectrum sweeps.  loraspec records one row per sweep of
+   the band and lorawf views or exports them, on the RPI or anywhere else,
+   so this file doesn't touch the hardware.
+
+   A file is a 24 byte header followed by rows:
+
+   header  "LWF1", start Hz, step Hz, bins, reads per step, pad,
+           settle us, rssi offset dB, pad
+   row     wall clock us at the start of the sweep, then for every bin the
+           mean and the max of the raw RegRssiValue reads at that step
+
+   Multi-byte fields are little endian, like the frames in frame.h.  A raw
+   reading plus the rssi offset is dBm.  One byte per number keeps a 200
+   step sweep at 408 bytes a row, so a day of sweeps at several rows a
+   second still fits comfortably on the RPI's card.  The max is kept next
+   to the mean because an intermittent emitter that is there for one read
+   out of eight barely moves the mean.
+
+   ---------------------------------------------------------------------------------------------*/
+
+#ifndef WATERFALL_H
+#define WATERFALL_H
+
+//------------------------------header files and label definitions------------------------------
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "frame.h"
+
+#define WF_HEADER_LEN 24
+#define WF_MAX_BINS   4096
+
+struct wf_header{
+  uint32_t start_hz;
+  uint32_t step_hz;
+  uint16_t bins;
+  uint8_t  reads;
+  uint32_t settle_us;
+  int16_t  rssi_offset;
+};
+
+//-----------------------------------helper function implementations----------------------------
+
+static int wf_write_header(FILE *f, const struct wf_header *h){
+  uint8_t b[WF_HEADER_LEN] = {'L', 'W', 'F', '1'};
+  put32(b + 4, h->start_hz);
+  put32(b + 8, h->step_hz);
+  put16(b + 12, h->bins);
+  b[14] = h->reads;
+  put32(b + 16, h->settle_us);
+  put16(b + 20, (uint16_t)h->rssi_offset);
+  return fwrite(b, 1, WF_HEADER_LEN, f) == WF_HEADER_LEN ? 0 : -1;
+}
+
+//reads and checks the header, 0 on success or -1
+static int wf_read_header(FILE *f, struct wf_header *h){
+  uint8_t b[WF_HEADER_LEN];
+  if(fread(b, 1, WF_HEADER_LEN, f) != WF_HEADER_LEN || memcmp(b, "LWF1", 4) != 0) return -1;
+  h->start_hz = get32(b + 4);
+  h->step_hz = get32(b + 8);
+  h->bins = get16(b + 12);
+  h->reads = b[14];
+  h->settle_us = get32(b + 16);
+  h->rssi_offset = (int16_t)get16(b + 20);
+  if(h->bins == 0 || h->bins > WF_MAX_BINS) return -1;
+  return 0;
+}
+
+//bytes in one row of a file with this header
+static uint32_t wf_row_len(const struct wf_header *h){
+  return 8 + 2 * (uint32_t)h->bins;
+}
+
+//writes one row, mean and max hold bins raw readings each
+static int wf_write_row(FILE *f, const struct wf_header *h, uint64_t t_us, const uint8_t *mean, const uint8_t *max){
+  uint8_t b[8 + 2*WF_MAX_BINS];
+  put64(b, t_us);
+  for(int i = 0; i < h->bins; i++){
+    b[8 + 2*i] = mean[i];
+    b[9 + 2*i] = max[i];
+  }
+  uint32_t len = wf_row_len(h);
+  return fwrite(b, 1, len, f) == len ? 0 : -1;
+}
+
+//reads one row, 0 on success or -1 at the end of the file
+static int wf_read_row(FILE *f, const struct wf_header *h, uint64_t *t_us, uint8_t *mean, uint8_t *max){
+  uint8_t b[8 + 2*WF_MAX_BINS];
+  uint32_t len = wf_row_len(h);
+  if(fread(b, 1, len, f) != len) return -1;
+  *t_us = get64(b);
+  for(int i = 0; i < h->bins; i++){
+    mean[i] = b[8 + 2*i];
+    max[i] = b[9 + 2*i];
+  }
+  return 0;
+}
+
+#endif